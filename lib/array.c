@@ -1,25 +1,114 @@
-#define _GNU_SOURCE /* need this for qsort_r in stdlib.h */
+#define _GNU_SOURCE /* need this for qsort_r in stdlib.h, and mremap */
+
+#include <sys/mman.h>
 
 #include "libdino_internal.h"
 #include "bsearchn.h"
+#include "keycmp.h"
 #include "memory.h"
 #include "fileio.h"
 #include "array.h"
 
+#define ROUND_UP(n, align) ((((n)+(align)-1)/(align))*(align))
+
+/* Resize (or create) the mapping for an MMAP/HUGETLB array.
+ * Small arrays get rounded up to whole pages, big ones to whole huge pages
+ * (anything less would just get mapped with regular pages anyway). */
+static ssize_t array_realloc_mmap(Array *a, size_t alloc_count) {
+    size_t size = alloc_count * a->isize;
+    size_t align = ((a->store == ARRAY_STORE_HUGETLB) || (size >= HUGEPAGESIZE)) ?
+                   HUGEPAGESIZE : PAGESIZE;
+    void *data = MAP_FAILED;
+    size = ROUND_UP(size, align);
+    if (size == a->mapsize)
+        return a->allocated;
+    if (a->store == ARRAY_STORE_HUGETLB) {
+        if (a->data)
+            data = mremap(a->data, a->mapsize, size, MREMAP_MAYMOVE);
+        else
+            data = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if ((data == MAP_FAILED) && !a->data) {
+            /* No huge pages reserved? Oh well, we tried. */
+            a->store = ARRAY_STORE_MMAP;
+            size = ROUND_UP(alloc_count * a->isize, PAGESIZE);
+        }
+    }
+    if (a->store == ARRAY_STORE_MMAP) {
+        if (a->data)
+            data = mremap(a->data, a->mapsize, size, MREMAP_MAYMOVE);
+        else
+            data = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if ((data != MAP_FAILED) && (size >= HUGEPAGESIZE))
+            madvise(data, size, MADV_HUGEPAGE);
+    }
+    if (data == MAP_FAILED)
+        return -1;
+    a->data = data;
+    a->mapsize = size;
+    a->allocated = size / a->isize;
+    return a->allocated;
+}
+
+/* Free the array's data, however it was allocated */
+static void array_free_data(Array *a) {
+    switch (a->store) {
+        case ARRAY_STORE_MMAP:
+        case ARRAY_STORE_HUGETLB:
+            if (a->data)
+                munmap(a->data, a->mapsize);
+            break;
+        case ARRAY_STORE_BORROWED:
+            break;
+        default:
+            free(a->data);
+    }
+}
+
 ssize_t array_realloc(Array *a, size_t alloc_count) {
     if (!a)
         return -1;
     if (alloc_count == 0)
         return 0;
     alloc_count = MAX(alloc_count, a->count);
-    void *data = reallocarray(a->data, alloc_count, a->isize);
+    if ((a->store == ARRAY_STORE_MMAP) || (a->store == ARRAY_STORE_HUGETLB))
+        return array_realloc_mmap(a, alloc_count);
+    void *data;
+    if (a->store == ARRAY_STORE_BORROWED) {
+        /* Not ours to realloc(), so make a copy that is */
+        data = reallocarray(NULL, alloc_count, a->isize);
+        if (data && a->count)
+            memcpy(data, a->data, a->count * a->isize);
+    } else {
+        data = reallocarray(a->data, alloc_count, a->isize);
+    }
     if (data == NULL)
         return -1;
+    a->store = ARRAY_STORE_MALLOC;
     a->allocated = alloc_count;
     a->data = data;
     return alloc_count;
 }
 
+int array_set_store(Array *a, ArrayStore store) {
+    if (!a || (store == ARRAY_STORE_BORROWED))
+        return -1;
+    if (store == a->store)
+        return 0;
+    Array tmp = { .isize = a->isize, .store = store };
+    if (a->allocated && (array_realloc(&tmp, a->allocated) < 0))
+        return -1;
+    if (a->count)
+        memcpy(tmp.data, a->data, a->count * a->isize);
+    array_free_data(a);
+    a->data = tmp.data;
+    a->allocated = tmp.allocated;
+    a->mapsize = tmp.mapsize;
+    a->store = tmp.store;
+    return 0;
+}
+
 ssize_t array_grow(Array *a) {
     if (!a)
         return -1;
@@ -37,8 +126,10 @@ Array *array_new(size_t isize) {
     if (!isize)
         return NULL;
     Array *a = calloc(1, sizeof(Array));
-    if (a)
+    if (a) {
         a->isize = isize;
+        a->keycmp = keycmp_select(isize);
+    }
     return a;
 }
 
@@ -55,12 +146,14 @@ Array *array_with_capacity(size_t isize, size_t alloc_count) {
     return a;
 }
 
-/* NOTE: if buf can't be realloc/free'd you're gonna have a bad time */
 Array *array_from_buf(void *buf, size_t isize, size_t count) {
     Array *a = array_new(isize);
+    if (!a)
+        return NULL;
     a->count = count;
-    a->allocated = ~0; /* TODO: other functions should check this */
+    a->allocated = count;
     a->data = buf;
+    a->store = ARRAY_STORE_BORROWED;
     return a;
 }
 
@@ -68,7 +161,7 @@ Array *array_from_buf(void *buf, size_t isize, size_t count) {
 Array *array_load(Array *a, int fd, off_t offset, size_t count) {
     if (a == NULL)
         return NULL;
-    if (array_realloc(a, count) != count)
+    if (array_realloc(a, count) < (ssize_t)count)
         return NULL;
     size_t asize = count * a->isize;
     ssize_t r = pread_retry(fd, a->data, asize, offset);
@@ -85,10 +178,14 @@ ssize_t array_shrink(Array *a) {
 }
 
 void array_clear(Array *a) {
-    free(a->data);
+    array_free_data(a);
     a->data = NULL;
     a->count = 0;
     a->allocated = 0;
+    a->mapsize = 0;
+    /* Nothing's borrowed anymore; any other store preference sticks */
+    if (a->store == ARRAY_STORE_BORROWED)
+        a->store = ARRAY_STORE_MALLOC;
 }
 
 void array_free(Array *a) {
@@ -136,7 +233,7 @@ ssize_t array_insort_range(SortArray *a, const void *item, size_t baseidx, size_
         return -1;
     size_t idx;
     if (num)
-        idx = bisect(item, a->data, baseidx, baseidx+num, a->isize);
+        idx = bisect_cmp(item, a->data, baseidx, baseidx+num, a->isize, a->keycmp);
     else
         idx = baseidx;
     array_insert(a, item, idx);
@@ -6,11 +6,34 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "keycmp.h"
+
+/* Where an Array's data lives, and who's responsible for freeing it.
+ * - MALLOC: the default; plain old malloc/realloc/free.
+ * - MMAP: anonymous mmap(), grown with mremap() so the data never gets
+ *   copied, and marked MADV_HUGEPAGE so big arrays get transparent huge
+ *   pages - which means a lot fewer TLB misses when you binary search it.
+ * - HUGETLB: like MMAP, but explicitly asks for MAP_HUGETLB pages. Those
+ *   have to be reserved by the admin, so if we can't get any we quietly
+ *   fall back to MMAP.
+ * - BORROWED: someone else owns the data (see array_from_buf()). We never
+ *   free it or resize it in place; if the array needs to grow, the data gets
+ *   copied to a MALLOC buffer first. */
+typedef enum ArrayStore_e {
+    ARRAY_STORE_MALLOC   = 0,
+    ARRAY_STORE_MMAP     = 1,
+    ARRAY_STORE_HUGETLB  = 2,
+    ARRAY_STORE_BORROWED = 3,
+} ArrayStore;
+
 typedef struct Array {
     size_t isize;
     size_t count;
     size_t allocated;
     void *data;
+    ArrayStore store;
+    size_t mapsize;     /* size of the mapping, for MMAP/HUGETLB */
+    keycmp_fn *keycmp;  /* keycmp_select(isize), for bisect/insort */
 } Array;
 
 
@@ -22,7 +45,13 @@ typedef struct Array {
 Array *array_new(size_t isize);
 Array *array_init(size_t isize);
 Array *array_with_capacity(size_t isize, size_t alloc_count);
+/* The Array borrows buf rather than taking ownership: array_free() won't
+ * free it, and anything that grows the array copies it first. */
 Array *array_from_buf(void *buf, size_t isize, size_t count);
+/* Switch the array to a different backing store, moving any existing data.
+ * Returns 0, or -1 if we're out of memory (in which case the array is left
+ * the way it was) or you asked for ARRAY_STORE_BORROWED. */
+int array_set_store(Array *a, ArrayStore store);
 Array *array_load(Array *a, int fd, off_t offset, size_t count);
 #define array_read(fd, off, isize, count) \
     (array_load(array_new(isize), fd, off, count))
@@ -42,7 +71,8 @@ typedef struct Array SortArray;
 SortArray *array_sort_cmp(Array *a, int (*cmp)(const void *, const void *, const size_t));
 #define array_sort(a) array_sort_cmp(a, memcmp)
 ssize_t array_insort_range(SortArray *a, const void *item, size_t baseidx, size_t num);
-#define array_bisect_range(a, i, b, n) bisect(i, a->data, b, (b)+(n), a->isize)
+#define array_bisect_range(a, i, b, n) \
+    bisect_cmp(i, a->data, b, (b)+(n), a->isize, a->keycmp)
 #define array_insort(a, item) array_insort_range(a, item, 0, a->count)
 
 
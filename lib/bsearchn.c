@@ -1,4 +1,7 @@
 #include "bsearchn.h"
+#include "bsearchn_tmpl.h"
+#include "common.h"
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Fucking C, man. The only binary search algorithm in the standard library
@@ -49,23 +52,7 @@ ssize_t bsearchir_cmp(const void *key,
                       const void *array, size_t baseidx, size_t num, size_t size,
                       int (*cmp)(const void *, const void *, size_t))
 {
-    const char *item;
-    ssize_t idx;
-    int res;
-
-    while (num) {
-        idx = baseidx + (num>>1);       /* midpoint of [baseidx,baseidx+num] */
-        item = array + (idx*size);      /* get pointer to midpoint item */
-        res = cmp(key, item, size);     /* compare with key */
-        if (res == 0)                   /* it's a match - return this index */
-            return idx;
-        if (res > 0) {                  /* key > item? */
-            baseidx = idx+1;            /* - new baseidx is the next item */
-            num--;                      /* - one less item to compare */
-        }                               /* key < item: no change to baseidx */
-        num >>= 1;                      /* divide search space in half */
-    }                                   /* ...and try again */
-    return ~baseidx;                    /* no match; return the final index */
+    return bsearchir_tmpl(key, array, baseidx, num, size, cmp);
 }
 
 /*
@@ -102,21 +89,103 @@ size_t bisect_cmp(const void *key,
                   const void *array, size_t lo, size_t hi, size_t size,
                   int (*cmp)(const void *, const void *, size_t))
 {
-    const char *item;
-    size_t mid;
-    int res;
-
-    while (lo<hi) {
-        mid = lo + ((hi-lo)>>1);        /* midpoint of [lo,hi] */
-        item = array + (mid*size);      /* get pointer to midpoint item */
-        res = cmp(key, item, size);     /* compare with key */
-        if (res > 0) {                  /* key > item? */
-            lo = mid+1;                 /* - new baseidx is the next item */
-        } else {
+    return bisect_tmpl(key, array, lo, hi, size, cmp, 0);
+}
+
+/*
+ * bisect_branchless_cmp() gives the same answer as bisect_cmp(), but it's
+ * written so the compiler doesn't need a branch to pick the next half.
+ *
+ * When the keys are random digests, whether the key is in the upper or lower
+ * half is a coin flip, so the branch in bisect_cmp() mispredicts about half
+ * the time - and every mispredict throws away a pipeline full of work. Here
+ * we always shrink the range by the same amount and just move `base` by
+ * either 0 or `half` items, which is a multiply (or cmov) instead of a jump.
+ *
+ * The catch is that the CPU can't speculate ahead into the next probe
+ * anymore, so it ends up waiting on memory. To make up for that we prefetch
+ * both of the places the next probe might land before doing the compare.
+ */
+size_t bisect_branchless_cmp(const void *key,
+                             const void *array, size_t lo, size_t hi, size_t size,
+                             int (*cmp)(const void *, const void *, size_t))
+{
+    return bisect_branchless_tmpl(key, array, lo, hi, size, cmp);
+}
+
+/* bsearchir_branchless_cmp() is bsearchir_cmp() built on top of
+ * bisect_branchless_cmp(). If there are duplicate keys it always returns
+ * the first one, but bsearchir_cmp() doesn't promise anything about which
+ * one you get, so they're interchangeable. */
+ssize_t bsearchir_branchless_cmp(const void *key,
+                                 const void *array, size_t baseidx, size_t num, size_t size,
+                                 int (*cmp)(const void *, const void *, size_t))
+{
+    return bsearchir_branchless_tmpl(key, array, baseidx, num, size, cmp);
+}
+
+/* bsearchir_interp_cmp() is bsearchir_cmp() using interpolation search:
+ * rather than probing the middle of the range, guess where the key should be
+ * based on how far its value is between the first and last item. Digests are
+ * (by design!) uniformly distributed, so the guesses are good and it takes
+ * O(log log n) probes instead of O(log n). */
+ssize_t bsearchir_interp_cmp(const void *key,
+                             const void *array, size_t baseidx, size_t num, size_t size,
+                             int (*cmp)(const void *, const void *, size_t))
+{
+    return bsearchir_interp_tmpl(key, array, baseidx, num, size, cmp);
+}
+
+/* Compare the first `nbytes` bytes of `pkey` and `item` with `cmp`, and
+ * then (if they match) the bits selected by `lastmask` in the byte after
+ * that. If lastmask is 0 that's just cmp(pkey, item, nbytes). */
+static inline int prefix_cmp(const uint8_t *pkey, const uint8_t *item,
+                             size_t nbytes, uint8_t lastmask,
+                             int (*cmp)(const void *, const void *, size_t))
+{
+    int res = nbytes ? cmp(pkey, item, nbytes) : 0;
+    if (res || !lastmask)
+        return res;
+    return (int)(pkey[nbytes] & lastmask) - (int)(item[nbytes] & lastmask);
+}
+
+/* Find the range of items that match the prefix with two bisections: the
+ * first finds the leftmost item whose prefix is >= pkey (lower bound), and
+ * the second finds the leftmost item whose prefix is > pkey (upper bound),
+ * starting from the lower bound. No temporary keys, no linear scanning, so
+ * it's O(log num) no matter how many items match. */
+static idx_range prefix_range(const uint8_t *pkey, size_t nbytes, uint8_t lastmask,
+                              const void *array, size_t baseidx, size_t num, size_t size,
+                              int (*cmp)(const void *, const void *, size_t))
+{
+    size_t lo = baseidx, hi = baseidx+num, mid;
+    idx_range rv;
+
+    while (lo<hi) {                     /* lower bound: first item >= pkey */
+        mid = lo + ((hi-lo)>>1);
+        if (prefix_cmp(pkey, array+(mid*size), nbytes, lastmask, cmp) > 0)
+            lo = mid+1;
+        else
             hi = mid;
-        }                               /* - one less item to compare */
-    }                                   /* ...and try again */
-    return lo;                          /* no match; return the final index */
+    }
+    rv.lo = lo;
+
+    hi = baseidx+num;
+    while (lo<hi) {                     /* upper bound: first item > pkey */
+        mid = lo + ((hi-lo)>>1);
+        if (prefix_cmp(pkey, array+(mid*size), nbytes, lastmask, cmp) >= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+
+    if (lo == rv.lo) {                  /* nothing matched */
+        rv.hi = rv.lo;
+        rv.lo++;
+    } else {
+        rv.hi = lo-1;
+    }
+    return rv;
 }
 
 /* bsearchpkr_cmp() ("binary search, partial key range") - find a range of
@@ -125,67 +194,67 @@ idx_range bsearchpkr_cmp(const void *pkey, size_t pkeysize,
                          const void *array, size_t baseidx, size_t num, size_t size,
                          int (*cmp)(const void *, const void *, size_t))
 {
-    const char *item;
-    ssize_t idx;
-    int lr=0, hr=0;
-    idx_range rv = { 0, 0 };
+    return prefix_range(pkey, MIN(pkeysize, size), 0, array, baseidx, num, size, cmp);
+}
 
-    char *lokey = malloc(size);
-    memset(lokey, 0x00, size);
-    memcpy(lokey, pkey, pkeysize);
+/* bsearchpbr_cmp() ("binary search, partial bits range") - same as above,
+ * but the prefix is `pkeybits` bits long. */
+idx_range bsearchpbr_cmp(const void *pkey, size_t pkeybits,
+                         const void *array, size_t baseidx, size_t num, size_t size,
+                         int (*cmp)(const void *, const void *, size_t))
+{
+    size_t nbytes = pkeybits >> 3;
+    uint8_t lastmask = (uint8_t)(0xff00 >> (pkeybits & 7));
+    if (nbytes >= size) {
+        nbytes = size;
+        lastmask = 0;
+    }
+    return prefix_range(pkey, nbytes, lastmask, array, baseidx, num, size, cmp);
+}
 
-    char *hikey = malloc(size);
-    memset(hikey, 0xff, size);
-    memcpy(hikey, pkey, pkeysize);
+/* bsearchbr_cmp() ("binary search, bounded range") - find the range of
+ * items between `lokey` and `hikey`, inclusive. */
+idx_range bsearchbr_cmp(const void *lokey, const void *hikey,
+                        const void *array, size_t baseidx, size_t num, size_t size,
+                        int (*cmp)(const void *, const void *, size_t))
+{
+    return bsearchbr_tmpl(lokey, hikey, array, baseidx, num, size, cmp);
+}
 
-    while (num) {
-        idx = baseidx + (num>>1);       /* midpoint of [baseidx,baseidx+num] */
-        item = array + (idx*size);      /* get pointer to midpoint item */
-        lr = cmp(lokey, item, size);    /* compare with lokey */
-        hr = cmp(hikey, item, size);    /* and compare with hikey */
-        if (lr != hr)                   /* lokey <= item <= hikey! */
-            break;
-        if (lr > 0) {                   /* - key > item? */
-            baseidx = idx+1;            /* - new baseidx is the next item */
-            num--;                      /* - one less item to compare */
-        }                               /* - key < item: no change to baseidx */
-        num >>= 1;                      /* - divide search space in half */
+void prefix_bounds(const void *pkey, size_t pkeybits, size_t size,
+                   uint8_t *lokey, uint8_t *hikey)
+{
+    size_t nbytes = MIN(pkeybits >> 3, size);
+    memcpy(lokey, pkey, nbytes);
+    memcpy(hikey, pkey, nbytes);
+    memset(lokey+nbytes, 0x00, size-nbytes);
+    memset(hikey+nbytes, 0xff, size-nbytes);
+    if ((nbytes < size) && (pkeybits & 7)) {
+        uint8_t mask = (uint8_t)(0xff00 >> (pkeybits & 7));
+        lokey[nbytes] = ((const uint8_t *)pkey)[nbytes] & mask;
+        hikey[nbytes] = ((const uint8_t *)pkey)[nbytes] | ~mask;
     }
-    if (num == 0) {                     /* nothing matched */
-        rv.lo = baseidx+1;
-        rv.hi = baseidx;
-    } else {
-        /* We broke out of the loop because idx falls within the range of
-         * matching items! There's three possibilities:
-         *
-         * 1. We found the leftmost item:  ((lr == 0) && (hr == 1))
-         * 2. We found the rightmost item: ((lr == -1) && (hr == 0))
-         * 3. We found a middle item:      ((lr == -1) && (hr == 1))
-         *
-         * So if (lr != 0), baseidx <= rv.lo <  idx, and similarly
-         *    if (hr != 0),     idx <  rv.hi <= idx+(num>>1)
-         *
-         * It's definitely simplest to just do a linear search up/down from
-         * `idx`, and probably just as fast for small values of `num` and/or
-         * small numbers of likely matches, so that's what we do here.
-         *
-         * TODO: for large `num` or many matches it might be faster to do a
-         * binary search of the remaining space, like:
-         * num >>= 1;
-         * rv.lo = bisect_cmp(lokey, array, baseidx, idx-1, size, cmp);
-         * rv.hi = bisect_cmp(hikey, array, idx+1, idx+num, size, cmp);
-         * Without some benchmarks it's hard to say what the right
-         * threshold for binary vs. linear search is, though.
-         */
-        rv.lo = idx;
-        rv.hi = idx;
-        if (lr)
-            while ((rv.lo>baseidx) && (cmp(pkey, array+((rv.lo-1)*size), pkeysize) == 0))
-                rv.lo--;
-        idx = idx+(num>>1); /* max index */
-        if (hr)
-            while ((rv.hi<idx) && (cmp(pkey, array+((rv.hi+1)*size), pkeysize) == 0))
-                rv.hi++;
+}
+
+size_t common_prefix_nibbles(const void *a, const void *b, size_t size) {
+    const uint8_t *x = a, *y = b;
+    size_t i;
+    for (i=0; (i<size) && (x[i]==y[i]); i++);
+    if (i == size)
+        return size<<1;
+    return (i<<1) + (((x[i]^y[i]) & 0xf0) ? 0 : 1);
+}
+
+size_t unique_prefix_nibbles(const void *array, size_t num, size_t size, uint8_t *lens) {
+    size_t fullsize = size<<1, maxlen = 0;
+    size_t prev = 0, next, len;    /* common prefix with previous/next item */
+    for (size_t i=0; i<num; i++) {
+        next = (i+1 < num) ? common_prefix_nibbles(array+(i*size), array+((i+1)*size), size) : 0;
+        len = MIN(MAX(prev, next)+1, fullsize);
+        if (lens)
+            lens[i] = MIN(len, UINT8_MAX);
+        maxlen = MAX(maxlen, len);
+        prev = next;
     }
-    return rv;
+    return maxlen;
 }
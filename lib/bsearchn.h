@@ -1,6 +1,7 @@
 #ifndef _BSEARCHN_H
 #define _BSEARCHN_H 1
 
+#include <stdint.h>
 #include "memory.h"
 
 /* bsearchn_cmp() is basically identical to bsearch(), except the comparison
@@ -50,6 +51,32 @@ size_t bisect_cmp(const void *key,
                   int (*cmp)(const void *, const void *, size_t));
 #define bisect(k, a, l, h, s) bisect_cmp(k, a, l, h, s, memcmp)
 
+/* Branchless versions of bisect_cmp() and bsearchir_cmp(). Same arguments
+ * and results, but they avoid data-dependent branches (which mispredict
+ * constantly on random keys) and prefetch the next probe's candidates. */
+size_t bisect_branchless_cmp(const void *key,
+                             const void *array, size_t lo, size_t hi, size_t size,
+                             int (*cmp)(const void *, const void *, size_t));
+ssize_t bsearchir_branchless_cmp(const void *key,
+                                 const void *array, size_t baseidx, size_t num, size_t size,
+                                 int (*cmp)(const void *, const void *, size_t));
+#define bisect_branchless(k, a, l, h, s) bisect_branchless_cmp(k, a, l, h, s, memcmp)
+#define bsearchir_branchless(k, a, b, n, s) bsearchir_branchless_cmp(k, a, b, n, s, memcmp)
+
+/* bsearchir_interp_cmp() is bsearchir_cmp() using interpolation search.
+ * It works with any sorted array, but it's only faster than bisection if the
+ * keys are roughly uniformly distributed - like digests. */
+ssize_t bsearchir_interp_cmp(const void *key,
+                             const void *array, size_t baseidx, size_t num, size_t size,
+                             int (*cmp)(const void *, const void *, size_t));
+#define bsearchir_interp(k, a, b, n, s) bsearchir_interp_cmp(k, a, b, n, s, memcmp)
+
+/* All the bsearchir variants have the same signature, so you can pick one
+ * at runtime. */
+typedef ssize_t bsearchir_fn(const void *key,
+                             const void *array, size_t baseidx, size_t num, size_t size,
+                             int (*cmp)(const void *, const void *, size_t));
+
 /* A struct to return a range of indexes */
 typedef struct idx_range {
     size_t lo;
@@ -64,10 +91,54 @@ typedef struct idx_range {
  * given in `pkey`, with size `pkeysize`.
  * If the returned range `r` has (r.lo == r.hi) then there was only one match;
  * if (r.lo > r.hi) then there are no keys that match the prefix, but
- * `r.hi` is the index where matching keys would go, as with bisect(). */
+ * `r.hi` is the index where matching keys would go, as with bisect().
+ * `cmp` is only ever called with `pkeysize` (or fewer) bytes, and it doesn't
+ * allocate anything, so it's safe to call as often as you like. */
 idx_range bsearchpkr_cmp(const void *pkey, size_t pkeysize,
                          const void *array, size_t baseidx, size_t num, size_t size,
                          int (*cmp)(const void *, const void *, size_t));
 #define bsearchpkr(pk, pks, a, b, n, s) bsearchpkr_cmp(pk, pks, a, b, n, s, memcmp)
 
+/* bsearchpbr_cmp() ("binary search, partial bits range") is bsearchpkr_cmp()
+ * with a prefix length given in bits rather than bytes - handy for matching
+ * hex strings with an odd number of digits. Bits are taken MSB-first from
+ * each byte, so a 12-bit prefix is pkey[0] plus the high nibble of pkey[1]. */
+idx_range bsearchpbr_cmp(const void *pkey, size_t pkeybits,
+                         const void *array, size_t baseidx, size_t num, size_t size,
+                         int (*cmp)(const void *, const void *, size_t));
+#define bsearchpbr(pk, pkb, a, b, n, s) bsearchpbr_cmp(pk, pkb, a, b, n, s, memcmp)
+
+/* bsearchbr_cmp() ("binary search, bounded range") returns the range of
+ * items that sort between `lokey` and `hikey` (inclusive), in the same form
+ * as bsearchpkr_cmp(). Unlike the prefix searches, `cmp` always compares
+ * whole items, so it can be one of the fixed-size keycmp kernels. */
+idx_range bsearchbr_cmp(const void *lokey, const void *hikey,
+                        const void *array, size_t baseidx, size_t num, size_t size,
+                        int (*cmp)(const void *, const void *, size_t));
+typedef idx_range bsearchbr_fn(const void *lokey, const void *hikey,
+                               const void *array, size_t baseidx, size_t num, size_t size,
+                               int (*cmp)(const void *, const void *, size_t));
+
+/* prefix_bounds() turns a prefix of `pkeybits` bits into the lowest and
+ * highest `size`-byte keys that start with it (the rest of the bits all 0s
+ * or all 1s), so bsearchbr_cmp(lokey, hikey, ...) finds the same range as
+ * bsearchpbr_cmp(pkey, pkeybits, ...). */
+void prefix_bounds(const void *pkey, size_t pkeybits, size_t size,
+                   uint8_t *lokey, uint8_t *hikey);
+
+/* common_prefix_nibbles() returns the number of leading 4-bit nibbles
+ * (i.e. hex digits) that `a` and `b` have in common, up to size*2. */
+size_t common_prefix_nibbles(const void *a, const void *b, size_t size);
+
+/* unique_prefix_nibbles() does a single pass over a sorted array of `num`
+ * items and computes the length (in hex digits) of the shortest prefix that
+ * uniquely identifies each item. If `lens` is non-NULL, the length for
+ * item i is stored in lens[i], saturating at UINT8_MAX.
+ * Since the array is sorted, the closest match to any item is one of its
+ * neighbors, so each item only needs to be compared to the one after it.
+ * Returns the longest of those lengths - which is the shortest abbreviation
+ * length that's unique for every item in the array.
+ * Duplicate items can't be made unique; they get their full length. */
+size_t unique_prefix_nibbles(const void *array, size_t num, size_t size, uint8_t *lens);
+
 #endif /* _BSEARCHN_H */
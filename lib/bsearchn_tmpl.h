@@ -0,0 +1,188 @@
+/* bsearchn_tmpl.h - the search loops behind bsearchn.c, as inline templates.
+ *
+ * Every one of these takes the comparison function as an argument, and gets
+ * inlined into whatever calls it. bsearchn.c instantiates them with the
+ * function pointer its caller passed in, so that's an indirect call for
+ * every probe - fine for generic code. keycmp.c instantiates them once per
+ * key size with one of its fixed-size kernels and a constant `size`, so the
+ * compiler can inline the comparison right into the loop and turn all the
+ * `idx*size` multiplies into shifts and adds. */
+#ifndef _BSEARCHN_TMPL_H
+#define _BSEARCHN_TMPL_H 1
+
+#include <stdint.h>
+#include "bsearchn.h"
+#include "common.h"
+
+typedef int bsearch_cmp_fn(const void *, const void *, size_t);
+
+/* See bsearchir_cmp() */
+static ALWAYS_INLINE ssize_t bsearchir_tmpl(const void *key,
+        const void *array, size_t baseidx, size_t num, size_t size,
+        bsearch_cmp_fn *cmp)
+{
+    const char *item;
+    ssize_t idx;
+    int res;
+
+    while (num) {
+        idx = baseidx + (num>>1);       /* midpoint of [baseidx,baseidx+num] */
+        item = array + (idx*size);      /* get pointer to midpoint item */
+        res = cmp(key, item, size);     /* compare with key */
+        if (res == 0)                   /* it's a match - return this index */
+            return idx;
+        if (res > 0) {                  /* key > item? */
+            baseidx = idx+1;            /* - new baseidx is the next item */
+            num--;                      /* - one less item to compare */
+        }                               /* key < item: no change to baseidx */
+        num >>= 1;                      /* divide search space in half */
+    }                                   /* ...and try again */
+    return ~baseidx;                    /* no match; return the final index */
+}
+
+/* See bisect_cmp(). If `right` is nonzero, this is bisect_right() instead:
+ * it returns the index *after* any items equal to `key`. */
+static ALWAYS_INLINE size_t bisect_tmpl(const void *key,
+        const void *array, size_t lo, size_t hi, size_t size,
+        bsearch_cmp_fn *cmp, const int right)
+{
+    const char *item;
+    size_t mid;
+    int res;
+
+    while (lo<hi) {
+        mid = lo + ((hi-lo)>>1);        /* midpoint of [lo,hi] */
+        item = array + (mid*size);      /* get pointer to midpoint item */
+        res = cmp(key, item, size);     /* compare with key */
+        if ((res > 0) || (right && (res == 0))) { /* key > item? */
+            lo = mid+1;                 /* - new baseidx is the next item */
+        } else {
+            hi = mid;
+        }                               /* - one less item to compare */
+    }                                   /* ...and try again */
+    return lo;                          /* no match; return the final index */
+}
+
+/* See bisect_branchless_cmp() */
+static ALWAYS_INLINE size_t bisect_branchless_tmpl(const void *key,
+        const void *array, size_t lo, size_t hi, size_t size,
+        bsearch_cmp_fn *cmp)
+{
+    const char *base = array + (lo*size);
+    size_t num = hi-lo, half, next;
+
+    if (lo >= hi)
+        return lo;
+    while (num > 1) {
+        half = num >> 1;
+        next = (num - half) >> 1;       /* next midpoint, relative to base */
+        __builtin_prefetch(base + (next*size));
+        __builtin_prefetch(base + ((half+next)*size));
+        base += (cmp(key, base + (half*size), size) > 0) * half * size;
+        num -= half;
+    }
+    return ((base - (const char *)array) / size) + (cmp(key, base, size) > 0);
+}
+
+/* See bsearchir_branchless_cmp() */
+static ALWAYS_INLINE ssize_t bsearchir_branchless_tmpl(const void *key,
+        const void *array, size_t baseidx, size_t num, size_t size,
+        bsearch_cmp_fn *cmp)
+{
+    size_t idx = bisect_branchless_tmpl(key, array, baseidx, baseidx+num, size, cmp);
+    if ((idx < baseidx+num) && (cmp(key, array+(idx*size), size) == 0))
+        return idx;
+    return ~idx;
+}
+
+/* The first 8 bytes of a key, as a big-endian number (so that it sorts the
+ * same way the key does). Shorter keys get padded with zeros. */
+static inline uint64_t key_prefix64(const uint8_t *key, size_t size) {
+    uint8_t buf[8] = { 0 };
+    uint64_t v;
+    memcpy(buf, key, MIN(size, sizeof(buf)));
+    memcpy(&v, buf, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* Stop interpolating once the range is this small, or after this many
+ * probes, and let bisection finish the job. For uniformly-distributed keys
+ * one or two interpolation probes usually gets us within a few items; if it
+ * doesn't, the keys probably aren't uniform and bisection is safer. */
+#define INTERP_MIN_RANGE 16
+#define INTERP_MAX_PROBES 4
+
+/* See bsearchir_interp_cmp() */
+static ALWAYS_INLINE ssize_t bsearchir_interp_tmpl(const void *key,
+        const void *array, size_t baseidx, size_t num, size_t size,
+        bsearch_cmp_fn *cmp)
+{
+    size_t lo = baseidx, hi = baseidx+num, guess, guard, step;
+    uint64_t k = key_prefix64(key, size), klo, khi;
+    int res;
+
+    for (int probe=0; (probe < INTERP_MAX_PROBES) && (hi-lo > INTERP_MIN_RANGE); probe++) {
+        klo = key_prefix64(array+(lo*size), size);
+        khi = key_prefix64(array+((hi-1)*size), size);
+        if ((k <= klo) || (k >= khi))
+            break;
+        guess = lo + (size_t)(((double)(k-klo) / (double)(khi-klo)) * (hi-1-lo));
+        guess = MIN(MAX(guess, lo), hi-1);
+        res = cmp(key, array+(guess*size), size);
+        if (res == 0)
+            return guess;
+        /* The guess is usually within about sqrt(n) items of the key, but
+         * it only moves one end of the range. Probe again sqrt(n) items
+         * further along to (hopefully) pull in the other end too. */
+        step = (size_t)1 << ((64 - __builtin_clzll(hi-lo)) >> 1);
+        if (res > 0) {
+            lo = guess+1;
+            guard = guess+step;
+            if (guard >= hi)
+                continue;
+            res = cmp(key, array+(guard*size), size);
+            if (res == 0)
+                return guard;
+            if (res < 0)
+                hi = guard;
+            else
+                lo = guard+1;
+        } else {
+            hi = guess;
+            if (guess < lo+step)
+                continue;
+            guard = guess-step;
+            res = cmp(key, array+(guard*size), size);
+            if (res == 0)
+                return guard;
+            if (res > 0)
+                lo = guard+1;
+            else
+                hi = guard;
+        }
+    }
+    return bsearchir_branchless_tmpl(key, array, lo, hi-lo, size, cmp);
+}
+
+/* See bsearchbr_cmp(). Same two bisections as prefix_range() in
+ * bsearchn.c, but against whole keys. */
+static ALWAYS_INLINE idx_range bsearchbr_tmpl(const void *lokey, const void *hikey,
+        const void *array, size_t baseidx, size_t num, size_t size,
+        bsearch_cmp_fn *cmp)
+{
+    idx_range rv;
+    rv.lo = bisect_tmpl(lokey, array, baseidx, baseidx+num, size, cmp, 0);
+    size_t hi = bisect_tmpl(hikey, array, rv.lo, baseidx+num, size, cmp, 1);
+    if (hi == rv.lo) {                  /* nothing matched */
+        rv.hi = rv.lo;
+        rv.lo++;
+    } else {
+        rv.hi = hi-1;
+    }
+    return rv;
+}
+
+#endif /* _BSEARCHN_TMPL_H */
@@ -21,6 +21,13 @@ size_t buf_realloc(Buf *buf, size_t size) {
     return size;
 }
 
+int buf_reserve(Buf *buf, size_t len) {
+    size_t size = buf->size ? buf->size : PAGESIZE;
+    while (buf->pos + len > size)
+        size <<= 1;
+    return (size == buf->size) || buf_realloc(buf, size);
+}
+
 void buf_free(Buf *buf) {
     free(buf->buf);
     free(buf);
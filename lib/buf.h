@@ -30,6 +30,9 @@ Buf *buf_init(size_t size);
 #define inbuf_init(size) ((inBuf *)buf_init(size))
 #define outbuf_init(size) ((outBuf *)buf_init(size))
 size_t buf_realloc(Buf *buf, size_t size);
+/* Make sure there's at least `len` bytes free at buf->pos, growing the
+ * buffer (by doubling) if needed. Returns 0 if we're out of memory. */
+int buf_reserve(Buf *buf, size_t len);
 void buf_clear(Buf *buf);
 void buf_free(Buf *buf);
 #define inbuf_free(buf) buf_free((Buf *)buf)
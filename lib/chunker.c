@@ -0,0 +1,76 @@
+/* chunker.c - FastCDC content-defined chunking.
+ *
+ * This is the algorithm from "FastCDC: a Fast and Efficient Content-Defined
+ * Chunking Approach for Data Deduplication" (Xia et al., USENIX ATC '16):
+ * a gear hash - h = (h << 1) + gear[byte] - rolled over the data, cutting
+ * wherever the masked bits of h are all zero. Since each byte gets shifted
+ * out of the hash after 64 more bytes, boundaries only depend on the data
+ * right before them, so an edit only moves the boundaries near it.
+ *
+ * Two tricks from the paper keep it fast and the sizes tidy: we don't bother
+ * hashing the first min_size bytes (no cut can happen there anyway), and
+ * "normalized chunking" uses a mask with more bits before avg_size and one
+ * with fewer bits after, which bunches chunk sizes up around the average. */
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "chunker.h"
+
+/* The gear table is 256 random 64-bit values. It's generated rather than
+ * written out, but it must never change (see CDC_AVG_SIZE_DEFAULT). */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+    /* splitmix64, from a fixed seed */
+    uint64_t x = 0x64696e6f63646321ULL;
+    for (int i=0; i<256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* The newest bytes affect the low bits of the hash and the oldest ones the
+ * high bits, so the masks use the top bits, which have seen the most data */
+#define TOP_BITS(n) (~0ULL << (64 - (n)))
+
+int cdc_params_init(Dino_CDC_Params *cdc, size_t avg_size) {
+    if ((avg_size < CDC_AVG_SIZE_MIN) || (avg_size > CDC_AVG_SIZE_MAX) ||
+        (avg_size & (avg_size - 1)))
+        return -EINVAL;
+    int bits = 0;
+    while (((size_t)1 << bits) < avg_size)
+        bits++;
+    cdc->min_size = avg_size / 4;
+    cdc->avg_size = avg_size;
+    cdc->max_size = avg_size * 4;
+    /* "normalization level 2" from the paper: 2 bits either way */
+    cdc->mask_s = TOP_BITS(bits + 2);
+    cdc->mask_l = TOP_BITS(bits - 2);
+    pthread_once(&gear_once, gear_init);
+    return 0;
+}
+
+size_t cdc_chunk(const Dino_CDC_Params *cdc, const uint8_t *data, size_t size) {
+    if (size <= cdc->min_size)
+        return size;
+    size_t end = MIN(size, cdc->max_size);
+    size_t normal = MIN(end, cdc->avg_size);
+    uint64_t h = 0;
+    size_t i = cdc->min_size;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & cdc->mask_s))
+            return i+1;
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & cdc->mask_l))
+            return i+1;
+    }
+    return end;
+}
@@ -0,0 +1,35 @@
+/* Content-defined chunking (FastCDC), for splitting files into chunks that
+ * can be deduplicated even when the data around them moves. */
+#ifndef _CHUNKER_H
+#define _CHUNKER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Chunk sizes, in the ratios the FastCDC paper recommends. Changing any of
+ * these changes where the chunk boundaries fall, and therefore which chunks
+ * new archives can share with old ones - so don't, without a good reason. */
+#define CDC_AVG_SIZE_DEFAULT (16<<10)
+#define CDC_AVG_SIZE_MIN 256
+#define CDC_AVG_SIZE_MAX (16<<20)
+
+typedef struct Dino_CDC_Params {
+    size_t min_size;    /* no chunk is smaller than this (except the last) */
+    size_t avg_size;    /* the size we aim for */
+    size_t max_size;    /* no chunk is bigger than this */
+    uint64_t mask_s;    /* (harder) cut condition for chunks under avg_size */
+    uint64_t mask_l;    /* (easier) cut condition for chunks over avg_size */
+} Dino_CDC_Params;
+
+/* cdc_params_init: set up `cdc` for an average chunk size of `avg_size`,
+ * which has to be a power of 2 between CDC_AVG_SIZE_MIN and _MAX.
+ * min_size and max_size are avg_size/4 and avg_size*4.
+ * Returns 0, or -EINVAL if avg_size isn't acceptable. */
+int cdc_params_init(Dino_CDC_Params *cdc, size_t avg_size);
+
+/* cdc_chunk: find where the first chunk of `data` ends.
+ * Returns its size, which is `size` if that's all there is. Call it again
+ * on the rest of the data to get the next chunk, and so on. */
+size_t cdc_chunk(const Dino_CDC_Params *cdc, const uint8_t *data, size_t size);
+
+#endif /* _CHUNKER_H */
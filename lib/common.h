@@ -17,6 +17,8 @@
        __typeof__ (max) _max = (max); \
      (_a < _max) ? ((_a > _min) ? _a : _min) : _max; })
 
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
 #define bitsizeof(x) (CHAR_BIT * sizeof(x))
@@ -1,4 +1,6 @@
 #include "../memory.h"
+#include "../common.h"
+#include "../varint.h"
 #include "compression.h"
 
 /* list of compression algorithms we've built with */
@@ -47,6 +49,7 @@ Dino_CStream *cstream_create(Dino_CompressID id) {
 
     cs->funcs = funcs;
     cs->cctx = cs->funcs->create_ctx();
+    cs->opts = COPTS_DEFAULT;
 
     if (!cs->funcs->setup(cs, NULL)) {
         cstream_free(cs);
@@ -55,6 +58,95 @@ Dino_CStream *cstream_create(Dino_CompressID id) {
     return cs;
 }
 
+/* The splitmix64 finalizer, as in sketch.c */
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t compress_dict_hash(const void *dict, size_t size) {
+    const uint8_t *p = dict;
+    uint64_t h = mix64(size), w;
+    size_t i;
+    for (i=0; i+8<=size; i+=8) {
+        memcpy(&w, p+i, 8);
+        h = mix64(h ^ w);
+    }
+    w = 0;
+    memcpy(&w, p+i, size-i);
+    h = mix64(h ^ w);
+    return h ? h : 1;
+}
+
+/* Point opts->dictdata at a copy of the dictionary, so the stream has its
+ * own. That way the caller can free theirs, and the pool can tell whether a
+ * stream's dictionary matches by looking at what's in it; comparing the
+ * pointers goes wrong as soon as the caller's buffer gets freed and its
+ * address reused for a different dictionary. We work out its hash here too,
+ * so the pool doesn't have to compare the whole thing every time.
+ * Returns 0 if we couldn't allocate the copy. */
+static int opts_copy_dict(Dino_COpts *opts) {
+    uint8_t *dict = NULL;
+    if (opts->dictdata && opts->dictsize) {
+        if (!(dict = malloc(opts->dictsize)))
+            return 0;
+        memcpy(dict, opts->dictdata, opts->dictsize);
+        opts->dicthash = compress_dict_hash(dict, opts->dictsize);
+    }
+    opts->dictdata = dict;
+    opts->dictsize = dict ? opts->dictsize : 0;
+    opts->dicthash = dict ? opts->dicthash : 0;
+    return 1;
+}
+
+int cstream_setopts(Dino_CStream *cstream, Dino_COpts *copts) {
+    if (!copts)
+        return 0;
+    Dino_COpts opts = *copts;
+    if (!opts_copy_dict(&opts))
+        return 0;
+    /* setup() might have applied some of the options before it hit the bad
+     * one, so put the old ones back if it fails */
+    if (!cstream->funcs->setup(cstream, &opts)) {
+        cstream->funcs->setup(cstream, &cstream->opts);
+        free(opts.dictdata);
+        return 0;
+    }
+    /* (cstream_setlevel() passes our own copy back in; keep the old
+     * dictsrc then, since the copy's about to go away) */
+    if (copts->dictdata != cstream->opts.dictdata)
+        cstream->dictsrc = copts->dictdata;
+    free(cstream->opts.dictdata);
+    cstream->opts = opts;
+    return 1;
+}
+
+int cstream_setlevel(Dino_CStream *cstream, int level) {
+    Dino_COpts copts = cstream->opts;
+    copts.level = level;
+    return cstream_setopts(cstream, &copts);
+}
+
+int cstream_reset(Dino_CStream *cstream) {
+    /* ref_prefix() may have dropped the dictionary and changed the window,
+     * so this needs the full setup() */
+    if (cstream->prefixed) {
+        cstream->prefixed = 0;
+        return cstream->funcs->setup(cstream, &cstream->opts);
+    }
+    if (cstream->funcs->reset)
+        return cstream->funcs->reset(cstream);
+    return cstream->funcs->setup(cstream, &cstream->opts);
+}
+
+int cstream_ref_prefix(Dino_CStream *cstream, const void *prefix, size_t size) {
+    if (!cstream->funcs->ref_prefix)
+        return 0;
+    cstream->prefixed = 1;
+    return cstream->funcs->ref_prefix(cstream, prefix, size);
+}
+
 /* FIXME what are the expected return values etc. here... */
 
 size_t cstream_compress_start(Dino_CStream *cstream, size_t size) {
@@ -71,18 +163,48 @@ size_t cstream_compress_end(Dino_CStream *cstream, outBuf *out) {
 }
 
 size_t cstream_compress1(Dino_CStream *cstream, inBuf *in, outBuf *out) {
-    /* FIXME error handling! */
-    cstream_compress_start(cstream, in->size);
-    cstream_compress(cstream, in, out);
-    cstream_compress_end(cstream, out);
-    /* FIXME I guess i'll return the bytes written? */
-    return out->pos;
+    size_t r;
+    if (cstream->funcs->compress1) {
+        r = cstream->funcs->compress1(cstream, in, out);
+        if (r != COMPRESS_ERR_BUF)
+            return r;
+    }
+    r = cstream_compress_start(cstream, in->size - in->pos);
+    if (IS_COMPRESS_ERR(r))
+        return r;
+    r = cstream_compress(cstream, in, out);
+    if (IS_COMPRESS_ERR(r))
+        return r;
+    /* If it didn't take all the input, it's because outbuf is full */
+    if (in->pos < in->size)
+        return COMPRESS_ERR_BUF;
+    r = cstream_compress_end(cstream, out);
+    if (r && !IS_COMPRESS_ERR(r))
+        return COMPRESS_ERR_BUF;
+    return r;
 }
 
 size_t dstream_decompress(Dino_DStream *dstream, inBuf *in, outBuf *out) {
     return dstream->funcs->decompress(dstream, in, out);
 }
 
+size_t dstream_decompress1(Dino_DStream *dstream, inBuf *in, outBuf *out) {
+    if (dstream->funcs->decompress1)
+        return dstream->funcs->decompress1(dstream, in, out);
+    size_t r, inpos, outpos;
+    do {
+        inpos = in->pos;
+        outpos = out->pos;
+        r = dstream_decompress(dstream, in, out);
+        if (IS_COMPRESS_ERR(r))
+            return r;
+        /* Stuck: either outbuf is full or the frame is truncated */
+        if (r && (in->pos == inpos) && (out->pos == outpos))
+            return (out->pos == out->size) ? COMPRESS_ERR_BUF : COMPRESS_ERR_UNK;
+    } while (r);
+    return 0;
+}
+
 size_t dstream_get_uncompressed_size(Dino_DStream *dstream, inBuf *in) {
     return dstream->funcs->getsize(dstream, in);
 }
@@ -92,6 +214,7 @@ void cstream_free(Dino_CStream *cs) {
         return;
     if (cs->funcs && cs->funcs->free_ctx && cs->cctx)
         cs->funcs->free_ctx(cs->cctx);
+    free(cs->opts.dictdata);
     free(cs);
 }
 
@@ -106,6 +229,7 @@ Dino_DStream *dstream_create(Dino_CompressID id) {
 
     ds->funcs = funcs;
     ds->dctx = ds->funcs->create_ctx();
+    ds->opts = COPTS_DEFAULT;
 
     if (!(ds->funcs->setup(ds, NULL))) {
         dstream_free(ds);
@@ -114,10 +238,136 @@ Dino_DStream *dstream_create(Dino_CompressID id) {
     return ds;
 }
 
+int dstream_setopts(Dino_DStream *ds, Dino_DOpts *dopts) {
+    if (!dopts)
+        return 0;
+    Dino_DOpts opts = *dopts;
+    if (!opts_copy_dict(&opts))
+        return 0;
+    if (!ds->funcs->setup(ds, &opts)) {
+        ds->funcs->setup(ds, &ds->opts);
+        free(opts.dictdata);
+        return 0;
+    }
+    /* see cstream_setopts() */
+    if (dopts->dictdata != ds->opts.dictdata)
+        ds->dictsrc = dopts->dictdata;
+    free(ds->opts.dictdata);
+    ds->opts = opts;
+    return 1;
+}
+
+int dstream_reset(Dino_DStream *ds) {
+    if (ds->prefixed) {
+        ds->prefixed = 0;
+        return ds->funcs->setup(ds, &ds->opts);
+    }
+    if (ds->funcs->reset)
+        return ds->funcs->reset(ds);
+    return ds->funcs->setup(ds, &ds->opts);
+}
+
+int dstream_ref_prefix(Dino_DStream *ds, const void *prefix, size_t size) {
+    if (!ds->funcs->ref_prefix)
+        return 0;
+    ds->prefixed = 1;
+    return ds->funcs->ref_prefix(ds, prefix, size);
+}
+
 void dstream_free(Dino_DStream *ds) {
     if (!ds)
         return;
     if (ds->funcs && ds->funcs->free_ctx && ds->dctx)
         ds->funcs->free_ctx(ds->dctx);
+    free(ds->opts.dictdata);
     free(ds);
 }
+
+size_t compress_train_dict(Dino_CompressID id, void *dict, size_t dictcap,
+                           const void *samples, const size_t *sizes, unsigned count) {
+    const Dino_CCFuncs *funcs = _get_ccfuncs(id);
+    if (!funcs || !funcs->train_dict || !count)
+        return 0;
+    return funcs->train_dict(dict, dictcap, samples, sizes, count);
+}
+
+/* Write one option record's header; see Dino_COpt_Tag in dino.h */
+static void copt_put_hdr(Buf *out, Dino_COpt_Tag tag, size_t size) {
+    uint8_t *p = out->buf + out->pos;
+    *p++ = tag;
+    out->pos += 1 + dino_encode_varint(p, VARINT_MAXLEN, size);
+}
+
+static void copt_put_int(Buf *out, Dino_COpt_Tag tag, int64_t val, uint8_t size) {
+    copt_put_hdr(out, tag, size);
+    uint8_t *p = out->buf + out->pos;
+    for (uint8_t i=0; i<size; i++, val >>= 8)
+        *p++ = val & 0xff;
+    out->pos += size;
+}
+
+ssize_t copts_write(const Dino_COpts *copts, Buf *out) {
+    size_t start = out->pos;
+    size_t dictsize = copts->dictdata ? copts->dictsize : 0;
+    if (!buf_reserve(out, 4*(1+VARINT_MAXLEN+sizeof(int32_t)) + dictsize))
+        return -1;
+    if (copts->level != COMPRESS_LEVEL_DEFAULT)
+        copt_put_int(out, DINO_COPT_LEVEL, copts->level, sizeof(int32_t));
+    if (copts->window_log)
+        copt_put_int(out, DINO_COPT_WINDOW_LOG, copts->window_log, 1);
+    if (copts->long_distance)
+        copt_put_int(out, DINO_COPT_LONG_DISTANCE, 1, 1);
+    if (dictsize) {
+        copt_put_hdr(out, DINO_COPT_DICT, dictsize);
+        memcpy(out->buf + out->pos, copts->dictdata, dictsize);
+        out->pos += dictsize;
+    }
+    return out->pos - start;
+}
+
+int copts_read(Dino_DOpts *dopts, const void *data, size_t size) {
+    const uint8_t *p = data, *end = p + size;
+    size_t len;
+    *dopts = COPTS_DEFAULT;
+    while (p < end) {
+        Dino_COpt_Tag tag = *p++;
+        if (tag == DINO_COPT_END)
+            break;
+        /* don't let the varint decoder run off the end */
+        uint8_t vbuf[VARINT_MAXLEN] = { 0 };
+        memcpy(vbuf, p, MIN((size_t)(end-p), VARINT_MAXLEN));
+        uintmax_t vsize = dino_decode_varint(vbuf, &len);
+        if (!len || (len > (size_t)(end-p)) || (vsize > (uintmax_t)(end-p-len)))
+            return -1;
+        p += len;
+        /* integer values are never more than 8 bytes */
+        uint64_t val = 0;
+        int isint = (tag == DINO_COPT_LEVEL) || (tag == DINO_COPT_WINDOW_LOG) ||
+                    (tag == DINO_COPT_LONG_DISTANCE);
+        if (isint && (vsize > sizeof(uint64_t)))
+            return -1;
+        for (uint8_t i=0; isint && (i<vsize); i++)
+            val |= (uint64_t)p[i] << (i*8);
+        switch (tag) {
+            case DINO_COPT_LEVEL:
+                dopts->level = (int32_t)val;
+                break;
+            case DINO_COPT_WINDOW_LOG:
+                dopts->window_log = val;
+                break;
+            case DINO_COPT_LONG_DISTANCE:
+                dopts->long_distance = (val != 0);
+                break;
+            case DINO_COPT_DICT:
+                dopts->dictdata = (uint8_t *)p;
+                dopts->dictsize = vsize;
+                dopts->dicthash = compress_dict_hash(p, vsize);
+                break;
+            default:
+                /* Not something we know about; skip it */
+                break;
+        }
+        p += vsize;
+    }
+    return 0;
+}
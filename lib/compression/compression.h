@@ -2,7 +2,9 @@
 #ifndef _COMPRESSION_H
 #define _COMPRESSION_H 1
 
+#include <limits.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include "../dino.h"
 #include "../buf.h"
 
@@ -15,6 +17,11 @@ const char *libdino_compression_available[DINO_COMPRESSNUM+1];
 Dino_CompressID compress_id(const char *name);
 const char *compress_name(Dino_CompressID id);
 int compress_avail(Dino_CompressID id);
+/* Can compress_train_dict() build dictionaries for this algorithm? */
+int compress_can_train(Dino_CompressID id);
+/* Valid Dino_COpts.window_log values for this algorithm (besides 0), in
+ * *min..*max. Returns 0 if the algorithm isn't available. */
+int compress_window_log_range(Dino_CompressID id, int *min, int *max);
 
 
 #define DEFAULT_BUFSIZE (1<<17)
@@ -46,16 +53,55 @@ int compress_avail(Dino_CompressID id);
  *    - level, rsyncable
  */
 
-/* A struct to hold advanced compression/decompression options. */
+/* A struct to hold advanced compression/decompression options.
+ *
+ * Which of these actually get used depends on the algorithm:
+ *   zstd: level, threads (nbWorkers), long_distance, window_log, dictdata
+ *   xz:   level (preset), threads, window_log (dict_size = 1<<window_log);
+ *         decoders use threads too (with liblzma >= 5.4)
+ *   lz4:  level (<= 0 is the fast mode, >= 3 is lz4hc); the window is always
+ *         64KB, so window_log just has to be at least 16
+ *   zlib: level (0-9), window_log (windowBits; anything over 15 means 15)
+ * Anything an algorithm doesn't understand is ignored.
+ *
+ * Only level, long_distance, window_log and the dictionary get written into
+ * the DINO's compress_opts section (see copts_write()) - window_log and the
+ * dictionary because the decoder needs them, the others so we can reproduce
+ * the output later. threads and the rest are runtime-only.
+ *
+ * cstream_setopts() and dstream_setopts() copy dictdata, so the caller can
+ * free theirs once the options are set. */
 typedef struct Dino_COpts {
-    int level;          /* simple compression level */
+    int level;          /* compression level, or COMPRESS_LEVEL_DEFAULT */
+    int threads;        /* worker threads; 0 or 1 means "don't use threads" */
+    int long_distance;  /* enable long-distance matching */
+    int window_log;     /* log2 of max window/dictionary size; 0 = default */
     size_t dictsize;    /* dictionary data size */
     uint8_t *dictdata;  /* dictionary data */
+    uint64_t dicthash;  /* compress_dict_hash() of dictdata, or 0 if unknown */
     void *params;       /* other algo-specific parameter data */
     /* TODO: flags to enable/disable reading/writing checksums */
 } Dino_COpts;
 typedef struct Dino_COpts Dino_DOpts;
 
+/* zstd allows negative levels and xz allows level 0, so we need something
+ * else to mean "whatever the algorithm's default is". */
+#define COMPRESS_LEVEL_DEFAULT INT_MIN
+#define COPTS_DEFAULT ((Dino_COpts) { .level = COMPRESS_LEVEL_DEFAULT })
+
+/* copts_write: append the options needed to decompress (or reproduce) data
+ * compressed with `copts` to `out`, in the format used for the section named
+ * by Dhdr.compress_opts. Returns the number of bytes written, or -1 if we
+ * ran out of memory. */
+ssize_t copts_write(const Dino_COpts *copts, Buf *out);
+
+/* copts_read: read options written by copts_write() from `data` into
+ * `dopts`. Anything not in the data gets its default value.
+ * dopts->dictdata points into `data`, so don't free that while you're
+ * still using the dictionary.
+ * Returns 0, or -1 if the data is malformed. */
+int copts_read(Dino_DOpts *dopts, const void *data, size_t size);
+
 /* Forward declarations for [CD]Stream; needed here because we've got a
  * reference loop where CStream contains a (*CCFuncs) and the function
  * signatures in CCFuncs refer to CStream. */
@@ -67,17 +113,95 @@ typedef struct Dino_DStream Dino_DStream;
  * library; none of the internal machinery is exposed, which is
  * nice.*/
 
+/* compress_dict_hash: a 64-bit hash of a dictionary, for telling whether two
+ * dictionaries are (almost certainly) the same without comparing them. Never
+ * returns 0, so 0 can mean "not worked out yet". */
+uint64_t compress_dict_hash(const void *dict, size_t size);
+
+/* compress_train_dict: build a dictionary for compressing lots of small,
+ * similar objects with algorithm `id`. The sample objects are concatenated
+ * in `samples`, and `sizes` has the size of each of the `count` samples.
+ * The dictionary goes in `dict`, which has room for `dictcap` bytes.
+ * (Rule of thumb: you want ~100x as much sample data as dictionary.)
+ * Returns the size of the dictionary, or 0 if the algorithm doesn't do
+ * dictionaries or training failed (e.g. not enough samples). */
+size_t compress_train_dict(Dino_CompressID id, void *dict, size_t dictcap,
+                           const void *samples, const size_t *sizes, unsigned count);
+
 /* Stream management */
 Dino_CStream *cstream_create(Dino_CompressID id);
 void cstream_free(Dino_CStream *cstream);
-/* FIXME: implement these! */
-//int cstream_setlevel(Dino_CStream *cstream, int level);
-//int cstream_setopts(Dino_CStream *cstream, Dino_COpts *copts);
+
+/* cstream_setopts: (re)configure the compressor with `copts`, replacing
+ * whatever options were set before. Do this before starting a frame.
+ * Returns 1 on success, 0 if the options are invalid or unsupported (in
+ * which case the old options are still in effect). */
+int cstream_setopts(Dino_CStream *cstream, Dino_COpts *copts);
+
+/* cstream_setlevel: change just the compression level. Same return value as
+ * cstream_setopts(). */
+int cstream_setlevel(Dino_CStream *cstream, int level);
 
 Dino_DStream *dstream_create(Dino_CompressID id);
+/* dstream_setopts: configure the decompressor with `dopts` (probably from
+ * copts_read()). Returns 1 on success, 0 on failure. */
 int dstream_setopts(Dino_DStream *dstream, Dino_DOpts *dopts);
 void dstream_free(Dino_DStream *dstream);
 
+/* cstream_reset/dstream_reset: abandon whatever frame was in progress (if
+ * any) and get ready to start a new one, keeping the current options -
+ * including the dictionary, which is the expensive part to set up.
+ * Returns 1 on success, 0 on failure (in which case, free the stream). */
+int cstream_reset(Dino_CStream *cstream);
+int dstream_reset(Dino_DStream *dstream);
+
+/* cstream_ref_prefix/dstream_ref_prefix: use `prefix` as the "history"
+ * for the next frame only, like `zstd --patch-from`: a new version of a
+ * file compressed against the old version comes out as little more than
+ * the differences. The decoder has to be given the same prefix.
+ * The prefix replaces the stream's dictionary for that frame; the next
+ * reset (or putting the stream back into the pool) puts the dictionary
+ * back. The prefix isn't copied, so keep it around until the frame is done.
+ * Call this after a reset, before starting the frame.
+ * Returns 1 on success, 0 if the algorithm can't do this (only zstd can)
+ * or it failed - in either case, reset the stream before using it again. */
+int cstream_ref_prefix(Dino_CStream *cstream, const void *prefix, size_t size);
+int dstream_ref_prefix(Dino_DStream *dstream, const void *prefix, size_t size);
+
+/* Stream pools.
+ *
+ * Making a new stream means allocating (and initializing) the codec's
+ * context, which costs hundreds of KB to a few MB for zstd - a lot more than
+ * actually compressing or decompressing a small object. So instead of
+ * create/free for each object, get a stream from the pool and put it back
+ * when you're done.
+ *
+ * Each thread keeps one stream of each kind for each algorithm, which it can
+ * get/put without any locking; anything beyond that goes into a shared
+ * (locked) pool, so streams can move between threads. When a thread exits,
+ * its streams go back to the shared pool.
+ *
+ * The _get functions return a stream set up with the given options (NULL
+ * means the defaults), or NULL if we couldn't make one. If a pooled stream
+ * already has matching options - most importantly a dictionary with the
+ * same contents - it doesn't get set up again. For decompression,
+ * "matching" just means the same dictionary and a big enough window.
+ * Dictionaries are matched by size and dicthash first, so fill that in
+ * (see compress_dict_hash()) if you're going to ask for the same one a lot;
+ * copts_read() does.
+ *
+ * The _put functions reset the stream (see above) and put it back into the
+ * pool, or free it if the reset fails or the pool is full. Don't use the
+ * stream after you put it back! */
+Dino_CStream *cstream_pool_get(Dino_CompressID id, Dino_COpts *copts);
+void cstream_pool_put(Dino_CStream *cstream);
+Dino_DStream *dstream_pool_get(Dino_CompressID id, Dino_DOpts *dopts);
+void dstream_pool_put(Dino_DStream *dstream);
+
+/* compress_pool_clear: free all the streams in the shared pool and the
+ * calling thread's cache. */
+void compress_pool_clear(void);
+
 /* And here's the actual generic compress/decompress API! */
 
 /* cstream_compress_start: give a hint to the encoder that a new stream
@@ -95,11 +219,15 @@ size_t cstream_compress(Dino_CStream *cstream, inBuf *in, outBuf *out);
  * if outbuf is full, returns a minimum number of bytes left to write. */
 size_t cstream_compress_end(Dino_CStream *cstream, outBuf *out);
 
-/* cstream_compress1: compress inbuf to outbuf in one operation, e.g.:
+/* cstream_compress1: compress all of inbuf to outbuf as one frame.
+ * If the algorithm has a one-shot compressor and outbuf has room for the
+ * worst case, that gets used; otherwise it's equivalent to:
  *   cstream_compress_start(cstream, (in->size - in->pos));
  *   cstream_compress(cstream, in, out);
  *   return cstream_compress_end(cstream, out);
- * return value is same as cstream_compress_end(). */
+ * returns 0 if the frame is complete, COMPRESS_ERR_BUF if outbuf wasn't big
+ * enough, or another COMPRESS_ERR_* code. After an error, reset the stream
+ * before using it again. */
 size_t cstream_compress1(Dino_CStream *cstream, inBuf *in, outBuf *out);
 
 /* dstream_decompress: decompress inbuf to outbuf.
@@ -112,8 +240,20 @@ size_t cstream_compress1(Dino_CStream *cstream, inBuf *in, outBuf *out);
  * the frame. Not sure about other decoders, though...) */
 size_t dstream_decompress(Dino_DStream *dstream, inBuf *in, outBuf *out);
 
+/* dstream_decompress1: decompress the complete frame at inbuf->buf[pos]
+ * into outbuf in one operation. outbuf needs room for all of it - use
+ * the index's unc_size or dstream_get_uncompressed_size() to size it.
+ * This skips the streaming machinery (and its internal buffering and
+ * copying) when the algorithm has a one-shot decoder.
+ * returns 0 if the whole frame was decoded, COMPRESS_ERR_BUF if outbuf
+ * wasn't big enough, or another COMPRESS_ERR_* code. After an error, reset
+ * the stream before using it again. */
+size_t dstream_decompress1(Dino_DStream *dstream, inBuf *in, outBuf *out);
+
 /* dstream_get_uncompressed_size: read the uncompressed content size from
- * the frame header, pointed to by inbuf->buf[pos].
+ * the frame header, pointed to by inbuf->buf[pos]. gzip and xz keep the
+ * size at the end of the frame instead, so for those inbuf->size has to be
+ * where the frame ends.
  * Returns the size - which may be 0 for an empty frame,
  *   or UNCOMPRESS_SIZE_UNKNOWN if the size is unknown,
  *   or UNCOMPRESS_SIZE_ERROR if inbuf isn't pointing to the header.
@@ -134,6 +274,9 @@ typedef struct Dino_CCFuncs {
     Dino_CompressID id;
     Dino_CCtx (*create_ctx)(void);
     void (*free_ctx)(Dino_CCtx);
+
+    /* setup(): (re)initialize the stream using the given options, or the
+     * defaults if copts is NULL. Returns 1 on success, 0 on failure. */
     int (*setup)(Dino_CStream*, Dino_COpts*);
 
     /* setsize(): tell the compressor the total uncompressed size of the data
@@ -162,6 +305,26 @@ typedef struct Dino_CCFuncs {
      * updates outbuf->pos
      * return value same as flush(). */
     size_t (*end)(Dino_CStream*, outBuf *);
+
+    /* train_dict(): optional; see compress_train_dict(). */
+    size_t (*train_dict)(void *, size_t, const void *, const size_t *, unsigned);
+
+    /* reset(): optional; see cstream_reset(). If this is NULL we just call
+     * setup() again with the current options. */
+    int (*reset)(Dino_CStream*);
+
+    /* compress1(): optional; compress all of inbuf->buf[pos:size] into a
+     * complete frame at outbuf->buf[pos] in one go, and update both `pos`
+     * fields. Returns 0 on success, or an error code. If it returns
+     * COMPRESS_ERR_BUF nothing has been read or written, and
+     * cstream_compress1() falls back to the streaming functions - so return
+     * that if outbuf might be too small, or if streaming would be better. */
+    size_t (*compress1)(Dino_CStream*, inBuf*, outBuf*);
+
+    /* ref_prefix(): optional; see cstream_ref_prefix(). It can change
+     * whatever parameters it likes - setup() gets called afterward to put
+     * the stream's own options back. */
+    int (*ref_prefix)(Dino_CStream*, const void*, size_t);
 } Dino_CCFuncs;
 
 /* function interface for a compliant decompression algorithm. */
@@ -169,6 +332,8 @@ typedef struct Dino_DCFuncs {
     Dino_CompressID id;
     Dino_DCtx (*create_ctx)(void);
     void (*free_ctx)(Dino_DCtx);
+
+    /* setup(): (re)initialize the stream, as above. */
     int (*setup)(Dino_DStream*, Dino_DOpts*);
 
     /* getsize(): return the uncompressed size of the compressed data frame
@@ -187,6 +352,17 @@ typedef struct Dino_DCFuncs {
      *  decoded or flushed, and gives a suggested next input size. */
     size_t (*decompress)(Dino_DStream*, inBuf*, outBuf*);
 
+    /* reset(): optional; see dstream_reset() and CCFuncs.reset(). */
+    int (*reset)(Dino_DStream*);
+
+    /* decompress1(): optional; decompress the complete frame that starts at
+     * inbuf->buf[pos] to outbuf->buf[pos] in one go, and update both `pos`
+     * fields. Returns 0 on success, COMPRESS_ERR_BUF (without reading or
+     * writing anything) if outbuf is too small, or another error code. */
+    size_t (*decompress1)(Dino_DStream*, inBuf*, outBuf*);
+
+    /* ref_prefix(): optional; see dstream_ref_prefix() and CCFuncs. */
+    int (*ref_prefix)(Dino_DStream*, const void*, size_t);
 } Dino_DCFuncs;
 
 /* getters for looking up [CD]CFuncs by id */
@@ -200,6 +376,11 @@ typedef struct Dino_CStream {
     size_t rec_outbuf_size;
     Dino_CCtx cctx;
     const Dino_CCFuncs *funcs;
+    Dino_COpts opts;
+    int prefixed;       /* ref_prefix() was called since the last reset */
+    /* The last caller's dictionary we checked against ours byte-by-byte;
+     * see dict_match() in pool.c */
+    const uint8_t *dictsrc;
 } Dino_CStream;
 
 typedef struct Dino_DStream {
@@ -208,6 +389,9 @@ typedef struct Dino_DStream {
     size_t rec_outbuf_size;
     Dino_DCtx dctx;
     const Dino_DCFuncs *funcs;
+    Dino_DOpts opts;
+    int prefixed;
+    const uint8_t *dictsrc;
 } Dino_DStream;
 
 /* TODO: better error codes */
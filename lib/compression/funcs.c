@@ -6,6 +6,11 @@ int compress_avail(Dino_CompressID id) {
     return (_get_ccfuncs(id) != NULL);
 }
 
+int compress_can_train(Dino_CompressID id) {
+    const Dino_CCFuncs *funcs = _get_ccfuncs(id);
+    return (funcs && funcs->train_dict);
+}
+
 typedef struct Memcpy_CCtx {
     size_t srcsize;
     size_t bytes_in;
@@ -78,6 +83,19 @@ size_t memcpy_end(Dino_CStream *cs, outBuf *outbuf) {
     return 0;
 }
 
+int memcpy_reset_dstream(Dino_DStream *ds) {
+    Memcpy_DCtx *ctx = ds->dctx;
+    ctx->bytes_in = 0;
+    ctx->bytes_out = 0;
+    ctx->srcsize = UNCOMPRESS_SIZE_UNKNOWN;
+    return 1;
+}
+
+int memcpy_reset_cstream(Dino_CStream *cs) {
+    memcpy_end(cs, NULL);
+    return 1;
+}
+
 size_t memcpy_getsize(Dino_DStream *ds, inBuf *in) {
     if (in->pos + MEMCPY_HDRSIZE > in->size)
         return UNCOMPRESS_SIZE_ERROR;
@@ -142,18 +160,31 @@ const Dino_DCFuncs dcfuncs[] = {
     { DINO_COMPRESS_ZSTD,
         zstd_create_dctx, zstd_free_dctx,
         zstd_setup_dstream, zstd_getsize,
-        zstd_decompress },
+        zstd_decompress, zstd_reset_dstream,
+        zstd_decompress1, zstd_ref_prefix_dstream },
 #endif
 #if LIBDINO_XZ
     { DINO_COMPRESS_XZ,
         xz_create_dctx, xz_free_dctx,
-        xz_setup_dstream, noop_getsize,
+        xz_setup_dstream, xz_getsize,
         xz_decompress },
+#endif
+#if LIBDINO_LZ4
+    { DINO_COMPRESS_LZ4,
+        lz4_create_dctx, lz4_free_dctx,
+        lz4_setup_dstream, lz4_getsize,
+        lz4_decompress, lz4_reset_dstream },
+#endif
+#if LIBDINO_ZLIB
+    { DINO_COMPRESS_ZLIB,
+        zlib_create_dctx, zlib_free_dctx,
+        zlib_setup_dstream, zlib_getsize,
+        zlib_decompress, zlib_reset_dstream },
 #endif
     { DINO_COMPRESS_NONE,
         memcpy_create_dctx, memcpy_free_dctx,
         memcpy_setup_dstream, memcpy_getsize,
-        memcpy_decompress },
+        memcpy_decompress, memcpy_reset_dstream },
     { DINO_COMPRESS_INVALID,
         NULL, NULL,
         NULL,
@@ -167,7 +198,9 @@ const Dino_CCFuncs ccfuncs[] = {
         DINO_COMPRESS_ZSTD,
         zstd_create_cctx, zstd_free_cctx,
         zstd_setup_cstream, zstd_setsize,
-        zstd_compress, zstd_flush, zstd_end
+        zstd_compress, zstd_flush, zstd_end,
+        zstd_train_dict, zstd_reset_cstream,
+        zstd_compress1, zstd_ref_prefix_cstream
     },
 #endif
 #if LIBDINO_XZ
@@ -175,11 +208,26 @@ const Dino_CCFuncs ccfuncs[] = {
         xz_create_cctx, xz_free_cctx,
         xz_setup_cstream, noop_setsize,
         xz_compress, xz_flush, xz_end },
+#endif
+#if LIBDINO_LZ4
+    { DINO_COMPRESS_LZ4,
+        lz4_create_cctx, lz4_free_cctx,
+        lz4_setup_cstream, lz4_setsize,
+        lz4_compress, lz4_flush, lz4_end,
+        NULL, lz4_reset_cstream },
+#endif
+#if LIBDINO_ZLIB
+    { DINO_COMPRESS_ZLIB,
+        zlib_create_cctx, zlib_free_cctx,
+        zlib_setup_cstream, noop_setsize,
+        zlib_compress, zlib_flush, zlib_end,
+        NULL, zlib_reset_cstream },
 #endif
     { DINO_COMPRESS_NONE,
         memcpy_create_cctx, memcpy_free_cctx,
         memcpy_setup_cstream, memcpy_setsize,
-        memcpy_compress, memcpy_flush, memcpy_flush },
+        memcpy_compress, memcpy_flush, memcpy_end,
+        NULL, memcpy_reset_cstream },
     { DINO_COMPRESS_INVALID,
         NULL, NULL,
         NULL,
@@ -201,3 +249,40 @@ const Dino_CCFuncs *_get_ccfuncs(Dino_CompressID id) {
     return NULL;
 }
 
+/* Anything that doesn't care about window_log gets this range */
+#define WINDOW_LOG_MIN 10
+#define WINDOW_LOG_MAX 31
+
+int compress_window_log_range(Dino_CompressID id, int *min, int *max) {
+    if (!compress_avail(id))
+        return 0;
+    *min = WINDOW_LOG_MIN;
+    *max = WINDOW_LOG_MAX;
+    switch (id) {
+#if LIBDINO_ZSTD
+        case DINO_COMPRESS_ZSTD:
+            zstd_window_log_range(min, max);
+            break;
+#endif
+#if LIBDINO_XZ
+        case DINO_COMPRESS_XZ:
+            *min = XZ_WINDOW_LOG_MIN;
+            *max = XZ_WINDOW_LOG_MAX;
+            break;
+#endif
+#if LIBDINO_LZ4
+        case DINO_COMPRESS_LZ4:
+            *min = LZ4_WINDOW_LOG_MIN;
+            break;
+#endif
+#if LIBDINO_ZLIB
+        case DINO_COMPRESS_ZLIB:
+            *min = ZLIB_WBITS_MIN;
+            break;
+#endif
+        default:
+            break;
+    }
+    return 1;
+}
+
@@ -0,0 +1,270 @@
+/* lz4 compression support.
+ *
+ * This writes the LZ4 frame format (the same as the lz4 command-line tool),
+ * so each object gets a header with its content size, like zstd.
+ *
+ * LZ4 trades compression ratio for speed - it decodes at several GB/s per
+ * core - so it's a good fit for data that gets read much more often than
+ * it gets written, or where decompression latency matters more than size.
+ */
+
+#include "../common.h"
+#include "../memory.h"
+#include "lz4.h"
+
+/* The most input we give LZ4F_compressUpdate() at once. LZ4F insists on
+ * having room in the output for the worst case, so this keeps that (and our
+ * pending output buffer) to a sensible size. */
+#define LZ4_CHUNK_MAX (64<<10)
+
+/* Frame header magic and FLG bits; see lz4_Frame_format.md */
+#define LZ4_FRAME_MAGIC 0x184D2204U
+#define LZ4_FLG_VERSION(flg) ((flg) >> 6)
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FRAME_HDR_MIN 7     /* magic + FLG + BD + HC */
+
+typedef enum Lz4_Stage {
+    LZ4_STAGE_IDLE = 0, /* nothing written for this frame yet */
+    LZ4_STAGE_FRAME,    /* header written */
+    LZ4_STAGE_ENDED,    /* frame footer written (maybe not flushed) */
+} Lz4_Stage;
+
+typedef struct Lz4_CCtx {
+    LZ4F_cctx *cctx;
+    LZ4F_preferences_t prefs;
+    Lz4_Stage stage;
+    /* LZ4F output that didn't fit in the caller's outbuf */
+    uint8_t *pending;
+    size_t pend_size;
+    size_t pend_pos;
+    size_t pend_len;
+} Lz4_CCtx;
+
+Dino_CCtx lz4_create_cctx(void) {
+    Lz4_CCtx *ctx = calloc(1, sizeof(Lz4_CCtx));
+    if (ctx && LZ4F_isError(LZ4F_createCompressionContext(&ctx->cctx, LZ4F_VERSION))) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void lz4_free_cctx(Dino_CCtx c) {
+    Lz4_CCtx *ctx = c;
+    LZ4F_freeCompressionContext(ctx->cctx);
+    free(ctx->pending);
+    free(ctx);
+}
+
+int lz4_setup_cstream(Dino_CStream *c, Dino_COpts *copts) {
+    Lz4_CCtx *ctx = c->cctx;
+    if (!ctx)
+        return 0;
+    LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+    /* We hand LZ4F big chunks anyway, so there's no point having it copy
+     * the input into its own buffer first. */
+    prefs.autoFlush = 1;
+    if (copts) {
+        /* Negative levels are "acceleration", like zstd's */
+        if (copts->level != COMPRESS_LEVEL_DEFAULT) {
+            if (copts->level > LZ4F_compressionLevel_max())
+                return 0;
+            prefs.compressionLevel = copts->level;
+        }
+        /* The window is always 64KB, which is fine for any bigger limit */
+        if (copts->window_log && (copts->window_log < LZ4_WINDOW_LOG_MIN))
+            return 0;
+    }
+    size_t bound = LZ4F_compressBound(LZ4_CHUNK_MAX, &prefs);
+    if (bound > ctx->pend_size) {
+        uint8_t *pending = realloc(ctx->pending, bound);
+        if (!pending)
+            return 0;
+        ctx->pending = pending;
+        ctx->pend_size = bound;
+    }
+    ctx->prefs = prefs;
+    ctx->stage = LZ4_STAGE_IDLE;
+    ctx->pend_pos = ctx->pend_len = 0;
+    c->rec_inbuf_size = LZ4_CHUNK_MAX;
+    c->rec_outbuf_size = bound;
+    return 1;
+}
+
+int lz4_reset_cstream(Dino_CStream *c) {
+    Lz4_CCtx *ctx = c->cctx;
+    /* LZ4F_compressBegin() starts the LZ4F context over, so this is all
+     * we need to forget about the current frame */
+    ctx->stage = LZ4_STAGE_IDLE;
+    ctx->pend_pos = ctx->pend_len = 0;
+    ctx->prefs.frameInfo.contentSize = 0;
+    return 1;
+}
+
+size_t lz4_setsize(Dino_CStream *c, size_t srcsize) {
+    Lz4_CCtx *ctx = c->cctx;
+    if (ctx->stage != LZ4_STAGE_IDLE)
+        return COMPRESS_ERR_STG;
+    if (srcsize >= UNCOMPRESS_SIZE_MAX)
+        return COMPRESS_ERR_BIG;
+    /* (0 means "unknown" to LZ4F, which is fine for empty frames) */
+    ctx->prefs.frameInfo.contentSize = srcsize;
+    return srcsize;
+}
+
+/* Copy as much pending output into outbuf as will fit.
+ * Returns the number of bytes still pending. */
+static size_t lz4_drain(Lz4_CCtx *ctx, outBuf *outbuf) {
+    size_t n = MIN(ctx->pend_len - ctx->pend_pos, outbuf->size - outbuf->pos);
+    memcpy(outbuf->buf + outbuf->pos, ctx->pending + ctx->pend_pos, n);
+    outbuf->pos += n;
+    ctx->pend_pos += n;
+    if (ctx->pend_pos == ctx->pend_len)
+        ctx->pend_pos = ctx->pend_len = 0;
+    return ctx->pend_len - ctx->pend_pos;
+}
+
+/* Where should LZ4F put output that could be up to `need` bytes? Straight
+ * into outbuf if it's sure to fit, otherwise into our (empty) pending
+ * buffer. */
+static void *lz4_dst(Lz4_CCtx *ctx, outBuf *outbuf, size_t need, size_t *cap) {
+    if (outbuf->size - outbuf->pos >= need) {
+        *cap = outbuf->size - outbuf->pos;
+        return outbuf->buf + outbuf->pos;
+    }
+    *cap = ctx->pend_size;
+    return ctx->pending;
+}
+
+/* LZ4F wrote `n` bytes to `dst` (from lz4_dst()); account for them */
+static void lz4_wrote(Lz4_CCtx *ctx, outBuf *outbuf, void *dst, size_t n) {
+    if (dst == ctx->pending) {
+        ctx->pend_len = n;
+        lz4_drain(ctx, outbuf);
+    } else {
+        outbuf->pos += n;
+    }
+}
+
+static size_t lz4_begin(Lz4_CCtx *ctx, outBuf *outbuf) {
+    size_t cap;
+    void *dst = lz4_dst(ctx, outbuf, LZ4F_HEADER_SIZE_MAX, &cap);
+    size_t r = LZ4F_compressBegin(ctx->cctx, dst, cap, &ctx->prefs);
+    if (LZ4F_isError(r))
+        return COMPRESS_ERR_UNK;
+    lz4_wrote(ctx, outbuf, dst, r);
+    ctx->stage = LZ4_STAGE_FRAME;
+    return 0;
+}
+
+size_t lz4_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf) {
+    Lz4_CCtx *ctx = c->cctx;
+    size_t r, cap;
+    if (lz4_drain(ctx, outbuf))
+        return c->rec_inbuf_size;
+    if ((ctx->stage == LZ4_STAGE_IDLE) && IS_COMPRESS_ERR(r = lz4_begin(ctx, outbuf)))
+        return r;
+    while ((inbuf->pos < inbuf->size) && !ctx->pend_len) {
+        size_t chunk = MIN(inbuf->size - inbuf->pos, LZ4_CHUNK_MAX);
+        void *dst = lz4_dst(ctx, outbuf, LZ4F_compressBound(chunk, &ctx->prefs), &cap);
+        r = LZ4F_compressUpdate(ctx->cctx, dst, cap, inbuf->buf + inbuf->pos, chunk, NULL);
+        if (LZ4F_isError(r))
+            return COMPRESS_ERR_UNK;
+        inbuf->pos += chunk;
+        lz4_wrote(ctx, outbuf, dst, r);
+    }
+    return c->rec_inbuf_size;
+}
+
+/* With autoFlush, LZ4F never holds on to anything, so we just have to get
+ * rid of whatever's pending. */
+size_t lz4_flush(Dino_CStream *c, outBuf *outbuf) {
+    return lz4_drain(c->cctx, outbuf);
+}
+
+size_t lz4_end(Dino_CStream *c, outBuf *outbuf) {
+    Lz4_CCtx *ctx = c->cctx;
+    size_t r, cap, left;
+    if ((left = lz4_drain(ctx, outbuf)))
+        return left;
+    /* An empty frame still needs a header */
+    if (ctx->stage == LZ4_STAGE_IDLE) {
+        if (IS_COMPRESS_ERR(r = lz4_begin(ctx, outbuf)))
+            return r;
+        if (ctx->pend_len)
+            return ctx->pend_len - ctx->pend_pos;
+    }
+    if (ctx->stage == LZ4_STAGE_FRAME) {
+        void *dst = lz4_dst(ctx, outbuf, LZ4F_compressBound(0, &ctx->prefs), &cap);
+        r = LZ4F_compressEnd(ctx->cctx, dst, cap, NULL);
+        if (LZ4F_isError(r))
+            return COMPRESS_ERR_UNK;
+        lz4_wrote(ctx, outbuf, dst, r);
+        ctx->stage = LZ4_STAGE_ENDED;
+        if (ctx->pend_len)
+            return ctx->pend_len - ctx->pend_pos;
+    }
+    /* All done; get ready for the next frame */
+    lz4_reset_cstream(c);
+    return 0;
+}
+
+Dino_DCtx lz4_create_dctx(void) {
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return NULL;
+    return dctx;
+}
+
+void lz4_free_dctx(Dino_DCtx d) { LZ4F_freeDecompressionContext(d); }
+
+int lz4_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts) {
+    if (!d->dctx)
+        return 0;
+    d->rec_inbuf_size = LZ4_CHUNK_MAX;
+    d->rec_outbuf_size = DEFAULT_BUFSIZE;
+    /* Everything the decoder needs is in the frame header */
+    LZ4F_resetDecompressionContext(d->dctx);
+    return 1;
+}
+
+int lz4_reset_dstream(Dino_DStream *d) {
+    LZ4F_resetDecompressionContext(d->dctx);
+    return 1;
+}
+
+/* LZ4F_getFrameInfo() would do this, but it also starts decoding the frame,
+ * so just read the header ourselves. */
+size_t lz4_getsize(Dino_DStream *d, inBuf *inbuf) {
+    const uint8_t *p = inbuf->buf + inbuf->pos;
+    size_t len = inbuf->size - inbuf->pos;
+    if (len < LZ4_FRAME_HDR_MIN)
+        return UNCOMPRESS_SIZE_ERROR;
+    uint32_t magic = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    if ((magic != LZ4_FRAME_MAGIC) || (LZ4_FLG_VERSION(p[4]) != 1))
+        return UNCOMPRESS_SIZE_ERROR;
+    if (!(p[4] & LZ4_FLG_CONTENT_SIZE))
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    if (len < LZ4_FRAME_HDR_MIN + sizeof(uint64_t))
+        return UNCOMPRESS_SIZE_ERROR;
+    uint64_t size = 0;
+    for (int i=7; i>=0; i--)
+        size = (size << 8) | p[6+i];
+    if (size > UNCOMPRESS_SIZE_MAX)
+        return UNCOMPRESS_SIZE_ERROR;
+    return size;
+}
+
+size_t lz4_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf) {
+    size_t in_len = inbuf->size - inbuf->pos;
+    size_t out_len = outbuf->size - outbuf->pos;
+    size_t r = LZ4F_decompress(d->dctx, outbuf->buf + outbuf->pos, &out_len,
+                               inbuf->buf + inbuf->pos, &in_len, NULL);
+    inbuf->pos += in_len;
+    outbuf->pos += out_len;
+    /* FIXME convert errors */
+    if (LZ4F_isError(r))
+        return COMPRESS_ERR_UNK;
+    /* r is 0 at the end of the frame, or a hint about how much to read */
+    return r;
+}
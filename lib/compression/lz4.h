@@ -0,0 +1,26 @@
+#ifndef _LZ4_H
+#define _LZ4_H 1
+
+#include "compression.h"
+#include <lz4frame.h>
+
+/* The window is always 64KB, so we can't promise anything smaller */
+#define LZ4_WINDOW_LOG_MIN 16
+
+Dino_CCtx lz4_create_cctx(void);
+void lz4_free_cctx(Dino_CCtx c);
+int lz4_setup_cstream(Dino_CStream *c, Dino_COpts *copts);
+int lz4_reset_cstream(Dino_CStream *c);
+size_t lz4_setsize(Dino_CStream *c, size_t srcsize);
+size_t lz4_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf);
+size_t lz4_flush(Dino_CStream *c, outBuf *outbuf);
+size_t lz4_end(Dino_CStream *c, outBuf *outbuf);
+
+Dino_DCtx lz4_create_dctx(void);
+void lz4_free_dctx(Dino_DCtx d);
+int lz4_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts);
+int lz4_reset_dstream(Dino_DStream *d);
+size_t lz4_getsize(Dino_DStream *d, inBuf *inbuf);
+size_t lz4_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf);
+
+#endif /* _LZ4_H */
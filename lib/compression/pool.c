@@ -0,0 +1,226 @@
+/* pool.c - pools of reusable compression/decompression streams.
+ * See compression.h for the interface. */
+
+#include <pthread.h>
+
+#include "../common.h"
+#include "../memory.h"
+#include "compression.h"
+
+/* How many idle streams of each kind we keep around for each algorithm,
+ * not counting the ones in per-thread caches. */
+#define POOL_MAX 16
+
+/* Shared pool for one kind of stream (C or D) for one algorithm */
+typedef struct StreamPool {
+    pthread_mutex_t lock;
+    size_t count;
+    void *streams[POOL_MAX];
+} StreamPool;
+
+static StreamPool cpools[DINO_COMPRESSNUM];
+static StreamPool dpools[DINO_COMPRESSNUM];
+
+/* Per-thread cache: one stream of each kind per algorithm */
+typedef struct PoolCache {
+    Dino_CStream *cs[DINO_COMPRESSNUM];
+    Dino_DStream *ds[DINO_COMPRESSNUM];
+} PoolCache;
+
+static __thread PoolCache *tcache;
+
+/* __thread variables don't get destructors, but pthread keys do, so we also
+ * stash the cache in a key to hand its streams back when the thread exits. */
+static pthread_key_t tcache_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_init(void) {
+    for (Dino_CompressID id=0; id<DINO_COMPRESSNUM; id++) {
+        pthread_mutex_init(&cpools[id].lock, NULL);
+        pthread_mutex_init(&dpools[id].lock, NULL);
+    }
+}
+
+/* Push a stream into a shared pool. Returns 0 if the pool's full. */
+static int pool_push(StreamPool *pool, void *stream) {
+    int ok = 0;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < POOL_MAX) {
+        pool->streams[pool->count++] = stream;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+static void *pool_pop(StreamPool *pool) {
+    void *stream = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count)
+        stream = pool->streams[--pool->count];
+    pthread_mutex_unlock(&pool->lock);
+    return stream;
+}
+
+static void tcache_release(void *arg) {
+    PoolCache *cache = arg;
+    for (Dino_CompressID id=0; id<DINO_COMPRESSNUM; id++) {
+        if (cache->cs[id] && !pool_push(&cpools[id], cache->cs[id]))
+            cstream_free(cache->cs[id]);
+        if (cache->ds[id] && !pool_push(&dpools[id], cache->ds[id]))
+            dstream_free(cache->ds[id]);
+    }
+    free(cache);
+}
+
+static void pool_key_init(void) {
+    pool_init();
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/* Get this thread's cache, making it if needed. Returns NULL if we can't,
+ * in which case everything just goes through the shared pools. */
+static PoolCache *tcache_get(void) {
+    pthread_once(&pool_once, pool_key_init);
+    if (!tcache && (tcache = calloc(1, sizeof(PoolCache)))) {
+        if (pthread_setspecific(tcache_key, tcache)) {
+            free(tcache);
+            tcache = NULL;
+        }
+    }
+    return tcache;
+}
+
+/* Does the stream's dictionary (`have`, which is the stream's own copy; see
+ * cstream_setopts()) have the same contents as the one asked for?
+ * Different sizes or hashes mean no. Same hash means almost certainly yes,
+ * but check the bytes the first time we see a given caller's buffer; after
+ * that, `*src` remembers it. If that buffer gets freed and something else
+ * lands at the same address, its hash won't match (unless it's the same
+ * dictionary anyway). */
+static int dict_match(const Dino_COpts *have, const uint8_t **src,
+                      const Dino_COpts *want) {
+    size_t wantsize = want->dictdata ? want->dictsize : 0;
+    if (have->dictsize != wantsize)
+        return 0;
+    if (!wantsize)
+        return 1;
+    uint64_t wanthash = want->dicthash;
+    if (!wanthash)
+        wanthash = compress_dict_hash(want->dictdata, wantsize);
+    if (have->dicthash != wanthash)
+        return 0;
+    if (*src == want->dictdata)
+        return 1;
+    if (memcmp(have->dictdata, want->dictdata, wantsize))
+        return 0;
+    *src = want->dictdata;
+    return 1;
+}
+
+static int copts_match(Dino_CStream *cs, const Dino_COpts *b) {
+    const Dino_COpts *a = &cs->opts;
+    return (a->level == b->level) && (a->threads == b->threads) &&
+           (a->long_distance == b->long_distance) &&
+           (a->window_log == b->window_log) && dict_match(a, &cs->dictsrc, b);
+}
+
+Dino_CStream *cstream_pool_get(Dino_CompressID id, Dino_COpts *copts) {
+    if (id >= DINO_COMPRESSNUM)
+        return NULL;
+    Dino_COpts defaults = COPTS_DEFAULT;
+    if (!copts)
+        copts = &defaults;
+
+    PoolCache *cache = tcache_get();
+    Dino_CStream *cs = NULL;
+    if (cache && cache->cs[id]) {
+        cs = cache->cs[id];
+        cache->cs[id] = NULL;
+    } else {
+        cs = pool_pop(&cpools[id]);
+    }
+    if (!cs && !(cs = cstream_create(id)))
+        return NULL;
+
+    if (!copts_match(cs, copts) && !cstream_setopts(cs, copts)) {
+        cstream_free(cs);
+        return NULL;
+    }
+    return cs;
+}
+
+void cstream_pool_put(Dino_CStream *cs) {
+    if (!cs)
+        return;
+    Dino_CompressID id = cs->funcs->id;
+    PoolCache *cache = tcache_get();
+    if (!cstream_reset(cs))
+        cstream_free(cs);
+    else if (cache && !cache->cs[id])
+        cache->cs[id] = cs;
+    else if (!pool_push(&cpools[id], cs))
+        cstream_free(cs);
+}
+
+Dino_DStream *dstream_pool_get(Dino_CompressID id, Dino_DOpts *dopts) {
+    if (id >= DINO_COMPRESSNUM)
+        return NULL;
+    Dino_DOpts opts = dopts ? *dopts : COPTS_DEFAULT;
+
+    PoolCache *cache = tcache_get();
+    Dino_DStream *ds = NULL;
+    if (cache && cache->ds[id]) {
+        ds = cache->ds[id];
+        cache->ds[id] = NULL;
+    } else {
+        ds = pool_pop(&dpools[id]);
+    }
+    if (!ds && !(ds = dstream_create(id)))
+        return NULL;
+
+    /* A decoder that handles a bigger window handles a smaller one too, so
+     * don't ever shrink it. The dictionary has to be the right one, though,
+     * and that's the expensive part to change. The thread count changes
+     * which decoder xz uses, so that has to match as well. */
+    if (!dict_match(&ds->opts, &ds->dictsrc, &opts) ||
+        (opts.threads != ds->opts.threads) ||
+        (opts.window_log > ds->opts.window_log)) {
+        opts.window_log = MAX(opts.window_log, ds->opts.window_log);
+        if (!dstream_setopts(ds, &opts)) {
+            dstream_free(ds);
+            return NULL;
+        }
+    }
+    return ds;
+}
+
+void dstream_pool_put(Dino_DStream *ds) {
+    if (!ds)
+        return;
+    Dino_CompressID id = ds->funcs->id;
+    PoolCache *cache = tcache_get();
+    if (!dstream_reset(ds))
+        dstream_free(ds);
+    else if (cache && !cache->ds[id])
+        cache->ds[id] = ds;
+    else if (!pool_push(&dpools[id], ds))
+        dstream_free(ds);
+}
+
+void compress_pool_clear(void) {
+    void *s;
+    pthread_once(&pool_once, pool_key_init);
+    for (Dino_CompressID id=0; id<DINO_COMPRESSNUM; id++) {
+        if (tcache) {
+            cstream_free(tcache->cs[id]);
+            dstream_free(tcache->ds[id]);
+            tcache->cs[id] = NULL;
+            tcache->ds[id] = NULL;
+        }
+        while ((s = pool_pop(&cpools[id])))
+            cstream_free(s);
+        while ((s = pool_pop(&dpools[id])))
+            dstream_free(s);
+    }
+}
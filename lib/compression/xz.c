@@ -20,34 +20,104 @@
 
 
 void *xz_create_ctx(void) { return calloc(1, sizeof(lzma_stream)); }
-void xz_free_ctx(void *ctx) { free(ctx); }
+void xz_free_ctx(void *ctx) {
+    /* lzma_end() frees the coder's internal state, if it has any */
+    lzma_end(ctx);
+    free(ctx);
+}
 
 int xz_setup_cstream(Dino_CStream *c, Dino_COpts *copts) {
+    lzma_stream *strm = c->cctx;
     lzma_ret ret;
+    c->rec_inbuf_size = DEFAULT_BUFSIZE;
+    c->rec_outbuf_size = DEFAULT_BUFSIZE;
+    /* TODO: we could use LZMA_CHECK_NONE when we're calculating our
+     * own checksums... */
+    /* TODO: better error codes */
     if (!copts) {
-        c->rec_inbuf_size = DEFAULT_BUFSIZE;
-        c->rec_outbuf_size = DEFAULT_BUFSIZE;
-        /* TODO: we could use LZMA_CHECK_NONE when we're calculating our
-         * own checksums... */
-        ret = lzma_easy_encoder((lzma_stream *)c->cctx,
-                                XZ_LEVEL_DEFAULT,
-                                LZMA_CHECK_CRC32);
-        if (ret == LZMA_OK)
-            return 1;
-        /* TODO: better error codes */
+        ret = lzma_easy_encoder(strm, XZ_LEVEL_DEFAULT, LZMA_CHECK_CRC32);
+        return (ret == LZMA_OK);
+    }
+
+    uint32_t preset = XZ_LEVEL_DEFAULT;
+    if (copts->level != COMPRESS_LEVEL_DEFAULT) {
+        if ((copts->level < 0) || (copts->level > 9))
+            return 0;
+        preset = copts->level;
+    }
+    lzma_options_lzma lzopts;
+    if (lzma_lzma_preset(&lzopts, preset))
+        return 0;
+    if (copts->window_log) {
+        if ((copts->window_log < XZ_WINDOW_LOG_MIN) || (copts->window_log > XZ_WINDOW_LOG_MAX))
+            return 0;
+        lzopts.dict_size = 1U << copts->window_log;
     }
-    return 0;
+    lzma_filter filters[] = {
+        { .id = LZMA_FILTER_LZMA2, .options = &lzopts },
+        { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+    };
+
+    if (copts->threads > 1) {
+        /* The multithreaded encoder splits the input into blocks and
+         * compresses them in parallel. The default block size is 3x the
+         * dictionary size, which is fine. */
+        lzma_mt mt = {
+            .threads = copts->threads,
+            .filters = filters,
+            .check = LZMA_CHECK_CRC32,
+        };
+        ret = lzma_stream_encoder_mt(strm, &mt);
+    } else {
+        ret = lzma_stream_encoder(strm, filters, LZMA_CHECK_CRC32);
+    }
+    return (ret == LZMA_OK);
 }
 
-/* TODO: implement these...
- * size_t xz_getsize(Dino_DStream *d, inBuf *inbuf) { return UNCOMPRESS_SIZE_UNKNOWN; }
- * size_t xz_setsize(Dino_CStream *c, size_t srcsize) { return srcsize; }
- *
- * UNFORTUNATELY since xz puts the uncompressed content size in the stream
- * _footer_, this really isn't going to work out for simple stream I/O.
- * It's still feasible - you'd just have to pass in the _end_ of the stream
- * rather than the start.
- */
+/* xz keeps the uncompressed size in the index, right before the stream
+ * footer, so this needs inbuf to end exactly where the stream does (just like
+ * the gzip trailer in zlib.c). Like the other decoders, xz_decompress() only
+ * decodes one stream - one frame - at a time, so if the stream that ends
+ * there doesn't start at inbuf->pos (e.g. `cat a.xz b.xz`, or Stream Padding
+ * on the end) then we can't tell the size of the one that does. */
+size_t xz_getsize(Dino_DStream *d, inBuf *inbuf) {
+    const uint8_t *start = inbuf->buf + inbuf->pos;
+    const uint8_t *end = inbuf->buf + inbuf->size;
+    lzma_stream_flags hdr, ftr;
+    if ((size_t)(end - start) < 2*LZMA_STREAM_HEADER_SIZE)
+        return UNCOMPRESS_SIZE_ERROR;
+    /* Stream Padding is zero bytes, and a footer always ends in "YZ" */
+    if (!memcmp(end-4, "\0\0\0\0", 4))
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    const uint8_t *footer = end - LZMA_STREAM_HEADER_SIZE;
+    if (lzma_stream_footer_decode(&ftr, footer) != LZMA_OK)
+        return UNCOMPRESS_SIZE_ERROR;
+    if (ftr.backward_size > (lzma_vli)(footer - start - LZMA_STREAM_HEADER_SIZE))
+        return UNCOMPRESS_SIZE_ERROR;
+
+    lzma_index *idx = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t idxpos = 0;
+    if (lzma_index_buffer_decode(&idx, &memlimit, NULL,
+                                 footer - ftr.backward_size, &idxpos,
+                                 ftr.backward_size) != LZMA_OK)
+        return UNCOMPRESS_SIZE_ERROR;
+    lzma_vli unc_size = lzma_index_uncompressed_size(idx);
+    lzma_vli stream_size = lzma_index_stream_size(idx);
+    lzma_index_end(idx, NULL);
+
+    /* The index tells us where the stream starts, so check the header
+     * there agrees with the footer */
+    if (stream_size > (lzma_vli)(end - start))
+        return UNCOMPRESS_SIZE_ERROR;
+    const uint8_t *header = end - stream_size;
+    if ((lzma_stream_header_decode(&hdr, header) != LZMA_OK) ||
+        (lzma_stream_flags_compare(&hdr, &ftr) != LZMA_OK))
+        return UNCOMPRESS_SIZE_ERROR;
+    if ((header != start) || (unc_size > UNCOMPRESS_SIZE_MAX))
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    return unc_size;
+}
 
 size_t xz_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf) {
     lzma_stream *strm = c->cctx;
@@ -135,20 +205,37 @@ size_t xz_end(Dino_CStream *c, outBuf *outbuf) {
 }
 
 int xz_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts) {
+    lzma_stream *strm = d->dctx;
     lzma_ret ret;
-    if (!dopts) {
-        d->rec_inbuf_size = DEFAULT_BUFSIZE;
-        d->rec_outbuf_size = DEFAULT_BUFSIZE;
-        /* TODO: we could set the LZMA_IGNORE_CHECK flag if we're doing
-         * our own integrity check of the decompressed data... */
-        ret = lzma_stream_decoder((lzma_stream *)d->dctx,
-                                  UINT64_MAX, /* memlimit */
-                                  0);         /* checksum flags */
-        if (ret == LZMA_OK)
-            return 1;
-        /* FIXME: better return/error codes */
+    d->rec_inbuf_size = DEFAULT_BUFSIZE;
+    d->rec_outbuf_size = DEFAULT_BUFSIZE;
+    /* The xz stream headers have everything the decoder needs (and we don't
+     * set a memlimit), so threads is the only thing in dopts we care about.
+     * TODO: we could set the LZMA_IGNORE_CHECK flag if we're doing
+     * our own integrity check of the decompressed data... */
+#if LZMA_VERSION >= 50040000
+    if (dopts && (dopts->threads > 1)) {
+        /* The threaded decoder can only split up streams that have more than
+         * one block with the sizes in the block headers, which is what the
+         * threaded encoder writes. Anything else gets decoded in one thread,
+         * same as lzma_stream_decoder().
+         * Like xz(1), stop spinning up threads once the decoders would be
+         * using a quarter of RAM; past that it just goes single-threaded. */
+        uint64_t physmem = lzma_physmem();
+        lzma_mt mt = {
+            .threads = dopts->threads,
+            .memlimit_threading = physmem ? physmem/4 : UINT64_MAX,
+            .memlimit_stop = UINT64_MAX,
+        };
+        ret = lzma_stream_decoder_mt(strm, &mt);
+        return (ret == LZMA_OK);
     }
-    return 0;
+#endif
+    ret = lzma_stream_decoder(strm,
+                              UINT64_MAX, /* memlimit */
+                              0);         /* checksum flags */
+    /* FIXME: better return/error codes */
+    return (ret == LZMA_OK);
 }
 
 size_t xz_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf) {
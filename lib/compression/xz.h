@@ -7,6 +7,10 @@
 /* This is what RPM is currently using, so.. */
 #define XZ_LEVEL_DEFAULT 2
 
+/* What lzma_options_lzma.dict_size will take, as a power of two */
+#define XZ_WINDOW_LOG_MIN 12
+#define XZ_WINDOW_LOG_MAX 30
+
 /* This part is the same for xz/lzma dctx/cctx */
 void *xz_create_ctx(void);
 void xz_free_ctx(void *ctx);
@@ -23,7 +27,7 @@ size_t xz_end(Dino_CStream *c, outBuf *outbuf);
 #define xz_create_dctx ((Dino_DCtx (*)(void))xz_create_ctx)
 #define xz_free_dctx ((void (*)(Dino_DCtx))xz_free_ctx)
 int xz_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts);
-//size_t xz_getsize(Dino_DStream *d, inBuf *inbuf);
+size_t xz_getsize(Dino_DStream *d, inBuf *inbuf);
 size_t xz_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf);
 
 #endif /* _XZ_H */
@@ -0,0 +1,227 @@
+/* zlib (gzip) compression support.
+ *
+ * We write gzip members rather than raw zlib streams, so existing gzip data
+ * can be stored as-is and anything we write can be read by gzip/zcat.
+ * The decoder accepts zlib streams too.
+ *
+ * This only uses the classic zlib API, so it also builds against zlib-ng
+ * in compatibility mode (which gets you its SIMD inflate/deflate).
+ */
+
+#define _GNU_SOURCE /* for memmem */
+#include <limits.h>
+
+#include "../common.h"
+#include "../memory.h"
+#include "zlib.h"
+
+/* windowBits tweaks: +16 means "gzip wrapper", +32 means "detect gzip or
+ * zlib" (inflate only) */
+#define ZLIB_WBITS_GZIP 16
+#define ZLIB_WBITS_AUTO 32
+
+/* gzip header and trailer; see RFC 1952 */
+#define GZIP_ID1 0x1f
+#define GZIP_ID2 0x8b
+#define GZIP_CM_DEFLATE 8
+#define GZIP_HDR_MIN 10
+#define GZIP_TRAILER 8          /* CRC32 + ISIZE */
+static const uint8_t gzip_magic[] = { GZIP_ID1, GZIP_ID2, GZIP_CM_DEFLATE };
+
+/* The best deflate can possibly do is ~1032:1, so if the compressed data is
+ * smaller than this, the original size must have fit in 32 bits and the
+ * trailer's ISIZE (which is the size mod 2^32) is the actual size. */
+#define DEFLATE_MAX_RATIO 1032
+#define GZIP_ISIZE_SAFE (UINT32_MAX / DEFLATE_MAX_RATIO)
+
+/* zlib wants us to remember whether we've done deflateInit/inflateInit */
+typedef struct Zlib_Ctx {
+    z_stream strm;
+    int init;
+} Zlib_Ctx;
+typedef struct Zlib_Ctx Zlib_CCtx;
+typedef struct Zlib_Ctx Zlib_DCtx;
+
+/* z_stream counts in uInt, so don't hand it more than that at once */
+#define ZLIB_AVAIL(len) ((uInt)MIN((len), UINT_MAX))
+
+Dino_CCtx zlib_create_cctx(void) { return calloc(1, sizeof(Zlib_CCtx)); }
+Dino_DCtx zlib_create_dctx(void) { return calloc(1, sizeof(Zlib_DCtx)); }
+
+void zlib_free_cctx(Dino_CCtx c) {
+    Zlib_CCtx *ctx = c;
+    if (ctx->init)
+        deflateEnd(&ctx->strm);
+    free(ctx);
+}
+
+void zlib_free_dctx(Dino_DCtx d) {
+    Zlib_DCtx *ctx = d;
+    if (ctx->init)
+        inflateEnd(&ctx->strm);
+    free(ctx);
+}
+
+int zlib_setup_cstream(Dino_CStream *c, Dino_COpts *copts) {
+    Zlib_CCtx *ctx = c->cctx;
+    if (!ctx)
+        return 0;
+    c->rec_inbuf_size = DEFAULT_BUFSIZE;
+    c->rec_outbuf_size = DEFAULT_BUFSIZE;
+    int level = ZLIB_LEVEL_DEFAULT;
+    int wbits = ZLIB_WBITS_MAX;
+    if (copts) {
+        if (copts->level != COMPRESS_LEVEL_DEFAULT) {
+            if ((copts->level < Z_NO_COMPRESSION) || (copts->level > Z_BEST_COMPRESSION))
+                return 0;
+            level = copts->level;
+        }
+        /* The window can't be bigger than 32KB, which is fine for any
+         * bigger limit */
+        if (copts->window_log) {
+            if (copts->window_log < ZLIB_WBITS_MIN)
+                return 0;
+            wbits = MIN(copts->window_log, ZLIB_WBITS_MAX);
+        }
+    }
+    /* deflateParams() can't change the window size, so start over */
+    if (ctx->init)
+        deflateEnd(&ctx->strm);
+    ctx->strm = (z_stream) { 0 };
+    ctx->init = (deflateInit2(&ctx->strm, level, Z_DEFLATED, wbits + ZLIB_WBITS_GZIP,
+                              8, Z_DEFAULT_STRATEGY) == Z_OK);
+    return ctx->init;
+}
+
+int zlib_reset_cstream(Dino_CStream *c) {
+    Zlib_CCtx *ctx = c->cctx;
+    return ctx->init && (deflateReset(&ctx->strm) == Z_OK);
+}
+
+/* Run deflate() with the given flush mode on as much as fits */
+static int zlib_deflate(Zlib_CCtx *ctx, inBuf *inbuf, outBuf *outbuf, int flush) {
+    z_stream *strm = &ctx->strm;
+    uInt in_len = inbuf ? ZLIB_AVAIL(inbuf->size - inbuf->pos) : 0;
+    uInt out_len = ZLIB_AVAIL(outbuf->size - outbuf->pos);
+    strm->next_in = inbuf ? (Bytef *)inbuf->buf + inbuf->pos : Z_NULL;
+    strm->avail_in = in_len;
+    strm->next_out = (Bytef *)outbuf->buf + outbuf->pos;
+    strm->avail_out = out_len;
+    int ret = deflate(strm, flush);
+    if (inbuf)
+        inbuf->pos += in_len - strm->avail_in;
+    outbuf->pos += out_len - strm->avail_out;
+    return ret;
+}
+
+size_t zlib_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf) {
+    Zlib_CCtx *ctx = c->cctx;
+    int ret = Z_OK;
+    /* avail_in is only 32 bits, so we might need a few goes */
+    while ((ret == Z_OK) && (inbuf->pos < inbuf->size) && (outbuf->pos < outbuf->size))
+        ret = zlib_deflate(ctx, inbuf, outbuf, Z_NO_FLUSH);
+    /* Z_BUF_ERROR just means we couldn't make progress (outbuf is full) */
+    if ((ret == Z_OK) || (ret == Z_BUF_ERROR))
+        return c->rec_inbuf_size;
+    return COMPRESS_ERR_UNK;
+}
+
+size_t zlib_flush(Dino_CStream *c, outBuf *outbuf) {
+    int ret = zlib_deflate(c->cctx, NULL, outbuf, Z_SYNC_FLUSH);
+    if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+        return COMPRESS_ERR_UNK;
+    /* If deflate filled outbuf there might be more to come */
+    return (outbuf->pos < outbuf->size) ? 0 : 1;
+}
+
+size_t zlib_end(Dino_CStream *c, outBuf *outbuf) {
+    Zlib_CCtx *ctx = c->cctx;
+    int ret = zlib_deflate(ctx, NULL, outbuf, Z_FINISH);
+    switch (ret) {
+        case Z_STREAM_END:
+            /* Done; get ready for the next frame, like zstd does */
+            return (deflateReset(&ctx->strm) == Z_OK) ? 0 : COMPRESS_ERR_UNK;
+        case Z_OK:
+        case Z_BUF_ERROR:   /* not enough room in outbuf */
+            /* TODO: deflatePending() could tell us how much is left */
+            return 1;
+        default:
+            return COMPRESS_ERR_UNK;
+    }
+}
+
+int zlib_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts) {
+    Zlib_DCtx *ctx = d->dctx;
+    if (!ctx)
+        return 0;
+    d->rec_inbuf_size = DEFAULT_BUFSIZE;
+    d->rec_outbuf_size = DEFAULT_BUFSIZE;
+    /* The headers tell inflate everything it needs, so there's nothing in
+     * dopts for us. */
+    if (ctx->init)
+        return (inflateReset(&ctx->strm) == Z_OK);
+    ctx->strm = (z_stream) { 0 };
+    ctx->init = (inflateInit2(&ctx->strm, ZLIB_WBITS_MAX + ZLIB_WBITS_AUTO) == Z_OK);
+    return ctx->init;
+}
+
+int zlib_reset_dstream(Dino_DStream *d) {
+    Zlib_DCtx *ctx = d->dctx;
+    return ctx->init && (inflateReset(&ctx->strm) == Z_OK);
+}
+
+/* gzip only records the size in its trailer, so this assumes that inbuf
+ * ends where the gzip member does - which is true for DINO objects.
+ * zlib_decompress() stops at the end of each member, so if there's another
+ * member after this one (`cat a.gz b.gz`), the trailer at the end isn't
+ * this member's. There's no telling where a member ends without inflating
+ * it, but the next one would start with a gzip header, so if that turns up
+ * anywhere after ours we say we don't know. (The compressed data can
+ * contain those bytes by chance, but then we just don't get a size.)
+ * The decoder also takes zlib-wrapped data, which doesn't record the size
+ * anywhere, so anything that isn't gzip is "unknown" rather than an error. */
+size_t zlib_getsize(Dino_DStream *d, inBuf *inbuf) {
+    const uint8_t *p = inbuf->buf + inbuf->pos;
+    size_t len = inbuf->size - inbuf->pos;
+    if ((len < sizeof(gzip_magic)) || memcmp(p, gzip_magic, sizeof(gzip_magic)))
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    if (len < GZIP_HDR_MIN + GZIP_TRAILER)
+        return UNCOMPRESS_SIZE_ERROR;
+    if (len > GZIP_ISIZE_SAFE)
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    if (memmem(p + GZIP_HDR_MIN, len - GZIP_HDR_MIN, gzip_magic, sizeof(gzip_magic)))
+        return UNCOMPRESS_SIZE_UNKNOWN;
+    const uint8_t *isize = p + len - 4;
+    return isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint32_t)isize[3] << 24);
+}
+
+size_t zlib_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf) {
+    Zlib_DCtx *ctx = d->dctx;
+    z_stream *strm = &ctx->strm;
+    uInt in_len = ZLIB_AVAIL(inbuf->size - inbuf->pos);
+    uInt out_len = ZLIB_AVAIL(outbuf->size - outbuf->pos);
+    strm->next_in = (Bytef *)inbuf->buf + inbuf->pos;
+    strm->avail_in = in_len;
+    strm->next_out = (Bytef *)outbuf->buf + outbuf->pos;
+    strm->avail_out = out_len;
+
+    int ret = inflate(strm, Z_NO_FLUSH);
+    inbuf->pos += in_len - strm->avail_in;
+    outbuf->pos += out_len - strm->avail_out;
+
+    switch (ret) {
+        case Z_STREAM_END:
+            /* End of this member; get ready for the next one */
+            return (inflateReset(strm) == Z_OK) ? 0 : COMPRESS_ERR_UNK;
+        case Z_OK:
+        case Z_BUF_ERROR:   /* no progress possible: need input or space */
+            /* Not done yet, even if there's no input left: we can't
+             * return 0 (done) just because inbuf happens to be empty */
+            return d->rec_inbuf_size;
+        case Z_MEM_ERROR:
+            return COMPRESS_ERR_MEM;
+        /* TODO: better error codes */
+        default:
+            return COMPRESS_ERR_UNK;
+    }
+}
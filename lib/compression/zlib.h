@@ -0,0 +1,29 @@
+#ifndef _ZLIB_H
+#define _ZLIB_H 1
+
+#include "compression.h"
+#include <zlib.h>
+
+/* zlib's own default, which is what gzip uses too */
+#define ZLIB_LEVEL_DEFAULT Z_DEFAULT_COMPRESSION
+
+/* deflate's windowBits range */
+#define ZLIB_WBITS_MAX 15
+#define ZLIB_WBITS_MIN 9
+
+Dino_CCtx zlib_create_cctx(void);
+void zlib_free_cctx(Dino_CCtx c);
+int zlib_setup_cstream(Dino_CStream *c, Dino_COpts *copts);
+int zlib_reset_cstream(Dino_CStream *c);
+size_t zlib_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf);
+size_t zlib_flush(Dino_CStream *c, outBuf *outbuf);
+size_t zlib_end(Dino_CStream *c, outBuf *outbuf);
+
+Dino_DCtx zlib_create_dctx(void);
+void zlib_free_dctx(Dino_DCtx d);
+int zlib_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts);
+int zlib_reset_dstream(Dino_DStream *d);
+size_t zlib_getsize(Dino_DStream *d, inBuf *inbuf);
+size_t zlib_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf);
+
+#endif /* _ZLIB_H */
@@ -1,6 +1,9 @@
 /* zstd compression support */
 
 #include <zstd.h>
+#include <zdict.h>
+#include <zstd_errors.h>
+#include "../common.h"
 #include "compression.h"
 
 void zstd_free_cctx(Dino_CCtx c) { ZSTD_freeCCtx(c); }
@@ -8,25 +11,66 @@ void zstd_free_dctx(Dino_DCtx d) { ZSTD_freeDCtx(d); }
 Dino_CCtx zstd_create_cctx(void) { return (Dino_CCtx) ZSTD_createCCtx(); }
 Dino_DCtx zstd_create_dctx(void) { return (Dino_DCtx) ZSTD_createDCtx(); }
 
+/* zstd's ZSTD_WINDOWLOG_LIMIT_DEFAULT, which is in the experimental API */
+#define ZSTD_WINDOWLOG_DEFAULT_MAX 27
+
+/* Set a CCtx/DCtx parameter, bailing out of the current function if zstd
+ * doesn't like it */
+#define ZSTD_SETPARAM(setter, ctx, param, val) \
+    if (ZSTD_isError(setter(ctx, param, val))) return 0
+
 /* FIXME: better error codes */
 int zstd_setup_cstream(Dino_CStream *c, Dino_COpts *copts) {
-    if (!copts) {
-        c->rec_inbuf_size = ZSTD_CStreamInSize();
-        c->rec_outbuf_size = ZSTD_CStreamOutSize();
+    c->rec_inbuf_size = ZSTD_CStreamInSize();
+    c->rec_outbuf_size = ZSTD_CStreamOutSize();
+    if (!copts)
         return 1;
-    }
-    /* TODO: handle copts! */
-    return 0;
+    /* Every option gets set explicitly (0 meaning "default" for all of
+     * them), so nothing sticks around from the previous options. */
+    int level = (copts->level == COMPRESS_LEVEL_DEFAULT) ? 0 : copts->level;
+    int workers = (copts->threads > 1) ? copts->threads : 0;
+    ZSTD_CCtx *cctx = c->cctx;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    ZSTD_SETPARAM(ZSTD_CCtx_setParameter, cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_SETPARAM(ZSTD_CCtx_setParameter, cctx, ZSTD_c_nbWorkers, workers);
+    ZSTD_SETPARAM(ZSTD_CCtx_setParameter, cctx, ZSTD_c_enableLongDistanceMatching,
+                  copts->long_distance ? 1 : 0);
+    ZSTD_SETPARAM(ZSTD_CCtx_setParameter, cctx, ZSTD_c_windowLog, copts->window_log);
+    /* zstd digests the dictionary now (NULL clears it), and then uses it
+     * for every frame until we say otherwise. */
+    if (ZSTD_isError(ZSTD_CCtx_loadDictionary(cctx, copts->dictdata,
+                                              copts->dictdata ? copts->dictsize : 0)))
+        return 0;
+    return 1;
 }
 
 int zstd_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts) {
-    if (!dopts) {
-        d->rec_inbuf_size = ZSTD_DStreamInSize();
-        d->rec_outbuf_size = ZSTD_DStreamOutSize();
+    d->rec_inbuf_size = ZSTD_DStreamInSize();
+    d->rec_outbuf_size = ZSTD_DStreamOutSize();
+    if (!dopts)
         return 1;
-    }
-    /* TODO: handle dopts! */
-    return 0;
+    /* The decoder refuses windows bigger than 2^27 unless we tell it
+     * otherwise. We never go lower than that, so a stream that's set up
+     * for one DINO can still decode the defaults. */
+    ZSTD_DCtx *dctx = d->dctx;
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    ZSTD_SETPARAM(ZSTD_DCtx_setParameter, dctx, ZSTD_d_windowLogMax,
+                  MAX(dopts->window_log, ZSTD_WINDOWLOG_DEFAULT_MAX));
+    /* This builds a ZSTD_DDict inside the DCtx, which then gets reused for
+     * every frame - so we only pay for loading the dictionary once. */
+    if (ZSTD_isError(ZSTD_DCtx_loadDictionary(dctx, dopts->dictdata,
+                                              dopts->dictdata ? dopts->dictsize : 0)))
+        return 0;
+    return 1;
+}
+
+/* Resetting the session keeps the parameters and dictionary */
+int zstd_reset_cstream(Dino_CStream *c) {
+    return !ZSTD_isError(ZSTD_CCtx_reset(c->cctx, ZSTD_reset_session_only));
+}
+
+int zstd_reset_dstream(Dino_DStream *d) {
+    return !ZSTD_isError(ZSTD_DCtx_reset(d->dctx, ZSTD_reset_session_only));
 }
 
 size_t zstd_setsize(Dino_CStream *c, size_t srcsize) {
@@ -59,7 +103,9 @@ size_t zstd_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf) {
     size_t r = ZSTD_decompressStream((ZSTD_DStream *)d->dctx, &zob, &zib);
     inbuf->pos = zib.pos;
     outbuf->pos = zob.pos;
-    /* FIXME convert errors */
+    /* FIXME convert errors properly, rather than lumping them all together */
+    if (ZSTD_isError(r))
+        return COMPRESS_ERR_UNK;
     return r;
 }
 
@@ -88,3 +134,85 @@ size_t zstd_end(Dino_CStream *c, outBuf *outbuf) {
     /* FIXME convert errors */
     return r;
 }
+
+/* One-shot versions. These use the same (sticky) parameters and dictionary
+ * as the streaming functions, but skip the stream's internal buffers. */
+size_t zstd_compress1(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf) {
+    size_t in_len = inbuf->size - inbuf->pos;
+    size_t out_len = outbuf->size - outbuf->pos;
+    /* ZSTD_compress2() only notices the output doesn't fit after doing all
+     * the work, so let the streaming code handle it if it might not. */
+    if (out_len < ZSTD_compressBound(in_len))
+        return COMPRESS_ERR_BUF;
+    size_t r = ZSTD_compress2(c->cctx, outbuf->buf + outbuf->pos, out_len,
+                              inbuf->buf + inbuf->pos, in_len);
+    if (ZSTD_isError(r))
+        return COMPRESS_ERR_UNK;
+    inbuf->pos += in_len;
+    outbuf->pos += r;
+    return 0;
+}
+
+size_t zstd_decompress1(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf) {
+    const void *src = inbuf->buf + inbuf->pos;
+    size_t out_len = outbuf->size - outbuf->pos;
+    /* ZSTD_decompressDCtx() would keep going into the next frame, if any */
+    size_t in_len = ZSTD_findFrameCompressedSize(src, inbuf->size - inbuf->pos);
+    if (ZSTD_isError(in_len))
+        return COMPRESS_ERR_UNK;
+    unsigned long long size = ZSTD_getFrameContentSize(src, in_len);
+    if (size == ZSTD_CONTENTSIZE_ERROR)
+        return COMPRESS_ERR_HDR;
+    if ((size != ZSTD_CONTENTSIZE_UNKNOWN) && (size > out_len))
+        return COMPRESS_ERR_BUF;
+    size_t r = ZSTD_decompressDCtx(d->dctx, outbuf->buf + outbuf->pos, out_len,
+                                   src, in_len);
+    if (ZSTD_isError(r))
+        return (ZSTD_getErrorCode(r) == ZSTD_error_dstSize_tooSmall) ?
+               COMPRESS_ERR_BUF : COMPRESS_ERR_UNK;
+    inbuf->pos += in_len;
+    outbuf->pos += r;
+    return 0;
+}
+
+/* Patch-from style prefixes (see cstream_ref_prefix()). Matches can reach
+ * from the end of the new data all the way back to the start of the prefix,
+ * so the window needs to cover both; like zstd's --patch-from, we guess the
+ * new data is about the size of the prefix, and make it at least 2x that.
+ * The decoder works out the same size from the same prefix, so it'll
+ * always accept what the encoder wrote. */
+static int prefix_window_log(int window_log, size_t size) {
+    int log = ZSTD_WINDOWLOG_DEFAULT_MAX;
+    int max = ZSTD_cParam_getBounds(ZSTD_c_windowLog).upperBound;
+    while ((log < max) && (size >> (log - 1)))
+        log++;
+    return MAX(window_log, log);
+}
+
+int zstd_ref_prefix_cstream(Dino_CStream *c, const void *prefix, size_t size) {
+    ZSTD_SETPARAM(ZSTD_CCtx_setParameter, c->cctx, ZSTD_c_windowLog,
+                  prefix_window_log(c->opts.window_log, size));
+    return !ZSTD_isError(ZSTD_CCtx_refPrefix(c->cctx, prefix, size));
+}
+
+int zstd_ref_prefix_dstream(Dino_DStream *d, const void *prefix, size_t size) {
+    ZSTD_SETPARAM(ZSTD_DCtx_setParameter, d->dctx, ZSTD_d_windowLogMax,
+                  prefix_window_log(d->opts.window_log, size));
+    return !ZSTD_isError(ZSTD_DCtx_refPrefix(d->dctx, prefix, size));
+}
+
+/* ZSTD_WINDOWLOG_MAX is 30 on 32-bit builds and 31 on 64-bit ones, and it's
+ * in the experimental API anyway, so ask the library. */
+void zstd_window_log_range(int *min, int *max) {
+    ZSTD_bounds b = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+    if (ZSTD_isError(b.error))
+        return;
+    *min = b.lowerBound;
+    *max = b.upperBound;
+}
+
+size_t zstd_train_dict(void *dict, size_t dictcap,
+                       const void *samples, const size_t *sizes, unsigned count) {
+    size_t r = ZDICT_trainFromBuffer(dict, dictcap, samples, sizes, count);
+    return ZDICT_isError(r) ? 0 : r;
+}
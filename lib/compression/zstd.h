@@ -6,15 +6,24 @@
 Dino_CCtx zstd_create_cctx(void);
 void zstd_free_cctx(Dino_CCtx c);
 int zstd_setup_cstream(Dino_CStream *c, Dino_COpts *copts);
+int zstd_reset_cstream(Dino_CStream *c);
 size_t zstd_setsize(Dino_CStream *c, size_t srcsize);
 size_t zstd_compress(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf);
 size_t zstd_flush(Dino_CStream *c, outBuf *outbuf);
 size_t zstd_end(Dino_CStream *c, outBuf *outbuf);
+size_t zstd_compress1(Dino_CStream *c, inBuf *inbuf, outBuf *outbuf);
+int zstd_ref_prefix_cstream(Dino_CStream *c, const void *prefix, size_t size);
+void zstd_window_log_range(int *min, int *max);
+size_t zstd_train_dict(void *dict, size_t dictcap,
+                       const void *samples, const size_t *sizes, unsigned count);
 
 Dino_DCtx zstd_create_dctx(void);
 void zstd_free_dctx(Dino_DCtx d);
 int zstd_setup_dstream(Dino_DStream *d, Dino_DOpts *dopts);
+int zstd_reset_dstream(Dino_DStream *d);
 size_t zstd_getsize(Dino_DStream *d, inBuf *inbuf);
 size_t zstd_decompress(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf);
+size_t zstd_decompress1(Dino_DStream *d, inBuf *inbuf, outBuf *outbuf);
+int zstd_ref_prefix_dstream(Dino_DStream *d, const void *prefix, size_t size);
 
 #endif /* _ZSTD_H */
@@ -1,6 +1,8 @@
+#include <pthread.h>
 #include <string.h>
 #include <openssl/evp.h>
 
+#include "common.h"
 #include "digest.h"
 #include "dino.h"
 
@@ -112,3 +114,84 @@ void hasher_free(Hasher *h) {
         EVP_MD_CTX_free(h->ctx);
     free(h);
 }
+
+/* Workers claim runs of messages adding up to at least this much data, so
+ * a batch of tiny files doesn't mean taking the lock for every one. */
+#define BATCH_CLAIM_BYTES (64<<10)
+/* Starting a thread costs about as much as hashing this much data, so we
+ * don't use more threads than there are multiples of it in the batch. */
+#define BATCH_THREAD_BYTES (1<<20)
+
+typedef struct HashBatch {
+    const EVP_MD *type;
+    const void *const *inputs;
+    const size_t *lens;
+    size_t n;
+    uint8_t *out;
+    uint8_t size;
+    size_t next;            /* first unclaimed message */
+    int failed;
+    pthread_mutex_t lock;
+} HashBatch;
+
+static size_t hash_claim(HashBatch *b, size_t *first) {
+    pthread_mutex_lock(&b->lock);
+    size_t i = b->next, n = 0, bytes = 0;
+    if (!b->failed)
+        for (; (i+n < b->n) && (bytes < BATCH_CLAIM_BYTES); n++)
+            bytes += b->lens[i+n];
+    b->next += n;
+    pthread_mutex_unlock(&b->lock);
+    *first = i;
+    return n;
+}
+
+static void *hash_worker(void *arg) {
+    HashBatch *b = arg;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ok = (ctx != NULL);
+    size_t first, n;
+    while (ok && (n = hash_claim(b, &first))) {
+        for (size_t i=first; ok && (i < first+n); i++)
+            ok = EVP_DigestInit_ex(ctx, b->type, NULL) &&
+                 EVP_DigestUpdate(ctx, b->inputs[i], b->lens[i]) &&
+                 EVP_DigestFinal_ex(ctx, b->out + i*b->size, NULL);
+    }
+    if (!ok) {
+        pthread_mutex_lock(&b->lock);
+        b->failed = 1;
+        pthread_mutex_unlock(&b->lock);
+    }
+    EVP_MD_CTX_free(ctx);
+    return NULL;
+}
+
+int hasher_batch(Dino_DigestID d, const void *const inputs[], const size_t lens[],
+                 size_t n, uint8_t *out, int threads) {
+    digestInfo_t dig = get_digestinfo(d);
+    if (dig.id == DINO_DIGEST_UNKNOWN)
+        return 0;
+    HashBatch b = { .type = dig.mdfn(), .inputs = inputs, .lens = lens,
+                    .n = n, .out = out, .size = dig.size };
+    if (!b.type)
+        return 0;
+    size_t total = 0;
+    for (size_t i=0; i<n; i++)
+        total += lens[i];
+
+    /* As with dino_get_objects(), this thread works too, so if we can't
+     * start the others it just takes longer */
+    pthread_mutex_init(&b.lock, NULL);
+    size_t maxthreads = MIN(total/BATCH_THREAD_BYTES + 1, MAX(n, 1));
+    int nthreads = MIN((size_t)MAX(threads, 1), maxthreads);
+    pthread_t tids[nthreads];
+    int started = 0;
+    for (; started < nthreads-1; started++)
+        if (pthread_create(&tids[started], NULL, hash_worker, &b))
+            break;
+    hash_worker(&b);
+    for (int t=0; t<started; t++)
+        pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&b.lock);
+    return !b.failed;
+}
@@ -28,6 +28,18 @@ int hasher_finish(Hasher *h, uint8_t *out);
  * NOTE: allocates & frees temporary space for hasher_getdigest() */
 int hasher_verify(Hasher *h, const uint8_t *exp_digest);
 
+/* hasher_batch: hash `n` separate messages - lens[i] bytes at inputs[i] -
+ * with digest `d`, putting the digest of message i at out + i*digest_size(d).
+ * Hashing one small message is mostly per-message overhead, so this spreads
+ * the messages over up to `threads` threads (counting the calling thread;
+ * fewer if there's not much data), each reusing one context for every
+ * message it takes. OpenSSL already uses SHA-NI and friends where the CPU
+ * has them, so each message gets the fastest single-message code there is.
+ * Returns 1 if everything got hashed, 0 if `d` is unknown or hashing
+ * failed (in which case `out` holds garbage). */
+int hasher_batch(Dino_DigestID d, const void *const inputs[], const size_t lens[],
+                 size_t n, uint8_t *out, int threads);
+
 int hasher_size(Hasher *h);
 int hasher_blocksize(Hasher *h);
 
@@ -182,6 +182,7 @@ typedef struct
 typedef enum Dino_Secflags_e {
     DINO_FLAG_COMPRESSED = 1 << 0, /* bit 0: is this section compressed? */
     DINO_FLAG_VARINT    =  1 << 1, /* bit 1: does this section use varints? */
+    DINO_FLAG_SEEKABLE  =  1 << 2, /* bit 2: independent frames + seek table */
 } Dino_Secflags_e;
 typedef uint8_t Dino_Secflags;
 
@@ -201,7 +202,7 @@ typedef enum Dino_Sectype_e {
     DINO_SEC_NULL     = 0x00, /* Invalid/empty section */
     DINO_SEC_BLOB     = 0x01, /* Opaque blob of binary data */
     DINO_SEC_INDEX    = 0x02, /* A generic index over another section */
-    DINO_SEC_STRTAB   = 0x03, /* A table of strings prefixed with lengths */
+    DINO_SEC_STRTAB   = 0x03, /* Sorted table of length-prefixed strings => values */
     DINO_SEC_CSTRTAB  = 0x04, /* Table of NUL-terminated UTF8 strings */
     DINO_SEC_NOTE     = 0x05, /* ELF-style NOTE section */
 
@@ -209,6 +210,7 @@ typedef enum Dino_Sectype_e {
     DINO_SEC_DEPS     = 0x07, /* Symbols this object requires */
 
     DINO_SEC_FILESYS  = 0x08, /* A filesystem archive/image */
+    DINO_SEC_COPTS    = 0x09, /* Compression options (see below) */
 
     /* TODO: DINO-specific filesystem/archive/packfile format.
      * Use separate sections for:
@@ -226,6 +228,9 @@ typedef enum Dino_Sectype_e {
     DINO_SEC_FILESTAT = 0x11, /* File stat data (mode, mtime(?), etc) */
     DINO_SEC_FILETREE = 0x12, /* File paths / directory entries */
     DINO_SEC_FILEMETA = 0x13, /* File metadata (tags, fileclass, etc) */
+    DINO_SEC_CHUNKLIST = 0x14, /* Lists of chunk digests for chunked FILEDATA */
+    DINO_SEC_FILEDELTA = 0x15, /* File contents, as deltas against other files */
+    DINO_SEC_SKETCH   = 0x16, /* Similarity sketches of indexed objects */
 
     /* TODO: pkginfo, pkgdata, build objects... */
 
@@ -245,6 +250,103 @@ typedef enum Dino_Sectype_e {
 typedef uint8_t Dino_Sectype;
 
 
+/* Compression options.
+ * If Dhdr.compress_opts is the index of a DINO_SEC_COPTS section, that
+ * section holds options the decompressor needs (like the window size) plus
+ * a few that just help reproduce the compressed data (like the level).
+ * If it points at some other type of section, there aren't any options.
+ *
+ * The section data is a list of records, each of which is one byte for the
+ * tag, the size of the value (as a varint), and then the value itself.
+ * Integer values are little-endian. Readers should skip tags they don't
+ * understand. */
+typedef enum Dino_COpt_Tag_e {
+    DINO_COPT_END           = 0, /* End of list (optional) */
+    DINO_COPT_LEVEL         = 1, /* Compression level (signed) */
+    DINO_COPT_WINDOW_LOG    = 2, /* log2 of window/dictionary size */
+    DINO_COPT_LONG_DISTANCE = 3, /* Long-distance matching enabled (zstd) */
+    DINO_COPT_DICT          = 4, /* Dictionary data (raw bytes) */
+} Dino_COpt_Tag_e;
+typedef uint8_t Dino_COpt_Tag;
+
+
+/* Seekable compressed sections.
+ * A section with DINO_FLAG_SEEKABLE (and DINO_FLAG_COMPRESSED) isn't one big
+ * compressed stream; it's a series of independent frames, each holding the
+ * next chunk of the uncompressed data, followed by a seek table:
+ *
+ * +---------+---------+-...-+----------+----------+-...-+-------+
+ * | frame 0 | frame 1 | ... | entry 0  | entry 1  | ... | count |
+ * +---------+---------+-...-+----------+----------+-...-+-------+
+ *
+ * Each entry gives the sizes of the matching frame, and `count` (a Dino_Size)
+ * is the number of entries. The frame offsets come from adding up the sizes,
+ * so reading the table from the end of the section is enough to find the
+ * frame(s) holding any given range of the uncompressed data. */
+typedef struct
+{
+    Dino_Size size;      /* Compressed size of the frame */
+    Dino_Size unc_size;  /* Uncompressed size of the frame */
+} Dino_Seek_Entry;
+
+
+/* Chunked file data.
+ * Large files that change a little between builds dedupe badly as whole
+ * objects, so files can instead be split into content-defined chunks, which
+ * are stored as FILEDATA objects keyed by their own digests. Each file then
+ * gets a list of its chunks' keys, in order, in a DINO_SEC_CHUNKLIST section:
+ *
+ * +---------+---------+-...-+---------+---------+-...-+
+ * | key 0.0 | key 0.1 | ... | key 1.0 | key 1.1 | ... |
+ * +---------+---------+-...-+---------+---------+-...-+
+ *
+ * with an INDEX over it keyed by the whole file's digest. Each value points
+ * at the file's list, and its unc_size (if present) is the size of the file.
+ * The chunk keys are the same size as the keys of the FILEDATA index. */
+
+/* FILEDELTA sections
+ *
+ * A new version of a file is usually mostly the same as the old one, so it
+ * can be stored as a delta: a compression frame made with the old version
+ * (the "base") as its history, so it only has to encode the differences.
+ * (This is zstd's "patch-from" mode; it needs the base as a raw prefix, so
+ * only zstd can do it.) Each record in a DINO_SEC_FILEDELTA section is:
+ *
+ * +----------+---------------------------------+
+ * | base key | frame, compressed against base  |
+ * +----------+---------------------------------+
+ *
+ * with an INDEX over the records keyed by the file's digest, whose unc_size
+ * (if present) is the size of the file. The base key is the size of that
+ * index's keys, and names either a FILEDATA object or another delta - so
+ * bases can form chains. The section is always compressed, with the DINO's
+ * compress_id and options.
+ * Readers don't have to follow chains deeper than DINO_DELTA_DEPTH_MAX
+ * deltas, and writers shouldn't make them. */
+#define DINO_DELTA_DEPTH_MAX 16
+
+/* SKETCH sections
+ *
+ * To pick a good base for a delta you need to know which objects are like
+ * the new one, without comparing it to every one of them. So a DINO can
+ * have a DINO_SEC_SKETCH section: a MinHash sketch of each object in an
+ * INDEX, in the same order as the index's keys.
+ *
+ * A sketch is DINO_SKETCH_HASHES 16-bit values. The data gets split into
+ * small content-defined chunks, and each value is the minimum of one hash
+ * function over the chunks' fingerprints; the fraction of values two
+ * sketches share estimates how much of their chunks they share (their
+ * Jaccard similarity). Only the low 16 bits of each minimum are kept, which
+ * costs very little accuracy for a quarter of the space. See sketch.c for
+ * the chunking and hash functions; those are part of the format, since
+ * sketches made differently can't be compared.
+ *
+ * The low byte of the section's info is the section number of the INDEX,
+ * and the next byte is DINO_SKETCH_HASHES. The count is the number of
+ * sketches, which has to match the index's count. */
+#define DINO_SKETCH_HASHES 32
+
+
 /* Section table entry, also called a Shdr.
  *
  * By default, sections are not padded/aligned.
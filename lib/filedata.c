@@ -0,0 +1,542 @@
+/* filedata.c - writing FILEDATA sections and their indexes. */
+
+#include <errno.h>
+
+#include "libdino_internal.h"
+#include "array.h"
+#include "filedata.h"
+#include "sketch.h"
+
+/* The entries for an index we're building. Each entry is the key followed
+ * by its value (and maybe some extra data about the object, like a sketch),
+ * so sorting the entries with memcmp() sorts them by key.
+ * There's also an open-addressed hash of the keys, for spotting duplicates;
+ * slots hold entry numbers plus one, so 0 means empty. */
+typedef struct EntryTab {
+    Dino_Idx_Keysize keysize;
+    Array *entries;
+    size_t *slots;
+    size_t nslots;
+} EntryTab;
+
+struct Dino_Filedata {
+    Dino_CStream *cs;
+    int compressed;
+    unsigned min_gain;      /* percent; see filedata_set_min_gain() */
+    Buf *data;
+    EntryTab objs;
+    int sketching;          /* objs entries have sketches; see filedata_set_sketching() */
+    /* Chunked mode (see filedata_set_chunking()): each file's chunk list,
+     * and an entry for each file pointing at its list */
+    int chunked;
+    Dino_CDC_Params cdc;
+    Hasher *hasher;
+    Buf *lists;
+    EntryTab files;
+    /* Delta records (see filedata_add_delta()), once there are any */
+    Buf *deltas;
+    EntryTab delta_tab;
+};
+
+#define ENTRY_KEY(tab, i) ((Dino_Idx_Key *)array_get((tab)->entries, i))
+/* (the value might not be aligned, so it gets copied out) */
+#define ENTRY_VAL(tab, i, v) \
+    memcpy((v), array_get((tab)->entries, i) + (tab)->keysize, sizeof(Dino_Idx_Val_Unc64))
+#define ENTRY_EXTRA(tab, i) \
+    (array_get((tab)->entries, i) + (tab)->keysize + sizeof(Dino_Idx_Val_Unc64))
+
+static int tab_init(EntryTab *tab, Dino_Idx_Keysize keysize, size_t extra) {
+    tab->keysize = keysize;
+    tab->entries = array_new(keysize + sizeof(Dino_Idx_Val_Unc64) + extra);
+    tab->slots = NULL;
+    tab->nslots = 0;
+    return tab->entries ? 0 : -ENOMEM;
+}
+
+static void tab_free(EntryTab *tab) {
+    if (tab->entries)
+        array_free(tab->entries);
+    free(tab->slots);
+}
+
+Dino_Filedata *filedata_new(Dino_CStream *cs, Dino_Idx_Keysize keysize) {
+    if (!keysize)
+        return NULL;
+    Dino_Filedata *fdata = calloc(1, sizeof(Dino_Filedata));
+    if (!fdata)
+        return NULL;
+    fdata->cs = cs;
+    fdata->compressed = (cs->funcs->id != DINO_COMPRESS_NONE);
+    fdata->min_gain = FILEDATA_MIN_GAIN_DEFAULT;
+    fdata->data = buf_init(PAGESIZE);
+    if (!fdata->data || tab_init(&fdata->objs, keysize, 0) < 0) {
+        filedata_free(fdata);
+        return NULL;
+    }
+    return fdata;
+}
+
+void filedata_free(Dino_Filedata *fdata) {
+    if (!fdata)
+        return;
+    if (fdata->data)
+        buf_free(fdata->data);
+    tab_free(&fdata->objs);
+    if (fdata->lists)
+        buf_free(fdata->lists);
+    tab_free(&fdata->files);
+    if (fdata->deltas)
+        buf_free(fdata->deltas);
+    tab_free(&fdata->delta_tab);
+    free(fdata);
+}
+
+void filedata_set_min_gain(Dino_Filedata *fdata, unsigned percent) {
+    fdata->min_gain = MIN(percent, 100u);
+}
+
+int filedata_set_sketching(Dino_Filedata *fdata) {
+    if (fdata->sketching)
+        return 0;
+    EntryTab *tab = &fdata->objs;
+    if (array_len(tab->entries))
+        return -EINVAL;
+    Dino_Idx_Keysize keysize = tab->keysize;
+    tab_free(tab);
+    if (tab_init(tab, keysize, sizeof(Dino_Sketch)) < 0)
+        return -ENOMEM;
+    fdata->sketching = 1;
+    return 0;
+}
+
+/* Fill in the sketch for the object that was just added */
+static void objs_sketch(Dino_Filedata *fdata, const void *data, size_t size) {
+    if (!fdata->sketching)
+        return;
+    Dino_Sketch sk;
+    sketch_compute(data, size, &sk);
+    memcpy(ENTRY_EXTRA(&fdata->objs, array_len(fdata->objs.entries)-1), &sk, sizeof(sk));
+}
+
+/* Sampling for the incompressibility check: up to this many windows of this
+ * size, spread evenly through the object. Anything smaller than one window
+ * doesn't give us enough samples to tell, so it just gets compressed. */
+#define SAMPLE_WINDOWS 4
+#define SAMPLE_SIZE 4096
+
+/* Does the data look like it's already compressed (or encrypted, or
+ * random)? We estimate the order-2 Renyi entropy of a sample of bytes,
+ * -log2(sum(p^2)), which needs no logs or floats: it's over 7.8 bits/byte
+ * (2^7.8 ~= 223) when 223*sum(count^2) < n^2.
+ * Random data comes out around 7.9 for a 4KiB sample; text and code are
+ * nowhere near. This only looks at byte frequencies, so it can be fooled by
+ * data that's a random block repeated over and over - that just costs us
+ * the compression we'd have got, and it's rare in real files. */
+static int looks_incompressible(const uint8_t *data, size_t size) {
+    if (size < SAMPLE_SIZE)
+        return 0;
+    uint32_t counts[256] = { 0 };
+    size_t windows = MIN((size_t)SAMPLE_WINDOWS, size / SAMPLE_SIZE);
+    size_t stride = (size - SAMPLE_SIZE) / MAX(windows-1, (size_t)1);
+    for (size_t w=0; w<windows; w++) {
+        const uint8_t *p = data + w*stride;
+        for (size_t i=0; i<SAMPLE_SIZE; i++)
+            counts[p[i]]++;
+    }
+    uint64_t n = windows * SAMPLE_SIZE, sumsq = 0;
+    for (int b=0; b<256; b++)
+        sumsq += (uint64_t)counts[b] * counts[b];
+    return 223*sumsq < n*n;
+}
+
+/* Keys are digests, so any 8 bytes of them are as good a hash as any */
+static size_t tab_slot(EntryTab *tab, const Dino_Idx_Key *key) {
+    uint64_t h = 0;
+    memcpy(&h, key, MIN(sizeof(h), (size_t)tab->keysize));
+    h *= 0x9e3779b97f4a7c15ULL;
+    size_t slot = h & (tab->nslots - 1);
+    while (tab->slots[slot] &&
+           memcmp(ENTRY_KEY(tab, tab->slots[slot]-1), key, tab->keysize))
+        slot = (slot + 1) & (tab->nslots - 1);
+    return slot;
+}
+
+/* Make room for one more entry, keeping the hash at most half full */
+static int tab_grow(EntryTab *tab) {
+    if ((array_len(tab->entries) + 1) * 2 <= tab->nslots)
+        return 1;
+    size_t nslots = MAX(tab->nslots, (size_t)1024);
+    while ((array_len(tab->entries) + 1) * 2 > nslots)
+        nslots *= 2;
+    size_t *slots = calloc(nslots, sizeof(size_t));
+    if (!slots)
+        return 0;
+    free(tab->slots);
+    tab->slots = slots;
+    tab->nslots = nslots;
+    for (size_t i=0; i<array_len(tab->entries); i++)
+        tab->slots[tab_slot(tab, ENTRY_KEY(tab, i))] = i+1;
+    return 1;
+}
+
+/* Add an entry for `key` in `slot`, which tab_slot() found empty */
+static int tab_add(EntryTab *tab, size_t slot, const Dino_Idx_Key *key, Dino_Idx_Val_Unc64 *val) {
+    uint8_t entry[tab->entries->isize];
+    memset(entry, 0, sizeof(entry));
+    memcpy(entry, key, tab->keysize);
+    memcpy(entry + tab->keysize, val, sizeof(*val));
+    if (array_append(tab->entries, entry) < 0)
+        return -ENOMEM;
+    tab->slots[slot] = array_len(tab->entries);
+    return 0;
+}
+
+/* Find `key` in `tab` (which might not be in use at all). Returns its entry
+ * number plus one, 0 if it's not there, or -ENOMEM. */
+static ssize_t tab_find(EntryTab *tab, const Dino_Idx_Key *key) {
+    if (!tab->entries)
+        return 0;
+    if (!tab_grow(tab))
+        return -ENOMEM;
+    return tab->slots[tab_slot(tab, key)];
+}
+
+/* Put `data` on the end of the section, compressed or not (as described for
+ * filedata_add()), and fill in `val` for it. Returns 0 or a negative errno. */
+static int obj_store(Dino_Filedata *fdata, const void *data, size_t size, Dino_Idx_Val_Unc64 *val) {
+    /* Same deal as seekable_write(): leave room for data that doesn't
+     * compress, and if that's not enough, try again with more. */
+    Buf *out = fdata->data;
+    size_t start = out->pos, bound = size + (size>>6) + PAGESIZE, ret;
+    int raw = !fdata->compressed || !size || looks_incompressible(data, size);
+    if (!raw) {
+        do {
+            out->pos = start;
+            if (!buf_reserve(out, bound))
+                return -ENOMEM;
+            inBuf in = { data, size, 0 };
+            if (!cstream_reset(fdata->cs)) {
+                out->pos = start;
+                return -EIO;
+            }
+            ret = cstream_compress1(fdata->cs, &in, out);
+            bound *= 2;
+        } while (ret == COMPRESS_ERR_BUF);
+        if (ret) {
+            out->pos = start;
+            return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+        }
+        /* Not worth decompressing every time? Keep it raw instead. Note that
+         * a frame we keep is always smaller than the data, which is what
+         * lets readers spot the raw ones (see DINO_IDX_FLAG_RAW_OBJS). */
+        size_t csize = out->pos - start;
+        if ((csize >= size) || ((size - csize) * 100 < (uint64_t)size * fdata->min_gain)) {
+            out->pos = start;
+            raw = 1;
+        }
+    }
+    if (raw) {
+        if (!buf_reserve(out, size))
+            return -ENOMEM;
+        memcpy(out->buf + out->pos, data, size);
+        out->pos += size;
+    }
+    *val = (Dino_Idx_Val_Unc64) { start, out->pos - start, size };
+    return 0;
+}
+
+int filedata_add(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size) {
+    EntryTab *tab = &fdata->objs;
+    if (!tab_grow(tab))
+        return -ENOMEM;
+    size_t slot = tab_slot(tab, key);
+    if (tab->slots[slot])
+        return 0;
+    ssize_t r = tab_find(&fdata->delta_tab, key);
+    if (r)
+        return (r < 0) ? r : 0;
+    Dino_Idx_Val_Unc64 val;
+    if ((r = obj_store(fdata, data, size, &val)) < 0)
+        return r;
+    if (tab_add(tab, slot, key, &val) < 0) {
+        fdata->data->pos = val.offset;
+        return -ENOMEM;
+    }
+    objs_sketch(fdata, data, size);
+    return 1;
+}
+
+int filedata_set_chunking(Dino_Filedata *fdata, const Dino_CDC_Params *cdc, Hasher *hasher) {
+    if (hasher_size(hasher) != fdata->objs.keysize)
+        return -EINVAL;
+    if (!fdata->chunked) {
+        if (!(fdata->lists = buf_init(PAGESIZE)) ||
+            (tab_init(&fdata->files, fdata->objs.keysize, 0) < 0))
+            return -ENOMEM;
+        fdata->chunked = 1;
+    }
+    fdata->cdc = *cdc;
+    fdata->hasher = hasher;
+    return 0;
+}
+
+int filedata_add_chunked(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size) {
+    if (!fdata->chunked)
+        return -EINVAL;
+    EntryTab *files = &fdata->files;
+    if (!tab_grow(files))
+        return -ENOMEM;
+    size_t slot = tab_slot(files, key);
+    if (files->slots[slot])
+        return 0;
+
+    /* Add each chunk as an object of its own (or find it's already there),
+     * and its digest to the file's chunk list */
+    Dino_Idx_Keysize keysize = files->keysize;
+    Buf *lists = fdata->lists;
+    size_t start = lists->pos;
+    const uint8_t *p = data;
+    for (size_t off=0, len; off < size; off += len) {
+        len = cdc_chunk(&fdata->cdc, p+off, size-off);
+        if (!buf_reserve(lists, keysize)) {
+            lists->pos = start;
+            return -ENOMEM;
+        }
+        uint8_t *ckey = lists->buf + lists->pos;
+        if (!hasher_oneshot(fdata->hasher, p+off, len, ckey)) {
+            lists->pos = start;
+            return -EIO;
+        }
+        int r = filedata_add(fdata, ckey, p+off, len);
+        if (r < 0) {
+            lists->pos = start;
+            return r;
+        }
+        lists->pos += keysize;
+    }
+    Dino_Idx_Val_Unc64 val = { start, lists->pos - start, size };
+    if (tab_add(files, slot, key, &val) < 0) {
+        lists->pos = start;
+        return -ENOMEM;
+    }
+    return 1;
+}
+
+/* How many deltas deep would a delta against `base_key` be? 0 means the base
+ * isn't there, and anything over DINO_DELTA_DEPTH_MAX means "too deep" -
+ * we stop counting there. Each delta record starts with its base's key. */
+static ssize_t delta_depth(Dino_Filedata *fdata, const Dino_Idx_Key *base_key) {
+    EntryTab *tab = &fdata->delta_tab;
+    ssize_t depth = 1, i;
+    Dino_Idx_Val_Unc64 v;
+    while ((i = tab_find(tab, base_key)) > 0) {
+        if (++depth > DINO_DELTA_DEPTH_MAX)
+            return depth;
+        ENTRY_VAL(tab, i-1, &v);
+        base_key = fdata->deltas->buf + v.offset;
+    }
+    if (i < 0)
+        return i;
+    i = tab_find(&fdata->objs, base_key);
+    return (i > 0) ? depth : i;
+}
+
+int filedata_add_delta(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size,
+                       const Dino_Idx_Key *base_key, const void *base, size_t base_size) {
+    Dino_CStream *cs = fdata->cs;
+    if (!cs->funcs->ref_prefix)
+        return -ENOTSUP;
+    ssize_t r;
+    if ((r = tab_find(&fdata->objs, key)) || (r = tab_find(&fdata->delta_tab, key)))
+        return (r < 0) ? r : 0;
+    if (!fdata->deltas) {
+        if (!(fdata->deltas = buf_init(PAGESIZE)) ||
+            (tab_init(&fdata->delta_tab, fdata->objs.keysize, 0) < 0))
+            return -ENOMEM;
+    }
+    if ((r = delta_depth(fdata, base_key)) <= 0)
+        return r ? r : -ENOENT;
+    /* Like git, start over with a full copy once a chain gets too long */
+    if (r > DINO_DELTA_DEPTH_MAX)
+        return filedata_add(fdata, key, data, size);
+
+    /* The record: the base's key, then the frame */
+    Dino_Idx_Keysize keysize = fdata->objs.keysize;
+    Buf *out = fdata->deltas;
+    size_t start = out->pos, bound = keysize + size + (size>>6) + PAGESIZE, ret;
+    do {
+        out->pos = start;
+        if (!buf_reserve(out, bound))
+            return -ENOMEM;
+        memcpy(out->buf + out->pos, base_key, keysize);
+        out->pos += keysize;
+        inBuf in = { data, size, 0 };
+        if (!cstream_reset(cs) || !cstream_ref_prefix(cs, base, base_size)) {
+            ret = COMPRESS_ERR_UNK;
+            break;
+        }
+        ret = cstream_compress1(cs, &in, out);
+        bound *= 2;
+    } while (ret == COMPRESS_ERR_BUF);
+    /* Put the stream's dictionary back */
+    if (!cstream_reset(cs) && !ret)
+        ret = COMPRESS_ERR_UNK;
+    if (ret) {
+        out->pos = start;
+        return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+    }
+
+    /* Was the base any help? Compare with what we'd store without it: if
+     * the delta isn't under half that size (git's rule of thumb), it's not
+     * worth having to get the base every time we read it. */
+    Dino_Idx_Val_Unc64 val, dval = { start, out->pos - start, size };
+    if ((r = obj_store(fdata, data, size, &val)) < 0) {
+        out->pos = start;
+        return r;
+    }
+    int delta = (dval.size < val.size/2);
+    /* (drop whichever one we're not keeping) */
+    if (delta)
+        fdata->data->pos = val.offset;
+    else
+        out->pos = start;
+    EntryTab *tab = delta ? &fdata->delta_tab : &fdata->objs;
+    if (!tab_grow(tab) || (tab_add(tab, tab_slot(tab, key), key, delta ? &dval : &val) < 0)) {
+        if (delta)
+            out->pos = start;
+        else
+            fdata->data->pos = val.offset;
+        return -ENOMEM;
+    }
+    if (!delta)
+        objs_sketch(fdata, data, size);
+    return 1;
+}
+
+Buf *filedata_get_data(Dino_Filedata *fdata, Dino_Shdr *shdr) {
+    shdr->type = DINO_SEC_FILEDATA;
+    shdr->flags = fdata->compressed ? DINO_FLAG_COMPRESSED : 0;
+    shdr->size = fdata->data->pos;
+    shdr->count = array_len(fdata->objs.entries);
+    return fdata->data;
+}
+
+Buf *filedata_get_chunklists(Dino_Filedata *fdata, Dino_Shdr *shdr) {
+    if (!fdata->chunked)
+        return NULL;
+    shdr->type = DINO_SEC_CHUNKLIST;
+    shdr->flags = 0;
+    shdr->size = fdata->lists->pos;
+    shdr->count = array_len(fdata->files.entries);
+    return fdata->lists;
+}
+
+Buf *filedata_get_deltas(Dino_Filedata *fdata, Dino_Shdr *shdr) {
+    if (!fdata->deltas)
+        return NULL;
+    shdr->type = DINO_SEC_FILEDELTA;
+    shdr->flags = DINO_FLAG_COMPRESSED;
+    shdr->size = fdata->deltas->pos;
+    shdr->count = array_len(fdata->delta_tab.entries);
+    return fdata->deltas;
+}
+
+#define FANOUT_SIZE (sizeof(Dino_Idx_Cnt) << 8)
+
+/* Put the entries in key order, which is the order they go in the index.
+ * The hash needs rebuilding if we add anything else afterward. */
+static void tab_sort(EntryTab *tab) {
+    array_sort(tab->entries);
+    free(tab->slots);
+    tab->slots = NULL;
+    tab->nslots = 0;
+}
+
+/* Write out an index of the entries in `tab`, and sort them on the way */
+static ssize_t tab_write_index(EntryTab *tab, Dino_Idx_Flags flags, Dino_Secidx datasec,
+                               Buf *out, Dino_Shdr *shdr) {
+    size_t count = array_len(tab->entries);
+    if (count > UINT32_MAX)
+        return -EFBIG;
+    Dino_Idx_Val_Unc64 v;
+    for (size_t i=0; i<count; i++) {
+        ENTRY_VAL(tab, i, &v);
+        if ((v.offset > DINO_SIZE_MAX) || (v.size > DINO_SIZE_MAX) || (v.unc_size > DINO_SIZE_MAX))
+            flags |= DINO_IDX_FLAG_64BIT;
+    }
+    size_t valsize = (flags & DINO_IDX_FLAG_64BIT) ? sizeof(Dino_Idx_Val_Unc64)
+                                                   : sizeof(Dino_Idx_Val_Unc32);
+    size_t start = out->pos;
+    if (!buf_reserve(out, FANOUT_SIZE + count*(tab->keysize + valsize)))
+        return -ENOMEM;
+
+    tab_sort(tab);
+
+    /* TODO: byteswap if needed */
+    Dino_Idx_Cnt fanout[256] = { 0 };
+    for (size_t i=0; i<count; i++)
+        fanout[ENTRY_KEY(tab, i)[0]]++;
+    for (int b=1; b<256; b++)
+        fanout[b] += fanout[b-1];
+    memcpy(out->buf + out->pos, fanout, FANOUT_SIZE);
+    out->pos += FANOUT_SIZE;
+    for (size_t i=0; i<count; i++, out->pos += tab->keysize)
+        memcpy(out->buf + out->pos, ENTRY_KEY(tab, i), tab->keysize);
+    for (size_t i=0; i<count; i++, out->pos += valsize) {
+        ENTRY_VAL(tab, i, &v);
+        if (flags & DINO_IDX_FLAG_64BIT) {
+            memcpy(out->buf + out->pos, &v, valsize);
+        } else {
+            Dino_Idx_Val_Unc32 v32 = { v.offset, v.size, v.unc_size };
+            memcpy(out->buf + out->pos, &v32, valsize);
+        }
+    }
+
+    shdr->type = DINO_SEC_INDEX;
+    shdr->flags = 0;
+    shdr->info = tab->keysize | (datasec << 8) | (flags << 16);
+    shdr->size = out->pos - start;
+    shdr->count = count;
+    return out->pos - start;
+}
+
+ssize_t filedata_write_index(Dino_Filedata *fdata, Dino_Secidx datasec, Buf *out, Dino_Shdr *shdr) {
+    Dino_Idx_Flags flags = DINO_IDX_FLAG_UNC_SIZE;
+    if (fdata->compressed)
+        flags |= DINO_IDX_FLAG_RAW_OBJS;
+    return tab_write_index(&fdata->objs, flags, datasec, out, shdr);
+}
+
+ssize_t filedata_write_chunklist_index(Dino_Filedata *fdata, Dino_Secidx listsec,
+                                       Buf *out, Dino_Shdr *shdr) {
+    if (!fdata->chunked)
+        return -EINVAL;
+    return tab_write_index(&fdata->files, DINO_IDX_FLAG_UNC_SIZE, listsec, out, shdr);
+}
+
+ssize_t filedata_write_delta_index(Dino_Filedata *fdata, Dino_Secidx deltasec,
+                                   Buf *out, Dino_Shdr *shdr) {
+    if (!fdata->deltas)
+        return -EINVAL;
+    return tab_write_index(&fdata->delta_tab, DINO_IDX_FLAG_UNC_SIZE, deltasec, out, shdr);
+}
+
+ssize_t filedata_write_sketches(Dino_Filedata *fdata, Dino_Secidx idxsec, Buf *out, Dino_Shdr *shdr) {
+    if (!fdata->sketching)
+        return -EINVAL;
+    EntryTab *tab = &fdata->objs;
+    size_t count = array_len(tab->entries);
+    if (!buf_reserve(out, count*sizeof(Dino_Sketch)))
+        return -ENOMEM;
+    tab_sort(tab);
+    /* TODO: byteswap if needed */
+    size_t start = out->pos;
+    for (size_t i=0; i<count; i++, out->pos += sizeof(Dino_Sketch))
+        memcpy(out->buf + out->pos, ENTRY_EXTRA(tab, i), sizeof(Dino_Sketch));
+    shdr->type = DINO_SEC_SKETCH;
+    shdr->flags = 0;
+    shdr->info = idxsec | (DINO_SKETCH_HASHES << 8);
+    shdr->size = out->pos - start;
+    shdr->count = count;
+    return out->pos - start;
+}
@@ -0,0 +1,130 @@
+/* Writing FILEDATA sections: file contents, each in its own compression
+ * frame, plus an index of them by digest. See DINO_SEC_FILEDATA in dino.h.
+ * To read the objects back, use dino_get_object() or dino_get_objects(). */
+#ifndef _FILEDATA_H
+#define _FILEDATA_H 1
+
+#include <sys/types.h>
+
+#include "libdino.h"
+#include "buf.h"
+#include "chunker.h"
+#include "digest.h"
+#include "compression/compression.h"
+
+typedef struct Dino_Filedata Dino_Filedata;
+
+/* filedata_new: start a new FILEDATA section, with objects compressed by
+ * `cs` (which needs to stick around until you're done adding objects) and
+ * keys of `keysize` bytes. Returns NULL if we're out of memory. */
+Dino_Filedata *filedata_new(Dino_CStream *cs, Dino_Idx_Keysize keysize);
+void filedata_free(Dino_Filedata *fdata);
+
+/* By default an object is only kept compressed if that saves at least this
+ * many percent of its size; otherwise it's not worth the decompression. */
+#define FILEDATA_MIN_GAIN_DEFAULT 3
+
+/* filedata_set_min_gain: change the above for objects added from now on.
+ * 0 means keep any frame that's smaller than the data at all. */
+void filedata_set_min_gain(Dino_Filedata *fdata, unsigned percent);
+
+/* filedata_set_sketching: keep a similarity sketch (see sketch.h) of every
+ * object, for filedata_write_sketches(). This has to be done before adding
+ * any objects. Returns 0, -EINVAL if there's already objects, or -ENOMEM. */
+int filedata_set_sketching(Dino_Filedata *fdata);
+
+/* filedata_add: compress `size` bytes of `data` into a frame of its own and
+ * add it to the section under `key` (normally the data's digest).
+ * Data that already looks compressed (by a quick look at its byte
+ * frequencies) or that doesn't shrink enough is stored as-is instead, and
+ * the index marks it that way (DINO_IDX_FLAG_RAW_OBJS), so reading it back
+ * is just a read.
+ * Returns 1 if it was added, 0 if there's already an object with that key
+ * (in which case we assume it's the same data and skip it), or a negative
+ * errno: -ENOMEM, or -EIO if the compressor fails. */
+int filedata_add(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size);
+
+/* Chunked mode: rather than storing each file as one object, split it into
+ * content-defined chunks (see chunker.h) and store those as the objects,
+ * keyed by their own digests. Files that are mostly the same then share most
+ * of their chunks, even if some of the data moved around. Each file gets a
+ * list of its chunks' digests in a CHUNKLIST section, and that gets an index
+ * of its own, keyed by the file's digest; see DINO_SEC_CHUNKLIST in dino.h.
+ * dino_get_chunked_object() puts the file back together. */
+
+/* filedata_set_chunking: turn on chunked mode, splitting files as `cdc`
+ * says and using `hasher` (which has to stick around, and make keys of the
+ * right size) for the chunk digests.
+ * Returns 0, -EINVAL if the hasher's digests are the wrong size, or -ENOMEM. */
+int filedata_set_chunking(Dino_Filedata *fdata, const Dino_CDC_Params *cdc, Hasher *hasher);
+
+/* filedata_add_chunked: add the chunks of `data` that aren't already there,
+ * and a chunk list for the file under `key`. Plain filedata_add() still
+ * works too, for files that aren't worth chunking.
+ * Returns 1 if the file was added, 0 if it was already there, or a negative
+ * errno (-EINVAL if chunked mode isn't on, or as for filedata_add). */
+int filedata_add_chunked(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size);
+
+/* filedata_add_delta: add `data` as a delta against `base`, the data of an
+ * object that's already been added under `base_key` (see DINO_SEC_FILEDELTA
+ * in dino.h). Picking a good base - normally an older version of the same
+ * file - is up to the caller. The data gets compressed both ways, and if
+ * the delta doesn't come out under half the size of the normal object, or
+ * the chain of bases would get deeper than DINO_DELTA_DEPTH_MAX, the normal
+ * object is what gets added.
+ * The stream's dictionary doesn't get used for deltas.
+ * Returns 1 if it was added (either way), 0 if it was already there, or a
+ * negative errno: -ENOTSUP if the compressor can't do deltas (only zstd
+ * can), -ENOENT if there's nothing under `base_key`, or as for
+ * filedata_add. */
+int filedata_add_delta(Dino_Filedata *fdata, const Dino_Idx_Key *key, const void *data, size_t size,
+                       const Dino_Idx_Key *base_key, const void *base, size_t base_size);
+
+/* filedata_get_data: get the FILEDATA section's data, and fill in the type,
+ * flags, size and count in `shdr`. The Buf belongs to `fdata`, and the data
+ * is buf->pos bytes long; if that's more than DINO_SIZE_MAX, the size needs
+ * to go in the sec64 table (see DINO_ENCODING_SEC64) instead. */
+Buf *filedata_get_data(Dino_Filedata *fdata, Dino_Shdr *shdr);
+
+/* filedata_write_index: append the data for an index of the objects to
+ * `out`, and fill in the type, info, size and count in `shdr`. `datasec` is
+ * where the FILEDATA section will go in the section table.
+ * The index always has unc_size values (and RAW_OBJS if the section is
+ * compressed), and uses 64-bit values if it has to.
+ * Returns the size of the index data or a negative errno (-ENOMEM, or
+ * -EFBIG if there's more objects than an index can hold). */
+ssize_t filedata_write_index(Dino_Filedata *fdata, Dino_Secidx datasec, Buf *out, Dino_Shdr *shdr);
+
+/* filedata_get_chunklists: like filedata_get_data, for the CHUNKLIST
+ * section. Returns NULL if chunked mode isn't on. */
+Buf *filedata_get_chunklists(Dino_Filedata *fdata, Dino_Shdr *shdr);
+
+/* filedata_write_chunklist_index: like filedata_write_index, for the index
+ * of the chunk lists; `listsec` is where the CHUNKLIST section will go.
+ * The values' unc_size is the size of the whole file.
+ * Returns the size of the index data or a negative errno (-EINVAL if
+ * chunked mode isn't on, or as above). */
+ssize_t filedata_write_chunklist_index(Dino_Filedata *fdata, Dino_Secidx listsec,
+                                       Buf *out, Dino_Shdr *shdr);
+
+/* filedata_get_deltas: like filedata_get_data, for the FILEDELTA section.
+ * Returns NULL if there aren't any deltas. */
+Buf *filedata_get_deltas(Dino_Filedata *fdata, Dino_Shdr *shdr);
+
+/* filedata_write_delta_index: like filedata_write_index, for the index of
+ * the deltas; `deltasec` is where the FILEDELTA section will go. The values'
+ * unc_size is the size of the file.
+ * Returns the size of the index data or a negative errno (-EINVAL if there
+ * aren't any deltas, or as above). */
+ssize_t filedata_write_delta_index(Dino_Filedata *fdata, Dino_Secidx deltasec,
+                                   Buf *out, Dino_Shdr *shdr);
+
+/* filedata_write_sketches: append a SKETCH section for the objects to
+ * `out`, in the same order as the index from filedata_write_index() - which
+ * is in section `idxsec` - and fill in `shdr`. Chunks get sketches too, in
+ * chunked mode; deltas don't, as they're not in that index.
+ * Returns the size of the data, or a negative errno (-EINVAL if sketching
+ * isn't on, or -ENOMEM). */
+ssize_t filedata_write_sketches(Dino_Filedata *fdata, Dino_Secidx idxsec, Buf *out, Dino_Shdr *shdr);
+
+#endif /* _FILEDATA_H */
@@ -1,3 +1,9 @@
+#define _GNU_SOURCE /* for copy_file_range */
+
+#include <stdint.h>
+#include <sys/sendfile.h>
+
+#include "common.h"
 #include "buf.h"
 #include "fileio.h"
 
@@ -14,3 +20,57 @@ ssize_t buf_refill(int fd, Buf *b) {
         b->pos = nr;
     return nr;
 }
+
+/* Is this just copy_file_range()/sendfile() not handling these fds (or not
+ * existing), rather than an actual I/O error? */
+static int copy_unsupported(int err) {
+    return (err == EXDEV) || (err == EINVAL) || (err == ENOSYS) ||
+           (err == EOPNOTSUPP) || (err == EBADF);
+}
+
+#define COPY_BUFSIZE (128<<10)
+
+ssize_t fd_copy_range(int in_fd, off_t off, size_t len, int out_fd) {
+    size_t done = 0;
+    ssize_t r = 1;
+    /* Each way of copying picks up wherever the last one gave up, since
+     * out_fd's position has moved along with what got copied so far */
+    while ((done < len) && (r > 0)) {
+        loff_t ioff = off + done;
+        r = TEMP_FAILURE_RETRY(copy_file_range(in_fd, &ioff, out_fd, NULL, len-done, 0));
+        if (r > 0)
+            done += r;
+    }
+    if ((r < 0) && copy_unsupported(errno)) {
+        /* sendfile() splices through a pipe in the kernel, so it can write
+         * to pipes and sockets too */
+        r = 1;
+        while ((done < len) && (r > 0)) {
+            off_t ioff = off + done;
+            r = TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, &ioff, len-done));
+            if (r > 0)
+                done += r;
+        }
+    }
+    if ((r < 0) && copy_unsupported(errno)) {
+        uint8_t *buf = malloc(MIN(len-done, COPY_BUFSIZE));
+        if (!buf)
+            return -1;
+        r = 1;
+        while ((done < len) && (r > 0)) {
+            r = pread_retry(in_fd, buf, MIN(len-done, COPY_BUFSIZE), off + done);
+            if (r <= 0)
+                break;
+            ssize_t w = write_retry(out_fd, buf, r);
+            if (w < r) {
+                if (w >= 0)
+                    errno = EIO;
+                r = -1;
+                break;
+            }
+            done += r;
+        }
+        free(buf);
+    }
+    return (r < 0) ? r : (ssize_t)done;
+}
@@ -14,6 +14,15 @@ ssize_t buf_fill(int fd, Buf *b);
 /* Fill a Buf completely, wiping old data */
 ssize_t buf_refill(int fd, Buf *b);
 
+/* Copy `len` bytes of in_fd, starting at `off`, to out_fd (at its current
+ * position). The kernel does the copying if it can - copy_file_range(),
+ * which might not copy anything at all on filesystems that share extents,
+ * or failing that sendfile() - and we only read and write the data
+ * ourselves if neither works for these fds. in_fd's position isn't used or
+ * changed. Returns the number of bytes copied, which is only less than
+ * `len` if in_fd ends first, or -1 (with errno set) on error. */
+ssize_t fd_copy_range(int in_fd, off_t off, size_t len, int out_fd);
+
 #ifndef TEMP_FAILURE_RETRY
 #define TEMP_FAILURE_RETRY(expression) \
   ({ ssize_t __res; \
@@ -1,5 +1,6 @@
 #include "libdino_internal.h"
 #include "bsearchn.h"
+#include "keycmp.h"
 #include "fileio.h"
 #include "array.h"
 
@@ -31,11 +32,26 @@ typedef struct Dino_Index {
     /* Resizeable Array objects for keys and vals */
     Array *keys;
     Array *vals;
+
+    /* Key comparison function, specialized for this index's keysize */
+    keycmp_fn *keycmp;
+
+    /* Search functions for this index's keysize, the search strategy (as
+     * requested), and the search function it picked */
+    const keysearch_fns *searchfns;
+    Dino_Idx_Search search;
+    bsearchir_fn *searchfn;
+
+    /* Cached shortest unique abbreviation lengths (in hex digits) for each
+     * key, and the longest of those; NULL until someone asks for them */
+    uint8_t *abbrevs;
+    size_t min_abbrev;
 } Dino_Index;
 
 /* TODO: everything above should probably be in the headers.. */
 
 void index_free(Dino_Index *idx);
+static void index_pick_search(Dino_Index *idx);
 
 inline Dino_Sec *dino_get_index_othersec(Dino *dino, Dino_Index *idx) {
     return dino_getsec(dino, idx->othersec);
@@ -53,6 +69,9 @@ Dino_Index *index_new(Dino_Idx_Keysize keysize, uint8_t valsize) {
         index_free(idx);
         return NULL;
     }
+    idx->keycmp = keycmp_select(keysize);
+    idx->searchfns = keysearch_select(keysize);
+    index_set_search(idx, DINO_IDX_SEARCH_AUTO);
     return idx;
 }
 
@@ -88,7 +107,14 @@ Dino_Index *index_with_capacity(Dino_Idx_Keysize keysize, uint8_t valsize, size_
     return NULL;
 }
 
+static void index_clear_abbrevs(Dino_Index *idx) {
+    free(idx->abbrevs);
+    idx->abbrevs = NULL;
+    idx->min_abbrev = 0;
+}
+
 void index_clear(Dino_Index *idx) {
+    index_clear_abbrevs(idx);
     free(idx->fanout);
     idx->fanout = NULL;
     array_clear(idx->keys);
@@ -150,6 +176,13 @@ ssize_t load_index_data(Dino_Sec *sec) {
     }
     off += r;
 
+    /* Big indexes get mmap'd memory with huge pages, so searching them
+     * doesn't spend all its time missing the TLB. */
+    if (idx->count * idx->keys->isize >= HUGEPAGESIZE)
+        array_set_store(idx->keys, ARRAY_STORE_MMAP);
+    if (idx->count * idx->vals->isize >= HUGEPAGESIZE)
+        array_set_store(idx->vals, ARRAY_STORE_MMAP);
+
     if (!array_load(idx->keys, sec->dino->fd, off, idx->count))
         return -EIO;
 
@@ -158,6 +191,8 @@ ssize_t load_index_data(Dino_Sec *sec) {
     if (!array_load(idx->vals, sec->dino->fd, off, idx->count))
         return -EIO;
 
+    index_pick_search(idx);
+
     sec->data.d.off = 0;
     sec->data.d.data = idx;
     sec->data.d.size = sec->size;
@@ -166,7 +201,7 @@ ssize_t load_index_data(Dino_Sec *sec) {
 
 int load_indexes(Dino *dino) {
     ssize_t r;
-    int cnt;
+    int cnt = 0;
     /* TODO: section iterator would be nice... */
     for (int i=0; i<dino->dhdr.section_count; i++) {
         Dino_Sec *sec = &dino->sectab.sec[i];
@@ -175,6 +210,11 @@ int load_indexes(Dino *dino) {
             if (r < 0)
                 return -EIO;
             cnt++;
+        } else if (sec->shdr->type == DINO_SEC_STRTAB) {
+            r = load_strtab_data(sec);
+            if (r < 0)
+                return -EIO;
+            cnt++;
         }
     }
     return cnt;
@@ -185,7 +225,56 @@ ssize_t index_find(Dino_Index *idx, const Dino_Idx_Key *key) {
     uint8_t b = key[0];
     baseidx = (b==0) ? 0 : idx->fanout[b-1];
     num = idx->fanout[b] - baseidx;
-    return bsearchir(key, idx->keys->data, baseidx, num, idx->keys->isize);
+    return idx->searchfn(key, idx->keys->data, baseidx, num, idx->keys->isize, idx->keycmp);
+}
+
+/* Thresholds for DINO_IDX_SEARCH_AUTO, in (average) keys per fanout bucket.
+ * Below SEARCH_BRANCHY_MAX the whole search is a handful of probes over a
+ * few KB that's probably already in cache, so the plain branchy search
+ * (which lets the CPU speculate ahead) wins and prefetching is just
+ * overhead. Above SEARCH_INTERP_MIN there's enough keys that interpolation's
+ * O(log log n) pays for its extra math - as long as the keys are digests,
+ * and big enough that their first 8 bytes are (nearly) uniformly
+ * distributed. */
+#define SEARCH_BRANCHY_MAX 64
+#define SEARCH_INTERP_MIN 1024
+#define SEARCH_INTERP_MIN_KEYSIZE 16
+
+static void index_pick_search(Dino_Index *idx) {
+    Dino_Idx_Search s = idx->search;
+    if (s == DINO_IDX_SEARCH_AUTO) {
+        size_t bucket = array_len(idx->keys) >> 8;
+        if (bucket <= SEARCH_BRANCHY_MAX)
+            s = DINO_IDX_SEARCH_BRANCHY;
+        else if ((bucket >= SEARCH_INTERP_MIN) &&
+                 (idx->keys->isize >= SEARCH_INTERP_MIN_KEYSIZE))
+            s = DINO_IDX_SEARCH_INTERP;
+        else
+            s = DINO_IDX_SEARCH_BRANCHLESS;
+    }
+    switch (s) {
+        case DINO_IDX_SEARCH_BRANCHLESS:
+            idx->searchfn = idx->searchfns->branchless;
+            break;
+        case DINO_IDX_SEARCH_INTERP:
+            idx->searchfn = idx->searchfns->interp;
+            break;
+        default:
+            idx->searchfn = idx->searchfns->branchy;
+    }
+}
+
+void index_set_search(Dino_Index *idx, Dino_Idx_Search search) {
+    idx->search = search;
+    index_pick_search(idx);
+}
+
+Dino_Idx_Search index_get_search(Dino_Index *idx) {
+    if (idx->searchfn == idx->searchfns->branchless)
+        return DINO_IDX_SEARCH_BRANCHLESS;
+    if (idx->searchfn == idx->searchfns->interp)
+        return DINO_IDX_SEARCH_INTERP;
+    return DINO_IDX_SEARCH_BRANCHY;
 }
 
 Dino_Idx_Val *index_search(Dino_Index *idx, const Dino_Idx_Key *key) {
@@ -193,16 +282,30 @@ Dino_Idx_Val *index_search(Dino_Index *idx, const Dino_Idx_Key *key) {
     return (i < 0) ? NULL : array_get(idx->vals, i);
 }
 
-Dino_Idx_Range index_key_match(Dino_Index *idx, const Dino_Idx_Key *key, size_t matchlen) {
+Dino_Idx_Range index_key_match_bits(Dino_Index *idx, const Dino_Idx_Key *key, size_t matchbits) {
     size_t baseidx, num;
-    uint8_t b = key[0];
-    baseidx = (b==0) ? 0 : idx->fanout[b-1];
-    num = idx->fanout[b] - baseidx;
-    idx_range r = bsearchpkr(key, matchlen, idx->keys->data, baseidx, num, idx->keys->isize);
+    /* If the prefix is shorter than a byte, it matches a whole range of
+     * fanout buckets: lo has the unmatched bits cleared, hi has them set. */
+    uint8_t mask = (matchbits >= 8) ? 0xff : (uint8_t)(0xff00 >> matchbits);
+    uint8_t b = matchbits ? key[0] : 0;
+    uint8_t lo = b & mask, hi = b | ~mask;
+    baseidx = (lo==0) ? 0 : idx->fanout[lo-1];
+    num = idx->fanout[hi] - baseidx;
+    /* Searching for the lowest and highest keys with that prefix means we
+     * only ever compare whole keys, so we can use the keycmp kernels */
+    size_t keysize = idx->keys->isize;
+    uint8_t lokey[UINT8_MAX], hikey[UINT8_MAX];     /* (Dino_Idx_Keysize) */
+    prefix_bounds(key, matchbits, keysize, lokey, hikey);
+    idx_range r = idx->searchfns->range(lokey, hikey, idx->keys->data, baseidx, num,
+                                        keysize, idx->keycmp);
     /* TODO: this is goofy. These should be the same type... */
     return (Dino_Idx_Range) { r.lo, r.hi };
 }
 
+Dino_Idx_Range index_key_match(Dino_Index *idx, const Dino_Idx_Key *key, size_t matchlen) {
+    return index_key_match_bits(idx, key, matchlen << 3);
+}
+
 Dino_Index *get_index(Dino *dino, Dino_Secidx idx) {
     Dino_Sec *sec = dino_getsec(dino, idx);
     if (sec && (sec->shdr->type == DINO_SEC_INDEX))
@@ -221,6 +324,10 @@ uint8_t index_get_keysize(Dino_Index *idx) {
     return idx->keys->isize;
 }
 
+Dino_Idx_Flags index_get_flags(Dino_Index *idx) {
+    return idx->flags;
+}
+
 Dino_Idx_Key *index_get_key(Dino_Index *idx, Dino_Idx_Cnt i) {
     return array_get(idx->keys, i);
 }
@@ -229,11 +336,57 @@ Dino_Idx_Val *index_get_val(Dino_Index *idx, Dino_Idx_Cnt i) {
     return array_get(idx->vals, i);
 }
 
+int index_val_unc64(Dino_Index *idx, const Dino_Idx_Val *val, Dino_Idx_Val_Unc64 *out) {
+    switch (idx->flags & (DINO_IDX_FLAG_64BIT|DINO_IDX_FLAG_UNC_SIZE)) {
+        case DINO_IDX_FLAG_64BIT|DINO_IDX_FLAG_UNC_SIZE:
+            memcpy(out, val, sizeof(Dino_Idx_Val_Unc64));
+            return 1;
+        case DINO_IDX_FLAG_UNC_SIZE: {
+            const Dino_Idx_Val_Unc32 *v = (const Dino_Idx_Val_Unc32 *)val;
+            *out = (Dino_Idx_Val_Unc64) { v->offset, v->size, v->unc_size };
+            return 1;
+        }
+        case DINO_IDX_FLAG_64BIT: {
+            const Dino_Idx_Val64 *v = (const Dino_Idx_Val64 *)val;
+            *out = (Dino_Idx_Val_Unc64) { v->offset, v->size, DINO_SIZE64_UNKNOWN };
+            return 0;
+        }
+        default: {
+            const Dino_Idx_Val32 *v = (const Dino_Idx_Val32 *)val;
+            *out = (Dino_Idx_Val_Unc64) { v->offset, v->size, DINO_SIZE64_UNKNOWN };
+            return 0;
+        }
+    }
+}
+
 Dino_Idx_Cnt index_get_cnt(Dino_Index *idx) {
     return idx->count;
 }
 
+/* The keys are sorted, so we can work out every key's shortest unique prefix
+ * in one pass, and then we just keep it around until the keys change. */
+static uint8_t *index_load_abbrevs(Dino_Index *idx) {
+    size_t count = array_len(idx->keys);
+    if (idx->abbrevs || !count)
+        return idx->abbrevs;
+    idx->abbrevs = malloc(count);
+    if (idx->abbrevs)
+        idx->min_abbrev = unique_prefix_nibbles(idx->keys->data, count,
+                                                idx->keys->isize, idx->abbrevs);
+    return idx->abbrevs;
+}
+
+const uint8_t *index_get_abbrevs(Dino_Index *idx) {
+    return index_load_abbrevs(idx);
+}
+
+size_t index_min_abbrev(Dino_Index *idx) {
+    index_load_abbrevs(idx);
+    return idx->min_abbrev;
+}
+
 ssize_t index_add(Dino_Index *idx, const Dino_Idx_Key *key, const Dino_Idx_Val *val) {
+    index_clear_abbrevs(idx);
     ssize_t i = index_find(idx, key);
     if (i >= 0) {
         array_set(idx->vals, val, i);
@@ -241,6 +394,8 @@ ssize_t index_add(Dino_Index *idx, const Dino_Idx_Key *key, const Dino_Idx_Val *
         i = ~i;
         array_insert(idx->keys, key, i);
         array_insert(idx->vals, val, i);
+        if (idx->search == DINO_IDX_SEARCH_AUTO)
+            index_pick_search(idx);
     }
     return i;
 }
@@ -0,0 +1,268 @@
+/* keycmp.c - fixed-size key comparison kernels.
+ *
+ * Every probe in a binary search does a key comparison, and calling the
+ * generic libc memcmp() for that means an indirect call (through the PLT)
+ * into a function that has to figure out how big the keys are and how
+ * they're aligned before it can do anything useful. Our keys are digests,
+ * so there's only a handful of sizes we actually care about - and for those
+ * we can do a lot better with a couple of wide loads and a compare.
+ *
+ * There's two families of kernels here:
+ * - "word": load big-endian 64-bit (and 32-bit) words and compare them as
+ *   integers. Comparing unsigned big-endian words gives the same ordering as
+ *   comparing the bytes one at a time, so this is exactly memcmp() ordering.
+ *   Portable, and on little-endian machines the byteswap is one instruction.
+ * - "sse2"/"avx2": compare 16/32 bytes at a time, find the first byte that
+ *   differs with movemask+ctz, and compare just that byte. Tails are handled
+ *   by re-comparing an overlapping block that ends at the end of the key.
+ */
+
+#include <stdint.h>
+
+#include "common.h"
+#include "keycmp.h"
+#include "bsearchn_tmpl.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define KEYCMP_X86 1
+#include <immintrin.h>
+#else
+#define KEYCMP_X86 0
+#endif
+
+static ALWAYS_INLINE uint64_t load_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static ALWAYS_INLINE uint32_t load_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/* NOTE: all the known digest sizes are multiples of 4, so we only need to
+ * handle a single 32-bit tail word. */
+static ALWAYS_INLINE int keycmp_word(const uint8_t *a, const uint8_t *b, const size_t size) {
+    size_t off;
+    for (off=0; off+8 <= size; off+=8) {
+        uint64_t x = load_be64(a+off), y = load_be64(b+off);
+        if (x != y)
+            return (x > y) - (x < y);
+    }
+    if (size & 4) {
+        uint32_t x = load_be32(a+off), y = load_be32(b+off);
+        return (x > y) - (x < y);
+    }
+    return 0;
+}
+
+#if KEYCMP_X86
+/* Requires size >= 16. */
+static ALWAYS_INLINE int keycmp_sse2(const uint8_t *a, const uint8_t *b, const size_t size) {
+    size_t off = 0;
+    for (;;) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a+off));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b+off));
+        unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+        if (diff) {
+            size_t i = off + __builtin_ctz(diff);
+            return a[i] - b[i];
+        }
+        if (off+16 >= size)
+            return 0;
+        off = MIN(off+16, size-16);
+    }
+}
+
+/* Requires size >= 32. */
+__attribute__((target("avx2")))
+static ALWAYS_INLINE int keycmp_avx2(const uint8_t *a, const uint8_t *b, const size_t size) {
+    size_t off = 0;
+    for (;;) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a+off));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b+off));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff) {
+            size_t i = off + __builtin_ctz(diff);
+            return a[i] - b[i];
+        }
+        if (off+32 >= size)
+            return 0;
+        off = MIN(off+32, size-32);
+    }
+}
+#endif
+
+/* Stamp out a size-specialized wrapper for each kernel, so the compiler can
+ * unroll everything and turn the whole comparison into straight-line code. */
+#define KEYCMP_KERNEL(kind, n, attr...) \
+    attr static ALWAYS_INLINE int keycmp_##kind##_##n(const void *a, const void *b, size_t size) { \
+        return keycmp_##kind(a, b, n); \
+    }
+
+KEYCMP_KERNEL(word, 16)
+KEYCMP_KERNEL(word, 20)
+KEYCMP_KERNEL(word, 28)
+KEYCMP_KERNEL(word, 32)
+KEYCMP_KERNEL(word, 48)
+KEYCMP_KERNEL(word, 64)
+
+#if KEYCMP_X86
+KEYCMP_KERNEL(sse2, 16)
+KEYCMP_KERNEL(sse2, 20)
+KEYCMP_KERNEL(sse2, 28)
+KEYCMP_KERNEL(sse2, 32)
+KEYCMP_KERNEL(sse2, 48)
+KEYCMP_KERNEL(sse2, 64)
+KEYCMP_KERNEL(avx2, 32, __attribute__((target("avx2"))))
+KEYCMP_KERNEL(avx2, 48, __attribute__((target("avx2"))))
+KEYCMP_KERNEL(avx2, 64, __attribute__((target("avx2"))))
+#define SSE2(n) keycmp_sse2_##n
+#define AVX2(n) keycmp_avx2_##n
+#else
+#define SSE2(n) NULL
+#define AVX2(n) NULL
+#endif
+
+/* And a full set of search functions for each kernel. The wrappers above
+ * are always_inline, so once the template's `cmp` is a constant there's no
+ * call left in the search loop at all. (They still get an out-of-line copy
+ * for keycmp_select() to hand out.) */
+#define KEYSEARCH(kind, n, attr...) \
+    attr static ssize_t keysearch_##kind##_##n##_branchy(const void *key, \
+            const void *array, size_t baseidx, size_t num, size_t size, keycmp_fn *cmp) { \
+        return bsearchir_tmpl(key, array, baseidx, num, n, keycmp_##kind##_##n); \
+    } \
+    attr static ssize_t keysearch_##kind##_##n##_branchless(const void *key, \
+            const void *array, size_t baseidx, size_t num, size_t size, keycmp_fn *cmp) { \
+        return bsearchir_branchless_tmpl(key, array, baseidx, num, n, keycmp_##kind##_##n); \
+    } \
+    attr static ssize_t keysearch_##kind##_##n##_interp(const void *key, \
+            const void *array, size_t baseidx, size_t num, size_t size, keycmp_fn *cmp) { \
+        return bsearchir_interp_tmpl(key, array, baseidx, num, n, keycmp_##kind##_##n); \
+    } \
+    attr static idx_range keysearch_##kind##_##n##_range(const void *lokey, const void *hikey, \
+            const void *array, size_t baseidx, size_t num, size_t size, keycmp_fn *cmp) { \
+        return bsearchbr_tmpl(lokey, hikey, array, baseidx, num, n, keycmp_##kind##_##n); \
+    }
+#define KEYSEARCH_FNS(kind, n) { \
+    keysearch_##kind##_##n##_branchy, keysearch_##kind##_##n##_branchless, \
+    keysearch_##kind##_##n##_interp, keysearch_##kind##_##n##_range }
+
+KEYSEARCH(word, 16)
+KEYSEARCH(word, 20)
+KEYSEARCH(word, 28)
+KEYSEARCH(word, 32)
+KEYSEARCH(word, 48)
+KEYSEARCH(word, 64)
+
+#if KEYCMP_X86
+KEYSEARCH(sse2, 16)
+KEYSEARCH(sse2, 20)
+KEYSEARCH(sse2, 28)
+KEYSEARCH(sse2, 32)
+KEYSEARCH(sse2, 48)
+KEYSEARCH(sse2, 64)
+KEYSEARCH(avx2, 32, __attribute__((target("avx2"))))
+KEYSEARCH(avx2, 48, __attribute__((target("avx2"))))
+KEYSEARCH(avx2, 64, __attribute__((target("avx2"))))
+#define SSE2_SEARCH(n) KEYSEARCH_FNS(sse2, n)
+#define AVX2_SEARCH(n) KEYSEARCH_FNS(avx2, n)
+#else
+#define SSE2_SEARCH(n) { NULL }
+#define AVX2_SEARCH(n) { NULL }
+#endif
+#define NO_SEARCH { NULL }
+
+static const keysearch_fns generic_search = {
+    bsearchir_cmp, bsearchir_branchless_cmp, bsearchir_interp_cmp, bsearchbr_cmp
+};
+
+typedef struct keycmp_kernels {
+    size_t size;
+    keycmp_fn *word;
+    keycmp_fn *sse2;
+    keycmp_fn *avx2;
+    keysearch_fns word_search;
+    keysearch_fns sse2_search;
+    keysearch_fns avx2_search;
+} keycmp_kernels;
+
+static const keycmp_kernels kernels[] = {
+    { 16, keycmp_word_16, SSE2(16), NULL,
+      KEYSEARCH_FNS(word, 16), SSE2_SEARCH(16), NO_SEARCH },
+    { 20, keycmp_word_20, SSE2(20), NULL,
+      KEYSEARCH_FNS(word, 20), SSE2_SEARCH(20), NO_SEARCH },
+    { 28, keycmp_word_28, SSE2(28), NULL,
+      KEYSEARCH_FNS(word, 28), SSE2_SEARCH(28), NO_SEARCH },
+    { 32, keycmp_word_32, SSE2(32), AVX2(32),
+      KEYSEARCH_FNS(word, 32), SSE2_SEARCH(32), AVX2_SEARCH(32) },
+    { 48, keycmp_word_48, SSE2(48), AVX2(48),
+      KEYSEARCH_FNS(word, 48), SSE2_SEARCH(48), AVX2_SEARCH(48) },
+    { 64, keycmp_word_64, SSE2(64), AVX2(64),
+      KEYSEARCH_FNS(word, 64), SSE2_SEARCH(64), AVX2_SEARCH(64) },
+};
+
+static int have_sse2 = 0;
+static int have_avx2 = 0;
+
+void __attribute__ ((constructor)) _keycmp_init_cpu(void) {
+#if KEYCMP_X86
+    __builtin_cpu_init();
+    have_sse2 = __builtin_cpu_supports("sse2");
+    have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const keycmp_kernels *get_kernels(size_t size) {
+    for (unsigned i=0; i<ARRAY_SIZE(kernels); i++)
+        if (kernels[i].size == size)
+            return &kernels[i];
+    return NULL;
+}
+
+keycmp_fn *keycmp_select(size_t size) {
+    const keycmp_kernels *k = get_kernels(size);
+    if (!k)
+        return memcmp;
+    if (have_avx2 && k->avx2)
+        return k->avx2;
+    if (have_sse2 && k->sse2)
+        return k->sse2;
+    return k->word;
+}
+
+/* Same choice as keycmp_select(), so the search functions and the `cmp`
+ * they're given agree - not that the specialized ones use it. */
+const keysearch_fns *keysearch_select(size_t size) {
+    const keycmp_kernels *k = get_kernels(size);
+    const keysearch_fns *search = NULL;
+    if (!k)
+        return &generic_search;
+    if (have_avx2 && k->avx2)
+        search = &k->avx2_search;
+    else if (have_sse2 && k->sse2)
+        search = &k->sse2_search;
+    else
+        search = &k->word_search;
+    return search->branchy ? search : &generic_search;
+}
+
+const char *keycmp_kernel_name(size_t size) {
+    const keycmp_kernels *k = get_kernels(size);
+    if (!k)
+        return "memcmp";
+    if (have_avx2 && k->avx2)
+        return "avx2";
+    if (have_sse2 && k->sse2)
+        return "sse2";
+    return "word";
+}
@@ -0,0 +1,50 @@
+#ifndef _KEYCMP_H
+#define _KEYCMP_H 1
+
+#include "memory.h"
+#include "bsearchn.h"
+
+/* Key comparison functions have the same signature and semantics as memcmp():
+ * the sign of the return value tells you how `a` sorts relative to `b`.
+ * (The magnitude is meaningless, so don't use it for anything.) */
+typedef int keycmp_fn(const void *a, const void *b, size_t size);
+
+/* keycmp_select() returns a comparison function specialized for keys that
+ * are exactly `size` bytes long.
+ *
+ * We have specialized kernels for every digest_size() we know about -
+ * 16, 20, 28, 32, 48, and 64 bytes - which use SSE2/AVX2 when the CPU has
+ * them or byteswapped 64-bit word compares otherwise. For any other size you
+ * just get memcmp().
+ *
+ * The CPU check happens once, at load time, so the returned function can be
+ * stashed somewhere (like in a Dino_Index) and called directly.
+ *
+ * NOTE: specialized kernels ignore their `size` argument entirely, so don't
+ * use them to compare partial keys! */
+keycmp_fn *keycmp_select(size_t size);
+
+/* A set of search functions (see bsearchn.h) for keys of one size. */
+typedef struct keysearch_fns {
+    bsearchir_fn *branchy;
+    bsearchir_fn *branchless;
+    bsearchir_fn *interp;
+    bsearchbr_fn *range;
+} keysearch_fns;
+
+/* keysearch_select() returns search functions for keys that are exactly
+ * `size` bytes long, to be called with keycmp_select(size) as their `cmp`.
+ *
+ * Even with a specialized kernel, calling it through a pointer on every
+ * probe costs a call and return, and the search loop can't know the key
+ * size. So for every size keycmp_select() has a kernel for, we instantiate
+ * each search loop with the kernel inlined into it; those ignore their
+ * `size` and `cmp` arguments. Any other size gets the generic bsearchn.c
+ * functions, which call `cmp` for each probe. */
+const keysearch_fns *keysearch_select(size_t size);
+
+/* Returns the name of the kernel keycmp_select() would pick for `size`:
+ * "avx2", "sse2", "word", or "memcmp". Mostly useful for tests/debugging. */
+const char *keycmp_kernel_name(size_t size);
+
+#endif /* _KEYCMP_H */
@@ -4,6 +4,7 @@
 #define _LIBDINO_H 1
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #include "dino.h"
 
@@ -15,6 +16,7 @@ typedef struct Dino Dino;
 
 /* Section data structs */
 typedef struct Dino_Index Dino_Index;
+typedef struct Dino_Strtab Dino_Strtab;
 
 /* Descriptor for a chunk of data to be converted to/from disk format */
 /* TODO: hrm, why is this public in the elfuitls API? */
@@ -149,6 +151,8 @@ typedef enum Dino_Idx_Flags_e {
     DINO_IDX_FLAG_NOFANOUT = 1<<0, /* index omits the fanout table */
     DINO_IDX_FLAG_64BIT    = 1<<1, /* index contains 64-bit size/offsets */
     DINO_IDX_FLAG_UNC_SIZE = 1<<2, /* values are Dino_Idx_Val_Unc{32,64} structs */
+    DINO_IDX_FLAG_RAW_OBJS = 1<<3, /* objects with size == unc_size are stored
+                                      uncompressed (needs UNC_SIZE) */
     /* The rest are reserved for future use.. */
 } Dino_Idx_Flags_e;
 typedef uint8_t Dino_Idx_Flags;
@@ -166,6 +170,9 @@ typedef uint8_t Dino_Idx_Flags;
 /* Get the index's keysize */
 Dino_Idx_Keysize index_get_keysize(Dino_Index *idx);
 
+/* Get the index's flags (see Dino_Idx_Flags_e) */
+Dino_Idx_Flags index_get_flags(Dino_Index *idx);
+
 /* Get the associated section */
 Dino_Sec *dino_get_index_othersec(Dino *dino, Dino_Index *idx);
 
@@ -182,6 +189,36 @@ Dino_Idx_Val *index_get_val(Dino_Index *idx, Dino_Idx_Cnt i);
 #define index_get_val_unc32(idx, i) ((Dino_Idx_Val_Unc32 *)index_get_val(idx, i))
 #define index_get_val_unc64(idx, i) ((Dino_Idx_Val_Unc64 *)index_get_val(idx, i))
 
+/* Copy any flavor of index value into a Dino_Idx_Val_Unc64, so you don't
+ * have to care which one you've got. Returns 1 if the value has a unc_size;
+ * if not it returns 0 and out->unc_size is DINO_SIZE64_UNKNOWN. */
+int index_val_unc64(Dino_Index *idx, const Dino_Idx_Val *val, Dino_Idx_Val_Unc64 *out);
+
+/* Find the position of `key` in the index. Returns the position if found;
+ * if not, it returns ~pos, where pos is where the key would be inserted. */
+ssize_t index_find(Dino_Index *idx, const Dino_Idx_Key *key);
+
+/* Get the value for `key`, or NULL if it's not in the index. */
+Dino_Idx_Val *index_search(Dino_Index *idx, const Dino_Idx_Key *key);
+
+/* How index_find()/index_search() search for keys. Each index picks one when
+ * it's loaded (DINO_IDX_SEARCH_AUTO) based on how many keys it has and how
+ * big they are, but you can override that with index_set_search().
+ * - BRANCHY: plain binary search. Best for small indexes.
+ * - BRANCHLESS: binary search without data-dependent branches, prefetching
+ *   the next probe. Best for medium/large indexes of random keys.
+ * - INTERP: interpolation search. Best for huge indexes of digests. */
+typedef enum Dino_Idx_Search_e {
+    DINO_IDX_SEARCH_AUTO       = 0,
+    DINO_IDX_SEARCH_BRANCHY    = 1,
+    DINO_IDX_SEARCH_BRANCHLESS = 2,
+    DINO_IDX_SEARCH_INTERP     = 3,
+} Dino_Idx_Search;
+
+void index_set_search(Dino_Index *idx, Dino_Idx_Search search);
+/* Returns the strategy actually in use (so never DINO_IDX_SEARCH_AUTO) */
+Dino_Idx_Search index_get_search(Dino_Index *idx);
+
 /* Index match ranges, for partial key matching */
 typedef struct Dino_Idx_Range {
     size_t lo;
@@ -190,4 +227,56 @@ typedef struct Dino_Idx_Range {
 
 Dino_Idx_Range index_key_match(Dino_Index *idx, const Dino_Idx_Key *key, size_t matchlen);
 
+/* Like index_key_match, but matchbits gives the prefix length in bits, so you
+ * can match (e.g.) an odd number of hex digits. If matchbits is 0, every key
+ * in the index matches. */
+Dino_Idx_Range index_key_match_bits(Dino_Index *idx, const Dino_Idx_Key *key, size_t matchbits);
+
+/* Shortest unique key abbreviations, in hex digits.
+ * index_get_abbrevs returns an array with one length per key - the shortest
+ * prefix of that key that doesn't match any other key in the index - or NULL
+ * if the index is empty (or we're out of memory). Lengths saturate at 255.
+ * index_min_abbrev returns the longest of those lengths, which is the
+ * shortest abbreviation length that's safe to use for every key.
+ * Both are computed in one pass over the keys on first use and cached.
+ * To resolve an abbreviated key, use index_key_match_bits (with 4 bits per
+ * hex digit); if the resulting range has (lo == hi) it's unique. */
+const uint8_t *index_get_abbrevs(Dino_Index *idx);
+size_t index_min_abbrev(Dino_Index *idx);
+
+/* String table sections (DINO_SEC_STRTAB) map strings to values - for
+ * instance, RPM package names or NEVRAs to the position of the matching
+ * header's key in the RPMHDR index. The strings are sorted and front-coded,
+ * with restart points every few entries, so lookups are a binary search
+ * over the restart points plus a short scan - no need to decode the whole
+ * table. (See strtab.h for the gory details of the data layout.)
+ *
+ * For a String table section, the info item is laid out like an Index's:
+ * MSB                               LSB
+ * +--------+--------+--------+--------+
+ * |RESERVED| flags  |othersec|RESERVED|
+ * +--------+--------+--------+--------+
+ * othersec: the Dino_Secidx of the section the values refer to, if any.
+ * flags: what the values mean (see below).
+ */
+typedef enum Dino_Strtab_Flags_e {
+    DINO_STRTAB_FLAG_IDXPOS = 1<<0, /* values are key positions in othersec */
+} Dino_Strtab_Flags_e;
+#define DINO_SECINFO_STRTAB_FLAGS(i)    ( (uint8_t)     (((i)>>16) & 0xff) )
+#define DINO_SECINFO_STRTAB_OTHERSEC(i) ( (Dino_Secidx) (((i)>>8)  & 0xff) )
+
+/* String tables get loaded by load_indexes(), along with the indexes. */
+Dino_Strtab *get_strtab(Dino *dino, Dino_Secidx idx);
+Dino_Strtab *get_strtab_byname(Dino *dino, const char *name);
+void strtab_free(Dino_Strtab *st);
+
+/* Get the number of entries in the string table */
+size_t strtab_get_cnt(Dino_Strtab *st);
+
+/* Look up the values for `str` (which is `len` bytes long; it doesn't need
+ * to be NUL-terminated). Up to `maxvals` values are stored in `vals`.
+ * Returns the total number of matching entries, which may be > maxvals. */
+size_t strtab_lookup(Dino_Strtab *st, const char *str, size_t len,
+                     uint64_t *vals, size_t maxvals);
+
 #endif /* _LIBDINO_H */
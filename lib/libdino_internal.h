@@ -7,6 +7,8 @@
 #include "libdino.h"
 #include "common.h"
 
+#include <sys/types.h>
+
 #define GOOD_MAGIC(dhdr) \
    ((DINO_MAGIC_V0[0] == dhdr.magic[0]) && \
     (DINO_MAGIC_V0[1] == dhdr.magic[1]) && \
@@ -56,6 +58,10 @@ struct Dino_Sectab {
 void clear_sectab(Dino_Sectab *sectab);
 Dino_Secidx realloc_sectab(Dino_Sectab *sectab, Dino_Secidx alloc_count);
 
+/* Internal section data loaders (used by load_indexes) */
+ssize_t load_index_data(Dino_Sec *sec);
+ssize_t load_strtab_data(Dino_Sec *sec);
+
 #define _sectab_getsec(st, idx) ((st).sec+(idx))
 #define _sectab_hassec(st, idx) ((idx)<(st).count)
 #define _dino_getsec(dino, idx) _sectab_getsec((dino)->sectab, idx)
@@ -76,6 +82,9 @@ struct Dino {
 
     /* Name table. */
     Dino_Namtab namtab;
+
+    /* Decompression options from the compress_opts section, once loaded */
+    struct Dino_COpts *dopts;
 };
 
 #endif /* _LIBDINO_INTERNAL_H */
@@ -1,13 +1,23 @@
+#include <stdio.h>
 #include <unistd.h>
 #include "memory.h"
 
 size_t PAGESIZE = 4096;
 size_t CHONKSIZE = 4096 << 10;
+size_t HUGEPAGESIZE = 2048 << 10;
 
 void __attribute__ ((constructor)) _memory_init_pagesize(void) {
     long sys_pagesize = sysconf(_SC_PAGESIZE);
     if (sys_pagesize > 0) PAGESIZE = sys_pagesize;
     long sys_chonksize = sysconf(_SC_LEVEL3_CACHE_SIZE);
     if (sys_chonksize > 0) CHONKSIZE = sys_chonksize;
+    /* There's no sysconf() for this, so ask the THP code in sysfs */
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (fp) {
+        unsigned long sys_hugepagesize;
+        if ((fscanf(fp, "%lu", &sys_hugepagesize) == 1) && sys_hugepagesize)
+            HUGEPAGESIZE = sys_hugepagesize;
+        fclose(fp);
+    }
 }
 
@@ -6,5 +6,6 @@
 
 extern size_t PAGESIZE;
 extern size_t CHONKSIZE;
+extern size_t HUGEPAGESIZE;
 
 #endif /* _MEMORY_H */
@@ -0,0 +1,571 @@
+/* object.c - fetching individual objects out of an indexed section. */
+
+#include <pthread.h>
+
+#include "libdino_internal.h"
+#include "fileio.h"
+#include "object.h"
+
+/* Creating a decompression context isn't cheap - zstd allocates its window
+ * buffers, xz sets up its dictionary, etc. - and for a typical RPM header
+ * that can take longer than actually decompressing the thing. So we get
+ * DStreams from the stream pool (see compression.h), and each thread keeps
+ * a buffer for the compressed data that it reuses for every object. */
+static __thread Buf *obj_inbuf;
+
+/* zstd dictionaries are ~100KB; leave plenty of room */
+#define COPTS_SECTION_MAX (16<<20)
+
+int dino_get_dopts(Dino *dino, Dino_DOpts *dopts) {
+    *dopts = COPTS_DEFAULT;
+    if (dino->dopts) {
+        *dopts = *dino->dopts;
+        return 1;
+    }
+    Dino_Secidx idx = dino->dhdr.compress_opts;
+    if (!_sectab_hassec(dino->sectab, idx))
+        return 0;
+    Dino_Sec *sec = _dino_getsec(dino, idx);
+    if (sec->shdr->type != DINO_SEC_COPTS)
+        return 0;
+    /* A few small records plus maybe a dictionary; anything huge is bogus */
+    if (sec->size > COPTS_SECTION_MAX)
+        return -EINVAL;
+    /* The cached options and the section data live in one allocation, since
+     * dictdata points into the data */
+    Dino_DOpts *cached = malloc(sizeof(Dino_DOpts) + sec->size);
+    if (!cached)
+        return -ENOMEM;
+    uint8_t *data = (uint8_t *)(cached+1);
+    int r = 1;
+    if (pread_retry(dino->fd, data, sec->size, sec->offset) < (ssize_t)sec->size)
+        r = -EIO;
+    else if (copts_read(cached, data, sec->size) < 0)
+        r = -EINVAL;
+    if (r < 0) {
+        free(cached);
+        return r;
+    }
+    *dopts = *cached;
+    dino->dopts = cached;
+    return 1;
+}
+
+/* Get a DStream for `id` that's set up for the data in `dino` - i.e. with
+ * the DINO's dictionary (if any) and a big enough window. */
+static Dino_DStream *obj_dstream_get(Dino *dino, Dino_CompressID id) {
+    Dino_DOpts dopts;
+    if (dino_get_dopts(dino, &dopts) < 0)
+        return NULL;
+    return dstream_pool_get(id, &dopts);
+}
+
+/* Hand the DStream back to the pool, which resets it for the next frame.
+ * If the frame was corrupt, just throw the stream away. */
+static void obj_dstream_done(Dino_DStream *ds, int ok) {
+    if (ok)
+        dstream_pool_put(ds);
+    else
+        dstream_free(ds);
+}
+
+/* Decoded delta bases (see dino_get_delta_object()), most recently used
+ * first. Reading a few versions of a file - or following a chain - keeps
+ * needing the same bases, and decoding a base can mean decoding its base,
+ * and so on. Keys are digests of the contents, so an entry is good for any
+ * DINO. Bases bigger than BASE_CACHE_OBJ_MAX don't get kept. */
+#define BASE_CACHE_SLOTS 4
+#define BASE_CACHE_OBJ_MAX (64<<20)
+
+typedef struct BaseCache {
+    Dino_Idx_Keysize keysize;
+    uint8_t key[UINT8_MAX];
+    Buf *data;
+} BaseCache;
+static __thread BaseCache base_cache[BASE_CACHE_SLOTS];
+
+static Buf *base_cache_get(const Dino_Idx_Key *key, Dino_Idx_Keysize keysize) {
+    for (int i=0; i<BASE_CACHE_SLOTS && base_cache[i].data; i++) {
+        if ((base_cache[i].keysize != keysize) || memcmp(base_cache[i].key, key, keysize))
+            continue;
+        BaseCache hit = base_cache[i];
+        memmove(&base_cache[1], &base_cache[0], i*sizeof(BaseCache));
+        base_cache[0] = hit;
+        return hit.data;
+    }
+    return NULL;
+}
+
+/* The cache takes `data`, and frees whatever falls off the end */
+static void base_cache_put(const Dino_Idx_Key *key, Dino_Idx_Keysize keysize, Buf *data) {
+    if (base_cache[BASE_CACHE_SLOTS-1].data)
+        buf_free(base_cache[BASE_CACHE_SLOTS-1].data);
+    memmove(&base_cache[1], &base_cache[0], (BASE_CACHE_SLOTS-1)*sizeof(BaseCache));
+    base_cache[0].keysize = keysize;
+    memcpy(base_cache[0].key, key, keysize);
+    base_cache[0].data = data;
+}
+
+void dino_object_cache_free(void) {
+    for (int i=0; i<BASE_CACHE_SLOTS; i++)
+        if (base_cache[i].data)
+            buf_free(base_cache[i].data);
+    memset(base_cache, 0, sizeof(base_cache));
+    compress_pool_clear();
+    if (obj_inbuf)
+        buf_free(obj_inbuf);
+    obj_inbuf = NULL;
+}
+
+/* Find the object for `key`. Fills in the section it lives in and its value
+ * (in Unc64 form, whatever the index uses). Returns 0 or a negative errno. */
+static int obj_locate(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key,
+                      Dino_Sec **secp, Dino_Idx_Val_Unc64 *val) {
+    Dino_Idx_Val *v = index_search(idx, key);
+    if (!v)
+        return -ENOENT;
+    Dino_Sec *sec = dino_get_index_othersec(dino, idx);
+    if (!sec)
+        return -EINVAL;
+    index_val_unc64(idx, v, val);
+    if ((val->offset > sec->size) || (val->size > sec->size - val->offset))
+        return -EINVAL;
+    *secp = sec;
+    return 0;
+}
+
+/* Is the object stored as-is? That's everything in an uncompressed section,
+ * plus the objects a RAW_OBJS index marks by having size == unc_size (the
+ * writer only keeps a compressed frame if it's smaller than the data). */
+static int obj_is_raw(Dino_Index *idx, Dino_Sec *sec, Dino_Idx_Val_Unc64 *val) {
+    if (!(sec->shdr->flags & DINO_FLAG_COMPRESSED))
+        return 1;
+    return (index_get_flags(idx) & DINO_IDX_FLAG_RAW_OBJS) && (val->size == val->unc_size);
+}
+
+/* Read the object's (compressed) data into the per-thread read buffer,
+ * and point `in` at it. Returns 0 or a negative errno. */
+static int obj_read(Dino_Sec *sec, Dino_Idx_Val_Unc64 *val, inBuf *in) {
+    if (!obj_inbuf && !(obj_inbuf = buf_init(PAGESIZE)))
+        return -ENOMEM;
+    obj_inbuf->pos = 0;
+    if (!buf_reserve(obj_inbuf, val->size))
+        return -ENOMEM;
+    ssize_t r = pread_retry(sec->dino->fd, obj_inbuf->buf, val->size,
+                            sec->offset + val->offset);
+    if (r < 0 || (Dino_Size64)r < val->size)
+        return -EIO;
+    *in = (inBuf) { obj_inbuf->buf, val->size, 0 };
+    return 0;
+}
+
+/* Decompress one whole object from `in` into `out`, growing `out` as needed.
+ * Returns the object's size or a negative errno. Either way the caller hands
+ * `ds` back with obj_dstream_done() (or resets it, to use it again). */
+static ssize_t obj_decompress(Dino_DStream *ds, inBuf *in, Dino_Idx_Val_Unc64 *val, Buf *out) {
+    /* Figure out how much room we need. If we can't tell, guess. */
+    size_t unc_size = val->unc_size;
+    if (unc_size == DINO_SIZE64_UNKNOWN)
+        unc_size = dstream_get_uncompressed_size(ds, in);
+    int known = !IS_SIZE_ERR(unc_size);
+    if (!buf_reserve(out, known ? unc_size : MAX(val->size*4, PAGESIZE)))
+        return -ENOMEM;
+
+    /* If we know how big it is, decompress it all in one go */
+    size_t start = out->pos, ret, inpos, outpos;
+    if (known) {
+        ret = dstream_decompress1(ds, in, out);
+        if (ret != 0) {
+            out->pos = start;
+            return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+        }
+        /* An object is one frame; anything after it would get left out */
+        if ((out->pos - start != unc_size) || (in->pos != in->size)) {
+            out->pos = start;
+            return -EIO;
+        }
+        return unc_size;
+    }
+    for (;;) {
+        inpos = in->pos;
+        outpos = out->pos;
+        ret = dstream_decompress(ds, in, out);
+        if ((ret == 0) || IS_COMPRESS_ERR(ret))
+            break;
+        /* If we're not getting anywhere, either we're out of room (so the
+         * size was wrong, or we guessed) or we're out of input (so the data
+         * is truncated). */
+        if ((in->pos == inpos) && (out->pos == outpos)) {
+            if ((out->pos < out->size) || !buf_reserve(out, out->size)) {
+                ret = COMPRESS_ERR_UNK;
+                break;
+            }
+        }
+    }
+    if ((ret == 0) && (in->pos != in->size))
+        ret = COMPRESS_ERR_UNK;
+    if (ret != 0) {
+        out->pos = start;
+        return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+    }
+    return out->pos - start;
+}
+
+ssize_t dino_get_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key, Buf *out) {
+    Dino_Sec *sec;
+    Dino_Idx_Val_Unc64 val;
+    ssize_t r = obj_locate(dino, idx, key, &sec, &val);
+    if (r < 0)
+        return r;
+
+    /* Uncompressed objects are easy: read it straight into `out`. */
+    if (obj_is_raw(idx, sec, &val)) {
+        if (!buf_reserve(out, val.size))
+            return -ENOMEM;
+        r = pread_retry(dino->fd, out->buf+out->pos, val.size, sec->offset+val.offset);
+        if (r < 0 || (Dino_Size64)r < val.size)
+            return -EIO;
+        out->pos += r;
+        return r;
+    }
+
+    inBuf inbuf, *in = &inbuf;
+    if ((r = obj_read(sec, &val, in)) < 0)
+        return r;
+    Dino_CompressID id = dino->dhdr.compress_id;
+    Dino_DStream *ds = obj_dstream_get(dino, id);
+    if (!ds)
+        return -ENOTSUP;
+    r = obj_decompress(ds, in, &val, out);
+    /* Running out of memory isn't the stream's fault */
+    obj_dstream_done(ds, (r >= 0) || (r == -ENOMEM));
+    return r;
+}
+
+ssize_t dino_slice_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key,
+                          const Slice *file, Slice *out) {
+    Dino_Sec *sec;
+    Dino_Idx_Val_Unc64 val;
+    ssize_t r = obj_locate(dino, idx, key, &sec, &val);
+    if (r < 0)
+        return r;
+    if (!obj_is_raw(idx, sec, &val))
+        return -ENOTSUP;
+    Dino_Off64 off = sec->offset + val.offset;
+    if ((off > file->size) || (val.size > file->size - off))
+        return -ERANGE;
+    *out = (Slice) { file->buf + off, val.size, 0 };
+    return val.size;
+}
+
+ssize_t dino_write_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key, int fd) {
+    Dino_Sec *sec;
+    Dino_Idx_Val_Unc64 val;
+    ssize_t r = obj_locate(dino, idx, key, &sec, &val);
+    if (r < 0)
+        return r;
+
+    /* Stored as-is: let the kernel move it, without it passing through us */
+    if (obj_is_raw(idx, sec, &val)) {
+        r = fd_copy_range(dino->fd, sec->offset + val.offset, val.size, fd);
+        return (r < 0 || (Dino_Size64)r < val.size) ? -EIO : r;
+    }
+
+    inBuf inbuf, *in = &inbuf;
+    if ((r = obj_read(sec, &val, in)) < 0)
+        return r;
+
+    Dino_CompressID id = dino->dhdr.compress_id;
+    Dino_DStream *ds = obj_dstream_get(dino, id);
+    if (!ds)
+        return -ENOTSUP;
+
+    /* Decompress a chunk at a time, and write each chunk out as we go */
+    size_t chunksize = ds->rec_outbuf_size, ret, inpos;
+    uint8_t *chunk = malloc(chunksize);
+    if (!chunk) {
+        obj_dstream_done(ds, 1);
+        return -ENOMEM;
+    }
+    outBuf outchunk = { chunk, chunksize, 0 };
+    size_t total = 0;
+    do {
+        inpos = in->pos;
+        outchunk.pos = 0;
+        ret = dstream_decompress(ds, in, &outchunk);
+        if (IS_COMPRESS_ERR(ret))
+            break;
+        if ((in->pos == inpos) && (outchunk.pos == 0) && ret) {
+            /* Out of input, but the decoder wants more: truncated data */
+            ret = COMPRESS_ERR_UNK;
+            break;
+        }
+        if (write_retry(fd, chunk, outchunk.pos) < (ssize_t)outchunk.pos) {
+            free(chunk);
+            obj_dstream_done(ds, 0);
+            return -EIO;
+        }
+        total += outchunk.pos;
+    } while (ret);
+    free(chunk);
+    obj_dstream_done(ds, (ret == 0));
+    if (ret != 0)
+        return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+    if ((val.unc_size != DINO_SIZE64_UNKNOWN) && (total != val.unc_size))
+        return -EIO;
+    /* Like obj_decompress(): the frame should be all there is */
+    if (in->pos != in->size)
+        return -EIO;
+    return total;
+}
+
+ssize_t dino_get_chunked_object(Dino *dino, Dino_Index *files, Dino_Index *chunks,
+                                const Dino_Idx_Key *key, Buf *out) {
+    Dino_Sec *sec;
+    Dino_Idx_Val_Unc64 val;
+    ssize_t r = obj_locate(dino, files, key, &sec, &val);
+    if (r < 0)
+        return r;
+    size_t keysize = index_get_keysize(chunks);
+    if ((sec->shdr->flags & DINO_FLAG_COMPRESSED) || (val.size % keysize))
+        return -EINVAL;
+
+    /* Grab the list first; fetching the chunks uses the read buffer */
+    uint8_t *list = malloc(MAX(val.size, 1));
+    if (!list)
+        return -ENOMEM;
+    r = pread_retry(dino->fd, list, val.size, sec->offset + val.offset);
+    if (r < 0 || (Dino_Size64)r < val.size) {
+        free(list);
+        return -EIO;
+    }
+    size_t start = out->pos;
+    for (size_t off=0; off < val.size; off += keysize) {
+        if ((r = dino_get_object(dino, chunks, list+off, out)) < 0)
+            break;
+    }
+    free(list);
+    if (r == -ENOENT)
+        r = -EIO;
+    if ((r >= 0) && (val.unc_size != DINO_SIZE64_UNKNOWN) && (out->pos - start != val.unc_size))
+        r = -EIO;
+    if (r < 0) {
+        out->pos = start;
+        return r;
+    }
+    return out->pos - start;
+}
+
+static ssize_t delta_get(Dino *dino, Dino_Index *deltas, Dino_Index *objs,
+                         const Dino_Idx_Key *key, Buf *out, int depth) {
+    Dino_Sec *sec;
+    Dino_Idx_Val_Unc64 val;
+    ssize_t r = obj_locate(dino, deltas, key, &sec, &val);
+    if (r == -ENOENT)
+        return dino_get_object(dino, objs, key, out);
+    if (r < 0)
+        return r;
+    if (depth >= DINO_DELTA_DEPTH_MAX)
+        return -ELOOP;
+    Dino_Idx_Keysize keysize = index_get_keysize(deltas);
+    if (!(sec->shdr->flags & DINO_FLAG_COMPRESSED) || (val.size <= keysize))
+        return -EINVAL;
+
+    /* Grab the record first; getting the base uses the read buffer */
+    uint8_t *rec = malloc(val.size);
+    if (!rec)
+        return -ENOMEM;
+    r = pread_retry(dino->fd, rec, val.size, sec->offset + val.offset);
+    if (r < 0 || (Dino_Size64)r < val.size) {
+        free(rec);
+        return -EIO;
+    }
+    Buf *base = base_cache_get(rec, keysize);
+    int cached = (base != NULL);
+    if (!cached) {
+        if (!(base = buf_init(PAGESIZE)))
+            r = -ENOMEM;
+        else if ((r = delta_get(dino, deltas, objs, rec, base, depth+1)) == -ENOENT)
+            r = -EIO;   /* the DINO's missing the base */
+    }
+    if (r >= 0) {
+        Dino_DStream *ds = obj_dstream_get(dino, dino->dhdr.compress_id);
+        if (!ds) {
+            r = -ENOTSUP;
+        } else if (!dstream_ref_prefix(ds, base->buf, base->pos)) {
+            obj_dstream_done(ds, 0);
+            r = -ENOTSUP;
+        } else {
+            inBuf in = { rec + keysize, val.size - keysize, 0 };
+            r = obj_decompress(ds, &in, &val, out);
+            obj_dstream_done(ds, (r >= 0) || (r == -ENOMEM));
+        }
+    }
+    if (!cached && base) {
+        if ((r >= 0) && (base->pos <= BASE_CACHE_OBJ_MAX))
+            base_cache_put(rec, keysize, base);
+        else
+            buf_free(base);
+    }
+    free(rec);
+    return r;
+}
+
+ssize_t dino_get_delta_object(Dino *dino, Dino_Index *deltas, Dino_Index *objs,
+                              const Dino_Idx_Key *key, Buf *out) {
+    if (index_get_keysize(deltas) != index_get_keysize(objs))
+        return -EINVAL;
+    return delta_get(dino, deltas, objs, key, out, 0);
+}
+
+/* Objects that are no more than this far apart in the section get fetched
+ * with one read, as long as that read doesn't get bigger than this. */
+#define BATCH_GAP_MAX (4<<10)
+#define BATCH_READ_MAX (1<<20)
+
+typedef struct ObjSlot {
+    Dino_Idx_Val_Unc64 val;
+    size_t req;             /* which request it's for */
+    int raw;                /* stored uncompressed? (see obj_is_raw) */
+} ObjSlot;
+
+/* The shared state for one dino_get_objects() call. Workers claim runs of
+ * slots (in offset order) until there aren't any left. */
+typedef struct ObjBatch {
+    Dino *dino;
+    Dino_Sec *sec;
+    Dino_DOpts dopts;
+    Dino_Obj_Req *reqs;
+    ObjSlot *slots;
+    size_t count;
+    size_t next;            /* first unclaimed slot */
+    pthread_mutex_t lock;
+} ObjBatch;
+
+static int slot_cmp(const void *a, const void *b) {
+    Dino_Off64 oa = ((const ObjSlot *)a)->val.offset, ob = ((const ObjSlot *)b)->val.offset;
+    return (oa > ob) - (oa < ob);
+}
+
+/* Claim the next run of slots that can be read in one go. Returns how many
+ * there are (0 when we're done) and puts the first one in *first. */
+static size_t batch_claim(ObjBatch *b, size_t *first) {
+    pthread_mutex_lock(&b->lock);
+    size_t i = b->next, n = 0;
+    if (i < b->count) {
+        Dino_Off64 start = b->slots[i].val.offset;
+        Dino_Off64 end = start + b->slots[i].val.size;
+        for (n=1; i+n < b->count; n++) {
+            Dino_Idx_Val_Unc64 *v = &b->slots[i+n].val;
+            Dino_Off64 newend = MAX(end, v->offset + v->size);
+            if ((v->offset > end + BATCH_GAP_MAX) || (newend - start > BATCH_READ_MAX))
+                break;
+            end = newend;
+        }
+        b->next += n;
+    }
+    pthread_mutex_unlock(&b->lock);
+    *first = i;
+    return n;
+}
+
+static void *batch_worker(void *arg) {
+    ObjBatch *b = arg;
+    Dino_CompressID id = b->dino->dhdr.compress_id;
+    Dino_DStream *ds = NULL;
+    Buf *rbuf = buf_init(PAGESIZE);
+    size_t first, n;
+    while ((n = batch_claim(b, &first))) {
+        ObjSlot *run = b->slots + first;
+        Dino_Off64 start = run[0].val.offset, end = start;
+        for (size_t i=0; i<n; i++)
+            end = MAX(end, run[i].val.offset + run[i].val.size);
+        ssize_t r = 0;
+        if (!rbuf || !buf_reserve(rbuf, end - start)) {
+            r = -ENOMEM;
+        } else {
+            r = pread_retry(b->dino->fd, rbuf->buf, end - start, b->sec->offset + start);
+            r = ((r < 0) || ((Dino_Off64)r < end - start)) ? -EIO : 0;
+        }
+        for (size_t i=0; i<n; i++) {
+            Dino_Idx_Val_Unc64 *val = &run[i].val;
+            Dino_Obj_Req *req = &b->reqs[run[i].req];
+            inBuf in = { rbuf ? rbuf->buf + (val->offset - start) : NULL, val->size, 0 };
+            if (r < 0) {
+                req->result = r;
+            } else if (run[i].raw) {
+                if (!buf_reserve(req->out, val->size)) {
+                    req->result = -ENOMEM;
+                } else {
+                    memcpy(req->out->buf + req->out->pos, in.buf, val->size);
+                    req->out->pos += val->size;
+                    req->result = val->size;
+                }
+            } else if (!ds && !(ds = dstream_pool_get(id, &b->dopts))) {
+                req->result = -ENOTSUP;
+            } else {
+                req->result = obj_decompress(ds, &in, val, req->out);
+                /* Keep the stream for the next object, unless it choked */
+                if (((req->result < 0) && (req->result != -ENOMEM)) || !dstream_reset(ds)) {
+                    dstream_free(ds);
+                    ds = NULL;
+                }
+            }
+        }
+    }
+    if (ds)
+        dstream_pool_put(ds);
+    if (rbuf)
+        buf_free(rbuf);
+    return NULL;
+}
+
+ssize_t dino_get_objects(Dino *dino, Dino_Index *idx, Dino_Obj_Req *reqs,
+                         size_t count, int threads) {
+    ObjBatch b = { .dino = dino, .reqs = reqs };
+    if (!(b.sec = dino_get_index_othersec(dino, idx)))
+        return -EINVAL;
+    if (!count)
+        return 0;
+    /* The first dino_get_dopts() call fills in dino->dopts; do that now,
+     * before there's any workers around to do it at the same time */
+    if ((b.sec->shdr->flags & DINO_FLAG_COMPRESSED) && (dino_get_dopts(dino, &b.dopts) < 0))
+        return -EIO;
+    if (!(b.slots = malloc(count*sizeof(ObjSlot))))
+        return -ENOMEM;
+
+    /* Look everything up first, so we can read the objects in the order
+     * they're in the file */
+    Dino_Sec *sec;
+    for (size_t i=0; i<count; i++) {
+        ObjSlot *slot = &b.slots[b.count];
+        reqs[i].result = obj_locate(dino, idx, reqs[i].key, &sec, &slot->val);
+        if (reqs[i].result == 0) {
+            slot->req = i;
+            slot->raw = obj_is_raw(idx, sec, &slot->val);
+            b.count++;
+        }
+    }
+    qsort(b.slots, b.count, sizeof(ObjSlot), slot_cmp);
+
+    /* This thread works too, so if we can't start the others it just takes
+     * longer. */
+    pthread_mutex_init(&b.lock, NULL);
+    int nthreads = MIN((size_t)MAX(threads, 1), MAX(b.count, 1));
+    pthread_t tids[nthreads];
+    int started = 0;
+    for (; started < nthreads-1; started++)
+        if (pthread_create(&tids[started], NULL, batch_worker, &b))
+            break;
+    batch_worker(&b);
+    for (int t=0; t<started; t++)
+        pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&b.lock);
+    free(b.slots);
+
+    ssize_t ok = 0;
+    for (size_t i=0; i<count; i++)
+        if (reqs[i].result >= 0)
+            ok++;
+    return ok;
+}
@@ -0,0 +1,113 @@
+/* Fetching individual objects out of an indexed section. */
+#ifndef _OBJECT_H
+#define _OBJECT_H 1
+
+#include <sys/types.h>
+
+#include "libdino.h"
+#include "buf.h"
+#include "compression/compression.h"
+
+/* dino_get_object: look up `key` in `idx` and put the (uncompressed) object
+ * data from the index's section into `out`, starting at out->pos.
+ * `out` is grown if needed, and out->pos is moved past the object data.
+ *
+ * This does one index search and one pread() of exactly the object's
+ * compressed size, then decompresses the whole thing in one go. If the index
+ * has DINO_IDX_FLAG_UNC_SIZE we know exactly how big the output will be
+ * before we start; otherwise we ask the decompressor for the size in the
+ * frame header, and if that doesn't work either we just grow `out` as needed.
+ * Objects that a DINO_IDX_FLAG_RAW_OBJS index marks as stored raw skip the
+ * decompressor altogether.
+ *
+ * Returns the size of the object, or a negative errno:
+ *   -ENOENT if the key isn't in the index,
+ *   -EINVAL if the index value points outside its section,
+ *   -ENOTSUP if we can't decompress the section's data,
+ *   -ENOMEM if we run out of memory,
+ *   -EIO if the read fails or the data is corrupt.
+ */
+ssize_t dino_get_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key, Buf *out);
+
+/* dino_write_object: like dino_get_object, but writes the object data to
+ * `fd` as it's decompressed, so you don't need a buffer big enough for the
+ * whole object. Objects stored as-is get copied by the kernel where it can
+ * (see fd_copy_range() in fileio.h), so they never get read into memory.
+ * Returns the number of bytes written, or a negative errno (as above). */
+ssize_t dino_write_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key, int fd);
+
+/* dino_slice_object: get an object that's stored as-is (i.e. it's in an
+ * uncompressed section, or a RAW_OBJS index says it wasn't compressed)
+ * without copying it anywhere: `out` is pointed at the object's data inside
+ * `file`, which holds the DINO's contents from the start of the file - the
+ * whole thing mmap()ed, say, or as much of it as you've read in. `out` is
+ * only good as long as `file` is.
+ * Returns the size of the object, or a negative errno:
+ *   -ENOENT and -EINVAL as for dino_get_object,
+ *   -ENOTSUP if the object is compressed (use dino_get_object),
+ *   -ERANGE if `file` ends before the object does.
+ */
+ssize_t dino_slice_object(Dino *dino, Dino_Index *idx, const Dino_Idx_Key *key,
+                          const Slice *file, Slice *out);
+
+/* dino_get_chunked_object: get a file that was stored in chunks (see
+ * DINO_SEC_CHUNKLIST in dino.h). `files` is the index of the chunk lists and
+ * `chunks` is the index of the FILEDATA section holding the chunks. The
+ * chunks are fetched in order and appended to `out`, as dino_get_object does.
+ * Returns the size of the file or a negative errno, as above; -EIO also
+ * covers a chunk list that names a chunk that isn't there, or chunks that
+ * don't add up to the file's size. */
+ssize_t dino_get_chunked_object(Dino *dino, Dino_Index *files, Dino_Index *chunks,
+                                const Dino_Idx_Key *key, Buf *out);
+
+/* dino_get_delta_object: get a file that might be stored as a delta (see
+ * DINO_SEC_FILEDELTA in dino.h). `deltas` is the index of the FILEDELTA
+ * section and `objs` is the index of the FILEDATA section the chains start
+ * from; a key that isn't in `deltas` gets looked up in `objs` instead.
+ * The file is appended to `out`, as dino_get_object does.
+ * Getting the base for a delta means getting the whole file it's based on,
+ * which could be a delta too, so the last few bases get cached (per thread;
+ * dino_object_cache_free() frees them).
+ * Returns the size of the file or a negative errno, as above; -EIO also
+ * covers a missing base, -ELOOP a chain more than DINO_DELTA_DEPTH_MAX
+ * deltas long, and -EINVAL indexes with different key sizes. */
+ssize_t dino_get_delta_object(Dino *dino, Dino_Index *deltas, Dino_Index *objs,
+                              const Dino_Idx_Key *key, Buf *out);
+
+/* One object for dino_get_objects(). */
+typedef struct Dino_Obj_Req {
+    const Dino_Idx_Key *key;  /* the object's key */
+    Buf *out;                 /* where to put it; see dino_get_object */
+    ssize_t result;           /* set to its size, or a negative errno */
+} Dino_Obj_Req;
+
+/* dino_get_objects: fetch a batch of objects, like calling dino_get_object
+ * for each request in `reqs`, using up to `threads` threads (counting the
+ * calling thread). Every request needs its own `out` buffer.
+ *
+ * All the keys get looked up first, then the objects are read in the order
+ * they appear in the section - with objects that are close together fetched
+ * by a single read - and the workers take those reads in turn, decompressing
+ * each object into its request's buffer.
+ *
+ * Each request's `result` is set just like dino_get_object's return value.
+ * Returns the number of objects fetched successfully, or a negative errno if
+ * we couldn't even start (-EINVAL if the index doesn't point to a section,
+ * -EIO if we can't read the compression options, -ENOMEM). */
+ssize_t dino_get_objects(Dino *dino, Dino_Index *idx, Dino_Obj_Req *reqs,
+                         size_t count, int threads);
+
+/* dino_get_dopts: read the decompression options from the DINO's
+ * compress_opts section (see DINO_SEC_COPTS) into `dopts`. If there's no
+ * such section you get the defaults.
+ * Returns 1 if we found options, 0 if not, or a negative errno. */
+int dino_get_dopts(Dino *dino, Dino_DOpts *dopts);
+
+/* Decompression contexts come from the stream pool (see compression.h) and
+ * each thread keeps a read buffer around between calls, since setting those
+ * up is a lot more expensive than decompressing a typical small object.
+ * Call this before a thread exits (or whenever) to free the read buffer,
+ * the pooled streams, this thread's cached streams and its delta bases. */
+void dino_object_cache_free(void);
+
+#endif /* _OBJECT_H */
@@ -0,0 +1,221 @@
+/* pipeline.c - streaming blocks of data through a chain of stages. */
+
+#include "libdino_internal.h"
+#include "fileio.h"
+#include "pipeline.h"
+
+typedef enum {
+    STAGE_HASHER,
+    STAGE_COMPRESS,
+    STAGE_DECOMPRESS,
+    STAGE_BUF,
+    STAGE_FD,
+} StageType;
+
+typedef struct Stage {
+    StageType type;
+    union {
+        Hasher *h;
+        Dino_CStream *cs;
+        Dino_DStream *ds;
+        Buf *buf;
+        int fd;
+    };
+    outBuf out;             /* output block, for (de)compressors */
+    size_t ret;             /* decompressor's last return; 0 = frame done */
+} Stage;
+
+struct Dino_Pipeline {
+    size_t blocksize;
+    int count;
+    Stage stages[PIPELINE_STAGES_MAX];
+    size_t bytes_out;       /* out of the last stage, since the last finish */
+};
+
+Dino_Pipeline *pipeline_new(size_t blocksize) {
+    Dino_Pipeline *p = calloc(1, sizeof(Dino_Pipeline));
+    if (!p)
+        return NULL;
+    p->blocksize = blocksize ? MAX(blocksize, PIPELINE_BLOCK_MIN) : PIPELINE_BLOCK_DEFAULT;
+    return p;
+}
+
+void pipeline_free(Dino_Pipeline *p) {
+    if (!p)
+        return;
+    for (int i=0; i<p->count; i++)
+        free(p->stages[i].out.buf);
+    free(p);
+}
+
+/* Add a stage, with an output block if it needs one */
+static Stage *stage_add(Dino_Pipeline *p, StageType type, int *num) {
+    if (p->count == PIPELINE_STAGES_MAX) {
+        *num = -ENOSPC;
+        return NULL;
+    }
+    Stage *st = &p->stages[p->count];
+    *st = (Stage) { .type = type, .ret = 1 };
+    if ((type == STAGE_COMPRESS) || (type == STAGE_DECOMPRESS)) {
+        if (!(st->out.buf = malloc(p->blocksize))) {
+            *num = -ENOMEM;
+            return NULL;
+        }
+        st->out.size = p->blocksize;
+    }
+    *num = p->count++;
+    return st;
+}
+
+int pipeline_add_hasher(Dino_Pipeline *p, Hasher *h) {
+    int num;
+    Stage *st = stage_add(p, STAGE_HASHER, &num);
+    if (st)
+        st->h = h;
+    return num;
+}
+
+int pipeline_add_compress(Dino_Pipeline *p, Dino_CStream *cs) {
+    int num;
+    Stage *st = stage_add(p, STAGE_COMPRESS, &num);
+    if (st)
+        st->cs = cs;
+    return num;
+}
+
+int pipeline_add_decompress(Dino_Pipeline *p, Dino_DStream *ds) {
+    int num;
+    Stage *st = stage_add(p, STAGE_DECOMPRESS, &num);
+    if (st)
+        st->ds = ds;
+    return num;
+}
+
+int pipeline_add_buf(Dino_Pipeline *p, Buf *out) {
+    int num;
+    Stage *st = stage_add(p, STAGE_BUF, &num);
+    if (st)
+        st->buf = out;
+    return num;
+}
+
+int pipeline_add_fd(Dino_Pipeline *p, int fd) {
+    int num;
+    Stage *st = stage_add(p, STAGE_FD, &num);
+    if (st)
+        st->fd = fd;
+    return num;
+}
+
+static inline int codec_err(size_t r) {
+    return (r == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+}
+
+/* Feed one block to stage `i`, which passes its output on down the line
+ * before we come back here for the next block. */
+static int stage_push(Dino_Pipeline *p, int i, const void *data, size_t len) {
+    if (i == p->count) {
+        p->bytes_out += len;
+        return 0;
+    }
+    Stage *st = &p->stages[i];
+    inBuf in = { data, len, 0 };
+    size_t r, inpos;
+    int err;
+    switch (st->type) {
+    case STAGE_HASHER:
+        if (!hasher_update(st->h, data, len))
+            return -EIO;
+        break;
+    case STAGE_BUF:
+        if (!buf_reserve(st->buf, len))
+            return -ENOMEM;
+        memcpy(st->buf->buf + st->buf->pos, data, len);
+        st->buf->pos += len;
+        break;
+    case STAGE_FD:
+        if (write_retry(st->fd, data, len) < (ssize_t)len)
+            return -EIO;
+        break;
+    case STAGE_COMPRESS:
+        while (in.pos < in.size) {
+            inpos = in.pos;
+            st->out.pos = 0;
+            r = cstream_compress(st->cs, &in, &st->out);
+            if (IS_COMPRESS_ERR(r))
+                return codec_err(r);
+            if ((in.pos == inpos) && !st->out.pos)
+                return -EIO;
+            if ((err = stage_push(p, i+1, st->out.buf, st->out.pos)) < 0)
+                return err;
+        }
+        return 0;
+    case STAGE_DECOMPRESS:
+        /* Keep going while there's input, or while the decoder fills the
+         * whole output block (so it might be holding on to more) */
+        for (int full = 1; (in.pos < in.size) || full; ) {
+            /* Once the frame's done, anything more is junk */
+            if (!st->ret)
+                return (in.pos < in.size) ? -EIO : 0;
+            inpos = in.pos;
+            st->out.pos = 0;
+            r = dstream_decompress(st->ds, &in, &st->out);
+            if (IS_COMPRESS_ERR(r))
+                return codec_err(r);
+            st->ret = r;
+            if ((in.pos == inpos) && !st->out.pos)
+                return (in.pos < in.size) ? -EIO : 0;
+            if ((err = stage_push(p, i+1, st->out.buf, st->out.pos)) < 0)
+                return err;
+            full = (st->out.pos == st->out.size);
+        }
+        return 0;
+    }
+    return stage_push(p, i+1, data, len);
+}
+
+int pipeline_write_at(Dino_Pipeline *p, int stage, const void *data, size_t len) {
+    if ((stage < 0) || (stage > p->count))
+        return -EINVAL;
+    const uint8_t *d = data;
+    for (size_t off=0, n; off < len; off += n) {
+        n = MIN(len - off, p->blocksize);
+        int err = stage_push(p, stage, d + off, n);
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+int pipeline_write(Dino_Pipeline *p, const void *data, size_t len) {
+    return pipeline_write_at(p, 0, data, len);
+}
+
+ssize_t pipeline_finish(Dino_Pipeline *p) {
+    /* Each compressor's leftovers go through the stages after it - which
+     * could include another compressor - so go front to back */
+    int err = 0;
+    for (int i=0; (i < p->count) && !err; i++) {
+        Stage *st = &p->stages[i];
+        if (st->type == STAGE_DECOMPRESS) {
+            if (st->ret)
+                err = -EIO;     /* the frame was cut short */
+        } else if (st->type == STAGE_COMPRESS) {
+            size_t r;
+            do {
+                st->out.pos = 0;
+                r = cstream_compress_end(st->cs, &st->out);
+                if (IS_COMPRESS_ERR(r))
+                    err = codec_err(r);
+                else
+                    err = stage_push(p, i+1, st->out.buf, st->out.pos);
+            } while (r && !err);
+        }
+    }
+    /* Whatever happened, we're ready to start again */
+    for (int i=0; i<p->count; i++)
+        p->stages[i].ret = 1;
+    size_t out = p->bytes_out;
+    p->bytes_out = 0;
+    return err ? err : (ssize_t)out;
+}
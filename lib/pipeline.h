@@ -0,0 +1,77 @@
+/* Streaming data through a chain of stages - hashing, (de)compressing,
+ * writing - a block at a time. */
+#ifndef _PIPELINE_H
+#define _PIPELINE_H 1
+
+#include <sys/types.h>
+
+#include "buf.h"
+#include "digest.h"
+#include "compression/compression.h"
+
+/* Hashing some data and then compressing it means reading all of it from
+ * memory twice, and decompress -> hash -> recompress is three times. A
+ * pipeline pushes each block of data through every stage before moving on
+ * to the next one, so all but the first stage find the block (or what the
+ * stage before made of it) still in cache.
+ *
+ * Every stage passes its output on to the next one: hashers and sinks pass
+ * their input on unchanged, (de)compressors pass on what they produce. The
+ * output of the last stage is just counted.
+ *
+ * It all happens in the calling thread. Handing blocks over to other
+ * threads would mean they'd end up in some other core's cache, which is
+ * what we're trying to avoid; if you want more threads, give them to the
+ * compressor (see Dino_COpts.threads) or run more pipelines. */
+
+/* Small enough to stay in L2 alongside a block or two of codec output, big
+ * enough that the per-block overhead doesn't matter. */
+#define PIPELINE_BLOCK_DEFAULT (64<<10)
+#define PIPELINE_BLOCK_MIN (4<<10)
+#define PIPELINE_STAGES_MAX 8
+
+typedef struct Dino_Pipeline Dino_Pipeline;
+
+/* pipeline_new: make an empty pipeline that feeds its stages `blocksize`
+ * bytes at a time (0 means PIPELINE_BLOCK_DEFAULT; anything smaller than
+ * PIPELINE_BLOCK_MIN gets bumped up to that). NULL if we're out of memory. */
+Dino_Pipeline *pipeline_new(size_t blocksize);
+void pipeline_free(Dino_Pipeline *p);
+
+/* Adding stages. Each of these returns the number of the new stage (for
+ * pipeline_write_at()), or -ENOMEM, or -ENOSPC if the pipeline already has
+ * PIPELINE_STAGES_MAX stages. The pipeline doesn't own any of the things
+ * it's given, and you get them ready for each new lot of data yourself -
+ * hasher_start(), cstream_reset()/dstream_reset() (not needed for fresh
+ * streams), and cstream_compress_start() if you want to tell the encoder
+ * the size - but pipeline_finish() ends the compressed frames. */
+int pipeline_add_hasher(Dino_Pipeline *p, Hasher *h);
+int pipeline_add_compress(Dino_Pipeline *p, Dino_CStream *cs);
+/* The input to a decompress stage has to be a single complete frame. */
+int pipeline_add_decompress(Dino_Pipeline *p, Dino_DStream *ds);
+/* Sinks: append to `out` (growing it as needed), or write to `fd`. */
+int pipeline_add_buf(Dino_Pipeline *p, Buf *out);
+int pipeline_add_fd(Dino_Pipeline *p, int fd);
+
+/* pipeline_write: push `len` bytes of `data` through the whole pipeline.
+ * pipeline_write_at: same, but start at stage number `stage`, skipping the
+ * ones before it - e.g. to compress some data along with data you're
+ * hashing, without hashing it.
+ * Returns 0 or a negative errno:
+ *   -EINVAL if there's no such stage,
+ *   -ENOMEM if we run out of memory,
+ *   -EIO if a codec fails, the compressed data is corrupt, or writing fails.
+ * After an error the pipeline's stages are in no state to carry on; reset
+ * the streams and start over. */
+int pipeline_write(Dino_Pipeline *p, const void *data, size_t len);
+int pipeline_write_at(Dino_Pipeline *p, int stage, const void *data, size_t len);
+
+/* pipeline_finish: end the frames of any compress stages, flushing what's
+ * left through the rest of the pipeline, and check that the decompress
+ * stages got to the end of their frames. The pipeline is then ready to be
+ * used again, once you've got the stages ready again (see above).
+ * Returns how many bytes came out of the last stage since the pipeline was
+ * last finished (or made), or a negative errno as above. */
+ssize_t pipeline_finish(Dino_Pipeline *p);
+
+#endif /* _PIPELINE_H */
@@ -0,0 +1,293 @@
+/* seekable.c - seekable compressed sections: a series of independent
+ * frames plus a seek table. See DINO_FLAG_SEEKABLE in dino.h. */
+
+#include <pthread.h>
+
+#include "libdino_internal.h"
+#include "fileio.h"
+#include "object.h"
+#include "seekable.h"
+
+struct Dino_Seekable {
+    Dino_Sec *sec;
+    Dino_CompressID id;
+    Dino_DOpts dopts;
+    Dino_Size count;         /* number of frames */
+    Dino_Off64 *offset;      /* where each frame starts; count+1 of them */
+    Dino_Off64 *unc_offset;  /* same, but in the uncompressed data */
+    int threads;
+};
+
+/* Room to leave for a frame that doesn't compress: zstd's worst case is
+ * about size/256 (plus headers), and the others are in the same ballpark */
+#define FRAME_BOUND(size) ((size) + ((size)>>6) + PAGESIZE)
+
+ssize_t seekable_write(Dino_CStream *cs, const void *data, size_t size,
+                       size_t frame_size, Buf *out) {
+    if (!frame_size || (frame_size > DINO_SIZE_MAX))
+        return -EINVAL;
+    size_t start = out->pos;
+    Buf *table = buf_init(PAGESIZE);
+    if (!table)
+        return -ENOMEM;
+    Dino_Size count = 0;
+    ssize_t r = 0;
+    for (size_t off=0; off<size; off+=frame_size) {
+        size_t unc_size = MIN(frame_size, size-off);
+        size_t framestart = out->pos, bound = FRAME_BOUND(unc_size), ret;
+        /* If the frame doesn't fit after all, start it over with more room */
+        do {
+            out->pos = framestart;
+            if (!buf_reserve(out, bound) || !buf_reserve(table, sizeof(Dino_Seek_Entry))) {
+                r = -ENOMEM;
+                goto fail;
+            }
+            inBuf in = { data+off, unc_size, 0 };
+            if (!cstream_reset(cs)) {
+                r = -EIO;
+                goto fail;
+            }
+            ret = cstream_compress1(cs, &in, out);
+            bound *= 2;
+        } while (ret == COMPRESS_ERR_BUF);
+        if (ret) {
+            r = (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+            goto fail;
+        }
+        if (out->pos - framestart > DINO_SIZE_MAX) {
+            r = -EFBIG;
+            goto fail;
+        }
+        Dino_Seek_Entry entry = { out->pos - framestart, unc_size };
+        memcpy(table->buf+table->pos, &entry, sizeof(entry));
+        table->pos += sizeof(entry);
+        count++;
+    }
+    /* TODO: byteswap if needed */
+    if (!buf_reserve(out, table->pos + sizeof(count))) {
+        r = -ENOMEM;
+        goto fail;
+    }
+    memcpy(out->buf+out->pos, table->buf, table->pos);
+    out->pos += table->pos;
+    memcpy(out->buf+out->pos, &count, sizeof(count));
+    out->pos += sizeof(count);
+    buf_free(table);
+    return out->pos - start;
+fail:
+    out->pos = start;
+    buf_free(table);
+    return r;
+}
+
+void dino_seekable_free(Dino_Seekable *sk) {
+    if (!sk)
+        return;
+    free(sk->offset);
+    free(sk->unc_offset);
+    free(sk);
+}
+
+Dino_Seekable *dino_seekable_open(Dino *dino, Dino_Secidx idx) {
+    if (!_sectab_hassec(dino->sectab, idx)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    Dino_Sec *sec = _dino_getsec(dino, idx);
+    Dino_Size count;
+    if (!(sec->shdr->flags & DINO_FLAG_SEEKABLE) || (sec->size < sizeof(count))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    Dino_Off64 tablepos = sec->size - sizeof(count);
+    if (pread_retry(dino->fd, &count, sizeof(count), sec->offset+tablepos) < (ssize_t)sizeof(count)) {
+        errno = EIO;
+        return NULL;
+    }
+    if ((Dino_Size64)count*sizeof(Dino_Seek_Entry) > tablepos) {
+        errno = EINVAL;
+        return NULL;
+    }
+    tablepos -= (Dino_Size64)count*sizeof(Dino_Seek_Entry);
+
+    Dino_Seekable *sk = calloc(1, sizeof(Dino_Seekable));
+    Dino_Seek_Entry *table = malloc(count*sizeof(Dino_Seek_Entry));
+    int err = ENOMEM;
+    if (!sk || !(table || !count) ||
+        !(sk->offset = malloc((count+1)*sizeof(Dino_Off64))) ||
+        !(sk->unc_offset = malloc((count+1)*sizeof(Dino_Off64))))
+        goto fail;
+    err = EIO;
+    size_t tablesize = count*sizeof(Dino_Seek_Entry);
+    if (pread_retry(dino->fd, table, tablesize, sec->offset+tablepos) < (ssize_t)tablesize)
+        goto fail;
+    /* The frames had better add up to exactly the space before the table */
+    err = EINVAL;
+    sk->offset[0] = sk->unc_offset[0] = 0;
+    for (Dino_Size f=0; f<count; f++) {
+        sk->offset[f+1] = sk->offset[f] + table[f].size;
+        sk->unc_offset[f+1] = sk->unc_offset[f] + table[f].unc_size;
+    }
+    if (sk->offset[count] != tablepos)
+        goto fail;
+    /* Get the options now, since dino_get_dopts() caches them in `dino` and
+     * that's not something we want to race with in the reader threads */
+    if (dino_get_dopts(dino, &sk->dopts) < 0)
+        goto fail;
+    free(table);
+    sk->sec = sec;
+    sk->id = (sec->shdr->flags & DINO_FLAG_COMPRESSED) ? dino->dhdr.compress_id
+                                                       : DINO_COMPRESS_NONE;
+    sk->count = count;
+    sk->threads = 1;
+    return sk;
+fail:
+    free(table);
+    dino_seekable_free(sk);
+    errno = err;
+    return NULL;
+}
+
+Dino_Size64 dino_seekable_size(Dino_Seekable *sk) {
+    return sk->unc_offset[sk->count];
+}
+
+void dino_seekable_set_threads(Dino_Seekable *sk, int threads) {
+    sk->threads = MAX(threads, 1);
+}
+
+/* The frame that holds uncompressed offset `off` (which must be less than
+ * the total size); i.e. the last frame starting at or before it. */
+static Dino_Size sk_find_frame(Dino_Seekable *sk, Dino_Off64 off) {
+    Dino_Size lo = 0, hi = sk->count;
+    while (hi - lo > 1) {
+        Dino_Size mid = lo + (hi - lo)/2;
+        if (sk->unc_offset[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* One reader's share of a dino_seekable_read_at() call */
+typedef struct SkRead {
+    Dino_Seekable *sk;
+    Dino_Size first, last;  /* frames to read (inclusive)... */
+    Dino_Size step;         /* ...taking every step'th one, from first */
+    Dino_Off64 off;         /* uncompressed range we want */
+    size_t len;
+    uint8_t *dst;           /* where it goes */
+    int err;
+} SkRead;
+
+/* Read frame `f` and decompress the part that overlaps the requested range
+ * into its spot in dst. `tmp` holds the compressed data, plus the whole
+ * uncompressed frame if we only want part of it. */
+static int sk_read_frame(SkRead *rd, Dino_DStream *ds, Dino_Size f, Buf *tmp) {
+    Dino_Seekable *sk = rd->sk;
+    Dino_Off64 ustart = sk->unc_offset[f], uend = sk->unc_offset[f+1];
+    Dino_Off64 from = MAX(ustart, rd->off), to = MIN(uend, rd->off + rd->len);
+    if (from >= to)
+        return 0;
+    size_t csize = sk->offset[f+1] - sk->offset[f], usize = uend - ustart;
+    int partial = (from != ustart) || (to != uend);
+    tmp->pos = 0;
+    if (!buf_reserve(tmp, csize + (partial ? usize : 0)))
+        return -ENOMEM;
+    ssize_t r = pread_retry(sk->sec->dino->fd, tmp->buf, csize, sk->sec->offset + sk->offset[f]);
+    if ((r < 0) || ((size_t)r < csize))
+        return -EIO;
+
+    inBuf in = { tmp->buf, csize, 0 };
+    outBuf dec = { rd->dst + (from - rd->off), usize, 0 };
+    if (partial)
+        dec.buf = tmp->buf + csize;
+    size_t ret = dstream_decompress1(ds, &in, &dec);
+    if (ret)
+        return (ret == COMPRESS_ERR_MEM) ? -ENOMEM : -EIO;
+    if (dec.pos != usize)
+        return -EIO;
+    if (partial)
+        memcpy(rd->dst + (from - rd->off), dec.buf + (from - ustart), to - from);
+    return 0;
+}
+
+static void *sk_reader(void *arg) {
+    SkRead *rd = arg;
+    Dino_DStream *ds = dstream_pool_get(rd->sk->id, &rd->sk->dopts);
+    Buf *tmp = buf_init(PAGESIZE);
+    rd->err = (ds && tmp) ? 0 : (!ds ? -ENOTSUP : -ENOMEM);
+    for (Dino_Size f=rd->first; !rd->err && (f<=rd->last); f+=rd->step) {
+        rd->err = sk_read_frame(rd, ds, f, tmp);
+        /* The stream gets reset for the next frame either way; if the frame
+         * was bad we don't trust it for the next one, though */
+        if (rd->err) {
+            dstream_free(ds);
+            ds = NULL;
+        } else if (!dstream_reset(ds)) {
+            rd->err = -EIO;
+        }
+    }
+    if (ds)
+        dstream_pool_put(ds);
+    if (tmp)
+        buf_free(tmp);
+    return NULL;
+}
+
+ssize_t dino_seekable_read_at(Dino_Seekable *sk, Dino_Off64 off, size_t len, Buf *out) {
+    Dino_Size64 size = dino_seekable_size(sk);
+    if (off > size)
+        return -EINVAL;
+    len = MIN(len, size - off);
+    if (!len)
+        return 0;
+    if (!buf_reserve(out, len))
+        return -ENOMEM;
+    SkRead rd = {
+        .sk = sk,
+        .first = sk_find_frame(sk, off),
+        .last = sk_find_frame(sk, off + len - 1),
+        .step = 1,
+        .off = off,
+        .len = len,
+        .dst = out->buf + out->pos,
+    };
+
+    /* Each thread takes every nth frame, so they all get about the same
+     * amount of work (only the first and last frames can be partial). */
+    int nthreads = MIN((Dino_Size)sk->threads, rd.last - rd.first + 1);
+    if (nthreads <= 1) {
+        sk_reader(&rd);
+    } else {
+        SkRead reads[nthreads];
+        pthread_t tids[nthreads];
+        int started = 0;
+        for (int t=0; t<nthreads; t++) {
+            reads[t] = rd;
+            reads[t].first = rd.first + t;
+            reads[t].step = nthreads;
+        }
+        /* If we can't start a thread, do its share of the frames here */
+        for (; started<nthreads; started++)
+            if (pthread_create(&tids[started], NULL, sk_reader, &reads[started]))
+                break;
+        if (started < nthreads) {
+            for (int t=started; t<nthreads; t++) {
+                sk_reader(&reads[t]);
+                if (reads[t].err)
+                    rd.err = reads[t].err;
+            }
+        }
+        for (int t=0; t<started; t++) {
+            pthread_join(tids[t], NULL);
+            if (reads[t].err)
+                rd.err = reads[t].err;
+        }
+    }
+    if (rd.err)
+        return rd.err;
+    out->pos += len;
+    return len;
+}
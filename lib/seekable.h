@@ -0,0 +1,58 @@
+/* Random access to seekable compressed sections (see DINO_FLAG_SEEKABLE). */
+#ifndef _SEEKABLE_H
+#define _SEEKABLE_H 1
+
+#include <sys/types.h>
+
+#include "libdino.h"
+#include "buf.h"
+#include "compression/compression.h"
+
+/* Smaller frames mean less wasted decompression for small reads; bigger
+ * frames compress better, since each one starts with an empty window. */
+#define SEEKABLE_FRAME_SIZE_DEFAULT (256<<10)
+
+/* seekable_write: compress `size` bytes of `data` with `cs`, as independent
+ * frames of `frame_size` uncompressed bytes (the last one may be smaller),
+ * then add the seek table. It all gets appended to `out` (which is grown as
+ * needed), so `out` ends up holding the whole section's data; give the
+ * section DINO_FLAG_COMPRESSED|DINO_FLAG_SEEKABLE.
+ * `cs` gets reset before each frame; its options are left alone.
+ * Returns the number of bytes written, or a negative errno:
+ *   -EINVAL if frame_size is 0 or too big for the seek table,
+ *   -EFBIG if a compressed frame is too big for the seek table,
+ *   -ENOMEM if we run out of memory,
+ *   -EIO if the compressor fails.
+ */
+ssize_t seekable_write(Dino_CStream *cs, const void *data, size_t size,
+                       size_t frame_size, Buf *out);
+
+typedef struct Dino_Seekable Dino_Seekable;
+
+/* dino_seekable_open: read the seek table of section `idx`, which needs to
+ * have DINO_FLAG_SEEKABLE set. Returns NULL (and sets errno) if that fails.
+ * Free it with dino_seekable_free() when you're done. */
+Dino_Seekable *dino_seekable_open(Dino *dino, Dino_Secidx idx);
+void dino_seekable_free(Dino_Seekable *sk);
+
+/* Total uncompressed size of the section's data */
+Dino_Size64 dino_seekable_size(Dino_Seekable *sk);
+
+/* Decompress frames in `threads` threads (1, the default, means just use the
+ * calling thread). Only reads that touch more than one frame use them. */
+void dino_seekable_set_threads(Dino_Seekable *sk, int threads);
+
+/* dino_seekable_read_at: put `len` bytes of the uncompressed data, starting
+ * at `off`, into `out` at out->pos. `out` is grown if needed, and out->pos
+ * is moved past the data. Only the frames holding that range are read and
+ * decompressed. Reads past the end are cut short, like pread().
+ * Returns the number of bytes read, or a negative errno:
+ *   -EINVAL if `off` is past the end of the data,
+ *   -ENOTSUP if we can't decompress the section's data,
+ *   -ENOMEM if we run out of memory,
+ *   -EIO if the read fails or the data is corrupt.
+ * On failure, out->pos is left where it was.
+ */
+ssize_t dino_seekable_read_at(Dino_Seekable *sk, Dino_Off64 off, size_t len, Buf *out);
+
+#endif /* _SEEKABLE_H */
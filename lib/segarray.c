@@ -0,0 +1,192 @@
+/* segarray.c - segmented sorted arrays. See segarray.h for details. */
+
+#include "libdino_internal.h"
+#include "memory.h"
+#include "keycmp.h"
+#include "segarray.h"
+
+/* A block of items. Each item is key+val, back to back. */
+typedef struct SegBlock {
+    size_t count;
+    uint8_t items[];
+} SegBlock;
+
+struct SegArray {
+    size_t keysize;
+    size_t valsize;
+    size_t isize;       /* keysize+valsize */
+    size_t blockitems;  /* max items per block */
+    size_t count;       /* total items */
+    Array *blocks;      /* directory: SegBlock pointers, in order */
+    keycmp_fn *keycmp;
+};
+
+/* Default block size. Big enough that the directory stays small (a million
+ * 40-byte items is ~2500 blocks), small enough that shifting items around
+ * inside a block stays cheap and cache-friendly. */
+#define SEGARRAY_BLOCKSIZE (16<<10)
+
+#define SEGBLOCK(s, b) (*(SegBlock **)array_get((s)->blocks, b))
+#define SEGITEM(s, blk, i) ((blk)->items + ((i)*(s)->isize))
+
+SegArray *segarray_new(size_t keysize, size_t valsize, size_t blockitems) {
+    if (!keysize)
+        return NULL;
+    SegArray *s = calloc(1, sizeof(SegArray));
+    if (!s)
+        return NULL;
+    s->keysize = keysize;
+    s->valsize = valsize;
+    s->isize = keysize + valsize;
+    /* need at least 2 items per block so splitting leaves something behind */
+    s->blockitems = blockitems ? blockitems : (SEGARRAY_BLOCKSIZE / s->isize);
+    s->blockitems = MAX(s->blockitems, 2);
+    s->blocks = array_new(sizeof(SegBlock *));
+    s->keycmp = keycmp_select(keysize);
+    if (!s->blocks) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void segarray_free(SegArray *s) {
+    if (!s)
+        return;
+    for (size_t b=0; b<array_len(s->blocks); b++)
+        free(SEGBLOCK(s, b));
+    array_free(s->blocks);
+    free(s);
+}
+
+size_t segarray_len(SegArray *s) {
+    return s->count;
+}
+
+static SegBlock *segblock_new(SegArray *s) {
+    SegBlock *blk = malloc(sizeof(SegBlock) + (s->blockitems * s->isize));
+    if (blk)
+        blk->count = 0;
+    return blk;
+}
+
+/* Find the first block whose last key is >= key - that's the block where
+ * the key's lower bound is. If key is bigger than everything, that's the
+ * last block. */
+static size_t segarray_find_block(SegArray *s, const void *key) {
+    size_t lo = 0, hi = array_len(s->blocks), mid;
+    SegBlock *blk;
+    while (lo < hi) {
+        mid = lo + ((hi-lo)>>1);
+        blk = SEGBLOCK(s, mid);
+        if (s->keycmp(key, SEGITEM(s, blk, blk->count-1), s->keysize) > 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return MIN(lo, array_len(s->blocks)-1);
+}
+
+/* Find the first item in blk whose key is >= key */
+static size_t segblock_bisect(SegArray *s, SegBlock *blk, const void *key) {
+    size_t lo = 0, hi = blk->count, mid;
+    while (lo < hi) {
+        mid = lo + ((hi-lo)>>1);
+        if (s->keycmp(key, SEGITEM(s, blk, mid), s->keysize) > 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void *segarray_find(SegArray *s, const void *key) {
+    if (!s->count)
+        return NULL;
+    SegBlock *blk = SEGBLOCK(s, segarray_find_block(s, key));
+    size_t i = segblock_bisect(s, blk, key);
+    if ((i < blk->count) && (s->keycmp(key, SEGITEM(s, blk, i), s->keysize) == 0))
+        return SEGITEM(s, blk, i) + s->keysize;
+    return NULL;
+}
+
+int segarray_insort(SegArray *s, const void *key, const void *val, int replace) {
+    SegBlock *blk;
+    size_t b, i;
+
+    /* Blocks are never empty, except the very first one */
+    if (!array_len(s->blocks)) {
+        if (!(blk = segblock_new(s)))
+            return -1;
+        if (array_append(s->blocks, &blk) < 0) {
+            free(blk);
+            return -1;
+        }
+        b = i = 0;
+    } else {
+        b = segarray_find_block(s, key);
+        blk = SEGBLOCK(s, b);
+        i = segblock_bisect(s, blk, key);
+    }
+
+    if (replace && (i < blk->count) &&
+        (s->keycmp(key, SEGITEM(s, blk, i), s->keysize) == 0)) {
+        if (s->valsize)
+            memcpy(SEGITEM(s, blk, i) + s->keysize, val, s->valsize);
+        return 0;
+    }
+
+    /* Full block? Split it in half, and move on to whichever half the new
+     * item belongs in. */
+    if (blk->count == s->blockitems) {
+        SegBlock *next = segblock_new(s);
+        if (!next)
+            return -1;
+        size_t half = blk->count >> 1;
+        next->count = blk->count - half;
+        memcpy(next->items, SEGITEM(s, blk, half), next->count * s->isize);
+        if (array_insert(s->blocks, &next, b+1) < 0) {
+            free(next);
+            return -1;
+        }
+        blk->count = half;
+        if (i > half) {
+            blk = next;
+            i -= half;
+        }
+    }
+
+    uint8_t *item = SEGITEM(s, blk, i);
+    memmove(item + s->isize, item, (blk->count - i) * s->isize);
+    memcpy(item, key, s->keysize);
+    if (s->valsize)
+        memcpy(item + s->keysize, val, s->valsize);
+    blk->count++;
+    s->count++;
+    return 1;
+}
+
+ssize_t segarray_flatten(SegArray *s, Array *keys, Array *vals) {
+    if (!s->valsize)
+        vals = NULL;
+    if ((keys->isize != s->keysize) || (vals && (vals->isize != s->valsize)))
+        return -1;
+    if ((array_realloc(keys, keys->count + s->count) < 0) ||
+        (vals && (array_realloc(vals, vals->count + s->count) < 0)))
+        return -1;
+    for (size_t b=0; b<array_len(s->blocks); b++) {
+        SegBlock *blk = SEGBLOCK(s, b);
+        if (!s->valsize) {
+            /* keys only, so the items are already laid out like an Array */
+            memcpy(array_get(keys, keys->count), blk->items, blk->count * s->isize);
+            keys->count += blk->count;
+            continue;
+        }
+        for (size_t i=0; i<blk->count; i++) {
+            memcpy(array_get(keys, keys->count++), SEGITEM(s, blk, i), s->keysize);
+            if (vals)
+                memcpy(array_get(vals, vals->count++), SEGITEM(s, blk, i) + s->keysize, s->valsize);
+        }
+    }
+    return s->count;
+}
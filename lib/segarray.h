@@ -0,0 +1,53 @@
+#ifndef _SEGARRAY_H
+#define _SEGARRAY_H 1
+
+#include <sys/types.h>
+
+#include "array.h"
+
+/* A segmented sorted array, for building big sorted arrays one item at a
+ * time.
+ *
+ * Inserting into the middle of a regular Array means memmove()ing everything
+ * after it, so building a sorted Array with array_insort() is O(n^2) - and
+ * an index has to do it twice, once for the keys and once for the vals.
+ *
+ * A SegArray keeps its items in fixed-size blocks instead, plus a small
+ * directory of pointers to those blocks. Inserting an item only moves items
+ * in one block; when a block fills up it gets split in two, which means
+ * shifting the directory (but not any items). With blocks of about sqrt(n)
+ * items that's O(sqrt n) per insert rather than O(n).
+ *
+ * Each item is a key, plus an optional value that goes along for the ride.
+ * Items are sorted by key only. Once you're done adding things, flatten it
+ * into regular Arrays with segarray_flatten() for searching/serialization.
+ */
+typedef struct SegArray SegArray;
+
+/* Make a new SegArray for keys of size `keysize` and values of size
+ * `valsize` (which may be 0). `blockitems` is the maximum number of items
+ * per block; 0 picks a sensible default. */
+SegArray *segarray_new(size_t keysize, size_t valsize, size_t blockitems);
+void segarray_free(SegArray *s);
+
+/* Number of items in the array */
+size_t segarray_len(SegArray *s);
+
+/* Insert `key` (and `val`, if the array has values) in sorted order.
+ * If the key is already present and `replace` is nonzero, the existing
+ * value is replaced; otherwise the new item goes before the existing one(s).
+ * Returns 1 if an item was added, 0 if a value was replaced, -1 on error. */
+int segarray_insort(SegArray *s, const void *key, const void *val, int replace);
+
+/* Find `key`. Returns a pointer to its value (or to the key itself, if the
+ * array has no values), or NULL if it's not there. The pointer is only
+ * good until the next insert, and it's not necessarily aligned. */
+void *segarray_find(SegArray *s, const void *key);
+
+/* Append all the keys (and values) to `keys` (and `vals`), in order.
+ * `vals` can be NULL if you don't want them. The SegArray is unchanged.
+ * Returns the number of items appended, or -1 if we ran out of memory or
+ * the Arrays' item sizes don't match the SegArray's key/value sizes. */
+ssize_t segarray_flatten(SegArray *s, Array *keys, Array *vals);
+
+#endif /* _SEGARRAY_H */
@@ -0,0 +1,207 @@
+/* sketch.c - MinHash sketches, and finding similar objects with them.
+ *
+ * The features we sketch are small content-defined chunks of the data (see
+ * chunker.h): an edit only changes the chunks around it, so the fraction of
+ * chunks two files share says a lot about how well one would delta against
+ * the other. Each chunk gets a 64-bit fingerprint, and each of the sketch's
+ * values is the minimum of a different hash of those fingerprints.
+ *
+ * Everything here - the chunk size, the fingerprint, the hash functions
+ * and their seeds - ends up in the sketches we write, so none of it can
+ * change without making old sketches useless. */
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libdino_internal.h"
+#include "chunker.h"
+#include "fileio.h"
+#include "sketch.h"
+
+#define SKETCH_CHUNK_AVG 256
+
+/* The splitmix64 finalizer; a good cheap 64-bit mixer */
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Hash i is mul[i]*f + add[i] (multiply-add hashing, which is plenty on
+ * fingerprints that are already well mixed) */
+static Dino_CDC_Params sketch_cdc;
+static uint64_t mul[DINO_SKETCH_HASHES], add[DINO_SKETCH_HASHES];
+static pthread_once_t sketch_once = PTHREAD_ONCE_INIT;
+
+static void sketch_init(void) {
+    cdc_params_init(&sketch_cdc, SKETCH_CHUNK_AVG);
+    uint64_t x = 0x736b65746368696eULL;
+    for (int i=0; i<DINO_SKETCH_HASHES; i++) {
+        mul[i] = mix64(x += 0x9e3779b97f4a7c15ULL) | 1;
+        add[i] = mix64(x += 0x9e3779b97f4a7c15ULL);
+    }
+}
+
+static uint64_t fingerprint(const uint8_t *p, size_t len) {
+    uint64_t h = len, w;
+    size_t i = 0;
+    for (; i+8 <= len; i += 8) {
+        memcpy(&w, p+i, 8);
+        h = mix64(h ^ le64toh(w));
+    }
+    if (i < len) {
+        w = 0;
+        memcpy(&w, p+i, len-i);
+        h = mix64(h ^ le64toh(w));
+    }
+    return h;
+}
+
+void sketch_compute(const void *data, size_t size, Dino_Sketch *sk) {
+    pthread_once(&sketch_once, sketch_init);
+    uint64_t mins[DINO_SKETCH_HASHES];
+    for (int i=0; i<DINO_SKETCH_HASHES; i++)
+        mins[i] = UINT64_MAX;
+    const uint8_t *p = data;
+    for (size_t off=0, len; off < size; off += len) {
+        len = cdc_chunk(&sketch_cdc, p+off, size-off);
+        uint64_t f = fingerprint(p+off, len);
+        for (int i=0; i<DINO_SKETCH_HASHES; i++) {
+            uint64_t v = mul[i]*f + add[i];
+            if (v < mins[i])
+                mins[i] = v;
+        }
+    }
+    /* The top bits of a minimum are mostly zeros, so mix it all into the
+     * 16 bits we keep */
+    for (int i=0; i<DINO_SKETCH_HASHES; i++)
+        sk->h[i] = mix64(mins[i]);
+}
+
+unsigned sketch_similarity(const Dino_Sketch *a, const Dino_Sketch *b) {
+    unsigned n = 0;
+    for (int i=0; i<DINO_SKETCH_HASHES; i++)
+        n += (a->h[i] == b->h[i]);
+    return n;
+}
+
+/* Each band's bucket lists are chained through `next`, in index order;
+ * heads and links hold sketch numbers plus one, so 0 ends a chain. */
+struct Dino_Sketches {
+    Dino_Index *idx;
+    size_t count;
+    Dino_Sketch *sketches;
+    size_t nslots;          /* buckets per band; a power of 2 */
+    uint32_t *heads;        /* [band*nslots + slot] */
+    uint32_t *next;         /* [band*count + sketch] */
+};
+
+static inline uint64_t band_key(const Dino_Sketch *sk, int band) {
+    uint64_t key = 0;
+    memcpy(&key, sk->h + band*SKETCH_ROWS, SKETCH_ROWS*sizeof(uint16_t));
+    return key;
+}
+
+static inline size_t band_slot(Dino_Sketches *sks, uint64_t key, int band) {
+    return mix64(key + ((uint64_t)band << 48)) & (sks->nslots - 1);
+}
+
+void sketches_free(Dino_Sketches *sks) {
+    if (!sks)
+        return;
+    free(sks->sketches);
+    free(sks->heads);
+    free(sks->next);
+    free(sks);
+}
+
+Dino_Sketches *dino_load_sketches(Dino *dino, Dino_Secidx secidx) {
+    if (!_sectab_hassec(dino->sectab, secidx))
+        return NULL;
+    Dino_Sec *sec = _dino_getsec(dino, secidx);
+    Dino_Shdr *shdr = sec->shdr;
+    if ((shdr->type != DINO_SEC_SKETCH) || (shdr->flags & DINO_FLAG_COMPRESSED) ||
+        (((shdr->info >> 8) & 0xff) != DINO_SKETCH_HASHES))
+        return NULL;
+    Dino_Index *idx = get_index(dino, shdr->info & 0xff);
+    if (!idx || (index_get_cnt(idx) != sec->count) || (sec->count >= UINT32_MAX) ||
+        (sec->size != sec->count * sizeof(Dino_Sketch)))
+        return NULL;
+
+    Dino_Sketches *sks = calloc(1, sizeof(Dino_Sketches));
+    if (!sks)
+        return NULL;
+    sks->idx = idx;
+    sks->count = sec->count;
+    sks->nslots = 16;
+    while (sks->nslots < sks->count*2)
+        sks->nslots *= 2;
+    sks->sketches = malloc(MAX(sec->size, 1));
+    sks->heads = calloc(SKETCH_BANDS*sks->nslots, sizeof(uint32_t));
+    sks->next = malloc(MAX(SKETCH_BANDS*sks->count, 1)*sizeof(uint32_t));
+    if (!sks->sketches || !sks->heads || !sks->next)
+        goto fail;
+    /* TODO: byteswap if needed */
+    ssize_t r = pread_retry(dino->fd, sks->sketches, sec->size, sec->offset);
+    if (r < 0 || (Dino_Size64)r < sec->size)
+        goto fail;
+
+    /* Going backwards leaves each chain in index order */
+    for (int b=0; b<SKETCH_BANDS; b++) {
+        uint32_t *heads = sks->heads + b*sks->nslots, *next = sks->next + b*sks->count;
+        for (size_t i=sks->count; i-- > 0; ) {
+            size_t slot = band_slot(sks, band_key(&sks->sketches[i], b), b);
+            next[i] = heads[slot];
+            heads[slot] = i+1;
+        }
+    }
+    return sks;
+
+fail:
+    sketches_free(sks);
+    return NULL;
+}
+
+Dino_Index *sketches_get_index(Dino_Sketches *sks) {
+    return sks->idx;
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+size_t sketches_query(Dino_Sketches *sks, const Dino_Sketch *sk, unsigned min_score,
+                      Dino_Sketch_Match *matches, size_t k) {
+    if (!k)
+        return 0;
+    /* Gather the candidates from each band's bucket */
+    uint32_t cand[SKETCH_BANDS*SKETCH_SCAN_MAX];
+    size_t ncand = 0;
+    for (int b=0; b<SKETCH_BANDS && sks->count; b++) {
+        uint64_t key = band_key(sk, b);
+        uint32_t *next = sks->next + b*sks->count;
+        uint32_t e = sks->heads[b*sks->nslots + band_slot(sks, key, b)];
+        for (int scanned=0; e && (scanned < SKETCH_SCAN_MAX); e = next[e-1], scanned++)
+            if (band_key(&sks->sketches[e-1], b) == key)
+                cand[ncand++] = e-1;
+    }
+
+    /* Score each one once, keeping the best k (by insertion, since k is
+     * normally tiny) */
+    qsort(cand, ncand, sizeof(uint32_t), u32_cmp);
+    size_t found = 0;
+    for (size_t c=0; c<ncand; c++) {
+        if (c && (cand[c] == cand[c-1]))
+            continue;
+        unsigned score = sketch_similarity(sk, &sks->sketches[cand[c]]);
+        if ((score < min_score) || ((found == k) && (score <= matches[k-1].score)))
+            continue;
+        size_t i = (found < k) ? found++ : k-1;
+        for (; i && (matches[i-1].score < score); i--)
+            matches[i] = matches[i-1];
+        matches[i] = (Dino_Sketch_Match) { cand[c], index_get_key(sks->idx, cand[c]), score };
+    }
+    return found;
+}
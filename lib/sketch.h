@@ -0,0 +1,65 @@
+/* Similarity sketches (MinHash) of objects, for finding delta bases.
+ * See DINO_SEC_SKETCH in dino.h for the on-disk format. */
+#ifndef _SKETCH_H
+#define _SKETCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libdino.h"
+
+typedef struct Dino_Sketch {
+    uint16_t h[DINO_SKETCH_HASHES];
+} Dino_Sketch;
+
+/* sketch_compute: make a sketch of `size` bytes of `data`. */
+void sketch_compute(const void *data, size_t size, Dino_Sketch *sk);
+
+/* sketch_similarity: how many of the values in `a` and `b` match. Divide
+ * by DINO_SKETCH_HASHES to estimate the fraction of content they share. */
+unsigned sketch_similarity(const Dino_Sketch *a, const Dino_Sketch *b);
+
+/* A loaded SKETCH section, with the buckets for finding similar objects.
+ *
+ * Comparing a new sketch with every one in the section would be far too
+ * slow with millions of objects, so we use locality-sensitive hashing: the
+ * values are split into SKETCH_BANDS bands, and objects get put into a
+ * bucket for each band by that band's values. Objects that share a bucket
+ * with the new sketch in any band are the candidates, and only those get
+ * compared. Two objects sharing a fraction s of their content get to be
+ * candidates with probability 1-(1-s^2)^16: ~80% at s=0.3, ~99% at s=0.5.
+ * Using more rows per band would mean fewer candidates to check, but would
+ * miss a lot of the (still useful) bases under s=0.7 or so. */
+#define SKETCH_BANDS 16
+#define SKETCH_ROWS (DINO_SKETCH_HASHES / SKETCH_BANDS)
+
+typedef struct Dino_Sketches Dino_Sketches;
+
+/* dino_load_sketches: load the SKETCH section numbered `sec`, and build its
+ * buckets. The index it goes with has to be loaded (see load_indexes()).
+ * Returns NULL if the section isn't a SKETCH section for a loaded index
+ * that it matches, or if we couldn't read it or ran out of memory. */
+Dino_Sketches *dino_load_sketches(Dino *dino, Dino_Secidx sec);
+void sketches_free(Dino_Sketches *sketches);
+
+/* The index the sketches go with */
+Dino_Index *sketches_get_index(Dino_Sketches *sketches);
+
+typedef struct Dino_Sketch_Match {
+    Dino_Idx_Cnt pos;           /* position in the index */
+    const Dino_Idx_Key *key;    /* its key (points into the index) */
+    unsigned score;             /* sketch_similarity() with the query */
+} Dino_Sketch_Match;
+
+/* Buckets holding lots of objects with identical bands - e.g. lots of
+ * copies of some tiny file - only get this many of them looked at, so a
+ * query never costs more than SKETCH_BANDS*SKETCH_SCAN_MAX comparisons. */
+#define SKETCH_SCAN_MAX 64
+
+/* sketches_query: find the objects most like `sk`. Puts up to `k` of the
+ * candidates with a score of at least `min_score` in `matches`, best first
+ * (ties go to the earlier position). Returns how many it found. */
+size_t sketches_query(Dino_Sketches *sketches, const Dino_Sketch *sk, unsigned min_score,
+                      Dino_Sketch_Match *matches, size_t k);
+
+#endif /* _SKETCH_H */
@@ -0,0 +1,282 @@
+/* strtab.c - sorted, front-coded string tables. See strtab.h for details. */
+
+#include "libdino_internal.h"
+#include "fileio.h"
+#include "varint.h"
+#include "strtab.h"
+
+/* An in-memory string table. */
+typedef struct Dino_Strtab {
+    /* Raw section data */
+    const uint8_t *data;
+    size_t size;
+    int owned;
+
+    /* Size of the entries part of the data (i.e. offset of restarts) */
+    size_t entsize;
+
+    /* Restart point offsets (points into data; may be unaligned) */
+    const uint8_t *restarts;
+
+    Dino_Strtab_Footer footer;
+} Dino_Strtab;
+
+typedef struct Dino_Strtab_Builder {
+    Buf *buf;
+    Array *restarts;
+    unsigned interval;
+    uint32_t count;
+    uint32_t maxlen;
+    char *last;
+    size_t lastlen;
+} Dino_Strtab_Builder;
+
+/* Get the offset of restart point r */
+static inline uint32_t restart_off(const Dino_Strtab *st, uint32_t r) {
+    uint32_t off;
+    memcpy(&off, st->restarts+(r*sizeof(uint32_t)), sizeof(off));
+    return off;
+}
+
+/* Compare two strings with explicit lengths, memcmp-style. Shorter strings
+ * sort before longer strings with the same prefix. */
+static inline int strncmp_len(const void *a, size_t alen, const void *b, size_t blen) {
+    int r = memcmp(a, b, MIN(alen, blen));
+    return r ? r : (alen > blen) - (alen < blen);
+}
+
+Dino_Strtab_Builder *strtab_builder_new(unsigned interval) {
+    Dino_Strtab_Builder *b = calloc(1, sizeof(Dino_Strtab_Builder));
+    if (!b)
+        return NULL;
+    b->interval = interval ? interval : STRTAB_INTERVAL_DEFAULT;
+    b->buf = buf_init(PAGESIZE);
+    b->restarts = array_new(sizeof(uint32_t));
+    b->last = malloc(STRTAB_KEYLEN_MAX);
+    if (!(b->buf && b->restarts && b->last)) {
+        strtab_builder_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+void strtab_builder_free(Dino_Strtab_Builder *b) {
+    if (!b)
+        return;
+    if (b->buf)
+        buf_free(b->buf);
+    if (b->restarts)
+        array_free(b->restarts);
+    free(b->last);
+    free(b);
+}
+
+static void buf_put_varint(Buf *buf, uintmax_t val) {
+    buf->pos += dino_encode_varint(buf->buf+buf->pos, buf->size-buf->pos, val);
+}
+
+ssize_t strtab_builder_add(Dino_Strtab_Builder *b, const char *str, size_t len, uint64_t val) {
+    if (len > STRTAB_KEYLEN_MAX)
+        return -1;
+    if (b->count && (strncmp_len(b->last, b->lastlen, str, len) > 0))
+        return -1;
+    /* Restart offsets and the entry count are uint32_t in the section */
+    if ((b->count == UINT32_MAX) || (b->buf->pos > UINT32_MAX))
+        return -1;
+    if (!buf_reserve(b->buf, (VARINT_MAXLEN*3)+len))
+        return -1;
+
+    size_t shared = 0;
+    if (b->count % b->interval == 0) {
+        uint32_t off = b->buf->pos;
+        if (array_append(b->restarts, &off) < 0)
+            return -1;
+    } else {
+        size_t maxshared = MIN(len, b->lastlen);
+        while ((shared < maxshared) && (b->last[shared] == str[shared]))
+            shared++;
+    }
+
+    buf_put_varint(b->buf, shared);
+    buf_put_varint(b->buf, len-shared);
+    memcpy(b->buf->buf+b->buf->pos, str+shared, len-shared);
+    b->buf->pos += len-shared;
+    buf_put_varint(b->buf, val);
+
+    memcpy(b->last+shared, str+shared, len-shared);
+    b->lastlen = len;
+    b->maxlen = MAX(b->maxlen, len);
+    return b->count++;
+}
+
+Buf *strtab_builder_finish(Dino_Strtab_Builder *b) {
+    Dino_Strtab_Footer footer = {
+        .count = b->count,
+        .nrestarts = array_len(b->restarts),
+        .interval = b->interval,
+        .maxlen = b->maxlen,
+    };
+    size_t rsize = array_size(b->restarts);
+    if (!buf_reserve(b->buf, rsize+sizeof(footer)))
+        return NULL;
+    if (rsize)
+        memcpy(b->buf->buf+b->buf->pos, b->restarts->data, rsize);
+    b->buf->pos += rsize;
+    memcpy(b->buf->buf+b->buf->pos, &footer, sizeof(footer));
+    b->buf->pos += sizeof(footer);
+    Buf *out = b->buf;
+    b->buf = NULL;
+    return out;
+}
+
+Dino_Strtab *strtab_from_buf(void *data, size_t size, int owned) {
+    Dino_Strtab_Footer footer;
+    if (!data || (size < sizeof(footer)))
+        return NULL;
+    memcpy(&footer, data+size-sizeof(footer), sizeof(footer));
+    /* FIXME: byteswap if needed */
+    size_t rsize = (size_t)footer.nrestarts * sizeof(uint32_t);
+    if ((rsize > size-sizeof(footer)) ||
+        (footer.maxlen > STRTAB_KEYLEN_MAX) ||
+        (footer.count && (!footer.interval || !footer.nrestarts)))
+        return NULL;
+
+    Dino_Strtab *st = calloc(1, sizeof(Dino_Strtab));
+    if (!st)
+        return NULL;
+    st->data = data;
+    st->size = size;
+    st->owned = owned;
+    st->entsize = size - sizeof(footer) - rsize;
+    st->restarts = data + st->entsize;
+    st->footer = footer;
+    for (uint32_t r=0; r<footer.nrestarts; r++) {
+        if (restart_off(st, r) >= st->entsize) {
+            strtab_free(st);
+            return NULL;
+        }
+    }
+    return st;
+}
+
+void strtab_free(Dino_Strtab *st) {
+    if (!st)
+        return;
+    if (st->owned)
+        free((void *)st->data);
+    free(st);
+}
+
+size_t strtab_get_cnt(Dino_Strtab *st) {
+    return st->footer.count;
+}
+
+/* Decode the entry at `off` into key[shared:shared+suffixlen], and return
+ * the offset of the next entry (or 0 if the entry is corrupt). */
+static size_t strtab_decode(const Dino_Strtab *st, size_t off,
+                            uint8_t *key, size_t *keylen, uint64_t *val) {
+    size_t len, shared, suffixlen;
+    const uint8_t *p = st->data;
+    /* Varints are at most VARINT_MAXLEN bytes; make sure that won't run off
+     * the end of the entries before we decode anything. */
+    if (off + VARINT_MAXLEN*2 > st->size)
+        return 0;
+    shared = dino_decode_varint(p+off, &len);
+    off += len;
+    suffixlen = dino_decode_varint(p+off, &len);
+    off += len;
+    if ((shared > *keylen) || (shared+suffixlen > st->footer.maxlen) ||
+        (off+suffixlen > st->entsize))
+        return 0;
+    memcpy(key+shared, p+off, suffixlen);
+    off += suffixlen;
+    if (off + VARINT_MAXLEN > st->size)
+        return 0;
+    *val = dino_decode_varint(p+off, &len);
+    *keylen = shared+suffixlen;
+    return off+len;
+}
+
+/* Compare `str` with the full string stored at restart point `r`. */
+static int strtab_restart_cmp(const Dino_Strtab *st, uint32_t r, const char *str, size_t len) {
+    size_t vlen, off = restart_off(st, r);
+    dino_decode_varint(st->data+off, &vlen); /* shared; always 0 here */
+    off += vlen;
+    size_t keylen = dino_decode_varint(st->data+off, &vlen);
+    off += vlen;
+    keylen = MIN(keylen, st->entsize-off);
+    return strncmp_len(str, len, st->data+off, keylen);
+}
+
+size_t strtab_lookup(Dino_Strtab *st, const char *str, size_t len,
+                     uint64_t *vals, size_t maxvals) {
+    if (!st->footer.count || (len > st->footer.maxlen))
+        return 0;
+
+    /* Find the last restart point whose string is < str. Any matches must
+     * come after it, and (since we're sorted) there can't be any matches
+     * before it - even if there's a bunch of duplicates. */
+    uint32_t lo = 0, hi = st->footer.nrestarts, mid;
+    while (lo < hi) {
+        mid = lo + ((hi-lo)>>1);
+        if (strtab_restart_cmp(st, mid, str, len) > 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    size_t off = restart_off(st, lo ? lo-1 : 0);
+
+    /* Now decode entries until we find one that's > str */
+    uint8_t key[st->footer.maxlen+1];
+    size_t keylen = 0, found = 0;
+    uint64_t val;
+    int r;
+    while (off < st->entsize) {
+        if (!(off = strtab_decode(st, off, key, &keylen, &val)))
+            break;
+        r = strncmp_len(key, keylen, str, len);
+        if (r > 0)
+            break;
+        if (r == 0) {
+            if (found < maxvals)
+                vals[found] = val;
+            found++;
+        }
+    }
+    return found;
+}
+
+/* Load string table data from a section into memory. */
+ssize_t load_strtab_data(Dino_Sec *sec) {
+    void *data = malloc(sec->size);
+    if (!data)
+        return -ENOMEM;
+    ssize_t r = pread_retry(sec->dino->fd, data, sec->size, sec->offset);
+    if (r < sec->size) {
+        free(data);
+        return -EIO;
+    }
+    Dino_Strtab *st = strtab_from_buf(data, sec->size, 1);
+    if (!st) {
+        free(data);
+        return -EINVAL;
+    }
+    sec->data.d.off = 0;
+    sec->data.d.data = st;
+    sec->data.d.size = sec->size;
+    return r;
+}
+
+Dino_Strtab *get_strtab(Dino *dino, Dino_Secidx idx) {
+    Dino_Sec *sec = dino_getsec(dino, idx);
+    if (sec && (sec->shdr->type == DINO_SEC_STRTAB))
+        return sec->data.d.data;
+    return NULL;
+}
+
+Dino_Strtab *get_strtab_byname(Dino *dino, const char *name) {
+    int idx = get_secidx_byname(dino, name);
+    if (idx >= 0)
+        return get_strtab(dino, idx);
+    return NULL;
+}
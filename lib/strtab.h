@@ -0,0 +1,73 @@
+/* Sorted, front-coded string tables (DINO_SEC_STRTAB). */
+#ifndef _STRTAB_H
+#define _STRTAB_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libdino.h"
+#include "array.h"
+#include "buf.h"
+
+/* A string table maps (sorted) strings to integer values, so you can look
+ * up (e.g.) an RPM header by package name or NEVRA without decompressing
+ * every header in the archive.
+ *
+ * Sorted strings tend to share long prefixes with the string before them
+ * ("kernel-core", "kernel-devel", "kernel-modules", ...), so each entry only
+ * stores the length of the prefix it shares with the previous string, plus
+ * whatever's left over. Every `interval` entries there's a "restart point"
+ * where the full string is stored, and the offsets of those restart points
+ * are kept in a table at the end of the section. Lookups do a binary search
+ * over the restart points and then decode at most a handful of entries, so
+ * we never have to decode the whole table.
+ *
+ * Section layout:
+ * +---------...---------+----------------------+--------+
+ * | entries             | restarts[nrestarts]  | footer |
+ * +---------...---------+----------------------+--------+
+ *
+ * entry:    varint shared | varint suffixlen | suffix[suffixlen] | varint val
+ * restarts: uint32_t offset of each restart entry, from the section start
+ * footer:   Dino_Strtab_Footer
+ *
+ * Duplicate strings are allowed (for instance, if you're mapping package
+ * names to headers and there's more than one version of a package); their
+ * values are kept in the order they were added.
+ */
+
+typedef struct Dino_Strtab_Footer {
+    uint32_t count;      /* number of entries */
+    uint32_t nrestarts;  /* number of restart points */
+    uint32_t interval;   /* entries between restart points */
+    uint32_t maxlen;     /* length of the longest string */
+} Dino_Strtab_Footer;
+
+/* Longest string we'll store (or read) in a string table. */
+#define STRTAB_KEYLEN_MAX 0xffff
+
+/* Default number of entries between restart points. Bigger saves space,
+ * smaller makes lookups decode fewer entries. */
+#define STRTAB_INTERVAL_DEFAULT 16
+
+/* Building a string table: add strings in sorted (memcmp) order, then call
+ * strtab_builder_finish() to get the finished section data. */
+typedef struct Dino_Strtab_Builder Dino_Strtab_Builder;
+
+Dino_Strtab_Builder *strtab_builder_new(unsigned interval);
+/* Returns the index of the new entry, or -1 if str sorts before the
+ * previous string (or is too long, or we're out of memory, or the table
+ * has outgrown the uint32_t offsets and counts in the section). */
+ssize_t strtab_builder_add(Dino_Strtab_Builder *b, const char *str, size_t len, uint64_t val);
+/* Returns a Buf holding the section data; buf->pos is the data size.
+ * The builder can't be used after this, but it still needs to be freed. */
+Buf *strtab_builder_finish(Dino_Strtab_Builder *b);
+void strtab_builder_free(Dino_Strtab_Builder *b);
+
+/* Load a string table from a buffer holding the section data.
+ * The Dino_Strtab keeps a pointer to `data` rather than copying it, so
+ * the buffer must stay around until strtab_free(); if `owned` is nonzero
+ * strtab_free() will free() it for you. Returns NULL if it's malformed. */
+Dino_Strtab *strtab_from_buf(void *data, size_t size, int owned);
+
+#endif /* _STRTAB_H */
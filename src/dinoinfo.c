@@ -43,7 +43,7 @@ static const struct argp_option options[] =
     { "all-headers",     'a', 0, 0, "Show the contents of all headers and indexes" },
 
     { 0,0,0,0, "Output format options:" },
-    { "abbrev-key",       ARGP_KEY_ABBREV,   "N", 0, "Abbreviate keys to N characters (default: 8)" },
+    { "abbrev-key",       ARGP_KEY_ABBREV,   "N", 0, "Abbreviate keys to at least N characters, or more if needed to keep them unique (default: 8)" },
     { "no-abbrev-key",    ARGP_KEY_NOABBREV,  0,  0, "Show full hexadecimal keys" },
     { "verbose",         'v', 0, 0, "Produce verbose output" },
 
@@ -156,8 +156,9 @@ int main(int argc, char *argv[]) {
                N_("idx"), N_("type"), N_("name"), N_("size"), N_("flags"), N_("info"));
         for (int i=0; i<dhdr->section_count; i++) {
             shdr = get_shdr(dino, i);
-            printf("  %3u   %02x %-16s %08x ------%c%c %016x\n",
+            printf("  %3u   %02x %-16s %08x -----%c%c%c %016x\n",
                     i, shdr->type, dino_getname(dino, shdr->name), shdr->size,
+                    shdr->flags & DINO_FLAG_SEEKABLE   ? 's' : '-',
                     shdr->flags & DINO_FLAG_VARINT     ? 'v' : '-',
                     shdr->flags & DINO_FLAG_COMPRESSED ? 'c' : '-',
                     shdr->info);
@@ -199,6 +200,9 @@ int main(int argc, char *argv[]) {
             printf("  Index section %s -> %s, %u keys, keysize %u\n",
                     dino_secname(idxsec), dino_secname(othersec),
                     keycount, keysize);
+            if (args.verbose)
+                printf("  shortest unique key abbreviation: %zu\n",
+                        index_min_abbrev(idx));
 
             char *hexkey = malloc((keysize*2)+1);
             Dino_Idx_Key *k;
@@ -209,23 +213,29 @@ int main(int argc, char *argv[]) {
                 /* Show matching keys */
                 /* TODO: MATCH_EXACT */
                 Dino_Idx_Key *partkey = hex2key_a(args.keystr, args.keystrlen);
-                uint8_t partkeylen = args.keystrlen>>1;
-                showkeys = index_key_match(idx, partkey, partkeylen);
-                /* TODO: if args.keystrlen & 1, we ignored 4 bits of keystr */
+                /* each hex digit is 4 bits, so odd-length keys work too */
+                showkeys = index_key_match_bits(idx, partkey, args.keystrlen<<2);
                 free(partkey);
             } else {
                 /* Show all keys */
                 showkeys.lo=0;
                 showkeys.hi=index_get_cnt(idx)-1;
             }
+            /* Working these out means a pass over all the keys, so only
+             * do it if we're going to use them */
+            const uint8_t *abbrevs = NULL;
+            if (args.abbrevkey && (showkeys.lo <= showkeys.hi))
+                abbrevs = index_get_abbrevs(idx);
             for (int i=showkeys.lo; i<=showkeys.hi; i++) {
                 k = index_get_key(idx, i);
                 /* FIXME: different val sizes / formats */
                 v = index_get_val32(idx, i);
                 key2hex(k, keysize, hexkey);
+                unsigned keylen = keysize<<1;
+                if (abbrevs)
+                    keylen = MIN(MAX(args.abbrevkey, abbrevs[i]), keylen);
                 printf("    key %.*s size %08x offset %08x\n",
-                        args.abbrevkey ? MIN(args.abbrevkey, keysize<<1) : keysize<<1, hexkey,
-                        v->size, v->offset);
+                        keylen, hexkey, v->size, v->offset);
             }
             printf("\n");
         }
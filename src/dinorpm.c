@@ -23,7 +23,7 @@ static const char doc[] = N_("\
 Print information from DINO file in human-readable form.");
 
 /* String for program arguments, used in help text */
-static const char args_doc[] = N_("FILE");
+static const char args_doc[] = N_("FILE [KEY...]");
 
 /* The options we understand */
 static const struct argp_option options[] =
@@ -36,6 +36,8 @@ static const struct argp_option options[] =
 struct argstruct {
     int verbose;
     char *filename;
+    char **keys;        /* hex (maybe abbreviated) RPMHdr keys to fetch */
+    int nkeys;
 };
 
 /* Prototype for option handler */
@@ -63,6 +65,7 @@ static struct argp argp = { options, parse_opt, args_doc, doc };
 #include "../lib/buf.h"
 #include "../lib/compression/compression.h"
 #include "../lib/libdino_internal.h"
+#include "../lib/object.h"
 
 Header rpmhdr_import(Buf *hbuf) {
     return headerImport(hbuf->buf, hbuf->size, HEADERIMPORT_FAST);
@@ -101,6 +104,8 @@ int main(int argc, char *argv[]) {
 
     /* Set argument defaults */
     args.verbose = 0;
+    args.keys = NULL;
+    args.nkeys = 0;
 
     /* Default return value */
     rv = 0;
@@ -118,12 +123,51 @@ int main(int argc, char *argv[]) {
         error(2, errno, N_("failed reading '%s'"), args.filename);
     }
 
+    if (load_indexes(dino) < 0) {
+        error(2, errno, N_("failed to load indexes"));
+    }
+
     Dino_Index *rpmidx = get_index_byname(dino, ".rpmhdr.idx");
     if (rpmidx == NULL) {
         error(2, errno, N_("failed to load RPMHdr index"));
     }
 
-    /* TODO: look up key(s), do stuff */
+    size_t keysize = index_get_keysize(rpmidx);
+    Buf *hdrbuf = buf_init(PAGESIZE);
+    for (int i=0; i<args.nkeys; i++) {
+        const char *keystr = args.keys[i];
+        unsigned keystrlen = strlen(keystr);
+        if (keystrlen > (keysize<<1)) {
+            error(0, 0, N_("key '%s' is too long"), keystr);
+            rv = 1;
+            continue;
+        }
+        /* Abbreviated keys are fine as long as they're unique */
+        Dino_Idx_Key *partkey = hex2key_a(keystr, keystrlen);
+        Dino_Idx_Range r = index_key_match_bits(rpmidx, partkey, keystrlen<<2);
+        free(partkey);
+        if (r.lo != r.hi) {
+            error(0, 0, (r.lo > r.hi) ? N_("key '%s' not found")
+                                      : N_("key '%s' is ambiguous"), keystr);
+            rv = 1;
+            continue;
+        }
+        const Dino_Idx_Key *key = index_get_key(rpmidx, r.lo);
+        hdrbuf->pos = 0;
+        ssize_t size = dino_get_object(dino, rpmidx, key, hdrbuf);
+        char *hexkey = key2hex_a(key, keysize);
+        if (size < 0) {
+            error(0, -size, N_("couldn't read header %s"), hexkey);
+            rv = 1;
+        } else {
+            /* TODO: split out the signature and main headers and hand them
+             * to rpmlib, like rpmReadPackageFile (see above) */
+            printf("%s %zd bytes\n", hexkey, size);
+        }
+        free(hexkey);
+    }
+    buf_free(hdrbuf);
+    dino_object_cache_free();
 
     close(fd);
     /* All finished - return and exit. */
@@ -136,11 +180,16 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       case 'v':
         args->verbose = 1; break;
       case ARGP_KEY_ARG:
-        if (state->arg_num >= 1) {
-          argp_usage(state);
-        } else {
-          args->filename = arg;
+        args->filename = arg;
+        /* Everything after FILE is a key */
+        args->keys = &state->argv[state->next];
+        args->nkeys = state->argc - state->next;
+        for (int i=0; i<args->nkeys; i++) {
+          unsigned len;
+          if (!canonicalize_hexstr(args->keys[i], &len))
+            argp_error(state, N_("invalid key '%s'"), args->keys[i]);
         }
+        state->next = state->argc;
         break;
       case ARGP_KEY_END:
         if (state->arg_num < 1) {
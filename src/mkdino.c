@@ -23,6 +23,7 @@
 #include "../lib/array.h"
 #include "../lib/buf.h"
 #include "../lib/digest.h"
+#include "../lib/pipeline.h"
 #include "../lib/compression/compression.h"
 
 /* Program version */
@@ -37,6 +38,9 @@ static const char args_doc[] = N_("DINOFILE RPM...");
 
 enum long_opts_e {
     ARG_COMPRESS_LEVEL = 1,
+    ARG_COMPRESS_LONG,
+    ARG_COMPRESS_WINDOWLOG,
+    ARG_COMPRESS_DICTSIZE,
     ARG_RPM_NODIGEST,
     ARG_RPM_NOFILEDIGEST,
     ARG_INDEX_VARINT,
@@ -71,6 +75,10 @@ static const struct argp_option options[] =
     {0,'1',0,OPTION_HIDDEN}, {0,'2',0,OPTION_HIDDEN}, {0,'3',0,OPTION_HIDDEN},
     {0,'4',0,OPTION_HIDDEN}, {0,'5',0,OPTION_HIDDEN}, {0,'6',0,OPTION_HIDDEN},
     {0,'7',0,OPTION_HIDDEN}, {0,'8',0,OPTION_HIDDEN}, {0,'9',0,OPTION_HIDDEN},
+    { "threads", 'T', "N", 0, "Use N threads for compression" },
+    { "long", ARG_COMPRESS_LONG, 0, 0, "Enable long-distance matching (zstd)" },
+    { "window-log", ARG_COMPRESS_WINDOWLOG, "N", 0, "Use a 2^N byte compression window" },
+    { "dict-size", ARG_COMPRESS_DICTSIZE, "BYTES", 0, "Max size of trained header dictionary (0 to disable)" },
 
     { 0,0,0,0, "Index options:" },
     { "index-varint",   ARG_INDEX_VARINT,   0, 0, "Use variable-length integers for size/offset" },
@@ -82,8 +90,7 @@ static const struct argp_option options[] =
     /* FUTURE OPTIONS */
     /* Section ordering */
     /* Generate/store alternate digests */
-    /* Generate/store delta of existing payload vs. reconstructed payload */
-    /* CPU threads */
+    /* Store payloads as FILEDELTA objects; see filedata_add_delta() */
     /* Adding signatures? */
 
     { 0,0,0,0, "Help/usage switches:", -1 },
@@ -102,8 +109,9 @@ enum {
 struct argstruct {
     int verbose;
 
-    int compresslevel;
+    Dino_COpts copts;
     Dino_CompressID compress_id;
+    size_t dictsize;
 
     int rpmverify;           /* DIGEST, FILEDIGEST */
 
@@ -124,6 +132,7 @@ static struct argp argp = { options, parse_opt, args_doc, doc };
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     struct argstruct *args = state->input;
     unsigned long n;
+    long l;
     char *endp;
 
     switch (key) {
@@ -145,16 +154,43 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       case ARG_INDEX_COMPRESS:
         args->idx_flags |= DINO_FLAG_COMPRESSED; break;
 
+      case 'c':
+        args->compress_id = compress_id(arg);
+        if (!compress_avail(args->compress_id))
+            argp_error(state, N_("unsupported compressor '%s'"), arg);
+        break;
+
       case ARG_COMPRESS_LEVEL:
-        n = strtoul(arg, &endp, 10);
-        if (*endp || n > 256)
+        l = strtol(arg, &endp, 10);
+        if (*endp || l < -256 || l > 256)
             argp_error(state, N_("invalid --compress-level value '%s'"), arg);
-        args->compresslevel = n;
+        args->copts.level = l;
         break;
 
       case '1': case '2': case '3': case '4': case '5':
       case '6': case '7': case '8': case '9':
-        args->compresslevel = key;
+        args->copts.level = key - '0';
+        break;
+
+      case 'T':
+        n = strtoul(arg, &endp, 10);
+        if (*endp || n > 256)
+            argp_error(state, N_("invalid --threads value '%s'"), arg);
+        args->copts.threads = n;
+        break;
+      case ARG_COMPRESS_LONG:
+        args->copts.long_distance = 1; break;
+      case ARG_COMPRESS_WINDOWLOG:
+        n = strtoul(arg, &endp, 10);
+        if (*endp || n < 1 || n > 31)
+            argp_error(state, N_("invalid --window-log value '%s'"), arg);
+        args->copts.window_log = n;
+        break;
+      case ARG_COMPRESS_DICTSIZE:
+        n = strtoul(arg, &endp, 10);
+        if (*endp || n > (1<<24))
+            argp_error(state, N_("invalid --dict-size value '%s'"), arg);
+        args->dictsize = n;
         break;
 
       case ARGP_KEY_ARG:
@@ -166,6 +202,14 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       case ARGP_KEY_END:
         if (state->arg_num < 2)
             argp_usage(state);
+        /* The compressor might come after --window-log, so check it here */
+        if (args->copts.window_log) {
+            int min, max;
+            compress_window_log_range(args->compress_id, &min, &max);
+            if ((args->copts.window_log < min) || (args->copts.window_log > max))
+                argp_error(state, N_("--window-log for %s must be %d-%d"),
+                           compress_name(args->compress_id), min, max);
+        }
         break;
       default:
         return ARGP_ERR_UNKNOWN;
@@ -232,7 +276,60 @@ void headerBufFree(HeaderBuf *h) {
     free(h);
 }
 
-#define PAD_PAGE(s) (((s)+0xfff)&~0xfff)
+/* RPM headers are small and extremely similar to each other, which is just
+ * what zstd dictionaries are for. 110KB is zstd's recommended size. */
+#define DICTSIZE_DEFAULT (110<<10)
+/* Don't bother reading more than this many headers for training */
+#define DICT_MAX_SAMPLES 4096
+
+/* Read the sig+hdr of (up to DICT_MAX_SAMPLES of) the RPMs and train a
+ * dictionary from them. Returns the dictionary (and sets *dictsize), or NULL
+ * if there's not enough data or the compressor doesn't do dictionaries. */
+static uint8_t *train_header_dict(Dino_CompressID id, Array *rpms, size_t *dictsize) {
+    size_t count = array_len(rpms);
+    size_t stride = (count / DICT_MAX_SAMPLES) + 1;
+    Buf *samples = buf_init(PAGESIZE);
+    Array *sizes = array_new(sizeof(size_t));
+    uint8_t *dict = NULL;
+    if (!samples || !sizes)
+        goto out;
+    for (size_t i=0; i<count; i+=stride) {
+        FD_t fd = Fopen(*(char **)array_get(rpms, i), "r");
+        if (!fd)
+            continue;
+        Fseek(fd, 0x60, 0);
+        HeaderBuf *sigbuf = headerReadRaw(fd, 1);
+        HeaderBuf *hdrbuf = sigbuf ? headerReadRaw(fd, 0) : NULL;
+        if (hdrbuf) {
+            size_t size = sigbuf->size + hdrbuf->size;
+            if (buf_reserve(samples, size)) {
+                memcpy(samples->buf+samples->pos, sigbuf->buf, sigbuf->size);
+                memcpy(samples->buf+samples->pos+sigbuf->size, hdrbuf->buf, hdrbuf->size);
+                samples->pos += size;
+                array_append(sizes, &size);
+            }
+        }
+        headerBufFree(hdrbuf);
+        headerBufFree(sigbuf);
+        Fclose(fd);
+    }
+    /* The usual advice is ~100x as much sample data as dictionary */
+    size_t dictcap = MIN(*dictsize, samples->pos / 100);
+    if (dictcap < 1024)
+        goto out;
+    if ((dict = malloc(dictcap)))
+        *dictsize = compress_train_dict(id, dict, dictcap, samples->buf,
+                                        sizes->data, array_len(sizes));
+    if (dict && !*dictsize) {
+        free(dict);
+        dict = NULL;
+    }
+out:
+    buf_free(samples);
+    array_free(sizes);
+    return dict;
+}
+
 /* TODO: better logging than this.. */
 #define VERBOSE_PRINTF(fmt, vargs...) (args.verbose ? printf(fmt, vargs) : 0)
 
@@ -246,7 +343,8 @@ int main(int argc, char *argv[]) {
     args.idx_info = 0;
     args.idx_flags = 0;
     args.compress_id = DINO_COMPRESS_ZSTD;
-    args.compresslevel = 6;
+    args.copts = COPTS_DEFAULT;
+    args.dictsize = DICTSIZE_DEFAULT;
     args.rpmverify = RPM_DIGEST | RPM_FILEDIGEST;
     args.rpms = array_with_capacity(sizeof(char*), argc);
 
@@ -258,7 +356,9 @@ int main(int argc, char *argv[]) {
 
     VERBOSE_PRINTF("%s starting...\n", argp_program_version);
     VERBOSE_PRINTF("  files to read: %lu\n", array_len(args.rpms));
-    VERBOSE_PRINTF("  compression: %s -%u\n", compress_name(args.compress_id), args.compresslevel);
+    VERBOSE_PRINTF("  compression: %s, level %d, %d thread(s)\n", compress_name(args.compress_id),
+                   args.copts.level == COMPRESS_LEVEL_DEFAULT ? 0 : args.copts.level,
+                   MAX(args.copts.threads, 1));
 
     Dino_DigestID digestid = DINO_DIGEST_SHA256;
     Dino_Idx_Keysize keysize = digest_size(digestid);
@@ -267,11 +367,35 @@ int main(int argc, char *argv[]) {
     char *hexdigest = malloc(keysize<<1);
 
     Dino_CStream *cs = cstream_create(args.compress_id);
-    //TODO: cstream_setlevel(cs, args.compresslevel);
+    if (!(digest && hexdigest && cs))
+        error(ENOMEM, errno, N_("couldn't allocate memory"));
+    uint8_t *dict = NULL;
+    if (args.dictsize && !compress_can_train(args.compress_id)) {
+        VERBOSE_PRINTF("  header dictionary: %s can't train one\n",
+                       compress_name(args.compress_id));
+    } else if (args.dictsize) {
+        size_t dictsize = args.dictsize;
+        if ((dict = train_header_dict(args.compress_id, args.rpms, &dictsize))) {
+            args.copts.dictdata = dict;
+            args.copts.dictsize = dictsize;
+        }
+        VERBOSE_PRINTF("  header dictionary: %lu bytes\n", dict ? dictsize : 0);
+    }
+    if (!cstream_setopts(cs, &args.copts))
+        error(EXIT_FAILURE, 0, N_("unsupported %s compression options"),
+              compress_name(args.compress_id));
+    /* TODO: once we write the DINO, put copts_write(&args.copts, ...) (which
+     * includes the dictionary) in a DINO_SEC_COPTS section and point
+     * dhdr.compress_opts at it */
     outBuf *outbuf = buf_init(cs->rec_outbuf_size);
-    inBuf inbuf = {NULL, 0, 0};
+    Dino_Pipeline *hdrpipe = pipeline_new(0);
 
-    if (!(digest && hexdigest && outbuf && cs))
+    if (!outbuf || !hdrpipe)
+        error(ENOMEM, errno, N_("couldn't allocate memory"));
+    /* hasher -> compressor -> outbuf, so the headers only get read once */
+    int hashed = pipeline_add_hasher(hdrpipe, hasher);
+    int compress_stage = pipeline_add_compress(hdrpipe, cs);
+    if ((hashed < 0) || (compress_stage < 0) || (pipeline_add_buf(hdrpipe, outbuf) < 0))
         error(ENOMEM, errno, N_("couldn't allocate memory"));
 
     /* TODO: progress indicator */
@@ -294,29 +418,22 @@ int main(int argc, char *argv[]) {
 
         /* TODO: multithreaded hashing/compressing! */
 
-        /* This is how you verify the digests in the sig hdr... */
+        /* This is how you verify the digests in the sig hdr: hash the
+         * header, with its magic bytes. And here's how we compress headers:
+         * the sig and the header, as one frame. The sig skips the hasher. */
+        size_t input_size = hdrbuf->size + sigbuf->size;
+        VERBOSE_PRINTF("  sig+hdr combined: %7lu bytes\n", input_size);
         hasher_start(hasher);
         hasher_update(hasher, rpm_header_magic, 8);
-        hasher_update(hasher, hdrbuf->buf, hdrbuf->size);
+        if (!cstream_reset(cs))
+            error(EXIT_FAILURE, 0, N_("couldn't reset the compressor"));
+        cstream_compress_start(cs, input_size);
+        if ((pipeline_write_at(hdrpipe, compress_stage, sigbuf->buf, sigbuf->size) < 0) ||
+            (pipeline_write(hdrpipe, hdrbuf->buf, hdrbuf->size) < 0) ||
+            (pipeline_finish(hdrpipe) < 0))
+            error(EXIT_FAILURE, 0, N_("couldn't compress headers of %s"), rpmfn);
         hasher_finish(hasher, digest);
         key2hex(digest, keysize, hexdigest);
-
-        /* And here's how we compress headers... */
-        size_t input_size = hdrbuf->size + sigbuf->size;
-        VERBOSE_PRINTF("  sig+hdr combined: %7lu bytes\n", input_size);
-        size_t outbuf_size = PAD_PAGE(input_size);
-        if (outbuf_size > outbuf->size)
-            buf_realloc(outbuf, outbuf_size);
-        cstream_compress_start(cs, input_size);
-        inbuf.buf = sigbuf->buf;
-        inbuf.pos = 0;
-        inbuf.size = sigbuf->size;
-        cstream_compress(cs, &inbuf, outbuf);
-        inbuf.buf = hdrbuf->buf;
-        inbuf.pos = 0;
-        inbuf.size = hdrbuf->size;
-        cstream_compress(cs, &inbuf, outbuf);
-        cstream_compress_end(cs, outbuf);
         VERBOSE_PRINTF("  sig+hdr compressed: %5lu bytes\n", outbuf->pos);
 
         /* NOTE!! headerImport modifies the underlying buffer, which is why we
@@ -349,8 +466,10 @@ int main(int argc, char *argv[]) {
         Fclose(fd);
     }
 
+    pipeline_free(hdrpipe);
     hasher_free(hasher);
     cstream_free(cs);
+    free(dict);
     buf_free(outbuf);
     free(digest);
     free(hexdigest);
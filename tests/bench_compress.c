@@ -0,0 +1,530 @@
+/* bench_compress - compression ratio, speed and memory use for every
+ * compression algorithm libdino was built with.
+ *
+ * Give it files or directories (for example, a directory of extracted RPM
+ * headers) and it treats them as one corpus; with no arguments it makes up
+ * three synthetic ones - text, structured binary, and random data - so
+ * `meson test --benchmark` has something to chew on.
+ *
+ * Each object is compressed into independent frames (one per file, or per
+ * block of the given size), the same way FILEDATA and seekable sections
+ * store them. Each configuration runs in a child process of its own, so the
+ * peak memory reported is just what the codec (and its frames) needed.
+ */
+
+#define _GNU_SOURCE /* for nftw() */
+#include <argp.h>
+#include <errno.h>
+#include <error.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/array.h"
+#include "../lib/common.h"
+#include "../lib/memory.h"
+#include "../lib/compression/compression.h"
+
+const char *argp_program_version = "bench_compress 0.1";
+
+static const char doc[] = "\
+Benchmark libdino's compression algorithms on a corpus of files.\v\
+With no PATH, synthetic text, binary and random corpora are used.";
+
+static const char args_doc[] = "[PATH...]";
+
+static const struct argp_option options[] = {
+    { "algo",    'a', "ALGO[,ALGO...]",   0, "Only test these algorithms" },
+    { "levels",  'l', "LEVEL[,LEVEL...]", 0, "Compression levels to try (default: a few per algorithm)" },
+    { "blocks",  'b', "SIZE[,SIZE...]",   0, "Frame sizes to try; 0 means one frame per file (default: 0,65536)" },
+    { "time",    't', "SECONDS",          0, "Repeat each measurement for at least this long (default: 0.2)" },
+    { "json",    'J', 0,                  0, "Print results as JSON instead of a table" },
+    { 0 }
+};
+
+#define MAX_LIST 16
+
+struct argstruct {
+    int algos[DINO_COMPRESSNUM];    /* nonzero for each algo to test */
+    int nlevels;
+    int levels[MAX_LIST];
+    int nblocks;
+    size_t blocks[MAX_LIST];
+    double mintime;
+    int json;
+    Array *paths;
+};
+
+/* Parse a comma-separated list of numbers. Returns how many there were. */
+static int parse_list(const char *arg, long *vals, struct argp_state *state) {
+    int n = 0;
+    const char *p = arg;
+    char *endp;
+    while (*p) {
+        if (n == MAX_LIST)
+            argp_error(state, "too many items in '%s'", arg);
+        errno = 0;
+        vals[n++] = strtol(p, &endp, 10);
+        if (errno || endp == p || (*endp && *endp != ','))
+            argp_error(state, "invalid list '%s'", arg);
+        p = *endp ? endp+1 : endp;
+    }
+    return n;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct argstruct *args = state->input;
+    long vals[MAX_LIST];
+    char *name, *save;
+    switch (key) {
+      case 'a':
+        memset(args->algos, 0, sizeof(args->algos));
+        for (name = strtok_r(arg, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            Dino_CompressID id = compress_id(name);
+            if (!compress_avail(id))
+                argp_error(state, "compression algorithm '%s' not available", name);
+            args->algos[id] = 1;
+        }
+        break;
+      case 'l':
+        args->nlevels = parse_list(arg, vals, state);
+        for (int i=0; i<args->nlevels; i++)
+            args->levels[i] = vals[i];
+        break;
+      case 'b':
+        args->nblocks = parse_list(arg, vals, state);
+        for (int i=0; i<args->nblocks; i++) {
+            if (vals[i] < 0)
+                argp_error(state, "invalid block size %ld", vals[i]);
+            args->blocks[i] = vals[i];
+        }
+        break;
+      case 't':
+        args->mintime = strtod(arg, NULL);
+        break;
+      case 'J':
+        args->json = 1;
+        break;
+      case ARGP_KEY_ARG:
+        array_append(args->paths, &arg);
+        break;
+      default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+/* The levels we try if you don't say otherwise: the fastest setting, the
+ * library's default, and the high end, roughly. */
+static const int default_levels[DINO_COMPRESSNUM][MAX_LIST] = {
+    [DINO_COMPRESS_NONE] = { COMPRESS_LEVEL_DEFAULT },
+    [DINO_COMPRESS_ZLIB] = { 1, 6, 9 },
+    [DINO_COMPRESS_XZ]   = { 0, 6, 9 },
+    [DINO_COMPRESS_LZ4]  = { 0, 9, 12 },
+    [DINO_COMPRESS_ZSTD] = { 1, 3, 9, 19 },
+};
+/* (every list above has a nonzero level after the first, so a 0 after that
+ * marks the end) */
+static int default_nlevels(Dino_CompressID id) {
+    int n = 1;
+    while (n < MAX_LIST && default_levels[id][n])
+        n++;
+    return n;
+}
+
+/* A corpus is just an Array of these */
+typedef struct Sample {
+    uint8_t *data;
+    size_t size;
+} Sample;
+
+typedef struct Corpus {
+    const char *name;
+    Array *samples;
+    size_t total;
+} Corpus;
+
+static void corpus_add(Corpus *c, uint8_t *data, size_t size) {
+    Sample s = { data, size };
+    if (array_append(c->samples, &s) < 0)
+        error(EXIT_FAILURE, ENOMEM, "couldn't allocate memory");
+    c->total += size;
+}
+
+static void corpus_free(Corpus *c) {
+    for (size_t i=0; i<array_len(c->samples); i++)
+        free(((Sample *)array_get(c->samples, i))->data);
+    array_free(c->samples);
+}
+
+static Corpus *file_corpus;
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type != FTW_F || !S_ISREG(st->st_mode) || !st->st_size)
+        return 0;
+    FILE *fp = fopen(path, "rb");
+    uint8_t *data = malloc(st->st_size);
+    if (!fp || !data || fread(data, 1, st->st_size, fp) != (size_t)st->st_size) {
+        error(0, errno, "skipping %s", path);
+        free(data);
+    } else {
+        corpus_add(file_corpus, data, st->st_size);
+    }
+    if (fp)
+        fclose(fp);
+    return 0;
+}
+
+/* xorshift64*: the synthetic corpora should be the same every time */
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+static uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* ~2MB each, with plenty of files bigger than the default 64KiB block */
+#define SYNTH_FILES 32
+#define SYNTH_MAXSIZE (128<<10)
+
+/* Words from a small vocabulary, with punctuation: compresses like text */
+static void synth_text(uint8_t *p, size_t size) {
+    static const char *words[] = {
+        "package", "version", "release", "the", "of", "and", "file", "usr",
+        "lib", "share", "doc", "config", "install", "a", "to", "is", "for",
+        "binary", "library", "license", "GPLv2+", "x86_64", "noarch", "x",
+    };
+    size_t off = 0;
+    while (off < size) {
+        const char *w = words[rng() % ARRAY_SIZE(words)];
+        size_t len = MIN(strlen(w), size-off);
+        memcpy(p+off, w, len);
+        off += len;
+        if (off < size)
+            p[off++] = (rng() % 12) ? ' ' : '\n';
+    }
+}
+
+/* Tables of little-endian records with small, slowly-changing fields, like
+ * symbol tables or RPM header index entries */
+static void synth_binary(uint8_t *p, size_t size) {
+    uint32_t rec[4] = { 0, 0, 0, 0 };
+    for (size_t off=0; off < size; off += sizeof(rec)) {
+        rec[0] = (rec[0] + 1 + (rng() & 3));
+        rec[1] = 1000 + (rng() % 16);
+        rec[2] += rng() % 256;
+        rec[3] = (rng() % 8) ? 0 : (uint32_t)rng();
+        memcpy(p+off, rec, MIN(sizeof(rec), size-off));
+    }
+}
+
+static void synth_random(uint8_t *p, size_t size) {
+    for (size_t off=0; off < size; off += sizeof(uint64_t)) {
+        uint64_t r = rng();
+        memcpy(p+off, &r, MIN(sizeof(r), size-off));
+    }
+}
+
+static void synth_corpus(Corpus *c, const char *name, void (*fill)(uint8_t *, size_t)) {
+    c->name = name;
+    c->samples = array_new(sizeof(Sample));
+    c->total = 0;
+    for (int i=0; i<SYNTH_FILES; i++) {
+        size_t size = 512 + rng() % SYNTH_MAXSIZE;
+        uint8_t *data = malloc(size);
+        if (!data)
+            error(EXIT_FAILURE, ENOMEM, "couldn't allocate memory");
+        fill(data, size);
+        corpus_add(c, data, size);
+    }
+}
+
+typedef struct Result {
+    int ok;                 /* 0 if the algo didn't like these options */
+    size_t in_size, out_size, frames;
+    double c_mbps, d_mbps;
+    long peak_kb;
+} Result;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Worst case for one frame, give or take; cstream_compress1 tells us if
+ * it's not enough and we try again with more. */
+#define FRAME_BOUND(size) ((size) + ((size)>>6) + PAGESIZE)
+
+/* The frames: for each sample, its data in `block`-sized pieces */
+typedef struct Frame {
+    const uint8_t *data;
+    size_t size;
+    size_t coff, csize;     /* where it went in the compressed buffer */
+} Frame;
+
+static size_t make_frames(Corpus *c, size_t block, Frame **framesp) {
+    size_t count = 0;
+    for (size_t i=0; i<array_len(c->samples); i++) {
+        Sample *s = array_get(c->samples, i);
+        count += block ? (s->size + block-1) / block : 1;
+    }
+    Frame *frames = calloc(count, sizeof(Frame));
+    if (!frames)
+        error(EXIT_FAILURE, ENOMEM, "couldn't allocate memory");
+    size_t n = 0;
+    for (size_t i=0; i<array_len(c->samples); i++) {
+        Sample *s = array_get(c->samples, i);
+        size_t step = block ? block : s->size;
+        for (size_t off=0; off < s->size; off += step, n++) {
+            frames[n].data = s->data + off;
+            frames[n].size = MIN(step, s->size - off);
+        }
+    }
+    *framesp = frames;
+    return n;
+}
+
+/* Compress every frame into `comp`. Returns 0 or a COMPRESS_ERR_* code. */
+static size_t compress_all(Dino_CStream *cs, Frame *frames, size_t count, Buf *comp) {
+    comp->pos = 0;
+    for (size_t i=0; i<count; i++) {
+        size_t start = comp->pos, bound = FRAME_BOUND(frames[i].size), ret;
+        do {
+            comp->pos = start;
+            if (!buf_reserve(comp, bound))
+                return COMPRESS_ERR_MEM;
+            inBuf in = { (void *)frames[i].data, frames[i].size, 0 };
+            if (!cstream_reset(cs))
+                return COMPRESS_ERR_UNK;
+            ret = cstream_compress1(cs, &in, comp);
+            bound *= 2;
+        } while (ret == COMPRESS_ERR_BUF);
+        if (ret)
+            return ret;
+        frames[i].coff = start;
+        frames[i].csize = comp->pos - start;
+    }
+    return 0;
+}
+
+/* Decompress every frame, checking the results if `check` is set.
+ * Returns 0, or -1 if anything goes wrong. */
+static int decompress_all(Dino_DStream *ds, Frame *frames, size_t count,
+                          Buf *comp, Buf *out, int check) {
+    for (size_t i=0; i<count; i++) {
+        inBuf in = { comp->buf + frames[i].coff, frames[i].csize, 0 };
+        out->pos = 0;
+        if (!dstream_reset(ds) || dstream_decompress1(ds, &in, out))
+            return -1;
+        if (check && ((out->pos != frames[i].size) ||
+                      memcmp(out->buf, frames[i].data, frames[i].size)))
+            return -1;
+    }
+    return 0;
+}
+
+static long maxrss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* Runs in the child: measure one configuration. */
+static Result run_one(Corpus *c, Dino_CompressID id, int level, size_t block, double mintime) {
+    Result r = { 0 };
+    Frame *frames;
+    size_t count = make_frames(c, block, &frames), maxframe = 0, bounds = 0;
+    for (size_t i=0; i<count; i++) {
+        maxframe = MAX(maxframe, frames[i].size);
+        bounds += FRAME_BOUND(frames[i].size);
+    }
+    /* Get the buffers and touch every page now, so they're already in the
+     * peak RSS before we start counting */
+    Buf *comp = buf_init(bounds), *out = buf_init(FRAME_BOUND(maxframe));
+    if (!comp || !out)
+        error(EXIT_FAILURE, ENOMEM, "couldn't allocate memory");
+    memset(comp->buf, 0, comp->size);
+    memset(out->buf, 0, out->size);
+    long base_kb = maxrss_kb();
+
+    Dino_COpts copts = COPTS_DEFAULT;
+    copts.level = level;
+    Dino_CStream *cs = cstream_create(id);
+    if (!cs || !cstream_setopts(cs, &copts))
+        return r;
+    size_t ret;
+    int passes = 0;
+    double start = now(), elapsed;
+    do {
+        if ((ret = compress_all(cs, frames, count, comp)))
+            error(EXIT_FAILURE, 0, "%s level %d: compression failed (%zx)",
+                  compress_name(id), level, ret);
+        passes++;
+    } while ((elapsed = now() - start) < mintime);
+    r.c_mbps = (double)c->total * passes / elapsed / 1e6;
+    cstream_free(cs);
+
+    Dino_DStream *ds = dstream_create(id);
+    if (!ds)
+        error(EXIT_FAILURE, 0, "%s: can't create decompressor", compress_name(id));
+    passes = 0;
+    start = now();
+    do {
+        if (decompress_all(ds, frames, count, comp, out, (passes == 0)) < 0)
+            error(EXIT_FAILURE, 0, "%s level %d: decompression failed or didn't match",
+                  compress_name(id), level);
+        passes++;
+    } while ((elapsed = now() - start) < mintime);
+    r.d_mbps = (double)c->total * passes / elapsed / 1e6;
+    dstream_free(ds);
+
+    r.ok = 1;
+    r.in_size = c->total;
+    r.out_size = comp->pos;
+    r.frames = count;
+    r.peak_kb = maxrss_kb() - base_kb;
+    buf_free(comp);
+    buf_free(out);
+    free(frames);
+    return r;
+}
+
+/* Fork a child to run one configuration and send back the results */
+static Result run_child(Corpus *c, Dino_CompressID id, int level, size_t block, double mintime) {
+    Result r = { 0 };
+    int fds[2];
+    if (pipe(fds) < 0)
+        error(EXIT_FAILURE, errno, "pipe");
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+        error(EXIT_FAILURE, errno, "fork");
+    if (pid == 0) {
+        close(fds[0]);
+        r = run_one(c, id, level, block, mintime);
+        ssize_t w = write(fds[1], &r, sizeof(r));
+        _exit(w == sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], &r, sizeof(r));
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+        error(EXIT_FAILURE, 0, "%s level %d block %zu: benchmark failed",
+              compress_name(id), level, block);
+    if (n != sizeof(r))
+        r.ok = 0;
+    return r;
+}
+
+static int first_result = 1;
+
+static void print_result(struct argstruct *args, Corpus *c, Dino_CompressID id,
+                         int level, size_t block, Result *r) {
+    double ratio = r->out_size ? (double)r->in_size / r->out_size : 0;
+    if (args->json) {
+        printf("%s\n  {\"corpus\": \"%s\", \"algo\": \"%s\", ", first_result ? "[" : ",",
+               c->name, compress_name(id));
+        if (level == COMPRESS_LEVEL_DEFAULT)
+            printf("\"level\": null, ");
+        else
+            printf("\"level\": %d, ", level);
+        printf("\"block\": %zu, \"frames\": %zu, \"in_bytes\": %zu, \"out_bytes\": %zu, "
+               "\"ratio\": %.4f, \"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, "
+               "\"peak_kb\": %ld}",
+               block, r->frames, r->in_size, r->out_size,
+               ratio, r->c_mbps, r->d_mbps, r->peak_kb);
+    } else {
+        if (first_result)
+            printf("%-8s %-5s %5s %7s %12s %12s %7s %10s %10s %9s\n",
+                   "corpus", "algo", "level", "block", "in", "out", "ratio",
+                   "comp MB/s", "dec MB/s", "peak KiB");
+        char lvl[16], blk[24];
+        if (level == COMPRESS_LEVEL_DEFAULT)
+            snprintf(lvl, sizeof(lvl), "def");
+        else
+            snprintf(lvl, sizeof(lvl), "%d", level);
+        if (block)
+            snprintf(blk, sizeof(blk), "%zu", block);
+        else
+            snprintf(blk, sizeof(blk), "file");
+        printf("%-8s %-5s %5s %7s %12zu %12zu %7.3f %10.1f %10.1f %9ld\n",
+               c->name, compress_name(id), lvl, blk, r->in_size, r->out_size,
+               ratio, r->c_mbps, r->d_mbps, r->peak_kb);
+    }
+    fflush(stdout);
+    first_result = 0;
+}
+
+static void bench_corpus(struct argstruct *args, Corpus *c) {
+    for (Dino_CompressID id=0; id<DINO_COMPRESSNUM; id++) {
+        if (!args->algos[id])
+            continue;
+        int nlevels = args->nlevels ? args->nlevels : default_nlevels(id);
+        const int *levels = args->nlevels ? args->levels : default_levels[id];
+        /* "none" has no levels to speak of */
+        if (id == DINO_COMPRESS_NONE)
+            nlevels = 1, levels = default_levels[id];
+        for (int l=0; l<nlevels; l++) {
+            for (int b=0; b<args->nblocks; b++) {
+                Result r = run_child(c, id, levels[l], args->blocks[b], args->mintime);
+                if (r.ok)
+                    print_result(args, c, id, levels[l], args->blocks[b], &r);
+                else
+                    error(0, 0, "%s doesn't support level %d, skipping",
+                          compress_name(id), levels[l]);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct argstruct args = {
+        .nblocks = 2,
+        .blocks = { 0, 65536 },
+        .mintime = 0.2,
+        .paths = array_new(sizeof(char *)),
+    };
+    for (const char **a = libdino_compression_available; *a; a++)
+        args.algos[compress_id(*a)] = 1;
+    argp_parse(&argp, argc, argv, 0, NULL, &args);
+
+    if (array_len(args.paths)) {
+        Corpus files = { "files", array_new(sizeof(Sample)), 0 };
+        file_corpus = &files;
+        for (size_t i=0; i<array_len(args.paths); i++) {
+            const char *path = *(char **)array_get(args.paths, i);
+            if (nftw(path, add_file, 32, FTW_PHYS) < 0)
+                error(EXIT_FAILURE, errno, "can't read %s", path);
+        }
+        if (!files.total)
+            error(EXIT_FAILURE, 0, "no data to compress");
+        bench_corpus(&args, &files);
+        corpus_free(&files);
+    } else {
+        static const struct { const char *name; void (*fill)(uint8_t *, size_t); } synth[] = {
+            { "text", synth_text },
+            { "binary", synth_binary },
+            { "random", synth_random },
+        };
+        for (size_t i=0; i<ARRAY_SIZE(synth); i++) {
+            Corpus c;
+            synth_corpus(&c, synth[i].name, synth[i].fill);
+            bench_corpus(&args, &c);
+            corpus_free(&c);
+        }
+    }
+    if (args.json)
+        printf("%s\n", first_result ? "[]" : "\n]");
+    array_free(args.paths);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* dinotest.h - helpers shared by the test suites that need a DINO file or a
+ * pile of objects to put in one. Everything's static inline, since each
+ * suite is its own executable. */
+#ifndef _DINOTEST_H
+#define _DINOTEST_H 1
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/buf.h"
+
+#define KEYSIZE 32
+#define TESTOBJ_CHUNKSIZE 64
+
+typedef struct TestObj {
+    uint8_t key[KEYSIZE];
+    uint8_t *data;
+    size_t size;
+} TestObj;
+
+/* `count` random-ish objects that actually compress: a random chunk,
+ * repeated. There's always an empty one (objs[0]) and a big one (objs[1]). */
+static inline TestObj *make_objs(size_t count) {
+    TestObj *objs = munit_newa(TestObj, count);
+    uint8_t chunk[TESTOBJ_CHUNKSIZE];
+    for (size_t i=0; i<count; i++) {
+        munit_rand_memory(KEYSIZE, objs[i].key);
+        munit_rand_memory(TESTOBJ_CHUNKSIZE, chunk);
+        objs[i].size = (i == 0) ? 0 : (i == 1) ? 1<<20 : munit_rand_int_range(1, 20000);
+        objs[i].data = munit_malloc(objs[i].size+1);
+        for (size_t off=0; off<objs[i].size; off+=TESTOBJ_CHUNKSIZE)
+            memcpy(objs[i].data+off, chunk, MIN(TESTOBJ_CHUNKSIZE, objs[i].size-off));
+    }
+    return objs;
+}
+
+static inline void free_objs(TestObj *objs, size_t count) {
+    for (size_t i=0; i<count; i++)
+        free(objs[i].data);
+    free(objs);
+}
+
+/* Write a DINO holding `count` sections, compressed with `id`: their headers
+ * are in `shdrs`, their data in `bufs` and their names in `namtab`. If one of
+ * them is a DINO_SEC_COPTS section, the Dhdr points at it.
+ * Returns its fd. */
+static inline int write_test_dino(Dino_CompressID id, const Dino_Shdr *shdrs,
+                                  Buf **bufs, int count,
+                                  const char *namtab, size_t namtab_size) {
+    Dino_Dhdr dhdr = {
+        .version = 0,
+        .encoding = DINO_ENCODING_LSB,
+        .type = DINO_TYPE_ARCHIVE,
+        .compress_id = id,
+        .section_count = count,
+        .sectab_size = count*sizeof(Dino_Shdr),
+        .namtab_size = namtab_size,
+    };
+    memcpy(dhdr.magic, DINO_MAGIC_V0, sizeof(dhdr.magic));
+    for (int i=0; i<count; i++)
+        if (shdrs[i].type == DINO_SEC_COPTS)
+            dhdr.compress_opts = i;
+    FILE *fp = tmpfile();
+    munit_assert_not_null(fp);
+    fwrite(&dhdr, sizeof(dhdr), 1, fp);
+    fwrite(shdrs, sizeof(Dino_Shdr), count, fp);
+    fwrite(namtab, namtab_size, 1, fp);
+    for (int i=0; i<count; i++)
+        fwrite(bufs[i]->buf, bufs[i]->pos, 1, fp);
+    fflush(fp);
+    int fd = dup(fileno(fp));
+    fclose(fp);
+    return fd;
+}
+
+#endif /* _DINOTEST_H */
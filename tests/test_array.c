@@ -1,5 +1,8 @@
+#include <endian.h>
+
 #include "munit.h"
 #include "../lib/array.h"
+#include "../lib/segarray.h"
 
 MunitResult test_array_new(const MunitParameter params[], void* user_data) {
     size_t isize = 32; /* TODO: params */
@@ -103,6 +106,143 @@ MunitResult test_array_insort(const MunitParameter params[], void* fixture) {
     return MUNIT_OK;
 }
 
+static ArrayStore get_store(const char *name) {
+    if (strcmp(name, "mmap") == 0)
+        return ARRAY_STORE_MMAP;
+    if (strcmp(name, "hugetlb") == 0)
+        return ARRAY_STORE_HUGETLB;
+    return ARRAY_STORE_MALLOC;
+}
+
+MunitResult test_array_store(const MunitParameter params[], void* user_data) {
+    ArrayStore store = get_store(munit_parameters_get(params, "store"));
+    size_t num = 1<<18; /* 8MB of 32-byte items: several huge pages' worth */
+    uint8_t item[32];
+    Array *a = array_new(sizeof(item));
+    munit_assert_int(array_set_store(a, store), ==, 0);
+    /* HUGETLB falls back to MMAP if there's no huge pages reserved */
+    if (store == ARRAY_STORE_HUGETLB)
+        munit_assert(a->store == ARRAY_STORE_HUGETLB || a->store == ARRAY_STORE_MMAP);
+    else
+        munit_assert_int(a->store, ==, store);
+
+    /* Grow it one item at a time, and make sure nothing gets lost */
+    for (size_t i=0; i<num; i++) {
+        memset(item, i & 0xff, sizeof(item));
+        memcpy(item, &i, sizeof(i));
+        munit_assert_int(array_append(a, item), ==, i);
+    }
+    munit_assert_size(a->allocated, >=, num);
+    for (size_t i=0; i<num; i+=997) {
+        memset(item, i & 0xff, sizeof(item));
+        memcpy(item, &i, sizeof(i));
+        munit_assert_memory_equal(sizeof(item), array_get(a, i), item);
+    }
+
+    /* Move it to malloc'd memory and back again */
+    Array *copy = array_with_capacity(sizeof(item), num);
+    memcpy(copy->data, a->data, array_size(a));
+    copy->count = num;
+    munit_assert_int(array_set_store(a, ARRAY_STORE_MALLOC), ==, 0);
+    munit_assert_memory_equal(array_size(copy), a->data, copy->data);
+    munit_assert_int(array_set_store(a, store), ==, 0);
+    munit_assert_memory_equal(array_size(copy), a->data, copy->data);
+
+    /* Shrinking keeps the data too */
+    munit_assert_int(array_shrink(a), >=, num);
+    munit_assert_memory_equal(array_size(copy), a->data, copy->data);
+
+    /* You can't borrow memory you already own */
+    munit_assert_int(array_set_store(a, ARRAY_STORE_BORROWED), ==, -1);
+
+    array_free(copy);
+    array_free(a);
+    return MUNIT_OK;
+}
+
+MunitResult test_array_from_buf(const MunitParameter params[], void* user_data) {
+    /* not malloc'd, so freeing (or realloc'ing) it would blow up */
+    uint32_t buf[UINTDATA_COUNT];
+    memcpy(buf, uintdata, sizeof(buf));
+    Array *a = array_from_buf(buf, UINTDATA_ISIZE, UINTDATA_COUNT);
+    munit_assert_not_null(a);
+    munit_assert_int(a->store, ==, ARRAY_STORE_BORROWED);
+    munit_assert_ptr_equal(a->data, buf);
+
+    /* Growing it makes a copy, and leaves the original alone */
+    uint32_t val = 42;
+    munit_assert_int(array_append(a, &val), ==, UINTDATA_COUNT);
+    munit_assert_ptr_not_equal(a->data, buf);
+    munit_assert_int(a->store, ==, ARRAY_STORE_MALLOC);
+    munit_assert_memory_equal(sizeof(buf), a->data, uintdata);
+    munit_assert_memory_equal(sizeof(buf), buf, uintdata);
+    array_free(a);
+
+    /* Freeing it without growing it doesn't free buf */
+    a = array_from_buf(buf, UINTDATA_ISIZE, UINTDATA_COUNT);
+    array_free(a);
+    return MUNIT_OK;
+}
+
+/* Keys with values: values should stay with their keys, and replacing
+ * should update the value without adding anything. */
+MunitResult test_segarray_vals(const MunitParameter params[], void* user_data) {
+    const size_t num = 5000;
+    SegArray *s = segarray_new(sizeof(uint32_t), sizeof(uint64_t), 16);
+    munit_assert_not_null(s);
+    /* insert keys in a scrambled (but repeatable) order */
+    for (uint32_t i=0; i<num; i++) {
+        uint32_t key = htobe32((i * 7919) % num);
+        uint64_t val = be32toh(key);
+        munit_assert_int(segarray_insort(s, &key, &val, 1), ==, 1);
+    }
+    for (uint32_t i=0; i<num; i+=3) {
+        uint32_t key = htobe32(i);
+        uint64_t val = i * 10;
+        munit_assert_int(segarray_insort(s, &key, &val, 1), ==, 0);
+    }
+    munit_assert_size(segarray_len(s), ==, num);
+    uint32_t key = htobe32(num);
+    munit_assert_null(segarray_find(s, &key));
+    key = htobe32(6);
+    uint64_t val;
+    void *found = segarray_find(s, &key);
+    munit_assert_not_null(found);
+    memcpy(&val, found, sizeof(val));
+    munit_assert_uint64(val, ==, 60);
+
+    Array *keys = array_new(sizeof(uint32_t));
+    Array *vals = array_new(sizeof(uint64_t));
+    munit_assert_int64(segarray_flatten(s, keys, vals), ==, num);
+    munit_assert_size(keys->count, ==, num);
+    munit_assert_size(vals->count, ==, num);
+    for (uint32_t i=0; i<num; i++) {
+        munit_assert_uint32(be32toh(*(uint32_t *)array_get(keys, i)), ==, i);
+        munit_assert_uint64(*(uint64_t *)array_get(vals, i), ==, (i % 3) ? i : i*10);
+    }
+
+    /* Just the keys, please */
+    keys->count = 0;
+    munit_assert_int64(segarray_flatten(s, keys, NULL), ==, num);
+    munit_assert_size(keys->count, ==, num);
+    for (uint32_t i=0; i<num; i++)
+        munit_assert_uint32(be32toh(*(uint32_t *)array_get(keys, i)), ==, i);
+
+    /* Arrays with the wrong item sizes get turned away */
+    munit_assert_int64(segarray_flatten(s, vals, NULL), ==, -1);
+    munit_assert_int64(segarray_flatten(s, keys, keys), ==, -1);
+    munit_assert_size(keys->count, ==, num);
+    array_free(keys);
+    array_free(vals);
+    segarray_free(s);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum store_params[] = {
+    { (char*) "store", (char*[]) { "malloc", "mmap", "hugetlb", NULL } },
+    { NULL, NULL },
+};
+
 MunitTest arraytests[] = {
     { "/new", test_array_new, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/init", test_array_init, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
@@ -110,6 +250,9 @@ MunitTest arraytests[] = {
     { "/insert", test_array_insert, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/insort", test_array_insort, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/with_capacity", test_array_with_capacity, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/store", test_array_store, NULL, NULL, MUNIT_TEST_OPTION_NONE, store_params },
+    { "/from_buf", test_array_from_buf, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/segarray-vals", test_segarray_vals, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
@@ -228,6 +371,59 @@ MunitResult test_insort(const MunitParameter params[], void* fixture) {
     return MUNIT_OK;
 }
 
+/* Insert everything from the fixture, plus some random items, into both a
+ * SegArray and a regular Array; flattening the SegArray should get us the
+ * same thing as array_insort() did. */
+MunitResult test_segarray_insort(const MunitParameter params[], void* fixture) {
+    Array *a = fixture;
+    int inserts = INTPARAM("inserts");
+    SegArray *s = segarray_new(a->isize, 0, INTPARAM("blockitems"));
+    munit_assert_not_null(s);
+    for (size_t i=0; i<a->count; i++)
+        munit_assert_int(segarray_insort(s, array_get(a, i), NULL, 0), ==, 1);
+    void *item = munit_malloc(a->isize);
+    for (int i=0; i<inserts; i++) {
+        munit_rand_memory(a->isize, item);
+        munit_assert_int(segarray_insort(s, item, NULL, 0), ==, 1);
+        munit_assert_not_null(segarray_find(s, item));
+        array_insort(a, item);
+    }
+    munit_assert_size(segarray_len(s), ==, a->count);
+    Array *flat = array_new(a->isize);
+    munit_assert_int64(segarray_flatten(s, flat, NULL), ==, a->count);
+    munit_assert_size(flat->count, ==, a->count);
+    munit_assert_memory_equal(array_size(a), flat->data, a->data);
+    array_free(flat);
+    segarray_free(s);
+    free(item);
+    return MUNIT_OK;
+}
+
+/* Build a sorted array out of the (unsorted) fixture one item at a time,
+ * the old way and the segmented way. */
+MunitResult test_build_insort(const MunitParameter params[], void* fixture) {
+    Array *a = fixture;
+    Array *sorted = array_new(a->isize);
+    for (size_t i=0; i<a->count; i++)
+        array_insort(sorted, array_get(a, i));
+    munit_assert(array_is_sorted(sorted));
+    array_free(sorted);
+    return MUNIT_OK;
+}
+
+MunitResult test_build_segarray(const MunitParameter params[], void* fixture) {
+    Array *a = fixture;
+    Array *sorted = array_new(a->isize);
+    SegArray *s = segarray_new(a->isize, 0, 0);
+    for (size_t i=0; i<a->count; i++)
+        segarray_insort(s, array_get(a, i), NULL, 0);
+    munit_assert_int64(segarray_flatten(s, sorted, NULL), ==, a->count);
+    munit_assert(array_is_sorted(sorted));
+    segarray_free(s);
+    array_free(sorted);
+    return MUNIT_OK;
+}
+
 static MunitParameterEnum randarray_params[] = {
     { (char*) "inserts", (char*[]) { "1", NULL } } ,
     { (char*) "count", (char*[]) { "1", "10", "100", "1000", "10000", NULL } },
@@ -242,11 +438,26 @@ static MunitParameterEnum bench_params[] = {
     { NULL, NULL },
 };
 
+static MunitParameterEnum segarray_params[] = {
+    { (char*) "inserts", (char*[]) { "1", "1000", NULL } } ,
+    { (char*) "count", (char*[]) { "0", "1", "100", "10000", NULL } },
+    { (char*) "isize", (char*[]) { "1", "4", "20", "32", NULL } },
+    { (char*) "blockitems", (char*[]) { "0", "2", "64", NULL } },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum build_params[] = {
+    { (char*) "count", (char*[]) { "1000", "10000", "100000", NULL } },
+    { (char*) "isize", (char*[]) { "20", "32", NULL } },
+    { NULL, NULL },
+};
+
 MunitTest arrayrandtests[] = {
     { "/insert", test_randidx_insert, randarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, randarray_params },
     { "/sort", test_randarray_sort, randarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, randarray_params },
     { "/insort", test_insort, sortarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, randarray_params },
     { "/append-and-sort", test_append_and_sort, sortarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, randarray_params },
+    { "/segarray-insort", test_segarray_insort, sortarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, segarray_params },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
@@ -255,6 +466,8 @@ MunitTest arraybenchtests[] = {
     { "/insert", test_randidx_insert, randarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, bench_params },
     { "/insort", test_insort, sortarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, bench_params },
     { "/append-and-sort", test_append_and_sort, sortarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, bench_params },
+    { "/build-insort", test_build_insort, randarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, build_params },
+    { "/build-segarray", test_build_segarray, randarray_setup, array_teardown, MUNIT_TEST_OPTION_NONE, build_params },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
@@ -1,5 +1,7 @@
 #include "munit.h"
 #include "../lib/bsearchn.h"
+#include "../lib/keycmp.h"
+#include "../lib/common.h"
 
 const int intdata[] = {
     0,5,9,42,2903,31337,77777
@@ -76,12 +78,317 @@ MunitResult test_bsearchn_match(const MunitParameter params[], void *data) {
     return MUNIT_OK;
 }
 
+static size_t sort_keysize;
+static int sort_keycmp(const void *a, const void *b) {
+    return memcmp(a, b, sort_keysize);
+}
+
+#define munit_assert_range(r, l, h) \
+    do { munit_assert_size(r.lo, ==, l); munit_assert_size(r.hi, ==, h); } while (0)
+
+MunitResult test_bsearchpkr_bindata(const MunitParameter params[], void *data) {
+    idx_range r;
+    /* all the keys start with 0x0000 */
+    r = bsearchpkr("\x00\x00", 2, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 0, BINDATA_NUM-1);
+    /* two copies of 0x000001dead */
+    r = bsearchpkr("\x00\x00\x01", 3, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 2, 3);
+    /* only one match */
+    r = bsearchpkr("\x00\x00\x03", 3, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 5, 5);
+    /* no match; r.hi is where it would go */
+    r = bsearchpkr("\x00\x00\x05", 3, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert(idx_range_nomatch(r));
+    munit_assert_size(r.hi, ==, 6);
+    r = bsearchpkr("\xff", 1, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert(idx_range_nomatch(r));
+    munit_assert_size(r.hi, ==, BINDATA_NUM);
+    r = bsearchpkr("\x00", 1, &bindata, 0, 0, BINDATA_SIZE);
+    munit_assert(idx_range_nomatch(r));
+    munit_assert_size(r.hi, ==, 0);
+    return MUNIT_OK;
+}
+
+MunitResult test_bsearchpbr_bindata(const MunitParameter params[], void *data) {
+    idx_range r;
+    /* 0x00000 (5 hex digits) matches everything but 0x0000100000 */
+    r = bsearchpbr("\x00\x00\x00", 20, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 0, BINDATA_NUM-2);
+    r = bsearchpbr("\x00\x00\x10", 20, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, BINDATA_NUM-1, BINDATA_NUM-1);
+    /* low bits past the end of the prefix get ignored */
+    r = bsearchpbr("\x00\x00\x1f", 20, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, BINDATA_NUM-1, BINDATA_NUM-1);
+    /* 0x0000029 (7 hex digits) */
+    r = bsearchpbr("\x00\x00\x00\x29", 28, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 1, 1);
+    r = bsearchpbr("\x00\x00\x00\x30", 28, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert(idx_range_nomatch(r));
+    munit_assert_size(r.hi, ==, 2);
+    /* zero-length prefix matches everything */
+    r = bsearchpbr("", 0, &bindata, 0, BINDATA_NUM, BINDATA_SIZE);
+    munit_assert_range(r, 0, BINDATA_NUM-1);
+    return MUNIT_OK;
+}
+
+MunitResult test_bsearchpbr_random(const MunitParameter params[], void *data) {
+    size_t keysize = 4, num = 4096;
+    uint8_t *keys = munit_malloc(keysize*num);
+    uint8_t pkey[4];
+    munit_rand_memory(keysize*num, keys);
+    sort_keysize = keysize;
+    qsort(keys, num, keysize, sort_keycmp);
+    for (int i=0; i<1000; i++) {
+        size_t bits = munit_rand_int_range(0, 16);
+        uint32_t mask = bits ? ~0U << (32-bits) : 0;
+        munit_rand_memory(sizeof(pkey), pkey);
+        uint32_t p = ((uint32_t)pkey[0]<<24|pkey[1]<<16|pkey[2]<<8|pkey[3]) & mask;
+        /* find the expected range the slow way */
+        size_t lo = num, hi = 0, cnt = 0, ins = 0;
+        for (size_t k=0; k<num; k++) {
+            uint8_t *kp = keys+(k*keysize);
+            uint32_t v = ((uint32_t)kp[0]<<24|kp[1]<<16|kp[2]<<8|kp[3]) & mask;
+            if (v < p)
+                ins = k+1;
+            if (v == p) {
+                lo = MIN(lo, k);
+                hi = MAX(hi, k);
+                cnt++;
+            }
+        }
+        idx_range r = bsearchpbr(pkey, bits, keys, 0, num, keysize);
+        if (cnt) {
+            munit_assert_range(r, lo, hi);
+        } else {
+            munit_assert(idx_range_nomatch(r));
+            munit_assert_size(r.hi, ==, ins);
+        }
+    }
+    free(keys);
+    return MUNIT_OK;
+}
+
+MunitResult test_unique_prefix_bindata(const MunitParameter params[], void *data) {
+    uint8_t lens[BINDATA_NUM];
+    uint8_t exp_lens[BINDATA_NUM] = { 7, 7, 10, 10, 6, 6, 5 };
+    munit_assert_size(common_prefix_nibbles("\x12\x34", "\x12\x35", 2), ==, 3);
+    munit_assert_size(common_prefix_nibbles("\x12\x34", "\x12\x44", 2), ==, 2);
+    munit_assert_size(common_prefix_nibbles("\x12\x34", "\x12\x34", 2), ==, 4);
+    munit_assert_size(unique_prefix_nibbles(bindata, BINDATA_NUM, BINDATA_SIZE, lens), ==, 10);
+    munit_assert_memory_equal(BINDATA_NUM, lens, exp_lens);
+    munit_assert_size(unique_prefix_nibbles(bindata, 1, BINDATA_SIZE, NULL), ==, 1);
+    munit_assert_size(unique_prefix_nibbles(bindata, 0, BINDATA_SIZE, NULL), ==, 0);
+    return MUNIT_OK;
+}
+
+MunitResult test_unique_prefix_random(const MunitParameter params[], void *data) {
+    size_t keysize = 8, num = 2000;
+    uint8_t *keys = munit_malloc(keysize*num);
+    uint8_t *lens = munit_malloc(num);
+    munit_rand_memory(keysize*num, keys);
+    sort_keysize = keysize;
+    qsort(keys, num, keysize, sort_keycmp);
+    size_t maxlen = unique_prefix_nibbles(keys, num, keysize, lens);
+    for (size_t i=0; i<num; i++) {
+        const uint8_t *key = keys+(i*keysize);
+        /* the abbreviation matches only this key... */
+        idx_range r = bsearchpbr(key, lens[i]<<2, keys, 0, num, keysize);
+        munit_assert_size(r.lo, ==, i);
+        munit_assert_size(r.hi, ==, i);
+        /* ...and one digit less matches more than one key */
+        r = bsearchpbr(key, (lens[i]-1)<<2, keys, 0, num, keysize);
+        munit_assert_size(r.hi, >, r.lo);
+        munit_assert_size(lens[i], <=, maxlen);
+    }
+    free(keys);
+    free(lens);
+    return MUNIT_OK;
+}
+
+#define INTPARAM(name) atoi(munit_parameters_get(params, name))
+#define SIGN(x) (((x) > 0) - ((x) < 0))
+
+MunitResult test_keycmp_random(const MunitParameter params[], void *data) {
+    size_t keysize = INTPARAM("keysize");
+    keycmp_fn *keycmp = keycmp_select(keysize);
+    uint8_t *a = munit_malloc(keysize);
+    uint8_t *b = munit_malloc(keysize);
+    for (int i=0; i<10000; i++) {
+        munit_rand_memory(keysize, a);
+        memcpy(b, a, keysize);
+        /* Make keys that share a prefix of random length (maybe all of it)
+         * and differ in some random way after that */
+        size_t diffpos = munit_rand_int_range(0, keysize);
+        if (diffpos < keysize)
+            b[diffpos] = munit_rand_uint32();
+        munit_assert_int(SIGN(keycmp(a, b, keysize)), ==, SIGN(memcmp(a, b, keysize)));
+        munit_assert_int(SIGN(keycmp(b, a, keysize)), ==, SIGN(memcmp(b, a, keysize)));
+        munit_assert_int(keycmp(a, a, keysize), ==, 0);
+    }
+    free(a);
+    free(b);
+    return MUNIT_OK;
+}
+
+MunitResult test_keycmp_bsearchi(const MunitParameter params[], void *data) {
+    size_t keysize = INTPARAM("keysize");
+    size_t num = 1000;
+    keycmp_fn *keycmp = keycmp_select(keysize);
+    uint8_t *keys = munit_malloc(keysize*num);
+    uint8_t *key = munit_malloc(keysize);
+    munit_rand_memory(keysize*num, keys);
+    sort_keysize = keysize;
+    qsort(keys, num, keysize, sort_keycmp);
+    for (size_t i=0; i<num; i++) {
+        ssize_t idx = bsearchir_cmp(keys+(i*keysize), keys, 0, num, keysize, keycmp);
+        munit_assert_int(idx, >=, 0);
+        munit_assert_memory_equal(keysize, keys+(idx*keysize), keys+(i*keysize));
+        /* Random keys should give the same result as memcmp() */
+        munit_rand_memory(keysize, key);
+        munit_assert_int(bsearchir_cmp(key, keys, 0, num, keysize, keycmp),
+                         ==, bsearchir(key, keys, 0, num, keysize));
+    }
+    free(keys);
+    free(key);
+    return MUNIT_OK;
+}
+
+/* The search functions from keysearch_select() should give exactly the same
+ * answers as the generic ones with memcmp(), and the range search with
+ * prefix_bounds() should match bsearchpbr(). */
+MunitResult test_keysearch(const MunitParameter params[], void *data) {
+    size_t keysize = INTPARAM("keysize");
+    size_t num = 2000;
+    keycmp_fn *keycmp = keycmp_select(keysize);
+    const keysearch_fns *fns = keysearch_select(keysize);
+    bsearchir_fn *searchfns[] = { fns->branchy, fns->branchless, fns->interp };
+    /* Every size with a kernel gets specialized search loops too */
+    if (strcmp(keycmp_kernel_name(keysize), "memcmp"))
+        munit_assert_ptr_not_equal(fns->branchy, bsearchir_cmp);
+    uint8_t *keys = munit_malloc(keysize*num);
+    uint8_t *key = munit_malloc(keysize);
+    uint8_t *lokey = munit_malloc(keysize), *hikey = munit_malloc(keysize);
+    munit_rand_memory(keysize*num, keys);
+    /* throw in some duplicates */
+    for (size_t i=1; i<num; i+=4)
+        memcpy(keys+(i*keysize), keys+((i-1)*keysize), keysize);
+    sort_keysize = keysize;
+    qsort(keys, num, keysize, sort_keycmp);
+
+    for (size_t i=0; i<num; i++) {
+        const uint8_t *k = keys+(i*keysize);
+        munit_rand_memory(keysize, key);
+        size_t base = munit_rand_int_range(0, num-1);
+        for (int f=0; f<3; f++) {
+            ssize_t idx = searchfns[f](k, keys, 0, num, keysize, keycmp);
+            munit_assert_int(idx, >=, 0);
+            munit_assert_memory_equal(keysize, keys+(idx*keysize), k);
+            munit_assert_int(searchfns[f](key, keys, base, num-base, keysize, keycmp),
+                             ==, bsearchir(key, keys, base, num-base, keysize));
+        }
+        size_t bits = munit_rand_int_range(0, keysize*8);
+        prefix_bounds(k, bits, keysize, lokey, hikey);
+        idx_range r = fns->range(lokey, hikey, keys, 0, num, keysize, keycmp);
+        idx_range expect = bsearchpbr(k, bits, keys, 0, num, keysize);
+        munit_assert_size(r.lo, ==, expect.lo);
+        munit_assert_size(r.hi, ==, expect.hi);
+        /* And a prefix that (probably) isn't there */
+        prefix_bounds(key, 12, keysize, lokey, hikey);
+        r = fns->range(lokey, hikey, keys, base, num-base, keysize, keycmp);
+        expect = bsearchpbr(key, 12, keys, base, num-base, keysize);
+        munit_assert_size(r.lo, ==, expect.lo);
+        munit_assert_size(r.hi, ==, expect.hi);
+    }
+    free(keys);
+    free(key);
+    free(lokey);
+    free(hikey);
+    return MUNIT_OK;
+}
+
+static bsearchir_fn *get_searchfn(const char *name) {
+    if (strcmp(name, "branchless") == 0)
+        return bsearchir_branchless_cmp;
+    if (strcmp(name, "interp") == 0)
+        return bsearchir_interp_cmp;
+    return bsearchir_cmp;
+}
+
+/* Every bsearchir variant should agree with bisect() about where a key
+ * goes, and should find every key that's actually in the array. */
+MunitResult test_bsearchi_variants(const MunitParameter params[], void *data) {
+    size_t keysize = 32;
+    size_t num = INTPARAM("num");
+    bsearchir_fn *searchfn = get_searchfn(munit_parameters_get(params, "search"));
+    uint8_t *keys = munit_malloc(keysize*(num+1));
+    uint8_t *key = munit_malloc(keysize);
+    munit_rand_memory(keysize*num, keys);
+    /* throw in some duplicates */
+    for (size_t i=1; i<num; i+=4)
+        memcpy(keys+(i*keysize), keys+((i-1)*keysize), keysize);
+    sort_keysize = keysize;
+    qsort(keys, num, keysize, sort_keycmp);
+
+    for (size_t i=0; i<num; i++) {
+        const uint8_t *k = keys+(i*keysize);
+        ssize_t idx = searchfn(k, keys, 0, num, keysize, memcmp);
+        munit_assert_int(idx, >=, 0);
+        munit_assert_memory_equal(keysize, keys+(idx*keysize), k);
+        munit_assert_size(bisect_branchless(k, keys, 0, num, keysize),
+                          ==, bisect(k, keys, 0, num, keysize));
+    }
+    for (size_t i=0; i<1000; i++) {
+        size_t base = num ? munit_rand_int_range(0, num-1) : 0;
+        size_t n = num-base;
+        munit_rand_memory(keysize, key);
+        size_t expect = bisect(key, keys, base, base+n, keysize);
+        munit_assert_size(bisect_branchless(key, keys, base, base+n, keysize), ==, expect);
+        ssize_t idx = searchfn(key, keys, base, n, keysize, memcmp);
+        munit_assert_int(idx, <, 0);
+        munit_assert_size(~idx, ==, expect);
+    }
+    free(keys);
+    free(key);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum variant_params[] = {
+    { (char*) "search", (char*[]) { "branchy", "branchless", "interp", NULL } },
+    { (char*) "num", (char*[]) { "0", "1", "2", "7", "1000", "100000", NULL } },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum keycmp_params[] = {
+    { (char*) "keysize", (char*[]) { "5", "16", "20", "28", "32", "48", "64", NULL } },
+    { NULL, NULL },
+};
+
+static MunitTest keycmp_tests[] = {
+    { "/random", test_keycmp_random, NULL, NULL, MUNIT_TEST_OPTION_NONE, keycmp_params },
+    { "/bsearchi", test_keycmp_bsearchi, NULL, NULL, MUNIT_TEST_OPTION_NONE, keycmp_params },
+    { "/search", test_keysearch, NULL, NULL, MUNIT_TEST_OPTION_NONE, keycmp_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
 static MunitTest bsearchi_tests[] = {
     { "/trivial", test_bsearchi_trivial, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/first", test_bsearchi_first, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/last", test_bsearchi_last, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/notfound_lt", test_bsearchi_notfound_lt, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/notfound_gt", test_bsearchi_notfound_gt, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/variants", test_bsearchi_variants, NULL, NULL, MUNIT_TEST_OPTION_NONE, variant_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static MunitTest bsearchpkr_tests[] = {
+    { "/bindata", test_bsearchpkr_bindata, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/bits", test_bsearchpbr_bindata, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/bits_random", test_bsearchpbr_random, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/unique", test_unique_prefix_bindata, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/unique_random", test_unique_prefix_random, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
@@ -102,6 +409,8 @@ static const MunitSuite bsearch_suite = {
     (MunitSuite[]) {
         { "/i", bsearchi_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE },
         { "/n", bsearchn_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE },
+        { "/pkr", bsearchpkr_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE },
+        { "/keycmp", keycmp_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE },
         // { "/i/bench", bsearchi_benchtests, NULL, 3, MUNIT_SUITE_OPTION_NONE },
         { NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE },
     },
@@ -0,0 +1,127 @@
+#include <errno.h>
+
+#include "munit.h"
+#include "../lib/common.h"
+#include "../lib/chunker.h"
+
+#define DATASIZE (4<<20)
+
+/* Split `data` up, check the chunk sizes are in bounds, and put a hash of
+ * each chunk in `hashes`. Returns the number of chunks. */
+static size_t split(const Dino_CDC_Params *cdc, const uint8_t *data, size_t size, uint64_t *hashes) {
+    size_t n = 0, off = 0, len;
+    for (; off < size; off += len, n++) {
+        len = cdc_chunk(cdc, data+off, size-off);
+        munit_assert_size(len, >, 0);
+        munit_assert_size(len, <=, cdc->max_size);
+        if (off+len < size)
+            munit_assert_size(len, >=, cdc->min_size);
+        /* FNV-1a is plenty to tell chunks apart here */
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i=0; i<len; i++)
+            h = (h ^ data[off+i]) * 0x100000001b3ULL;
+        hashes[n] = h ^ len;
+    }
+    munit_assert_size(off, ==, size);
+    return n;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+MunitResult test_params(const MunitParameter params[], void *user_data) {
+    Dino_CDC_Params cdc;
+    munit_assert_int(cdc_params_init(&cdc, 0), ==, -EINVAL);
+    munit_assert_int(cdc_params_init(&cdc, 128), ==, -EINVAL);
+    munit_assert_int(cdc_params_init(&cdc, 3000), ==, -EINVAL);
+    munit_assert_int(cdc_params_init(&cdc, (size_t)1<<30), ==, -EINVAL);
+    munit_assert_int(cdc_params_init(&cdc, CDC_AVG_SIZE_DEFAULT), ==, 0);
+    munit_assert_size(cdc.min_size, ==, CDC_AVG_SIZE_DEFAULT/4);
+    munit_assert_size(cdc.max_size, ==, CDC_AVG_SIZE_DEFAULT*4);
+
+    /* Small stuff is one chunk, and nothing is nothing */
+    uint8_t data[100] = { 0 };
+    munit_assert_size(cdc_chunk(&cdc, data, sizeof(data)), ==, sizeof(data));
+    munit_assert_size(cdc_chunk(&cdc, data, 0), ==, 0);
+    return MUNIT_OK;
+}
+
+MunitResult test_chunk_sizes(const MunitParameter params[], void *user_data) {
+    Dino_CDC_Params cdc;
+    munit_assert_int(cdc_params_init(&cdc, 8192), ==, 0);
+    uint8_t *data = munit_malloc(DATASIZE);
+    munit_rand_memory(DATASIZE, data);
+    uint64_t *hashes = munit_newa(uint64_t, DATASIZE/cdc.min_size + 1);
+    size_t n = split(&cdc, data, DATASIZE, hashes);
+    /* Normalized chunking keeps the average close to what we asked for */
+    munit_assert_size(DATASIZE/n, >, cdc.avg_size/2);
+    munit_assert_size(DATASIZE/n, <, cdc.avg_size*2);
+
+    /* Zeros never match the cut condition, so they get max-size chunks */
+    memset(data, 0, DATASIZE);
+    n = split(&cdc, data, DATASIZE, hashes);
+    munit_assert_size(n, ==, (DATASIZE + cdc.max_size-1) / cdc.max_size);
+    free(hashes);
+    free(data);
+    return MUNIT_OK;
+}
+
+MunitResult test_chunk_shift(const MunitParameter params[], void *user_data) {
+    Dino_CDC_Params cdc;
+    munit_assert_int(cdc_params_init(&cdc, 8192), ==, 0);
+    uint8_t *v1 = munit_malloc(DATASIZE), *v2 = munit_malloc(DATASIZE+100);
+    munit_rand_memory(DATASIZE, v1);
+    /* v2: 100 bytes inserted near the start, and a few changed later on */
+    size_t ins = 1000000;
+    memcpy(v2, v1, ins);
+    munit_rand_memory(100, v2+ins);
+    memcpy(v2+ins+100, v1+ins, DATASIZE-ins);
+    v2[3000000] ^= 0xff;
+    v2[3000001] ^= 0xff;
+
+    size_t maxn = DATASIZE/cdc.min_size + 2;
+    uint64_t *h1 = munit_newa(uint64_t, maxn), *h2 = munit_newa(uint64_t, maxn);
+    size_t n1 = split(&cdc, v1, DATASIZE, h1);
+    size_t n2 = split(&cdc, v2, DATASIZE+100, h2);
+    /* Same data, same chunks */
+    uint64_t *h3 = munit_newa(uint64_t, maxn);
+    munit_assert_size(split(&cdc, v1, DATASIZE, h3), ==, n1);
+    munit_assert_memory_equal(n1*sizeof(uint64_t), h1, h3);
+
+    /* Only the chunks around the edits should differ */
+    qsort(h1, n1, sizeof(uint64_t), u64_cmp);
+    size_t shared = 0;
+    for (size_t i=0; i<n2; i++)
+        if (bsearch(&h2[i], h1, n1, sizeof(uint64_t), u64_cmp))
+            shared++;
+    munit_assert_size(n2 - shared, <=, 6);
+
+    free(h1);
+    free(h2);
+    free(h3);
+    free(v1);
+    free(v2);
+    return MUNIT_OK;
+}
+
+MunitTest chunker_tests[] = {
+    { "/params", test_params, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/sizes", test_chunk_sizes, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/shift", test_chunk_shift, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite chunker_suite = {
+    "/libdino/chunker",
+    chunker_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&chunker_suite, (void*) "libdino", argc, argv);
+};
@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <stdio.h>
+
 #include "munit.h"
 #include "../lib/compression/compression.h"
 #include "../lib/common.h"
@@ -32,6 +35,20 @@ MunitResult test_stream_new(const MunitParameter params[], void* user_data) {
     munit_assert_size(ds->rec_inbuf_size, >, 0);
     munit_assert_size(ds->rec_outbuf_size, >, 0);
 
+    /* The window_log range we advertise should match what setup accepts */
+    int min, max;
+    munit_assert_false(compress_window_log_range(DINO_COMPRESS_INVALID, &min, &max));
+    munit_assert_true(compress_window_log_range(id, &min, &max));
+    munit_assert_int(min, >, 0);
+    munit_assert_int(min, <=, max);
+    Dino_COpts copts = COPTS_DEFAULT;
+    copts.window_log = min;
+    munit_assert_true(cstream_setopts(cs, &copts));
+    if (id != DINO_COMPRESS_NONE) {
+        copts.window_log = min-1;
+        munit_assert_false(cstream_setopts(cs, &copts));
+    }
+
     /* cleanup! */
     cstream_free(cs);
     dstream_free(ds);
@@ -79,12 +96,11 @@ MunitResult test_compress1(const MunitParameter params[], void* user_data) {
     Dino_DStream *ds = dstream_create(id);
 
     /* check if we have the original size */
-    size_t output_size = outbuf->pos;
-    outbuf->pos = 0;
-    size_t orig_size = dstream_get_uncompressed_size(ds, (inBuf *)outbuf);
+    /* (gzip keeps the size at the end, so this has to be just the frame) */
+    inBuf frame = { outbuf->buf, outbuf->pos, 0 };
+    size_t orig_size = dstream_get_uncompressed_size(ds, &frame);
     if (!IS_SIZE_ERR(orig_size))
         munit_assert_size(orig_size, ==, inbuf->size);
-    outbuf->pos = output_size;
 
     /* reset inbuf to its original size and clear it out */
     inbuf->size = cs->rec_inbuf_size;
@@ -150,6 +166,703 @@ MunitResult test_compress_buf_pos(const MunitParameter params[], void* user_data
     return MUNIT_OK;
 }
 
+/* Compress all of `in` to a new Buf, looping until everything's consumed
+ * and flushed - with worker threads, zstd doesn't do it all in one call. */
+static Buf *compress_all(Dino_CStream *cs, inBuf *in) {
+    Buf *out = buf_init(cs->rec_outbuf_size);
+    munit_assert_not_null(out);
+    cstream_compress_start(cs, in->size - in->pos);
+    while (in->pos < in->size) {
+        munit_assert_true(buf_reserve(out, cs->rec_outbuf_size));
+        munit_assert_false(IS_COMPRESS_ERR(cstream_compress(cs, in, out)));
+    }
+    size_t r;
+    do {
+        munit_assert_true(buf_reserve(out, cs->rec_outbuf_size));
+        r = cstream_compress_end(cs, out);
+        munit_assert_false(IS_COMPRESS_ERR(r));
+    } while (r);
+    return out;
+}
+
+MunitResult test_copts(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    const char *optname = munit_parameters_get(params, "opts");
+    Dino_COpts copts = COPTS_DEFAULT;
+    if (!strcmp(optname, "fast"))
+        copts.level = 1;
+    else if (!strcmp(optname, "best"))
+        copts.level = 9;
+    else if (!strcmp(optname, "threads"))
+        copts.threads = 2;
+    else if (!strcmp(optname, "long")) {
+        copts.long_distance = 1;
+        copts.window_log = 24;
+    }
+
+    Dino_CStream *cs = cstream_create(id);
+    munit_assert_not_null(cs);
+    munit_assert_int(cstream_setopts(cs, &copts), ==, 1);
+    munit_assert_int(cs->opts.level, ==, copts.level);
+
+    /* Bad options get rejected, and don't clobber the good ones */
+    Dino_COpts bad = copts;
+    bad.window_log = 5;
+    if (id != DINO_COMPRESS_NONE) {
+        munit_assert_int(cstream_setopts(cs, &bad), ==, 0);
+        munit_assert_int(cs->opts.window_log, ==, copts.window_log);
+    }
+
+    /* A few MB of compressible data, so the threads have something to do */
+    size_t size = 4<<20;
+    uint8_t *data = munit_malloc(size);
+    uint8_t chunk[CHUNKSIZE*4];
+    for (size_t off=0; off<size; off+=sizeof(chunk)) {
+        munit_rand_memory(sizeof(chunk), chunk);
+        memcpy_repeat(data+off, chunk, CHUNKSIZE, 4);
+    }
+    inBuf in = { data, size, 0 };
+    Buf *out = compress_all(cs, &in);
+
+    /* Decompress with options read back from copts_write() */
+    Buf *optbuf = buf_init(16);
+    munit_assert_int64(copts_write(&copts, optbuf), ==, optbuf->pos);
+    Dino_DOpts dopts;
+    munit_assert_int(copts_read(&dopts, optbuf->buf, optbuf->pos), ==, 0);
+    munit_assert_int(dopts.window_log, ==, copts.window_log);
+    Dino_DStream *ds = dstream_create(id);
+    munit_assert_not_null(ds);
+    munit_assert_int(dstream_setopts(ds, &dopts), ==, 1);
+    Buf *check = buf_init(size);
+    inBuf cin = { out->buf, out->pos, 0 };
+    size_t r;
+    do {
+        r = dstream_decompress(ds, &cin, check);
+        munit_assert_false(IS_COMPRESS_ERR(r));
+    } while (r && (cin.pos < cin.size));
+    munit_assert_size(check->pos, ==, size);
+    munit_assert_memory_equal(size, check->buf, data);
+
+    buf_free(check);
+    buf_free(optbuf);
+    buf_free(out);
+    free(data);
+    dstream_free(ds);
+    cstream_free(cs);
+    return MUNIT_OK;
+}
+
+MunitResult test_copts_rw(const MunitParameter params[], void* user_data) {
+    Dino_COpts copts = { .level = -5, .threads = 8, .long_distance = 1, .window_log = 27 };
+    Dino_DOpts dopts;
+    Buf *b = buf_init(4);
+
+    /* Defaults don't need writing at all */
+    Dino_COpts defaults = COPTS_DEFAULT;
+    munit_assert_int64(copts_write(&defaults, b), ==, 0);
+    munit_assert_int(copts_read(&dopts, b->buf, b->pos), ==, 0);
+    munit_assert_int(dopts.level, ==, COMPRESS_LEVEL_DEFAULT);
+
+    /* Everything but threads makes the round trip */
+    munit_assert_int64(copts_write(&copts, b), >, 0);
+    munit_assert_int(copts_read(&dopts, b->buf, b->pos), ==, 0);
+    munit_assert_int(dopts.level, ==, -5);
+    munit_assert_int(dopts.threads, ==, 0);
+    munit_assert_int(dopts.long_distance, ==, 1);
+    munit_assert_int(dopts.window_log, ==, 27);
+
+    /* Unknown tags get skipped */
+    static const uint8_t future[] = { 0x7e, 2, 0xff, 0xff, DINO_COPT_WINDOW_LOG, 1, 20 };
+    munit_assert_int(copts_read(&dopts, future, sizeof(future)), ==, 0);
+    munit_assert_int(dopts.window_log, ==, 20);
+
+    /* Truncated data gets rejected */
+    munit_assert_int(copts_read(&dopts, b->buf, b->pos-1), ==, -1);
+    munit_assert_int(copts_read(&dopts, future, 1), ==, -1);
+
+    buf_free(b);
+    return MUNIT_OK;
+}
+
+/* Fake RPM-ish headers: mostly the same boilerplate, with a few fields
+ * that change from one to the next */
+#define NUM_SAMPLES 1000
+static size_t make_sample(char *buf, size_t size, int i) {
+    return snprintf(buf, size,
+        "Name: package-%d\nVersion: %d.%d.%d\nRelease: %d.fc%d\n"
+        "Summary: A package that does thing number %d\nLicense: GPLv2+\n"
+        "URL: https://example.com/projects/package-%d\nBuildHost: builder-%02d.example.com\n"
+        "Requires: libc.so.6()(64bit) libc.so.6(GLIBC_2.2.5)(64bit) rtld(GNU_HASH)\n"
+        "Provides: package-%d = %d.%d.%d-%d.fc%d package-%d(x86-64) = %d.%d.%d\n"
+        "Files: /usr/bin/package-%d /usr/share/doc/package-%d/README /usr/share/licenses/package-%d/COPYING\n",
+        i, i%7, i%13, i%5, i%3+1, 30+i%4, i, i, i%20, i, i%7, i%13, i%5, i%3+1, 30+i%4,
+        i, i%7, i%13, i%5, i, i, i);
+}
+
+MunitResult test_dict(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    Buf *samples = buf_init(NUM_SAMPLES*1024);
+    size_t *sizes = munit_newa(size_t, NUM_SAMPLES);
+    for (int i=0; i<NUM_SAMPLES; i++) {
+        sizes[i] = make_sample(samples->buf+samples->pos, samples->size-samples->pos, i);
+        samples->pos += sizes[i];
+    }
+    uint8_t *dict = munit_malloc(16<<10);
+    size_t dictsize = compress_train_dict(id, dict, 16<<10, samples->buf, sizes, NUM_SAMPLES);
+    munit_assert_int(compress_can_train(id), ==, id == DINO_COMPRESS_ZSTD);
+    if (id != DINO_COMPRESS_ZSTD) {
+        /* Nobody else does dictionaries (yet?) */
+        munit_assert_size(dictsize, ==, 0);
+        goto out;
+    }
+    munit_assert_size(dictsize, >, 0);
+
+    /* Compress each sample on its own, with and without the dictionary */
+    Dino_COpts copts = COPTS_DEFAULT;
+    copts.dictdata = dict;
+    copts.dictsize = dictsize;
+    Dino_CStream *plain = cstream_create(id), *cs = cstream_create(id);
+    munit_assert_int(cstream_setopts(cs, &copts), ==, 1);
+    Buf *plainout = buf_init(samples->pos*2), *out = buf_init(samples->pos*2);
+    size_t *outsizes = munit_newa(size_t, NUM_SAMPLES);
+    size_t off = 0;
+    for (int i=0; i<NUM_SAMPLES; off+=sizes[i++]) {
+        inBuf in = { samples->buf+off, sizes[i], 0 };
+        cstream_compress1(plain, &in, plainout);
+        in.pos = 0;
+        size_t start = out->pos;
+        cstream_compress1(cs, &in, out);
+        outsizes[i] = out->pos - start;
+    }
+    munit_logf(MUNIT_LOG_INFO, "%zu bytes: %zu without dict, %zu with (+%zu dict)",
+               samples->pos, plainout->pos, out->pos, dictsize);
+    munit_assert_size(out->pos + dictsize, <, plainout->pos);
+
+    /* Decompress them all using the dictionary from the options data */
+    Buf *optbuf = buf_init(16);
+    munit_assert_int64(copts_write(&copts, optbuf), >, dictsize);
+    Dino_DOpts dopts;
+    munit_assert_int(copts_read(&dopts, optbuf->buf, optbuf->pos), ==, 0);
+    munit_assert_size(dopts.dictsize, ==, dictsize);
+    Dino_DStream *ds = dstream_create(id);
+    munit_assert_int(dstream_setopts(ds, &dopts), ==, 1);
+    Buf *check = buf_init(samples->pos);
+    inBuf cin = { out->buf, 0, 0 };
+    for (int i=0; i<NUM_SAMPLES; i++) {
+        cin.size += outsizes[i];
+        munit_assert_size(dstream_decompress(ds, &cin, check), ==, 0);
+        munit_assert_size(cin.pos, ==, cin.size);
+    }
+    munit_assert_size(check->pos, ==, samples->pos);
+    munit_assert_memory_equal(samples->pos, check->buf, samples->buf);
+
+    buf_free(check);
+    buf_free(optbuf);
+    buf_free(plainout);
+    buf_free(out);
+    free(outsizes);
+    dstream_free(ds);
+    cstream_free(plain);
+    cstream_free(cs);
+out:
+    free(dict);
+    free(sizes);
+    buf_free(samples);
+    return MUNIT_OK;
+}
+
+MunitResult test_prefix(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    /* Two versions of a "file": a bunch of samples, and the same with one
+     * of them changed */
+    Buf *v1 = buf_init(NUM_SAMPLES*1024), *v2 = buf_init(NUM_SAMPLES*1024);
+    size_t sizes[NUM_SAMPLES];
+    for (int i=0; i<NUM_SAMPLES; i++) {
+        sizes[i] = make_sample(v1->buf+v1->pos, v1->size-v1->pos, i);
+        v1->pos += sizes[i];
+        v2->pos += make_sample(v2->buf+v2->pos, v2->size-v2->pos, (i == 50) ? 1000 : i);
+    }
+    Dino_CStream *cs = cstream_create(id);
+    Dino_DStream *ds = dstream_create(id);
+    if (id != DINO_COMPRESS_ZSTD) {
+        munit_assert_int(cstream_ref_prefix(cs, v1->buf, v1->pos), ==, 0);
+        munit_assert_int(dstream_ref_prefix(ds, v1->buf, v1->pos), ==, 0);
+        munit_assert_int(cstream_reset(cs), ==, 1);
+        munit_assert_int(dstream_reset(ds), ==, 1);
+        goto out;
+    }
+
+    /* With a dictionary, to check it comes back afterward */
+    uint8_t dict[4096];
+    size_t dictsize = compress_train_dict(id, dict, sizeof(dict), v1->buf, sizes, NUM_SAMPLES);
+    munit_assert_size(dictsize, >, 0);
+    Dino_COpts copts = COPTS_DEFAULT;
+    copts.dictdata = dict;
+    copts.dictsize = dictsize;
+    munit_assert_int(cstream_setopts(cs, &copts), ==, 1);
+    munit_assert_int(dstream_setopts(ds, &copts), ==, 1);
+    char sample[1024];
+    inBuf sin = { sample, make_sample(sample, sizeof(sample), 7), 0 };
+    Buf *before = buf_init(1024), *after = buf_init(1024);
+    munit_assert_size(cstream_compress1(cs, &sin, before), ==, 0);
+    munit_assert_int(cstream_reset(cs), ==, 1);
+
+    /* v2 against v1 should be tiny */
+    Buf *delta = buf_init(v2->pos), *check = buf_init(v2->pos);
+    inBuf in = { v2->buf, v2->pos, 0 };
+    munit_assert_int(cstream_ref_prefix(cs, v1->buf, v1->pos), ==, 1);
+    munit_assert_size(cstream_compress1(cs, &in, delta), ==, 0);
+    munit_assert_size(delta->pos, <, 256);
+    munit_assert_int(dstream_ref_prefix(ds, v1->buf, v1->pos), ==, 1);
+    inBuf din = { delta->buf, delta->pos, 0 };
+    munit_assert_size(dstream_decompress1(ds, &din, check), ==, 0);
+    munit_assert_size(check->pos, ==, v2->pos);
+    munit_assert_memory_equal(v2->pos, check->buf, v2->buf);
+
+    /* After a reset, the dictionary's back */
+    munit_assert_int(cstream_reset(cs), ==, 1);
+    munit_assert_int(dstream_reset(ds), ==, 1);
+    sin.pos = 0;
+    munit_assert_size(cstream_compress1(cs, &sin, after), ==, 0);
+    munit_assert_size(after->pos, ==, before->pos);
+    munit_assert_memory_equal(after->pos, after->buf, before->buf);
+    check->pos = 0;
+    din = (inBuf) { after->buf, after->pos, 0 };
+    munit_assert_size(dstream_decompress1(ds, &din, check), ==, 0);
+    munit_assert_memory_equal(sin.size, check->buf, sample);
+
+    buf_free(before);
+    buf_free(after);
+    buf_free(delta);
+    buf_free(check);
+out:
+    cstream_free(cs);
+    dstream_free(ds);
+    buf_free(v1);
+    buf_free(v2);
+    return MUNIT_OK;
+}
+
+/* Compress a little sample with a pooled stream, then decompress it with
+ * another pooled stream and check we got it back */
+static void pool_roundtrip(Dino_CompressID id, int i, Buf *tmp, Buf *check) {
+    char sample[1024];
+    size_t size = make_sample(sample, sizeof(sample), i);
+    Dino_CStream *cs = cstream_pool_get(id, NULL);
+    munit_assert_not_null(cs);
+    inBuf in = { sample, size, 0 };
+    tmp->pos = check->pos = 0;
+    cstream_compress1(cs, &in, tmp);
+    cstream_pool_put(cs);
+
+    Dino_DStream *ds = dstream_pool_get(id, NULL);
+    munit_assert_not_null(ds);
+    inBuf cin = { tmp->buf, tmp->pos, 0 };
+    munit_assert_size(dstream_decompress(ds, &cin, check), ==, 0);
+    dstream_pool_put(ds);
+    munit_assert_size(check->pos, ==, size);
+    munit_assert_memory_equal(size, check->buf, sample);
+}
+
+#define POOL_THREADS 4
+#define POOL_ROUNDS 500
+
+static void *pool_thread(void *arg) {
+    Dino_CompressID id = *(Dino_CompressID *)arg;
+    Buf *tmp = buf_init(4096), *check = buf_init(4096);
+    for (int i=0; i<POOL_ROUNDS; i++)
+        pool_roundtrip(id, i, tmp, check);
+    buf_free(tmp);
+    buf_free(check);
+    return NULL;
+}
+
+MunitResult test_pool(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    munit_assert_null(dstream_pool_get(DINO_COMPRESS_INVALID, NULL));
+
+    /* Putting a stream back and getting another one gets the same one */
+    Dino_DStream *ds = dstream_pool_get(id, NULL), *ds2;
+    munit_assert_not_null(ds);
+    dstream_pool_put(ds);
+    munit_assert_ptr_equal(dstream_pool_get(id, NULL), ds);
+    /* ...but two at once are different, of course */
+    ds2 = dstream_pool_get(id, NULL);
+    munit_assert_not_null(ds2);
+    munit_assert_ptr_not_equal(ds, ds2);
+
+    /* Asking for a different dictionary sets it up */
+    uint8_t dict[1024];
+    munit_rand_memory(sizeof(dict), dict);
+    Dino_DOpts dopts = COPTS_DEFAULT;
+    dopts.dictdata = dict;
+    dopts.dictsize = sizeof(dict);
+    dstream_pool_put(ds);
+    ds = dstream_pool_get(id, &dopts);
+    munit_assert_not_null(ds);
+    munit_assert_memory_equal(sizeof(dict), ds->opts.dictdata, dict);
+    munit_assert_uint64(ds->opts.dicthash, ==, compress_dict_hash(dict, sizeof(dict)));
+    /* The stream has its own copy, which it keeps if the contents match... */
+    const uint8_t *dictcopy = ds->opts.dictdata;
+    munit_assert_ptr_not_equal(dictcopy, dict);
+    dstream_pool_put(ds);
+    uint8_t samedict[sizeof(dict)];
+    memcpy(samedict, dict, sizeof(dict));
+    dopts.dictdata = samedict;
+    ds = dstream_pool_get(id, &dopts);
+    munit_assert_ptr_equal(ds->opts.dictdata, dictcopy);
+    dstream_pool_put(ds);
+    /* ...but a different dictionary at the same address isn't the same
+     * dictionary */
+    dict[0] ^= 0xff;
+    dopts.dictdata = dict;
+    ds = dstream_pool_get(id, &dopts);
+    munit_assert_memory_equal(sizeof(dict), ds->opts.dictdata, dict);
+    dstream_pool_put(ds);
+    /* copts_read() works out the hash, and the pool goes by that */
+    Buf *optbuf = buf_init(16);
+    munit_assert_int64(copts_write(&dopts, optbuf), >, 0);
+    Dino_DOpts readopts;
+    munit_assert_int(copts_read(&readopts, optbuf->buf, optbuf->pos), ==, 0);
+    munit_assert_uint64(readopts.dicthash, ==, compress_dict_hash(dict, sizeof(dict)));
+    ds = dstream_pool_get(id, &readopts);
+    munit_assert_memory_equal(sizeof(dict), ds->opts.dictdata, dict);
+    dstream_pool_put(ds);
+    buf_free(optbuf);
+    dstream_pool_put(ds2);
+
+    /* A reset in the middle of a frame leaves the stream ready for a new
+     * frame */
+    Buf *tmp = buf_init(4096), *check = buf_init(4096);
+    char sample[1024];
+    size_t size = make_sample(sample, sizeof(sample), 42);
+    Dino_CStream *cs = cstream_pool_get(id, NULL);
+    inBuf in = { sample, size, 0 };
+    cstream_compress1(cs, &in, tmp);
+    cstream_pool_put(cs);
+    ds = dstream_pool_get(id, NULL);
+    inBuf cin = { tmp->buf, tmp->pos/2, 0 };
+    dstream_decompress(ds, &cin, check);
+    munit_assert_int(dstream_reset(ds), ==, 1);
+    check->pos = 0;
+    cin.size = tmp->pos;
+    cin.pos = 0;
+    munit_assert_size(dstream_decompress(ds, &cin, check), ==, 0);
+    munit_assert_memory_equal(size, check->buf, sample);
+    dstream_pool_put(ds);
+
+    /* Lots of threads hammering on the pool at once */
+    pthread_t threads[POOL_THREADS];
+    for (int t=0; t<POOL_THREADS; t++)
+        munit_assert_int(pthread_create(&threads[t], NULL, pool_thread, &id), ==, 0);
+    for (int t=0; t<POOL_THREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    /* The exited threads' streams went back to the pool and still work */
+    pool_roundtrip(id, 1, tmp, check);
+
+    buf_free(tmp);
+    buf_free(check);
+    compress_pool_clear();
+    return MUNIT_OK;
+}
+
+MunitResult test_oneshot(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    Dino_CStream *cs = cstream_create(id);
+    Dino_DStream *ds = dstream_create(id);
+    Buf *tmp = buf_init(8192), *check = buf_init(8192);
+    char sample[1024];
+    size_t size = make_sample(sample, sizeof(sample), 7);
+
+    /* Two frames back to back; the fast path gets used for the first one */
+    inBuf in = { sample, size, 0 };
+    munit_assert_size(cstream_compress1(cs, &in, tmp), ==, 0);
+    munit_assert_size(in.pos, ==, size);
+    size_t frame1 = tmp->pos;
+    /* xz streams need setting up again after each frame */
+    munit_assert_true(cstream_reset(cs));
+    in.pos = 0;
+    munit_assert_size(cstream_compress1(cs, &in, tmp), ==, 0);
+    munit_assert_size(tmp->pos, ==, frame1*2);
+
+    /* Without room for the worst case it has to go the slow way, which
+     * should still work (and be readable by the one-shot decoder) */
+    Buf *slow = buf_init(frame1+16);
+    munit_assert_true(cstream_reset(cs));
+    in.pos = 0;
+    munit_assert_size(cstream_compress1(cs, &in, slow), ==, 0);
+    inBuf sin = { slow->buf, slow->pos, 0 };
+    munit_assert_size(dstream_decompress1(ds, &sin, check), ==, 0);
+    munit_assert_size(sin.pos, ==, slow->pos);
+    munit_assert_size(check->pos, ==, size);
+    munit_assert_memory_equal(size, check->buf, sample);
+    buf_free(slow);
+    munit_assert_true(cstream_reset(cs));
+    munit_assert_true(dstream_reset(ds));
+
+    /* And one with no room at all */
+    outBuf tight = { check->buf, 8, 0 };
+    in.pos = 0;
+    munit_assert_size(cstream_compress1(cs, &in, &tight), ==, COMPRESS_ERR_BUF);
+    munit_assert_true(cstream_reset(cs));
+
+    /* Decompress them one frame at a time */
+    inBuf cin = { tmp->buf, tmp->pos, 0 };
+    for (int f=0; f<2; f++) {
+        check->pos = 0;
+        munit_assert_size(dstream_decompress1(ds, &cin, check), ==, 0);
+        munit_assert_size(cin.pos, ==, frame1*(f+1));
+        munit_assert_size(check->pos, ==, size);
+        munit_assert_memory_equal(size, check->buf, sample);
+        munit_assert_true(dstream_reset(ds));
+    }
+
+    /* Not enough room for the output */
+    cin.pos = 0;
+    outBuf small = { check->buf, size-1, 0 };
+    munit_assert_size(dstream_decompress1(ds, &cin, &small), ==, COMPRESS_ERR_BUF);
+    munit_assert_true(dstream_reset(ds));
+
+    /* Truncated frame */
+    cin = (inBuf) { tmp->buf, frame1/2, 0 };
+    check->pos = 0;
+    munit_assert_true(IS_COMPRESS_ERR(dstream_decompress1(ds, &cin, check)));
+
+    buf_free(tmp);
+    buf_free(check);
+    cstream_free(cs);
+    dstream_free(ds);
+    return MUNIT_OK;
+}
+
+/* Compress and decompress with only a few bytes of output space at a time,
+ * so the codecs have to keep track of output they couldn't write yet */
+#define TINYBUF 16
+MunitResult test_tinybuf(const MunitParameter params[], void* user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    Dino_CStream *cs = cstream_create(id);
+    Dino_DStream *ds = dstream_create(id);
+    Buf *out = buf_init(256<<10), *check = buf_init(256<<10);
+    size_t size = 200<<10, r, guard;
+    uint8_t *data = munit_malloc(size);
+    for (size_t off=0; off<size; off+=CHUNKSIZE) {
+        munit_rand_memory(CHUNKSIZE/2, data+off);
+        memset(data+off+(CHUNKSIZE/2), off & 0xff, CHUNKSIZE/2);
+    }
+
+    inBuf in = { data, size, 0 };
+    cstream_compress_start(cs, size);
+    for (guard=0; in.pos < in.size; guard++) {
+        munit_assert_size(guard, <, size);
+        outBuf tiny = { out->buf, MIN(out->pos+TINYBUF, out->size), out->pos };
+        munit_assert_false(IS_COMPRESS_ERR(cstream_compress(cs, &in, &tiny)));
+        out->pos = tiny.pos;
+    }
+    do {
+        munit_assert_size(out->pos+TINYBUF, <=, out->size);
+        outBuf tiny = { out->buf, out->pos+TINYBUF, out->pos };
+        r = cstream_compress_end(cs, &tiny);
+        munit_assert_false(IS_COMPRESS_ERR(r));
+        out->pos = tiny.pos;
+    } while (r);
+
+    inBuf cin = { out->buf, out->pos, 0 };
+    guard = 0;
+    do {
+        munit_assert_size(guard++, <, size);
+        outBuf tiny = { check->buf, MIN(check->pos+TINYBUF, check->size), check->pos };
+        r = dstream_decompress(ds, &cin, &tiny);
+        munit_assert_false(IS_COMPRESS_ERR(r));
+        check->pos = tiny.pos;
+    } while (r);
+    munit_assert_size(cin.pos, ==, cin.size);
+    munit_assert_size(check->pos, ==, size);
+    munit_assert_memory_equal(size, check->buf, data);
+
+    free(data);
+    buf_free(out);
+    buf_free(check);
+    cstream_free(cs);
+    dstream_free(ds);
+    return MUNIT_OK;
+}
+
+/* `gzip -9 gzsample.txt`, where gzsample.txt is GZSAMPLE_TEXT twice */
+#define GZSAMPLE_TEXT "libdino can read gzip members written by gzip itself.\n"
+static const uint8_t gzsample[] = {
+    0x1f, 0x8b, 0x08, 0x08, 0x7a, 0xbb, 0xd5, 0x6a, 0x02, 0x03, 0x67, 0x7a,
+    0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x74, 0x78, 0x74, 0x00, 0xcb,
+    0xc9, 0x4c, 0x4a, 0xc9, 0xcc, 0xcb, 0x57, 0x48, 0x4e, 0xcc, 0x53, 0x28,
+    0x4a, 0x4d, 0x4c, 0x51, 0x48, 0xaf, 0xca, 0x2c, 0x50, 0xc8, 0x4d, 0xcd,
+    0x4d, 0x4a, 0x2d, 0x2a, 0x56, 0x28, 0x2f, 0xca, 0x2c, 0x29, 0x49, 0xcd,
+    0x53, 0x48, 0xaa, 0x84, 0x88, 0x67, 0x96, 0x14, 0xa7, 0xe6, 0xa4, 0xe9,
+    0x71, 0xe5, 0x90, 0xa5, 0x0b, 0x00, 0x58, 0x8c, 0x8f, 0x7e, 0x6c, 0x00,
+    0x00, 0x00
+};
+
+/* `data` as a zlib-wrapped stream (RFC 1950) holding one stored deflate
+ * block - about the simplest thing that isn't gzip but inflate accepts */
+static Buf *make_zlib_stored(const void *data, size_t size) {
+    const uint8_t *p = data;
+    munit_assert_size(size, <=, 0xffff);
+    Buf *zl = buf_init(size + 11);
+    uint8_t *o = zl->buf;
+    uint32_t a = 1, b = 0;
+    for (size_t i=0; i<size; i++) {
+        a = (a + p[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    uint8_t hdr[] = { 0x78, 0x01,           /* zlib header */
+                      0x01,                 /* BFINAL, BTYPE=00 (stored) */
+                      size & 0xff, size >> 8, ~size & 0xff, (~size >> 8) & 0xff };
+    uint8_t adler[] = { b >> 8, b & 0xff, a >> 8, a & 0xff };
+    memcpy(o, hdr, sizeof(hdr));
+    memcpy(o+sizeof(hdr), data, size);
+    memcpy(o+sizeof(hdr)+size, adler, sizeof(adler));
+    zl->pos = sizeof(hdr) + size + sizeof(adler);
+    return zl;
+}
+
+/* The zlib backend reads (and writes) plain old gzip */
+MunitResult test_gzip(const MunitParameter params[], void* user_data) {
+    if (!compress_avail(DINO_COMPRESS_ZLIB))
+        return MUNIT_SKIP;
+    const char *text = GZSAMPLE_TEXT GZSAMPLE_TEXT;
+    size_t textlen = strlen(text);
+    Dino_DStream *ds = dstream_create(DINO_COMPRESS_ZLIB);
+    munit_assert_not_null(ds);
+
+    /* Two members back to back, like `cat a.gz b.gz` */
+    Buf *gz = buf_init(2*sizeof(gzsample));
+    memcpy(gz->buf, gzsample, sizeof(gzsample));
+    memcpy(gz->buf+sizeof(gzsample), gzsample, sizeof(gzsample));
+    Buf *out = buf_init(textlen);
+    for (int m=0; m<2; m++) {
+        /* The size comes from the trailer, so we need the member's end */
+        inBuf in = { gz->buf, sizeof(gzsample)*(m+1), sizeof(gzsample)*m };
+        munit_assert_size(dstream_get_uncompressed_size(ds, &in), ==, textlen);
+        in.size = gz->size;
+        out->pos = 0;
+        munit_assert_size(dstream_decompress1(ds, &in, out), ==, 0);
+        munit_assert_size(in.pos, ==, sizeof(gzsample)*(m+1));
+        munit_assert_size(out->pos, ==, textlen);
+        munit_assert_memory_equal(textlen, out->buf, text);
+    }
+    /* The trailer on the end belongs to the second member, so the size of
+     * the first one (which is all dstream_decompress1() reads) is unknown */
+    inBuf both = { gz->buf, gz->size, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &both), ==, UNCOMPRESS_SIZE_UNKNOWN);
+
+    /* Running out of input partway through a member isn't the end of it */
+    inBuf half = { gzsample, sizeof(gzsample)/2, 0 };
+    out->pos = 0;
+    munit_assert_size(dstream_decompress(ds, &half, out), >, 0);
+    inBuf empty = { gzsample, 0, 0 };
+    munit_assert_size(dstream_decompress(ds, &empty, out), >, 0);
+    munit_assert_int(dstream_reset(ds), ==, 1);
+
+    /* A gzip header that's cut short is bad */
+    inBuf shortgz = { gzsample, 10, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &shortgz), ==, UNCOMPRESS_SIZE_ERROR);
+
+    /* zlib-wrapped data decodes fine, but doesn't say how big it is */
+    Buf *zl = make_zlib_stored(text, textlen);
+    inBuf zin = { zl->buf, zl->pos, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &zin), ==, UNCOMPRESS_SIZE_UNKNOWN);
+    out->pos = 0;
+    munit_assert_size(dstream_decompress1(ds, &zin, out), ==, 0);
+    munit_assert_size(out->pos, ==, textlen);
+    munit_assert_memory_equal(textlen, out->buf, text);
+    buf_free(zl);
+
+    /* What we write has a gzip header too */
+    Dino_CStream *cs = cstream_create(DINO_COMPRESS_ZLIB);
+    inBuf in = { text, textlen, 0 };
+    gz->pos = 0;
+    munit_assert_size(cstream_compress1(cs, &in, gz), ==, 0);
+    munit_assert_uint8(((uint8_t *)gz->buf)[0], ==, 0x1f);
+    munit_assert_uint8(((uint8_t *)gz->buf)[1], ==, 0x8b);
+    inBuf frame = { gz->buf, gz->pos, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &frame), ==, textlen);
+
+    cstream_free(cs);
+    dstream_free(ds);
+    buf_free(gz);
+    buf_free(out);
+    return MUNIT_OK;
+}
+
+/* xz keeps the size in the index at the end, and can use threads both ways */
+#define XZ_SAMPLE_SIZE (5<<19)
+MunitResult test_xz(const MunitParameter params[], void* user_data) {
+    if (!compress_avail(DINO_COMPRESS_XZ))
+        return MUNIT_SKIP;
+    /* Big enough that the threaded encoder splits it into (1MB) blocks */
+    Buf *data = buf_init(XZ_SAMPLE_SIZE);
+    for (int i=0; data->pos < data->size; i++)
+        data->pos += make_sample(data->buf+data->pos, data->size-data->pos, i);
+    /* (the last one got cut short) */
+    data->size = MIN(data->pos, data->size);
+    data->pos = 0;
+
+    Dino_COpts opts = COPTS_DEFAULT;
+    opts.level = 0;
+    opts.threads = 2;
+    Dino_CStream *cs = cstream_create(DINO_COMPRESS_XZ);
+    munit_assert_true(cstream_setopts(cs, &opts));
+    Buf *xz = buf_init(2*XZ_SAMPLE_SIZE);
+    munit_assert_size(cstream_compress1(cs, (inBuf *)data, xz), ==, 0);
+    size_t frame = xz->pos;
+
+    /* The size comes from the index, so we need the frame's end */
+    Dino_DStream *ds = dstream_create(DINO_COMPRESS_XZ);
+    inBuf in = { xz->buf, frame, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &in), ==, data->size);
+    in.size = frame - 1;
+    munit_assert_size(dstream_get_uncompressed_size(ds, &in), ==, UNCOMPRESS_SIZE_ERROR);
+    in.size = frame;
+    in.pos = 1;
+    munit_assert_size(dstream_get_uncompressed_size(ds, &in), ==, UNCOMPRESS_SIZE_ERROR);
+
+    /* Two streams back to back, like `cat a.xz b.xz`. Each one is a frame
+     * of its own, so we can't tell the first one's size from the end... */
+    memcpy(xz->buf+frame, xz->buf, frame);
+    inBuf cat = { xz->buf, 2*frame, 0 };
+    munit_assert_size(dstream_get_uncompressed_size(ds, &cat), ==, UNCOMPRESS_SIZE_UNKNOWN);
+    cat.pos = frame;
+    munit_assert_size(dstream_get_uncompressed_size(ds, &cat), ==, data->size);
+    /* ...nor with Stream Padding on the end */
+    memset(xz->buf+frame, 0, 4);
+    in.size = frame + 4;
+    munit_assert_size(dstream_get_uncompressed_size(ds, &in), ==, UNCOMPRESS_SIZE_UNKNOWN);
+    memcpy(xz->buf+frame, xz->buf, 4);
+
+    /* Decoding them one at a time, with or without threads, gets the
+     * original back twice */
+    Buf *check = buf_init(data->size);
+    for (int threads=2; threads>=0; threads-=2) {
+        opts.threads = threads;
+        munit_assert_true(dstream_setopts(ds, &opts));
+        cat.pos = 0;
+        for (int f=0; f<2; f++) {
+            check->pos = 0;
+            munit_assert_size(dstream_decompress1(ds, &cat, check), ==, 0);
+            munit_assert_size(cat.pos, ==, frame*(f+1));
+            munit_assert_size(check->pos, ==, data->size);
+            munit_assert_memory_equal(data->size, check->buf, data->buf);
+            munit_assert_true(dstream_reset(ds));
+        }
+    }
+
+    cstream_free(cs);
+    dstream_free(ds);
+    buf_free(data);
+    buf_free(xz);
+    buf_free(check);
+    return MUNIT_OK;
+}
+
 /* TODO: test flush/end with insufficient buffer space */
 /* TODO: test compression with multiple steps */
 /* TODO: test getsize/setsize */
@@ -159,10 +872,25 @@ static MunitParameterEnum compr_params[] = {
     { NULL, NULL },
 };
 
+static MunitParameterEnum copts_params[] = {
+    { (char*) "algo", (char **)libdino_compression_available },
+    { (char*) "opts", (char*[]) { "default", "fast", "best", "threads", "long", NULL } },
+    { NULL, NULL },
+};
+
 MunitTest compr_tests[] = {
     { "/new", test_stream_new, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
     { "/buf_pos", test_compress_buf_pos, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
     { "/compress1", test_compress1, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
+    { "/copts", test_copts, NULL, NULL, MUNIT_TEST_OPTION_NONE, copts_params },
+    { "/copts_rw", test_copts_rw, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/dict", test_dict, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
+    { "/prefix", test_prefix, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
+    { "/tinybuf", test_tinybuf, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
+    { "/oneshot", test_oneshot, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
+    { "/gzip", test_gzip, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/xz", test_xz, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/pool", test_pool, NULL, NULL, MUNIT_TEST_OPTION_NONE, compr_params },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
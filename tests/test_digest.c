@@ -180,6 +180,45 @@ MunitResult test_digest_multipart(const MunitParameter params[], void* user_data
     return MUNIT_OK;
 }
 
+#define BATCH_MSGS 1000
+
+MunitResult test_hasher_batch(const MunitParameter params[], void* user_data) {
+    Dino_DigestID id = DIGESTID_PARAM("algo");
+    Hasher *h = hasher_create(id);
+    int digestsize = hasher_size(h);
+    const void **inputs = munit_newa(const void *, BATCH_MSGS);
+    size_t *lens = munit_newa(size_t, BATCH_MSGS);
+    /* Lots of small messages (some empty), and a few big enough that the
+     * batch gets spread over some threads */
+    size_t datasize = 8<<20;
+    uint8_t *databuf = munit_malloc(datasize);
+    munit_rand_memory(datasize, databuf);
+    for (int i=0; i<BATCH_MSGS; i++) {
+        lens[i] = (i % 100 == 0) ? (2<<20) + i : munit_rand_int_range(0, 4096);
+        inputs[i] = databuf + munit_rand_int_range(0, datasize - lens[i]);
+    }
+    uint8_t *digests = munit_malloc(BATCH_MSGS*digestsize);
+    uint8_t *digest = munit_malloc(digestsize);
+    for (int threads=1; threads<=4; threads+=3) {
+        memset(digests, 0, BATCH_MSGS*digestsize);
+        munit_assert_int(hasher_batch(id, inputs, lens, BATCH_MSGS, digests, threads), ==, 1);
+        for (int i=0; i<BATCH_MSGS; i++) {
+            munit_assert(hasher_oneshot(h, inputs[i], lens[i], digest));
+            munit_assert_memory_equal(digestsize, digests + i*digestsize, digest);
+        }
+    }
+    munit_assert_int(hasher_batch(id, inputs, lens, 0, digests, 4), ==, 1);
+    munit_assert_int(hasher_batch(DINO_DIGEST_UNKNOWN, inputs, lens, 1, digests, 1), ==, 0);
+
+    free(digest);
+    free(digests);
+    free(databuf);
+    free(lens);
+    free(inputs);
+    hasher_free(h);
+    return MUNIT_OK;
+}
+
 
 static char *digest_algos[] = {
     "md5", "sha1", "ripemd160", "sha256", "sha384", "sha512", "sha224"
@@ -199,6 +238,7 @@ MunitTest hasher_tests[] = {
     //{ "/nullptr", test_hasher_nullptrs, NULL, NULL, MUNIT_TEST_OPTION_NONE, digest_params },
     { "/info", test_digest_info, NULL, NULL, MUNIT_TEST_OPTION_NONE, digest_params },
     { "/multipart", test_digest_multipart, NULL, NULL, MUNIT_TEST_OPTION_NONE, digest_params },
+    { "/batch", test_hasher_batch, NULL, NULL, MUNIT_TEST_OPTION_NONE, digest_params },
     /* End-of-array marker */
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 };
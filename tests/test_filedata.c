@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "dinotest.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/filedata.h"
+#include "../lib/object.h"
+
+#define INTPARAM(name) atoi(munit_parameters_get(params, name))
+
+#define NUM_OBJS 500
+#define CHUNKSIZE 64
+
+/* Write a DINO with the FILEDATA section from `fdata` and its index.
+ * Returns its fd. */
+static int write_filedata_dino(Dino_CompressID id, Dino_Filedata *fdata, size_t count) {
+    static const char namtab[] = ".filedata\0.filedata.idx";
+    Dino_Shdr shdr[2] = { 0 };
+    Buf *data[2];
+    data[0] = filedata_get_data(fdata, &shdr[0]);
+    munit_assert_uint8(shdr[0].type, ==, DINO_SEC_FILEDATA);
+    munit_assert_uint32(shdr[0].count, ==, count);
+    munit_assert_uint32(shdr[0].size, ==, data[0]->pos);
+    data[1] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_index(fdata, 0, data[1], &shdr[1]), ==, data[1]->pos);
+    munit_assert_uint8(shdr[1].type, ==, DINO_SEC_INDEX);
+    munit_assert_uint32(shdr[1].count, ==, count);
+    shdr[1].name = 10;
+    int fd = write_test_dino(id, shdr, data, 2, namtab, sizeof(namtab));
+    buf_free(data[1]);
+    return fd;
+}
+
+/* Add all the test objects to a new FILEDATA section and write it out */
+static int write_objs_dino(Dino_CompressID id, TestObj *objs) {
+    Dino_CStream *cs = cstream_create(id);
+    munit_assert_not_null(cs);
+    Dino_Filedata *fdata = filedata_new(cs, KEYSIZE);
+    munit_assert_not_null(fdata);
+    for (int i=0; i<NUM_OBJS; i++)
+        munit_assert_int(filedata_add(fdata, objs[i].key, objs[i].data, objs[i].size), ==, 1);
+    /* The same key again gets skipped */
+    munit_assert_int(filedata_add(fdata, objs[7].key, objs[7].data, objs[7].size), ==, 0);
+    int fd = write_filedata_dino(id, fdata, NUM_OBJS);
+    filedata_free(fdata);
+    cstream_free(cs);
+    return fd;
+}
+
+MunitResult test_get_objects(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    TestObj *objs = make_objs(NUM_OBJS);
+    int fd = write_objs_dino(id, objs);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".filedata.idx");
+    munit_assert_not_null(idx);
+
+    /* Every object (backwards, so the order doesn't match the section),
+     * one of them twice, and one that isn't there */
+    size_t nreqs = NUM_OBJS+2;
+    Dino_Obj_Req *reqs = munit_newa(Dino_Obj_Req, nreqs);
+    for (int i=0; i<NUM_OBJS; i++)
+        reqs[i] = (Dino_Obj_Req) { objs[NUM_OBJS-1-i].key, buf_init(16), 1 };
+    reqs[NUM_OBJS] = (Dino_Obj_Req) { objs[3].key, buf_init(16), 1 };
+    uint8_t missing[KEYSIZE];
+    memcpy(missing, objs[5].key, KEYSIZE);
+    missing[KEYSIZE-1] ^= 0xff;
+    reqs[NUM_OBJS+1] = (Dino_Obj_Req) { missing, buf_init(16), 1 };
+    /* The output goes wherever out->pos says */
+    reqs[0].out->pos = 5;
+
+    ssize_t r = dino_get_objects(dino, idx, reqs, nreqs, INTPARAM("threads"));
+    munit_assert_int64(r, ==, NUM_OBJS+1);
+    for (int i=0; i<NUM_OBJS; i++) {
+        TestObj *obj = &objs[NUM_OBJS-1-i];
+        size_t start = (i == 0) ? 5 : 0;
+        munit_assert_int64(reqs[i].result, ==, obj->size);
+        munit_assert_size(reqs[i].out->pos, ==, start+obj->size);
+        munit_assert_memory_equal(obj->size, reqs[i].out->buf+start, obj->data);
+    }
+    munit_assert_int64(reqs[NUM_OBJS].result, ==, objs[3].size);
+    munit_assert_memory_equal(objs[3].size, reqs[NUM_OBJS].out->buf, objs[3].data);
+    munit_assert_int64(reqs[NUM_OBJS+1].result, ==, -ENOENT);
+    munit_assert_size(reqs[NUM_OBJS+1].out->pos, ==, 0);
+
+    /* One at a time works too */
+    Buf *out = buf_init(16);
+    for (int i=0; i<NUM_OBJS; i+=37) {
+        out->pos = 0;
+        munit_assert_int64(dino_get_object(dino, idx, objs[i].key, out), ==, objs[i].size);
+        munit_assert_memory_equal(objs[i].size, out->buf, objs[i].data);
+    }
+    munit_assert_int64(dino_get_objects(dino, idx, reqs, 0, 4), ==, 0);
+
+    for (size_t i=0; i<nreqs; i++)
+        buf_free(reqs[i].out);
+    free(reqs);
+    buf_free(out);
+    dino_object_cache_free();
+    free_objs(objs, NUM_OBJS);
+    close(fd);
+    return MUNIT_OK;
+}
+
+/* Check that `key` was stored (un)compressed, and reads back right */
+static void check_stored(Dino *dino, Dino_Index *idx, TestObj *obj, int raw) {
+    Dino_Idx_Val_Unc64 val;
+    index_val_unc64(idx, index_search(idx, obj->key), &val);
+    munit_assert_uint64(val.unc_size, ==, obj->size);
+    if (raw)
+        munit_assert_uint64(val.size, ==, obj->size);
+    else
+        munit_assert_uint64(val.size, <, obj->size);
+    Buf *out = buf_init(16);
+    munit_assert_int64(dino_get_object(dino, idx, obj->key, out), ==, obj->size);
+    munit_assert_memory_equal(obj->size, out->buf, obj->data);
+    buf_free(out);
+}
+
+MunitResult test_raw_objs(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    /* Random data, compressible data, and the same again with a bigger
+     * minimum gain than we can possibly get */
+    TestObj objs[4];
+    for (int i=0; i<4; i++) {
+        munit_rand_memory(KEYSIZE, objs[i].key);
+        objs[i].size = 100000;
+        objs[i].data = munit_malloc(objs[i].size);
+        if (i % 2 == 0)
+            munit_rand_memory(objs[i].size, objs[i].data);
+        else
+            for (size_t off=0; off<objs[i].size; off++)
+                objs[i].data[off] = "hello dino "[off % 11];
+    }
+    Dino_CStream *cs = cstream_create(id);
+    Dino_Filedata *fdata = filedata_new(cs, KEYSIZE);
+    munit_assert_int(filedata_add(fdata, objs[0].key, objs[0].data, objs[0].size), ==, 1);
+    munit_assert_int(filedata_add(fdata, objs[1].key, objs[1].data, objs[1].size), ==, 1);
+    filedata_set_min_gain(fdata, 100);
+    munit_assert_int(filedata_add(fdata, objs[2].key, objs[2].data, objs[2].size), ==, 1);
+    munit_assert_int(filedata_add(fdata, objs[3].key, objs[3].data, objs[3].size), ==, 1);
+    int fd = write_filedata_dino(id, fdata, 4);
+    filedata_free(fdata);
+    cstream_free(cs);
+
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".filedata.idx");
+    munit_assert_not_null(idx);
+    Dino_Idx_Flags flags = index_get_flags(idx);
+    munit_assert_true(flags & DINO_IDX_FLAG_UNC_SIZE);
+    if (id == DINO_COMPRESS_NONE) {
+        /* Everything's raw anyway, so there's nothing to mark */
+        munit_assert_false(flags & DINO_IDX_FLAG_RAW_OBJS);
+        for (int i=0; i<4; i++)
+            check_stored(dino, idx, &objs[i], 1);
+    } else {
+        munit_assert_true(flags & DINO_IDX_FLAG_RAW_OBJS);
+        check_stored(dino, idx, &objs[0], 1);
+        check_stored(dino, idx, &objs[1], 0);
+        check_stored(dino, idx, &objs[2], 1);
+        check_stored(dino, idx, &objs[3], 1);
+    }
+
+    /* The batch reader sorts them out too */
+    Dino_Obj_Req reqs[4];
+    for (int i=0; i<4; i++)
+        reqs[i] = (Dino_Obj_Req) { objs[i].key, buf_init(16), 1 };
+    munit_assert_int64(dino_get_objects(dino, idx, reqs, 4, 2), ==, 4);
+    for (int i=0; i<4; i++) {
+        munit_assert_int64(reqs[i].result, ==, objs[i].size);
+        munit_assert_memory_equal(objs[i].size, reqs[i].out->buf, objs[i].data);
+        buf_free(reqs[i].out);
+        free(objs[i].data);
+    }
+    dino_object_cache_free();
+    close(fd);
+    return MUNIT_OK;
+}
+
+/* xorshift64*, as in bench_compress.c. Where the chunks get cut depends on
+ * the data, so the chunking tests use this to get the same data (and the
+ * same chunks) every time. */
+static uint64_t xorshift(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Compressible, but different all the way through */
+static uint8_t *make_varied(size_t size, uint64_t seed) {
+    uint8_t *data = munit_malloc(size);
+    uint8_t chunk[CHUNKSIZE];
+    for (int i=0; i<CHUNKSIZE; i++)
+        chunk[i] = xorshift(&seed);
+    for (size_t off=0; off<size; off+=CHUNKSIZE) {
+        memcpy(data+off, chunk, MIN(CHUNKSIZE, size-off));
+        uint64_t r = xorshift(&seed);
+        chunk[r % CHUNKSIZE] = r >> 32;
+    }
+    return data;
+}
+
+#define CHUNKED_SIZE (1<<20)
+
+MunitResult test_chunked(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    /* Two versions of a file, with a bit inserted in the middle of v2, and
+     * a small file that we don't bother chunking */
+    TestObj v1, v2, small;
+    v1.size = CHUNKED_SIZE;
+    v1.data = make_varied(v1.size, 0x76312e);
+    v2.size = v1.size + 50;
+    v2.data = munit_malloc(v2.size);
+    memcpy(v2.data, v1.data, v1.size/2);
+    uint8_t *insert = make_varied(50, 0x76322e);
+    memcpy(v2.data + v1.size/2, insert, 50);
+    free(insert);
+    memcpy(v2.data + v1.size/2 + 50, v1.data + v1.size/2, v1.size - v1.size/2);
+    small.size = 1000;
+    small.data = make_varied(small.size, 0x736d616c6c);
+
+    Hasher *hasher = hasher_create(DINO_DIGEST_SHA256);
+    munit_assert_int(hasher_size(hasher), ==, KEYSIZE);
+    hasher_oneshot(hasher, v1.data, v1.size, v1.key);
+    hasher_oneshot(hasher, v2.data, v2.size, v2.key);
+    hasher_oneshot(hasher, small.data, small.size, small.key);
+
+    Dino_CStream *cs = cstream_create(id);
+    Dino_Filedata *fdata = filedata_new(cs, KEYSIZE);
+    Dino_CDC_Params cdc;
+    munit_assert_int(cdc_params_init(&cdc, 4096), ==, 0);
+    munit_assert_int(filedata_add_chunked(fdata, v1.key, v1.data, v1.size), ==, -EINVAL);
+    munit_assert_null(filedata_get_chunklists(fdata, &(Dino_Shdr){ 0 }));
+    Hasher *md5 = hasher_create(DINO_DIGEST_MD5);
+    munit_assert_int(filedata_set_chunking(fdata, &cdc, md5), ==, -EINVAL);
+    hasher_free(md5);
+    munit_assert_int(filedata_set_chunking(fdata, &cdc, hasher), ==, 0);
+    munit_assert_int(filedata_add_chunked(fdata, v1.key, v1.data, v1.size), ==, 1);
+    Dino_Shdr shdr[4] = { 0 };
+    Buf *data[4];
+    filedata_get_data(fdata, &shdr[0]);
+    size_t v1_chunks = shdr[0].count;
+    munit_assert_int(filedata_add_chunked(fdata, v2.key, v2.data, v2.size), ==, 1);
+    munit_assert_int(filedata_add_chunked(fdata, v1.key, v1.data, v1.size), ==, 0);
+    munit_assert_int(filedata_add(fdata, small.key, small.data, small.size), ==, 1);
+
+    /* v2 should only have added the few chunks around the insert (and the
+     * small file is one more) */
+    data[0] = filedata_get_data(fdata, &shdr[0]);
+    munit_assert_size(shdr[0].count, >, v1_chunks+1);
+    munit_assert_size(shdr[0].count, <=, v1_chunks+1+4);
+    data[1] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_index(fdata, 0, data[1], &shdr[1]), >, 0);
+    data[2] = filedata_get_chunklists(fdata, &shdr[2]);
+    munit_assert_uint8(shdr[2].type, ==, DINO_SEC_CHUNKLIST);
+    munit_assert_uint32(shdr[2].count, ==, 2);
+    data[3] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_chunklist_index(fdata, 2, data[3], &shdr[3]), >, 0);
+    static const char namtab[] = ".filedata\0.filedata.idx\0.chunks\0.chunks.idx";
+    shdr[1].name = 10;
+    shdr[2].name = 24;
+    shdr[3].name = 32;
+    int fd = write_test_dino(id, shdr, data, 4, namtab, sizeof(namtab));
+    buf_free(data[1]);
+    buf_free(data[3]);
+    filedata_free(fdata);
+    cstream_free(cs);
+
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 2);
+    Dino_Index *chunks = get_index_byname(dino, ".filedata.idx");
+    Dino_Index *files = get_index_byname(dino, ".chunks.idx");
+    munit_assert_not_null(chunks);
+    munit_assert_not_null(files);
+    Buf *out = buf_init(16);
+    out->pos = 7;
+    munit_assert_int64(dino_get_chunked_object(dino, files, chunks, v1.key, out), ==, v1.size);
+    munit_assert_size(out->pos, ==, 7+v1.size);
+    munit_assert_memory_equal(v1.size, out->buf+7, v1.data);
+    out->pos = 0;
+    munit_assert_int64(dino_get_chunked_object(dino, files, chunks, v2.key, out), ==, v2.size);
+    munit_assert_memory_equal(v2.size, out->buf, v2.data);
+    /* The small one is a plain object; it's not in the chunk lists */
+    out->pos = 0;
+    munit_assert_int64(dino_get_chunked_object(dino, files, chunks, small.key, out), ==, -ENOENT);
+    munit_assert_size(out->pos, ==, 0);
+    munit_assert_int64(dino_get_object(dino, chunks, small.key, out), ==, small.size);
+    munit_assert_memory_equal(small.size, out->buf, small.data);
+
+    buf_free(out);
+    hasher_free(hasher);
+    dino_object_cache_free();
+    free(v1.data);
+    free(v2.data);
+    free(small.data);
+    close(fd);
+    return MUNIT_OK;
+}
+
+#define DELTA_SIZE (256<<10)
+#define DELTA_VERSIONS (DINO_DELTA_DEPTH_MAX+2)
+
+MunitResult test_deltas(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = compress_id(munit_parameters_get(params, "algo"));
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    /* A file with a few bytes changed in each version, so each one can be
+     * a delta against the one before - enough of them to go past the max
+     * chain depth - and an unrelated file. They're random, so only a delta
+     * can save anything. */
+    TestObj vers[DELTA_VERSIONS], other;
+    for (int v=0; v<DELTA_VERSIONS; v++) {
+        munit_rand_memory(KEYSIZE, vers[v].key);
+        vers[v].size = DELTA_SIZE;
+        vers[v].data = munit_malloc(DELTA_SIZE);
+        if (v == 0) {
+            munit_rand_memory(DELTA_SIZE, vers[v].data);
+            continue;
+        }
+        memcpy(vers[v].data, vers[v-1].data, DELTA_SIZE);
+        for (int i=0; i<8; i++)
+            vers[v].data[munit_rand_int_range(0, DELTA_SIZE-1)] ^= 0x5a;
+    }
+    munit_rand_memory(KEYSIZE, other.key);
+    other.size = DELTA_SIZE;
+    other.data = munit_malloc(DELTA_SIZE);
+    munit_rand_memory(DELTA_SIZE, other.data);
+
+    Dino_CStream *cs = cstream_create(id);
+    Dino_Filedata *fdata = filedata_new(cs, KEYSIZE);
+    munit_assert_int(filedata_add(fdata, vers[0].key, vers[0].data, DELTA_SIZE), ==, 1);
+    if (id != DINO_COMPRESS_ZSTD) {
+        munit_assert_int(filedata_add_delta(fdata, vers[1].key, vers[1].data, DELTA_SIZE,
+                                            vers[0].key, vers[0].data, DELTA_SIZE), ==, -ENOTSUP);
+        munit_assert_null(filedata_get_deltas(fdata, &(Dino_Shdr){ 0 }));
+        goto done;
+    }
+    munit_assert_int(filedata_add_delta(fdata, vers[1].key, vers[1].data, DELTA_SIZE,
+                                        other.key, other.data, DELTA_SIZE), ==, -ENOENT);
+    for (int v=1; v<DELTA_VERSIONS; v++)
+        munit_assert_int(filedata_add_delta(fdata, vers[v].key, vers[v].data, DELTA_SIZE,
+                                            vers[v-1].key, vers[v-1].data, DELTA_SIZE), ==, 1);
+    munit_assert_int(filedata_add_delta(fdata, vers[1].key, vers[1].data, DELTA_SIZE,
+                                        vers[0].key, vers[0].data, DELTA_SIZE), ==, 0);
+    munit_assert_int(filedata_add(fdata, vers[1].key, vers[1].data, DELTA_SIZE), ==, 0);
+    /* The base doesn't help at all here */
+    munit_assert_int(filedata_add_delta(fdata, other.key, other.data, DELTA_SIZE,
+                                        vers[0].key, vers[0].data, DELTA_SIZE), ==, 1);
+
+    /* The last version should have started a new chain, and the unrelated
+     * file should be a normal object */
+    Dino_Shdr shdr[4] = { 0 };
+    Buf *data[4];
+    data[0] = filedata_get_data(fdata, &shdr[0]);
+    munit_assert_uint32(shdr[0].count, ==, 3);
+    data[1] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_index(fdata, 0, data[1], &shdr[1]), >, 0);
+    data[2] = filedata_get_deltas(fdata, &shdr[2]);
+    munit_assert_uint8(shdr[2].type, ==, DINO_SEC_FILEDELTA);
+    munit_assert_uint32(shdr[2].count, ==, DINO_DELTA_DEPTH_MAX);
+    /* A few changed bytes should cost a lot less than a whole frame */
+    munit_assert_size(data[2]->pos, <, DINO_DELTA_DEPTH_MAX*2048);
+    data[3] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_delta_index(fdata, 2, data[3], &shdr[3]), >, 0);
+    static const char namtab[] = ".filedata\0.filedata.idx\0.deltas\0.deltas.idx";
+    shdr[1].name = 10;
+    shdr[2].name = 24;
+    shdr[3].name = 32;
+    int fd = write_test_dino(id, shdr, data, 4, namtab, sizeof(namtab));
+    buf_free(data[1]);
+    buf_free(data[3]);
+
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 2);
+    Dino_Index *objs = get_index_byname(dino, ".filedata.idx");
+    Dino_Index *deltas = get_index_byname(dino, ".deltas.idx");
+    munit_assert_not_null(objs);
+    munit_assert_not_null(deltas);
+    Buf *out = buf_init(16);
+    /* The whole chain, without any bases cached */
+    out->pos = 7;
+    TestObj *last = &vers[DINO_DELTA_DEPTH_MAX];
+    munit_assert_int64(dino_get_delta_object(dino, deltas, objs, last->key, out), ==, DELTA_SIZE);
+    munit_assert_size(out->pos, ==, 7+DELTA_SIZE);
+    munit_assert_memory_equal(DELTA_SIZE, out->buf+7, last->data);
+    for (int v=0; v<DELTA_VERSIONS; v++) {
+        out->pos = 0;
+        munit_assert_int64(dino_get_delta_object(dino, deltas, objs, vers[v].key, out), ==, DELTA_SIZE);
+        munit_assert_memory_equal(DELTA_SIZE, out->buf, vers[v].data);
+    }
+    out->pos = 0;
+    munit_assert_int64(dino_get_delta_object(dino, deltas, objs, other.key, out), ==, DELTA_SIZE);
+    munit_assert_memory_equal(DELTA_SIZE, out->buf, other.data);
+    uint8_t missing[KEYSIZE];
+    munit_rand_memory(KEYSIZE, missing);
+    out->pos = 0;
+    munit_assert_int64(dino_get_delta_object(dino, deltas, objs, missing, out), ==, -ENOENT);
+    munit_assert_size(out->pos, ==, 0);
+    buf_free(out);
+    close(fd);
+
+done:
+    filedata_free(fdata);
+    cstream_free(cs);
+    dino_object_cache_free();
+    for (int v=0; v<DELTA_VERSIONS; v++)
+        free(vers[v].data);
+    free(other.data);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum algo_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum get_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { (char*) "threads", (char*[]) { "1", "4", NULL } },
+    { NULL, NULL },
+};
+
+MunitTest filedata_tests[] = {
+    { "/get_objects", test_get_objects, NULL, NULL, MUNIT_TEST_OPTION_NONE, get_params },
+    { "/raw_objs", test_raw_objs, NULL, NULL, MUNIT_TEST_OPTION_NONE, algo_params },
+    { "/chunked", test_chunked, NULL, NULL, MUNIT_TEST_OPTION_NONE, algo_params },
+    { "/deltas", test_deltas, NULL, NULL, MUNIT_TEST_OPTION_NONE, algo_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite filedata_suite = {
+    "/libdino/filedata",
+    filedata_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&filedata_suite, (void*) "libdino", argc, argv);
+};
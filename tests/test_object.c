@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "munit.h"
+#include "dinotest.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/object.h"
+
+#define INTPARAM(name) atoi(munit_parameters_get(params, name))
+
+#define NUM_OBJS 64
+
+static int cmpobj(const void *a, const void *b) {
+    return memcmp(((const TestObj *)a)->key, ((const TestObj *)b)->key, KEYSIZE);
+}
+
+/* make_objs(), sorted by key, the way they go in the index */
+static TestObj *make_sorted_objs(void) {
+    TestObj *objs = make_objs(NUM_OBJS);
+    qsort(objs, NUM_OBJS, sizeof(TestObj), cmpobj);
+    return objs;
+}
+
+/* Compress (or don't) one object, appending it to `out` */
+static size_t put_obj(Dino_CompressID id, Dino_COpts *copts, TestObj *obj, Buf *out) {
+    munit_assert_true(buf_reserve(out, (obj->size*2)+1024));
+    if (id == DINO_COMPRESS_NONE) {
+        memcpy(out->buf+out->pos, obj->data, obj->size);
+        out->pos += obj->size;
+        return obj->size;
+    }
+    size_t start = out->pos;
+    Dino_CStream *cs = cstream_create(id);
+    munit_assert_not_null(cs);
+    if (copts)
+        munit_assert_int(cstream_setopts(cs, copts), ==, 1);
+    inBuf in = { obj->data, obj->size, 0 };
+    if (copts) {
+        /* Don't give the compressor the size: that way zstd puts the whole
+         * window size in the frame header, rather than shrinking the window
+         * to fit, so the decoder actually needs the options. */
+        cstream_compress(cs, &in, out);
+        while (cstream_compress_end(cs, out))
+            munit_assert_true(buf_reserve(out, PAGESIZE));
+    } else {
+        cstream_compress1(cs, &in, out);
+    }
+    munit_assert_size(in.pos, ==, in.size);
+    cstream_free(cs);
+    return out->pos - start;
+}
+
+/* Write a DINO with two sections - a blob of objects and an index for them -
+ * plus a third with the compression options, if `copts` isn't NULL.
+ * Returns its fd. */
+static int write_objs_dino_copts(Dino_CompressID id, Dino_Idx_Flags idxflags,
+                                 TestObj *objs, Dino_COpts *copts) {
+    static const char namtab[] = ".data\0.data.idx\0.copts";
+    Dino_Shdr shdr[3] = { 0 };
+    int nsec = copts ? 3 : 2;
+
+    /* section 0: the objects */
+    Buf *data = buf_init(PAGESIZE);
+    Dino_Idx_Val_Unc32 vals[NUM_OBJS];
+    for (int i=0; i<NUM_OBJS; i++) {
+        vals[i].offset = data->pos;
+        vals[i].size = put_obj(id, copts, &objs[i], data);
+        vals[i].unc_size = objs[i].size;
+    }
+    shdr[0] = (Dino_Shdr) {
+        .name = 0,
+        .type = DINO_SEC_BLOB,
+        .flags = (id == DINO_COMPRESS_NONE) ? 0 : DINO_FLAG_COMPRESSED,
+        .size = data->pos,
+        .count = NUM_OBJS,
+    };
+
+    /* section 1: fanout + keys + vals */
+    Buf *idx = buf_init(PAGESIZE);
+    Dino_Idx_Cnt fanout[256] = { 0 };
+    for (int i=0; i<NUM_OBJS; i++)
+        for (int b=objs[i].key[0]; b<256; b++)
+            fanout[b]++;
+    munit_assert_true(buf_reserve(idx, sizeof(fanout) + NUM_OBJS*(KEYSIZE+sizeof(vals[0]))));
+    memcpy(idx->buf, fanout, sizeof(fanout));
+    idx->pos += sizeof(fanout);
+    for (int i=0; i<NUM_OBJS; i++, idx->pos += KEYSIZE)
+        memcpy(idx->buf+idx->pos, objs[i].key, KEYSIZE);
+    for (int i=0; i<NUM_OBJS; i++) {
+        size_t valsize = (idxflags & DINO_IDX_FLAG_UNC_SIZE) ?
+                         sizeof(Dino_Idx_Val_Unc32) : sizeof(Dino_Idx_Val32);
+        memcpy(idx->buf+idx->pos, &vals[i], valsize);
+        idx->pos += valsize;
+    }
+    shdr[1] = (Dino_Shdr) {
+        .name = 6,
+        .type = DINO_SEC_INDEX,
+        .info = KEYSIZE | (0 << 8) | (idxflags << 16),
+        .size = idx->pos,
+        .count = NUM_OBJS,
+    };
+
+    /* section 2: compression options */
+    Buf *optbuf = buf_init(16);
+    if (copts) {
+        munit_assert_int64(copts_write(copts, optbuf), >, 0);
+        shdr[2] = (Dino_Shdr) {
+            .name = 16,
+            .type = DINO_SEC_COPTS,
+            .size = optbuf->pos,
+        };
+    }
+
+    Buf *bufs[3] = { data, idx, optbuf };
+    int fd = write_test_dino(id, shdr, bufs, nsec, namtab, sizeof(namtab));
+    buf_free(data);
+    buf_free(idx);
+    buf_free(optbuf);
+    return fd;
+}
+
+static int write_objs_dino(Dino_CompressID id, Dino_Idx_Flags idxflags, TestObj *objs) {
+    return write_objs_dino_copts(id, idxflags, objs, NULL);
+}
+
+static Dino_CompressID get_algo(const MunitParameter params[]) {
+    return compress_id(munit_parameters_get(params, "algo"));
+}
+
+MunitResult test_get_object(const MunitParameter params[], void *data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    Dino_Idx_Flags flags = INTPARAM("uncsize") ? DINO_IDX_FLAG_UNC_SIZE : 0;
+    TestObj *objs = make_sorted_objs();
+    int fd = write_objs_dino(id, flags, objs);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".data.idx");
+    munit_assert_not_null(idx);
+
+    /* Fetch everything twice (so we reuse the cached contexts), appending
+     * to the same buffer each time */
+    Buf *out = buf_init(16);
+    for (int pass=0; pass<2; pass++) {
+        for (int i=0; i<NUM_OBJS; i++) {
+            size_t start = out->pos;
+            ssize_t r = dino_get_object(dino, idx, objs[i].key, out);
+            munit_assert_int64(r, ==, objs[i].size);
+            munit_assert_size(out->pos, ==, start+r);
+            munit_assert_memory_equal(r, out->buf+start, objs[i].data);
+        }
+        out->pos = 0;
+    }
+
+    /* Missing keys aren't found */
+    uint8_t key[KEYSIZE];
+    memcpy(key, objs[NUM_OBJS/2].key, KEYSIZE);
+    key[KEYSIZE-1] ^= 0xff;
+    munit_assert_int64(dino_get_object(dino, idx, key, out), ==, -ENOENT);
+    munit_assert_size(out->pos, ==, 0);
+
+    buf_free(out);
+    dino_object_cache_free();
+    free_objs(objs, NUM_OBJS);
+    close(fd);
+    return MUNIT_OK;
+}
+
+MunitResult test_write_object(const MunitParameter params[], void *data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    Dino_Idx_Flags flags = INTPARAM("uncsize") ? DINO_IDX_FLAG_UNC_SIZE : 0;
+    TestObj *objs = make_sorted_objs();
+    int fd = write_objs_dino(id, flags, objs);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".data.idx");
+    munit_assert_not_null(idx);
+
+    FILE *outfp = tmpfile();
+    int outfd = fileno(outfp);
+    uint8_t *check = munit_malloc(1<<20);
+    /* The second time round, O_APPEND stops the kernel copying it for us */
+    for (int pass=0; pass<2; pass++) {
+        if (pass)
+            munit_assert_int(fcntl(outfd, F_SETFL, O_APPEND), ==, 0);
+        for (int i=0; i<NUM_OBJS; i++) {
+            munit_assert_int(ftruncate(outfd, 0), ==, 0);
+            munit_assert_int(lseek(outfd, 0, SEEK_SET), ==, 0);
+            ssize_t r = dino_write_object(dino, idx, objs[i].key, outfd);
+            munit_assert_int64(r, ==, objs[i].size);
+            munit_assert_int64(pread(outfd, check, r, 0), ==, r);
+            munit_assert_memory_equal(r, check, objs[i].data);
+        }
+    }
+
+    free(check);
+    fclose(outfp);
+    dino_object_cache_free();
+    free_objs(objs, NUM_OBJS);
+    close(fd);
+    return MUNIT_OK;
+}
+
+MunitResult test_slice_object(const MunitParameter params[], void *data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    Dino_Idx_Flags flags = INTPARAM("uncsize") ? DINO_IDX_FLAG_UNC_SIZE : 0;
+    TestObj *objs = make_sorted_objs();
+    int fd = write_objs_dino(id, flags, objs);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".data.idx");
+    munit_assert_not_null(idx);
+
+    size_t filesize = lseek(fd, 0, SEEK_END);
+    void *map = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    munit_assert_ptr_not_equal(map, MAP_FAILED);
+    Slice file = { map, filesize, 0 }, obj;
+    for (int i=0; i<NUM_OBJS; i++) {
+        ssize_t r = dino_slice_object(dino, idx, objs[i].key, &file, &obj);
+        if (id != DINO_COMPRESS_NONE) {
+            munit_assert_int64(r, ==, -ENOTSUP);
+            continue;
+        }
+        /* It's the data in the map itself, not a copy */
+        munit_assert_int64(r, ==, objs[i].size);
+        munit_assert_size(obj.size, ==, objs[i].size);
+        munit_assert_ptr(obj.buf, >=, map);
+        munit_assert_ptr(obj.buf + obj.size, <=, map + filesize);
+        munit_assert_memory_equal(r, obj.buf, objs[i].data);
+    }
+    if (id == DINO_COMPRESS_NONE) {
+        /* The big one doesn't fit in the first half of the file */
+        Slice half = { map, filesize/2, 0 };
+        int big = 0;
+        while (objs[big].size != 1<<20)
+            big++;
+        munit_assert_int64(dino_slice_object(dino, idx, objs[big].key, &half, &obj), ==, -ERANGE);
+    }
+    uint8_t key[KEYSIZE];
+    memcpy(key, objs[0].key, KEYSIZE);
+    key[KEYSIZE-1] ^= 0xff;
+    munit_assert_int64(dino_slice_object(dino, idx, key, &file, &obj), ==, -ENOENT);
+
+    munit_assert_int(munmap(map, filesize), ==, 0);
+    free_objs(objs, NUM_OBJS);
+    close(fd);
+    return MUNIT_OK;
+}
+
+/* Objects compressed with non-default options - including a zstd window
+ * bigger than the decoder allows by default - can still be fetched, since
+ * we pick up the options from the compress_opts section. */
+MunitResult test_get_object_copts(const MunitParameter params[], void *data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    Dino_COpts copts = COPTS_DEFAULT;
+    copts.level = 1;
+    copts.long_distance = 1;
+    copts.window_log = 28;
+    TestObj *objs = make_sorted_objs();
+    /* zstd treats anything without a dictionary header as a raw-content
+     * dictionary; that's good enough to check we're using the same one */
+    uint8_t dict[4096];
+    munit_rand_memory(sizeof(dict), dict);
+    copts.dictdata = dict;
+    copts.dictsize = sizeof(dict);
+    int fd = write_objs_dino_copts(id, DINO_IDX_FLAG_UNC_SIZE, objs, &copts);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+
+    Dino_DOpts dopts;
+    munit_assert_int(dino_get_dopts(dino, &dopts), ==, 1);
+    munit_assert_int(dopts.level, ==, 1);
+    munit_assert_int(dopts.window_log, ==, 28);
+    munit_assert_int(dopts.long_distance, ==, 1);
+    munit_assert_size(dopts.dictsize, ==, sizeof(dict));
+    munit_assert_memory_equal(sizeof(dict), dopts.dictdata, dict);
+
+    munit_assert_int(load_indexes(dino), ==, 1);
+    Dino_Index *idx = get_index_byname(dino, ".data.idx");
+    Buf *out = buf_init(16);
+    for (int i=0; i<NUM_OBJS; i++) {
+        out->pos = 0;
+        munit_assert_int64(dino_get_object(dino, idx, objs[i].key, out), ==, objs[i].size);
+        munit_assert_memory_equal(objs[i].size, out->buf, objs[i].data);
+    }
+
+    /* A DINO without options gets the defaults */
+    int fd2 = write_objs_dino(id, 0, objs);
+    Dino *dino2 = read_dino(fd2);
+    munit_assert_not_null(dino2);
+    munit_assert_int(dino_get_dopts(dino2, &dopts), ==, 0);
+    munit_assert_int(dopts.level, ==, COMPRESS_LEVEL_DEFAULT);
+    munit_assert_int(dopts.window_log, ==, 0);
+    munit_assert_null(dopts.dictdata);
+
+    /* ...and switching back and forth between the two works */
+    munit_assert_int(load_indexes(dino2), ==, 1);
+    Dino_Index *idx2 = get_index_byname(dino2, ".data.idx");
+    for (int i=0; i<NUM_OBJS; i++) {
+        out->pos = 0;
+        Dino *d = (i & 1) ? dino : dino2;
+        munit_assert_int64(dino_get_object(d, (i & 1) ? idx : idx2, objs[i].key, out),
+                           ==, objs[i].size);
+        munit_assert_memory_equal(objs[i].size, out->buf, objs[i].data);
+    }
+
+    buf_free(out);
+    dino_object_cache_free();
+    free_objs(objs, NUM_OBJS);
+    close(fd);
+    close(fd2);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum object_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { (char*) "uncsize", (char*[]) { "0", "1", NULL } },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum copts_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { NULL, NULL },
+};
+
+MunitTest object_tests[] = {
+    { "/get", test_get_object, NULL, NULL, MUNIT_TEST_OPTION_NONE, object_params },
+    { "/write", test_write_object, NULL, NULL, MUNIT_TEST_OPTION_NONE, object_params },
+    { "/slice", test_slice_object, NULL, NULL, MUNIT_TEST_OPTION_NONE, object_params },
+    { "/copts", test_get_object_copts, NULL, NULL, MUNIT_TEST_OPTION_NONE, copts_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite object_suite = {
+    "/libdino/object",
+    object_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&object_suite, (void*) "libdino", argc, argv);
+};
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/pipeline.h"
+
+#define DATASIZE ((1<<20) + 12345)
+#define CHUNKSIZE 100
+
+/* Random chunks, each repeated a few times, so it compresses some */
+static uint8_t *make_data(size_t size) {
+    uint8_t *data = munit_malloc(size);
+    uint8_t chunk[CHUNKSIZE];
+    for (size_t off=0; off<size; off+=CHUNKSIZE) {
+        if (off % (CHUNKSIZE*4) == 0)
+            munit_rand_memory(CHUNKSIZE, chunk);
+        memcpy(data+off, chunk, MIN(CHUNKSIZE, size-off));
+    }
+    return data;
+}
+
+/* Decompress the frame in `in` and check it matches `data` */
+static void check_frame(Dino_CompressID id, const void *in, size_t insize,
+                        const void *data, size_t size) {
+    Dino_DStream *ds = dstream_create(id);
+    munit_assert_not_null(ds);
+    uint8_t *out = munit_malloc(size+1);
+    inBuf ib = { in, insize, 0 };
+    outBuf ob = { out, size+1, 0 };
+    munit_assert_size(dstream_decompress1(ds, &ib, &ob), ==, 0);
+    munit_assert_size(ob.pos, ==, size);
+    munit_assert_memory_equal(size, out, data);
+    free(out);
+    dstream_free(ds);
+}
+
+static Dino_CompressID get_algo(const MunitParameter params[]) {
+    return compress_id(munit_parameters_get(params, "algo"));
+}
+
+MunitResult test_hash_compress(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    uint8_t *data = make_data(DATASIZE);
+    Hasher *h = hasher_create(DINO_DIGEST_SHA256);
+    Dino_CStream *cs = cstream_create(id);
+    Buf *out = buf_init(16);
+    Dino_Pipeline *p = pipeline_new(0);
+    munit_assert_not_null(p);
+    munit_assert_int(pipeline_add_hasher(p, h), ==, 0);
+    munit_assert_int(pipeline_add_compress(p, cs), ==, 1);
+    munit_assert_int(pipeline_add_buf(p, out), ==, 2);
+
+    uint8_t digest[32], expected[32];
+    munit_assert(hasher_oneshot(h, data, DATASIZE, expected));
+    /* Twice, to check it all gets ready to go again */
+    for (int pass=0; pass<2; pass++) {
+        out->pos = 0;
+        hasher_start(h);
+        munit_assert(cstream_reset(cs));
+        cstream_compress_start(cs, DATASIZE);
+        /* Feed it in odd-sized pieces */
+        for (size_t off=0, n; off<DATASIZE; off+=n) {
+            n = MIN((size_t)munit_rand_int_range(1, 200000), DATASIZE-off);
+            munit_assert_int(pipeline_write(p, data+off, n), ==, 0);
+        }
+        munit_assert_int64(pipeline_finish(p), ==, out->pos);
+        hasher_finish(h, digest);
+        munit_assert_memory_equal(sizeof(digest), digest, expected);
+        check_frame(id, out->buf, out->pos, data, DATASIZE);
+    }
+
+    /* Starting at the compressor skips the hasher */
+    out->pos = 0;
+    hasher_start(h);
+    munit_assert(cstream_reset(cs));
+    cstream_compress_start(cs, 2*CHUNKSIZE);
+    munit_assert_int(pipeline_write_at(p, 1, data, CHUNKSIZE), ==, 0);
+    munit_assert_int(pipeline_write(p, data+CHUNKSIZE, CHUNKSIZE), ==, 0);
+    munit_assert_int64(pipeline_finish(p), >, 0);
+    hasher_finish(h, digest);
+    munit_assert(hasher_oneshot(h, data+CHUNKSIZE, CHUNKSIZE, expected));
+    munit_assert_memory_equal(sizeof(digest), digest, expected);
+    check_frame(id, out->buf, out->pos, data, 2*CHUNKSIZE);
+    munit_assert_int(pipeline_write_at(p, 4, data, 1), ==, -EINVAL);
+    munit_assert_int(pipeline_write_at(p, -1, data, 1), ==, -EINVAL);
+
+    pipeline_free(p);
+    buf_free(out);
+    cstream_free(cs);
+    hasher_free(h);
+    free(data);
+    return MUNIT_OK;
+}
+
+/* The payload path: decompress, hash, recompress (with something else),
+ * write it out. */
+MunitResult test_recompress(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = get_algo(params);
+    Dino_CompressID from = DINO_COMPRESS_ZSTD;
+    if (!compress_avail(id) || !compress_avail(from))
+        return MUNIT_SKIP;
+    uint8_t *data = make_data(DATASIZE);
+    Buf *frame = buf_init(DATASIZE*2);
+    Dino_CStream *cs = cstream_create(from);
+    inBuf in = { data, DATASIZE, 0 };
+    munit_assert_size(cstream_compress1(cs, &in, frame), ==, 0);
+    cstream_free(cs);
+
+    Hasher *h = hasher_create(DINO_DIGEST_SHA256);
+    Dino_DStream *ds = dstream_create(from);
+    cs = cstream_create(id);
+    FILE *fp = tmpfile();
+    munit_assert_not_null(fp);
+    int fd = fileno(fp);
+    Dino_Pipeline *p = pipeline_new(PIPELINE_BLOCK_MIN);
+    munit_assert_int(pipeline_add_decompress(p, ds), ==, 0);
+    munit_assert_int(pipeline_add_hasher(p, h), ==, 1);
+    munit_assert_int(pipeline_add_compress(p, cs), ==, 2);
+    munit_assert_int(pipeline_add_fd(p, fd), ==, 3);
+
+    uint8_t digest[32], expected[32];
+    hasher_start(h);
+    cstream_compress_start(cs, DATASIZE);
+    munit_assert_int(pipeline_write(p, frame->buf, frame->pos), ==, 0);
+    ssize_t outsize = pipeline_finish(p);
+    munit_assert_int64(outsize, >, 0);
+    hasher_finish(h, digest);
+    munit_assert(hasher_oneshot(h, data, DATASIZE, expected));
+    munit_assert_memory_equal(sizeof(digest), digest, expected);
+    uint8_t *written = munit_malloc(outsize);
+    munit_assert_int64(pread(fd, written, outsize, 0), ==, outsize);
+    check_frame(id, written, outsize, data, DATASIZE);
+    free(written);
+
+    /* A frame that's cut short, or has junk after it, is an error */
+    dstream_reset(ds);
+    cstream_reset(cs);
+    hasher_start(h);
+    munit_assert_int(pipeline_write(p, frame->buf, frame->pos/2), ==, 0);
+    munit_assert_int64(pipeline_finish(p), ==, -EIO);
+    dstream_reset(ds);
+    cstream_reset(cs);
+    hasher_start(h);
+    munit_assert_int(pipeline_write(p, frame->buf, frame->pos), ==, 0);
+    munit_assert_int(pipeline_write(p, frame->buf, 1), ==, -EIO);
+
+    /* There's only room for so many stages */
+    for (int i=4; i<PIPELINE_STAGES_MAX; i++)
+        munit_assert_int(pipeline_add_hasher(p, h), ==, i);
+    munit_assert_int(pipeline_add_hasher(p, h), ==, -ENOSPC);
+
+    pipeline_free(p);
+    fclose(fp);
+    dstream_free(ds);
+    cstream_free(cs);
+    hasher_free(h);
+    buf_free(frame);
+    free(data);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum pipeline_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { NULL, NULL },
+};
+
+MunitTest pipeline_tests[] = {
+    { "/hash_compress", test_hash_compress, NULL, NULL, MUNIT_TEST_OPTION_NONE, pipeline_params },
+    { "/recompress", test_recompress, NULL, NULL, MUNIT_TEST_OPTION_NONE, pipeline_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite pipeline_suite = {
+    "/libdino/pipeline",
+    pipeline_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&pipeline_suite, (void*) "libdino", argc, argv);
+};
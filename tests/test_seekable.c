@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "dinotest.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/object.h"
+#include "../lib/seekable.h"
+
+#define INTPARAM(name) atoi(munit_parameters_get(params, name))
+
+#define DATASIZE ((1<<20) + 12345)
+#define FRAMESIZE (64<<10)
+#define CHUNKSIZE 200
+
+/* Compressible, but different all the way through, so reading from the
+ * wrong place can't give the right answer by accident */
+static uint8_t *make_data(size_t size) {
+    uint8_t *data = munit_malloc(size);
+    uint8_t chunk[CHUNKSIZE];
+    munit_rand_memory(CHUNKSIZE, chunk);
+    for (size_t off=0; off<size; off+=CHUNKSIZE) {
+        memcpy(data+off, chunk, MIN(CHUNKSIZE, size-off));
+        chunk[munit_rand_int_range(0, CHUNKSIZE-1)] = munit_rand_uint32();
+        chunk[munit_rand_int_range(0, CHUNKSIZE-1)] = (off >> 8);
+    }
+    return data;
+}
+
+/* Write a DINO whose only section holds `secdata`. Returns its fd. */
+static int write_blob_dino(Dino_CompressID id, Dino_Secflags flags, Buf *secdata) {
+    static const char namtab[] = ".data";
+    Dino_Shdr shdr = {
+        .name = 0,
+        .type = DINO_SEC_BLOB,
+        .flags = flags,
+        .size = secdata->pos,
+    };
+    return write_test_dino(id, &shdr, &secdata, 1, namtab, sizeof(namtab));
+}
+
+static int write_seekable_dino(Dino_CompressID id, const uint8_t *data, size_t size) {
+    Dino_CStream *cs = cstream_create(id);
+    munit_assert_not_null(cs);
+    Buf *sec = buf_init(PAGESIZE);
+    ssize_t r = seekable_write(cs, data, size, FRAMESIZE, sec);
+    munit_assert_int64(r, ==, sec->pos);
+    /* the frames, then an entry for each one, then the count */
+    munit_assert_int64(r, >, ((size+FRAMESIZE-1)/FRAMESIZE)*sizeof(Dino_Seek_Entry));
+    Dino_Secflags flags = DINO_FLAG_SEEKABLE;
+    if (id != DINO_COMPRESS_NONE)
+        flags |= DINO_FLAG_COMPRESSED;
+    int fd = write_blob_dino(id, flags, sec);
+    buf_free(sec);
+    cstream_free(cs);
+    return fd;
+}
+
+static Dino_CompressID get_algo(const MunitParameter params[]) {
+    return compress_id(munit_parameters_get(params, "algo"));
+}
+
+/* Read [off, off+len) and check it's what we expect */
+static void check_read(Dino_Seekable *sk, const uint8_t *data, size_t size,
+                       Dino_Off64 off, size_t len, Buf *out) {
+    size_t expect = (off < size) ? MIN(len, size-off) : 0;
+    out->pos = 3;
+    munit_assert_int64(dino_seekable_read_at(sk, off, len, out), ==, expect);
+    munit_assert_size(out->pos, ==, 3+expect);
+    munit_assert_memory_equal(expect, out->buf+3, data+off);
+}
+
+MunitResult test_read_at(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    uint8_t *data = make_data(DATASIZE);
+    int fd = write_seekable_dino(id, data, DATASIZE);
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    Dino_Seekable *sk = dino_seekable_open(dino, 0);
+    munit_assert_not_null(sk);
+    munit_assert_uint64(dino_seekable_size(sk), ==, DATASIZE);
+    dino_seekable_set_threads(sk, INTPARAM("threads"));
+
+    Buf *out = buf_init(16);
+    /* All of it, the edges of the frames, and the very end */
+    check_read(sk, data, DATASIZE, 0, DATASIZE, out);
+    check_read(sk, data, DATASIZE, 0, 1, out);
+    check_read(sk, data, DATASIZE, FRAMESIZE-1, 2, out);
+    check_read(sk, data, DATASIZE, FRAMESIZE, FRAMESIZE, out);
+    check_read(sk, data, DATASIZE, FRAMESIZE+1, 3*FRAMESIZE, out);
+    check_read(sk, data, DATASIZE, DATASIZE-1, 1, out);
+    /* Reads past the end get cut short; reads at the end get nothing */
+    check_read(sk, data, DATASIZE, DATASIZE-100, 1000, out);
+    check_read(sk, data, DATASIZE, DATASIZE, 10, out);
+    check_read(sk, data, DATASIZE, 1234, 0, out);
+    /* ...and reads beyond it are errors */
+    out->pos = 0;
+    munit_assert_int64(dino_seekable_read_at(sk, DATASIZE+1, 1, out), ==, -EINVAL);
+    munit_assert_size(out->pos, ==, 0);
+    /* And some random ones */
+    for (int i=0; i<32; i++) {
+        Dino_Off64 off = munit_rand_int_range(0, DATASIZE-1);
+        check_read(sk, data, DATASIZE, off, munit_rand_int_range(1, 5*FRAMESIZE), out);
+    }
+
+    buf_free(out);
+    dino_seekable_free(sk);
+    dino_object_cache_free();
+    free(data);
+    close(fd);
+    return MUNIT_OK;
+}
+
+MunitResult test_seekable_empty(const MunitParameter params[], void *user_data) {
+    Dino_CompressID id = get_algo(params);
+    if (!compress_avail(id))
+        return MUNIT_SKIP;
+    int fd = write_seekable_dino(id, NULL, 0);
+    Dino *dino = read_dino(fd);
+    Dino_Seekable *sk = dino_seekable_open(dino, 0);
+    munit_assert_not_null(sk);
+    munit_assert_uint64(dino_seekable_size(sk), ==, 0);
+    Buf *out = buf_init(16);
+    munit_assert_int64(dino_seekable_read_at(sk, 0, 10, out), ==, 0);
+    munit_assert_int64(dino_seekable_read_at(sk, 1, 10, out), ==, -EINVAL);
+    buf_free(out);
+    dino_seekable_free(sk);
+    close(fd);
+    return MUNIT_OK;
+}
+
+MunitResult test_seekable_bad(const MunitParameter params[], void *user_data) {
+    Dino_CStream *cs = cstream_create(DINO_COMPRESS_NONE);
+    Buf *sec = buf_init(PAGESIZE);
+    uint8_t data[100] = { 0 };
+    munit_assert_int64(seekable_write(cs, data, sizeof(data), 0, sec), ==, -EINVAL);
+    munit_assert_size(sec->pos, ==, 0);
+    munit_assert_int64(seekable_write(cs, data, sizeof(data), 30, sec), >, 0);
+
+    /* Not flagged as seekable */
+    int fd = write_blob_dino(DINO_COMPRESS_NONE, 0, sec);
+    Dino *dino = read_dino(fd);
+    munit_assert_null(dino_seekable_open(dino, 0));
+    munit_assert_int(errno, ==, EINVAL);
+    munit_assert_null(dino_seekable_open(dino, 1));
+    close(fd);
+
+    /* The frames don't add up */
+    Dino_Seek_Entry *entry = sec->buf + sec->pos - sizeof(Dino_Size) - 4*sizeof(Dino_Seek_Entry);
+    munit_assert_uint32(entry->unc_size, ==, 30);
+    entry->size++;
+    fd = write_blob_dino(DINO_COMPRESS_NONE, DINO_FLAG_SEEKABLE, sec);
+    dino = read_dino(fd);
+    munit_assert_null(dino_seekable_open(dino, 0));
+    munit_assert_int(errno, ==, EINVAL);
+    close(fd);
+
+    /* More entries than there's room for */
+    entry->size--;
+    *(Dino_Size *)(sec->buf + sec->pos - sizeof(Dino_Size)) = 1000;
+    fd = write_blob_dino(DINO_COMPRESS_NONE, DINO_FLAG_SEEKABLE, sec);
+    dino = read_dino(fd);
+    munit_assert_null(dino_seekable_open(dino, 0));
+    munit_assert_int(errno, ==, EINVAL);
+    close(fd);
+
+    buf_free(sec);
+    cstream_free(cs);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum read_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { (char*) "threads", (char*[]) { "1", "4", NULL } },
+    { NULL, NULL },
+};
+
+static MunitParameterEnum algo_params[] = {
+    { (char*) "algo", (char*[]) { "none", "zstd", "xz", "lz4", "zlib", NULL } },
+    { NULL, NULL },
+};
+
+MunitTest seekable_tests[] = {
+    { "/read_at", test_read_at, NULL, NULL, MUNIT_TEST_OPTION_NONE, read_params },
+    { "/empty", test_seekable_empty, NULL, NULL, MUNIT_TEST_OPTION_NONE, algo_params },
+    { "/bad", test_seekable_bad, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite seekable_suite = {
+    "/libdino/seekable",
+    seekable_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&seekable_suite, (void*) "libdino", argc, argv);
+};
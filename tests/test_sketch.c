@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "munit.h"
+#include "dinotest.h"
+#include "../lib/libdino_internal.h"
+#include "../lib/filedata.h"
+#include "../lib/sketch.h"
+
+#define BASESIZE (64<<10)
+
+static uint8_t *copy_edited(const uint8_t *data, size_t size, int edits) {
+    uint8_t *copy = munit_malloc(size);
+    memcpy(copy, data, size);
+    for (int i=0; i<edits; i++)
+        copy[munit_rand_int_range(0, size-1)] ^= 0xa5;
+    return copy;
+}
+
+MunitResult test_similarity(const MunitParameter params[], void *user_data) {
+    uint8_t *base = munit_malloc(BASESIZE), *other = munit_malloc(BASESIZE);
+    munit_rand_memory(BASESIZE, base);
+    munit_rand_memory(BASESIZE, other);
+    Dino_Sketch sb, sk;
+    sketch_compute(base, BASESIZE, &sb);
+    sketch_compute(base, BASESIZE, &sk);
+    munit_assert_uint(sketch_similarity(&sb, &sk), ==, DINO_SKETCH_HASHES);
+
+    /* A few edits only change a few of the ~256 chunks */
+    uint8_t *edited = copy_edited(base, BASESIZE, 4);
+    sketch_compute(edited, BASESIZE, &sk);
+    munit_assert_uint(sketch_similarity(&sb, &sk), >=, DINO_SKETCH_HASHES*3/4);
+
+    /* Half of it replaced: a third of the chunks are shared */
+    memcpy(edited + BASESIZE/2, other, BASESIZE/2);
+    sketch_compute(edited, BASESIZE, &sk);
+    munit_assert_uint(sketch_similarity(&sb, &sk), >=, 3);
+    munit_assert_uint(sketch_similarity(&sb, &sk), <=, DINO_SKETCH_HASHES*3/4);
+
+    /* Nothing in common */
+    sketch_compute(other, BASESIZE, &sk);
+    munit_assert_uint(sketch_similarity(&sb, &sk), <=, 2);
+
+    Dino_Sketch e1, e2;
+    sketch_compute(NULL, 0, &e1);
+    sketch_compute(other, 0, &e2);
+    munit_assert_uint(sketch_similarity(&e1, &e2), ==, DINO_SKETCH_HASHES);
+
+    free(base);
+    free(other);
+    free(edited);
+    return MUNIT_OK;
+}
+
+#define NUM_OBJS 300
+
+MunitResult test_query(const MunitParameter params[], void *user_data) {
+    uint8_t (*keys)[KEYSIZE] = munit_malloc(NUM_OBJS*KEYSIZE);
+    uint8_t **objs = munit_newa(uint8_t *, NUM_OBJS);
+    size_t *sizes = munit_newa(size_t, NUM_OBJS);
+    Dino_CStream *cs = cstream_create(DINO_COMPRESS_NONE);
+    Dino_Filedata *fdata = filedata_new(cs, KEYSIZE);
+    munit_assert_int(filedata_set_sketching(fdata), ==, 0);
+    for (int i=0; i<NUM_OBJS; i++) {
+        munit_rand_memory(KEYSIZE, keys[i]);
+        sizes[i] = munit_rand_int_range(16384, 65536);
+        objs[i] = munit_malloc(sizes[i]);
+        munit_rand_memory(sizes[i], objs[i]);
+        munit_assert_int(filedata_add(fdata, keys[i], objs[i], sizes[i]), ==, 1);
+    }
+
+    /* Write out the data, its index and the sketches */
+    static const char namtab[] = ".filedata\0.filedata.idx\0.sketch";
+    Dino_Shdr shdr[3] = { 0 };
+    Buf *data[3];
+    data[0] = filedata_get_data(fdata, &shdr[0]);
+    data[1] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_index(fdata, 0, data[1], &shdr[1]), >, 0);
+    data[2] = buf_init(PAGESIZE);
+    munit_assert_int64(filedata_write_sketches(fdata, 1, data[2], &shdr[2]), ==,
+                       NUM_OBJS*sizeof(Dino_Sketch));
+    munit_assert_uint8(shdr[2].type, ==, DINO_SEC_SKETCH);
+    munit_assert_uint32(shdr[2].count, ==, NUM_OBJS);
+    shdr[1].name = 10;
+    shdr[2].name = 24;
+    int fd = write_test_dino(DINO_COMPRESS_NONE, shdr, data, 3, namtab, sizeof(namtab));
+    buf_free(data[1]);
+    buf_free(data[2]);
+
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_null(dino_load_sketches(dino, 2));
+    munit_assert_int(load_indexes(dino), ==, 1);
+    munit_assert_null(dino_load_sketches(dino, 0));
+    munit_assert_null(dino_load_sketches(dino, 3));
+    Dino_Sketches *sks = dino_load_sketches(dino, 2);
+    munit_assert_not_null(sks);
+    Dino_Index *idx = get_index(dino, 1);
+    munit_assert_ptr_equal(sketches_get_index(sks), idx);
+
+    /* Slightly changed versions of some objects should find the original */
+    Dino_Sketch sk;
+    Dino_Sketch_Match matches[3];
+    for (int i=0; i<NUM_OBJS; i+=15) {
+        uint8_t *edited = copy_edited(objs[i], sizes[i], 2);
+        sketch_compute(edited, sizes[i], &sk);
+        free(edited);
+        munit_assert_size(sketches_query(sks, &sk, 8, matches, 3), >=, 1);
+        munit_assert_memory_equal(KEYSIZE, matches[0].key, keys[i]);
+        munit_assert_memory_equal(KEYSIZE, index_get_key(idx, matches[0].pos), keys[i]);
+        munit_assert_uint(matches[0].score, >=, 16);
+    }
+    /* Something new shouldn't find anything */
+    uint8_t *other = munit_malloc(16384);
+    munit_rand_memory(16384, other);
+    sketch_compute(other, 16384, &sk);
+    munit_assert_size(sketches_query(sks, &sk, 8, matches, 3), ==, 0);
+    munit_assert_size(sketches_query(sks, &sk, 0, matches, 0), ==, 0);
+    free(other);
+
+    /* Too late to turn sketching on once there's objects */
+    Dino_Filedata *late = filedata_new(cs, KEYSIZE);
+    munit_assert_int(filedata_add(late, keys[0], objs[0], sizes[0]), ==, 1);
+    munit_assert_int(filedata_set_sketching(late), ==, -EINVAL);
+    munit_assert_int64(filedata_write_sketches(late, 1, data[0], &shdr[2]), ==, -EINVAL);
+    filedata_free(late);
+
+    sketches_free(sks);
+    filedata_free(fdata);
+    cstream_free(cs);
+    for (int i=0; i<NUM_OBJS; i++)
+        free(objs[i]);
+    free(objs);
+    free(sizes);
+    free(keys);
+    close(fd);
+    return MUNIT_OK;
+}
+
+MunitTest sketch_tests[] = {
+    { "/similarity", test_similarity, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/query", test_query, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite sketch_suite = {
+    "/libdino/sketch",
+    sketch_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&sketch_suite, (void*) "libdino", argc, argv);
+};
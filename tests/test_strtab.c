@@ -0,0 +1,194 @@
+#include "munit.h"
+#include "dinotest.h"
+#include "../lib/strtab.h"
+#include "../lib/common.h"
+
+#define INTPARAM(name) atoi(munit_parameters_get(params, name))
+
+static const char *names[] = {
+    "bash", "bash-completion", "kernel", "kernel", "kernel-core",
+    "kernel-devel", "kernel-modules", "kernel-modules-extra", "rpm",
+    "rpm-build", "rpm-libs", "zsh",
+};
+#define NAMES_NUM ARRAY_SIZE(names)
+
+static Dino_Strtab *build_strtab(const char **strs, size_t num, unsigned interval) {
+    Dino_Strtab_Builder *b = strtab_builder_new(interval);
+    munit_assert_not_null(b);
+    for (size_t i=0; i<num; i++)
+        munit_assert_int(strtab_builder_add(b, strs[i], strlen(strs[i]), i), ==, i);
+    Buf *buf = strtab_builder_finish(b);
+    munit_assert_not_null(buf);
+    strtab_builder_free(b);
+    Dino_Strtab *st = strtab_from_buf(buf->buf, buf->pos, 1);
+    munit_assert_not_null(st);
+    free(buf); /* st owns buf->buf now */
+    return st;
+}
+
+#define LOOKUP(st, s, v, n) strtab_lookup(st, s, strlen(s), v, n)
+
+MunitResult test_strtab_names(const MunitParameter params[], void *data) {
+    Dino_Strtab *st = build_strtab(names, NAMES_NUM, INTPARAM("interval"));
+    uint64_t vals[4];
+    munit_assert_size(strtab_get_cnt(st), ==, NAMES_NUM);
+
+    /* everything we put in should come back out */
+    for (size_t i=0; i<NAMES_NUM; i++) {
+        size_t n = LOOKUP(st, names[i], vals, 4);
+        munit_assert_size(n, >=, 1);
+        munit_assert_string_equal(names[vals[0]], names[i]);
+    }
+    /* duplicates come back in order */
+    munit_assert_size(LOOKUP(st, "kernel", vals, 4), ==, 2);
+    munit_assert_uint64(vals[0], ==, 2);
+    munit_assert_uint64(vals[1], ==, 3);
+    /* maxvals limits what we store, but not the count */
+    munit_assert_size(LOOKUP(st, "kernel", vals, 1), ==, 2);
+    /* things that aren't there (including prefixes) aren't found */
+    munit_assert_size(LOOKUP(st, "", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "aaa", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "kern", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "kernel-cor", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "kernel-core2", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "rpm-buil", vals, 4), ==, 0);
+    munit_assert_size(LOOKUP(st, "zzz", vals, 4), ==, 0);
+
+    strtab_free(st);
+    return MUNIT_OK;
+}
+
+MunitResult test_strtab_unsorted(const MunitParameter params[], void *data) {
+    Dino_Strtab_Builder *b = strtab_builder_new(0);
+    munit_assert_int(strtab_builder_add(b, "rpm", 3, 0), ==, 0);
+    munit_assert_int(strtab_builder_add(b, "bash", 4, 0), <, 0);
+    munit_assert_int(strtab_builder_add(b, "rp", 2, 0), <, 0);
+    munit_assert_int(strtab_builder_add(b, "rpm", 3, 1), ==, 1);
+    strtab_builder_free(b);
+    return MUNIT_OK;
+}
+
+MunitResult test_strtab_empty(const MunitParameter params[], void *data) {
+    uint64_t val;
+    Dino_Strtab *st = build_strtab(NULL, 0, 0);
+    munit_assert_size(strtab_get_cnt(st), ==, 0);
+    munit_assert_size(LOOKUP(st, "bash", &val, 1), ==, 0);
+    strtab_free(st);
+    /* truncated data should be rejected */
+    munit_assert_null(strtab_from_buf("\0\0\0", 3, 0));
+    return MUNIT_OK;
+}
+
+static int cmpstr(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+MunitResult test_strtab_random(const MunitParameter params[], void *data) {
+    size_t num = 5000;
+    char **strs = munit_malloc(num * sizeof(char *));
+    uint64_t val;
+    for (size_t i=0; i<num; i++) {
+        /* random-ish package names with lots of shared prefixes */
+        strs[i] = munit_malloc(32);
+        snprintf(strs[i], 32, "pkg-%u-%u.x86_64",
+                 munit_rand_int_range(0, 500), munit_rand_uint32());
+    }
+    qsort(strs, num, sizeof(char *), cmpstr);
+    Dino_Strtab *st = build_strtab((const char **)strs, num, INTPARAM("interval"));
+    for (size_t i=0; i<num; i++) {
+        munit_assert_size(LOOKUP(st, strs[i], &val, 1), >=, 1);
+        munit_assert_string_equal(strs[val], strs[i]);
+    }
+    strtab_free(st);
+    for (size_t i=0; i<num; i++)
+        free(strs[i]);
+    free(strs);
+    return MUNIT_OK;
+}
+
+/* Write a DINO with a string table section, then load it back and look
+ * things up in it. */
+MunitResult test_strtab_section(const MunitParameter params[], void *data) {
+    Dino_Strtab_Builder *b = strtab_builder_new(INTPARAM("interval"));
+    munit_assert_not_null(b);
+    for (size_t i=0; i<NAMES_NUM; i++)
+        munit_assert_int(strtab_builder_add(b, names[i], strlen(names[i]), i*10), ==, i);
+    Buf *bufs[2];
+    bufs[0] = buf_init(16);
+    munit_rand_memory(16, bufs[0]->buf);
+    bufs[0]->pos = 16;
+    bufs[1] = strtab_builder_finish(b);
+    munit_assert_not_null(bufs[1]);
+    strtab_builder_free(b);
+
+    static const char namtab[] = ".blob\0.names";
+    Dino_Shdr shdrs[2] = {
+        { .name = 0, .type = DINO_SEC_BLOB, .size = bufs[0]->pos },
+        { .name = 6, .type = DINO_SEC_STRTAB, .size = bufs[1]->pos,
+          .count = NAMES_NUM, .info = (DINO_STRTAB_FLAG_IDXPOS << 16) | (0 << 8) },
+    };
+    int fd = write_test_dino(DINO_COMPRESS_NONE, shdrs, bufs, 2, namtab, sizeof(namtab));
+    Dino *dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_null(get_strtab_byname(dino, ".names"));
+    munit_assert_int(load_indexes(dino), ==, 1);
+    munit_assert_null(get_strtab_byname(dino, ".blob"));
+    munit_assert_null(get_strtab_byname(dino, ".nope"));
+    Dino_Strtab *st = get_strtab_byname(dino, ".names");
+    munit_assert_not_null(st);
+    munit_assert_ptr_equal(get_strtab(dino, 1), st);
+    uint32_t info = dino_getsec(dino, 1)->shdr->info;
+    munit_assert_uint8(DINO_SECINFO_STRTAB_FLAGS(info), ==, DINO_STRTAB_FLAG_IDXPOS);
+    munit_assert_uint8(DINO_SECINFO_STRTAB_OTHERSEC(info), ==, 0);
+
+    uint64_t vals[4];
+    munit_assert_size(strtab_get_cnt(st), ==, NAMES_NUM);
+    for (size_t i=0; i<NAMES_NUM; i++) {
+        munit_assert_size(LOOKUP(st, names[i], vals, 4), >=, 1);
+        munit_assert_string_equal(names[vals[0]/10], names[i]);
+    }
+    munit_assert_size(LOOKUP(st, "kernel", vals, 4), ==, 2);
+    munit_assert_uint64(vals[1], ==, 30);
+    munit_assert_size(LOOKUP(st, "kern", vals, 4), ==, 0);
+    close(fd);
+
+    /* A section with a bogus footer doesn't load */
+    uint32_t bogus = UINT32_MAX;
+    memcpy(bufs[1]->buf + bufs[1]->pos - sizeof(Dino_Strtab_Footer) +
+           offsetof(Dino_Strtab_Footer, nrestarts), &bogus, sizeof(bogus));
+    fd = write_test_dino(DINO_COMPRESS_NONE, shdrs, bufs, 2, namtab, sizeof(namtab));
+    dino = read_dino(fd);
+    munit_assert_not_null(dino);
+    munit_assert_int(load_indexes(dino), <, 0);
+    close(fd);
+    buf_free(bufs[0]);
+    buf_free(bufs[1]);
+    return MUNIT_OK;
+}
+
+static MunitParameterEnum strtab_params[] = {
+    { (char*) "interval", (char*[]) { "1", "2", "3", "16", "1000", NULL } },
+    { NULL, NULL },
+};
+
+MunitTest strtab_tests[] = {
+    { "/names", test_strtab_names, NULL, NULL, MUNIT_TEST_OPTION_NONE, strtab_params },
+    { "/unsorted", test_strtab_unsorted, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/empty", test_strtab_empty, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/section", test_strtab_section, NULL, NULL, MUNIT_TEST_OPTION_NONE, strtab_params },
+    { "/random", test_strtab_random, NULL, NULL, MUNIT_TEST_OPTION_NONE, strtab_params },
+    /* End-of-array marker */
+    { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+};
+
+static const MunitSuite strtab_suite = {
+    "/libdino/strtab",
+    strtab_tests,
+    NULL,
+    1,
+    MUNIT_SUITE_OPTION_NONE,
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+    return munit_suite_main(&strtab_suite, (void*) "libdino", argc, argv);
+};